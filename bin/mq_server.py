@@ -4,30 +4,279 @@
 
 This Message Queue Server supports the following REST API:
 
-    PUT     /topic/$topic               Publish message to $topic.
+    PUT     /topic/$topic               Publish message to $topic (with Mq-$name headers).
+    GET     /topic/$topic?offset=N&max=M Read up to M retained messages of $topic from offset N.
 
     GET     /queue/$queue               Retrieve one message from $queue.
+    GET     /queue/$queue?max=N&bytes=B Retrieve up to N messages (about B bytes) from $queue.
 
-    PUT     /subscription/$queue/$topic Subscribe $queue to $topic.
+    PUT     /subscription/$queue/$topic Subscribe $queue to $topic (with selector as body).
     DELETE  /subscription/$queue/$topic Unsubscribe $queue from $topic.
+
+    GET     /stats                      Report queue and topic counters as JSON.
+
+The API is served over TCP, and optionally over a Unix domain socket
+(--unix=PATH).  Co-located clients may also attach shared memory rings through
+a separate Unix domain socket (--shm=PATH): each ring record carries one HTTP
+request (or response) tagged with the client exchange it belongs to.
+
+Clients may also upgrade a connection to a compact binary protocol:
+
+    GET     /binary                     Upgrade: mq-binary/1
+
+After the 101 response, each request and response is a frame with a 12 byte
+header (length, opcode, status, and topic id in network byte order) followed
+by its body (see include/mq/frame.h).  Topic names are declared once per
+connection and referenced by id afterwards.
+
+With --workers=N, queues are partitioned across N worker processes by a hash
+of the queue name.  Every worker accepts connections on the shared port
+(SO_REUSEPORT) and forwards requests for queues it does not own to the owning
+worker over internal binary connections.  Workers announce which topics their
+queues subscribe to, so a publish is only delivered to the shards that have
+subscribers for its topic.
+
+Each queue keeps its newest messages in memory.  Once the queue exceeds its
+memory budget (--queue-memory), or the broker exceeds its global budget
+(--memory), the oldest messages spill to memory-mapped segment files in the
+spool directory (--spool) and are paged back in as consumers catch up.  Messages
+may be as large as --max-message bytes (1 GiB by default); clients stream
+large ones from and to files without buffering them whole.
+
+Publishers may limit how long a message waits in queues with an Mq-TTL header
+(milliseconds), and defer its delivery with an Mq-Delay header (milliseconds).
+Both are managed by a hierarchical timer wheel: expired messages stop counting
+against the memory budgets as soon as their bucket of the wheel expires, and
+are never delivered.
+
+Messages with Mq-Producer and Mq-Sequence headers (which the client library
+sets on every publish) are delivered at most once: each worker remembers a
+fixed window of recent sequence numbers per producer (--dedup-window), for a
+bounded number of recently active producers (--dedup-producers), so a publish
+retried after a failure is ignored rather than delivered twice.
+
+Publish responses carry a load hint: the depth of the deepest subscribed
+queue relative to its maximum (--max-depth), in an Mq-Load header (or, in
+permille, in the id of binary result frames).  Once a queue is at its maximum
+depth, publishes to it are refused with 429 and a Retry-After (in seconds, and
+in milliseconds as Mq-Retry-After or the id of binary result frames), so
+publishers slow down before the broker's spool grows without bound.
+
+With --retain=N, each topic also keeps a log of its last N messages, owned by
+one worker (by a hash of the topic name), to which every message is appended
+once however many consumers read it.  Consumers read the log by offset
+(starting at 0 for the first message ever published): a read waits until a
+message at or after the offset exists (or wait=MS milliseconds pass, with a 204
+response), and returns up to max messages, each as an "$OFFSET $LENGTH\n"
+line followed by the message.  The offset to read next is returned in an
+Mq-Offset header (or, on 204, the body of binary result frames).  Reads before the oldest retained message start
+at the oldest one, and negative offsets start at the next new message, so late
+joiners may replay history or just follow along.  Topics with a log accept
+publishes without subscribers.
+
+Consumers catching up on a backlog may retrieve several messages per request:
+a batch retrieval waits for one message like any other, then takes the
+messages already queued behind it, up to max messages or until bytes bytes are
+reached, and returns each as a "$LENGTH\n" line followed by the message.
+
+Statistics are kept as running counters (and exponentially decaying rates),
+so /stats is cheap to poll: it reports each queue's depth, bytes in memory,
+waiting consumers and rates, each topic's publishes, fan-out and rate, and
+the expiry and deduplication counters, merged across workers.  Retrieved
+messages and successful publishes and retrievals are only logged with
+--log-messages.
 '''
 
+import array
 import collections
+import http.client
+import itertools
+import json
 import logging
+import math
+import mmap
+import operator
+import os
+import re
 import signal
 import socket
+import struct
 import sys
+import tempfile
+import threading
 import time
+import urllib.parse
+import zlib
 
+import tornado.concurrent
 import tornado.gen
+import tornado.httpserver
+import tornado.ioloop
+import tornado.iostream
+import tornado.netutil
 import tornado.options
+import tornado.queues
+import tornado.tcpclient
 import tornado.web
 
+# Headers
+
+def decode_headers(block):
+    ''' Decode "name=value\\n" header lines. '''
+    headers = {}
+    for line in block.decode().splitlines():
+        name, _, value = line.partition('=')
+        headers[name.lower()] = value
+    return headers
+
+def encode_headers(headers):
+    ''' Encode headers as "name=value\\n" lines. '''
+    return ''.join('{}={}\n'.format(name, value) for name, value in headers.items()).encode()
+
+# Selector
+
+class Selector(object):
+    ''' Header selector compiled once from an expression such as:
+
+        region = 'us' and (priority >= 5 or exists urgent)
+
+    Headers are compared with quoted strings or numbers (=, !=, <, <=, >, >=,
+    in (...)), tested with exists, and combined with and, or, not and
+    parentheses.  Missing (or non-numeric, for numbers) headers never match.
+    '''
+    TOKENS    = re.compile(r"\s*(?:(-?\d+(?:\.\d+)?)|'([^']*)'|(<=|>=|!=|=|<|>|\(|\)|,)|([A-Za-z_][\w.-]*))")
+    OPERATORS = {
+        '=' : operator.eq,
+        '!=': operator.ne,
+        '<' : operator.lt,
+        '<=': operator.le,
+        '>' : operator.gt,
+        '>=': operator.ge,
+    }
+
+    def __init__(self, expression):
+        self.expression = expression
+        self.tokens     = []
+        self.position   = 0
+
+        offset = 0
+        while expression[offset:].strip():
+            match = self.TOKENS.match(expression, offset)
+            if not match:
+                self.fail('unexpected input at offset {}'.format(offset))
+            number, string, symbol, name = match.groups()
+            if number is not None:
+                self.tokens.append(('value', float(number)))
+            elif string is not None:
+                self.tokens.append(('value', string))
+            elif symbol is not None:
+                self.tokens.append(('symbol', symbol))
+            else:
+                self.tokens.append(('name', name.lower()))
+            offset = match.end()
+
+        self.match = self.parse_or()
+        if self.position < len(self.tokens):
+            self.fail('unexpected {}'.format(self.tokens[self.position][1]))
+
+    def __call__(self, headers):
+        return self.match(headers)
+
+    def fail(self, reason):
+        raise tornado.web.HTTPError(400, 'Invalid selector ({}): {}'.format(reason, self.expression))
+
+    def peek(self, kind, value=None):
+        if self.position < len(self.tokens):
+            token = self.tokens[self.position]
+            return token[0] == kind and (value is None or token[1] == value)
+        return False
+
+    def take(self, kind, value=None):
+        if not self.peek(kind, value):
+            self.fail('expected {}'.format(value or kind))
+        self.position += 1
+        return self.tokens[self.position - 1][1]
+
+    def parse_or(self):
+        left = self.parse_and()
+        while self.peek('name', 'or'):
+            self.take('name')
+            right = self.parse_and()
+            left  = (lambda l, r: lambda h: l(h) or r(h))(left, right)
+        return left
+
+    def parse_and(self):
+        left = self.parse_not()
+        while self.peek('name', 'and'):
+            self.take('name')
+            right = self.parse_not()
+            left  = (lambda l, r: lambda h: l(h) and r(h))(left, right)
+        return left
+
+    def parse_not(self):
+        if self.peek('name', 'not'):
+            self.take('name')
+            inner = self.parse_not()
+            return lambda h: not inner(h)
+        return self.parse_primary()
+
+    def parse_primary(self):
+        if self.peek('symbol', '('):
+            self.take('symbol')
+            inner = self.parse_or()
+            self.take('symbol', ')')
+            return inner
+
+        if self.peek('name', 'exists'):
+            self.take('name')
+            name = self.take('name')
+            return lambda h: name in h
+
+        name = self.take('name')
+        if self.peek('name', 'in'):
+            self.take('name')
+            self.take('symbol', '(')
+            values = [self.take('value')]
+            while self.peek('symbol', ','):
+                self.take('symbol')
+                values.append(self.take('value'))
+            self.take('symbol', ')')
+            tests = [self.compare(name, operator.eq, value) for value in values]
+            return lambda h: any(test(h) for test in tests)
+
+        symbol = self.take('symbol')
+        if symbol not in self.OPERATORS:
+            self.fail('unexpected {}'.format(symbol))
+        return self.compare(name, self.OPERATORS[symbol], self.take('value'))
+
+    @staticmethod
+    def compare(name, function, value):
+        if isinstance(value, str):
+            return lambda h: name in h and function(h[name], value)
+
+        def numeric(h):
+            try:
+                return function(float(h[name]), value)
+            except (KeyError, ValueError):
+                return False
+        return numeric
+
 # Base Handler
 
+class Overloaded(tornado.web.HTTPError):
+    ''' Publish refused because a subscribed queue is at its maximum depth (retry after milliseconds). '''
+    def __init__(self, load, retry):
+        tornado.web.HTTPError.__init__(
+            self, 429, 'Queues are overloaded ({:.0%} of maximum depth), retry after {} ms'.format(load, retry)
+        )
+        self.retry = retry
+
 class BaseHandler(tornado.web.RequestHandler):
     def write_error(self, status_code, **kwargs):
         self.set_status(status_code)
+        if isinstance(kwargs['exc_info'][1], Overloaded):
+            self.set_header('Retry-After', math.ceil(kwargs['exc_info'][1].retry / 1000.0))
+            self.set_header('Mq-Retry-After', kwargs['exc_info'][1].retry)
         try:
             self.write(str(kwargs['exc_info'][1].log_message) + '\n')
         except AttributeError:
@@ -40,71 +289,1050 @@ class BaseHandler(tornado.web.RequestHandler):
 # Topic Handler
 
 class TopicHandler(BaseHandler):
+    @tornado.gen.coroutine
     def put(self, topic):
         ''' Publish message (request body) to each queue that is subscribed to topic. '''
-        message     = self.request.body
-        subscribers = 0
-
-        for queue, topics in self.application.subscriptions.items():
-            if topic in topics:
-                self.application.queues[queue].append(message)
-                subscribers += 1
+        headers = {
+            name[3:].lower(): value for name, value in self.request.headers.get_all() if name.lower().startswith('mq-')
+        }
+        message, load = yield self.application.publish(topic, self.request.body, headers)
+        self.set_header('Mq-Load', '{:.3f}'.format(load))
+        self.write(message)
 
-        if subscribers:
-            self.write('Published message ({} bytes) to {} subscribers of {}\n'.format(
-                len(message),
-                subscribers,
-                topic,
-            ))
+    @tornado.gen.coroutine
+    def get(self, topic):
+        ''' Read messages retained by topic, from offset (wait until one is available). '''
+        self.topic = topic
+        offset, count, wait = self.application.cursor(
+            self.get_argument('offset', None), self.get_argument('max', None), self.get_argument('wait', None)
+        )
+        records, offset = yield self.application.read(topic, offset, count, self.request.connection.stream.closed, wait)
+        self.set_header('Mq-Offset', offset)
+        if records is None:
+            self.set_status(204)
         else:
-            raise tornado.web.HTTPError(404, 'There are no subscribers for topic: {}'.format(topic))
+            self.write(records)
+
+    def on_connection_close(self):
+        ''' Wake readers so the one serving this connection notices it closed. '''
+        if getattr(self, 'topic', None) in self.application.logs:
+            self.application.logs[self.topic].wake()
 
 # Queue Handler
 
 class QueueHandler(BaseHandler):
     @tornado.gen.coroutine
     def get(self, queue):
-        ''' Retrieve one message from queue (wait until one is available). '''
-
-        if queue not in self.application.queues:
-            raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
-
-        while not self.application.queues[queue] and not self.request.connection.stream.closed():
-            yield tornado.gen.sleep(1)
-
-        if self.application.queues[queue]:
-            self.write_response(self.application.queues[queue].pop(0))
+        ''' Retrieve one message (or batch of messages) from queue (wait until one is available). '''
+        self.queue  = queue
+        count, size = self.application.limits(self.get_argument('max', None), self.get_argument('bytes', None))
+        message = yield self.application.retrieve(queue, self.request.connection.stream.closed, None, count, size)
+        if self.application.log_messages:
+            self.write_response(message)
         else:
-            raise tornado.web.HTTPError(404, 'There are no messages for queue: {}'.format(queue))
+            self.write(message)
+
+    def on_connection_close(self):
+        ''' Wake waiters so the one serving this connection notices it closed. '''
+        self.application.wake(self.queue, everyone=True)
 
 # Subscription Handler
 
 class SubscriptionHandler(BaseHandler):
+    @tornado.gen.coroutine
     def put(self, queue, topic):
         ''' Subscribe queue to topic. '''
-        try:
-            self.application.subscriptions[queue].add(topic)
-            if queue not in self.application.queues:
-                self.application.queues[queue]
-        except KeyError:
-            raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
-
-        self.write_response('Subscribed queue ({}) to topic ({})\n'.format(queue, topic))
+        message = yield self.application.subscribe(queue, topic, self.request.body.decode().strip() or None)
+        self.write_response(message)
 
+    @tornado.gen.coroutine
     def delete(self, queue, topic):
         ''' Unsubscribe queue from topic. '''
+        message = yield self.application.unsubscribe(queue, topic)
+        self.write_response(message)
+
+# Stats Handler
+
+class StatsHandler(BaseHandler):
+    @tornado.gen.coroutine
+    def get(self):
+        ''' Report queue and topic counters (of every worker) as JSON. '''
+        stats = yield self.application.stats()
+        self.write(stats)
+
+# Binary Handler
+
+class BinaryHandler(BaseHandler):
+    @tornado.gen.coroutine
+    def get(self):
+        ''' Upgrade connection to binary protocol and serve frames until it closes. '''
+        if self.request.headers.get('Upgrade', '') != BinarySession.PROTOCOL:
+            raise tornado.web.HTTPError(400, 'Unsupported upgrade: {}'.format(self.request.headers.get('Upgrade', '')))
+
+        stream = self.detach()
+        stream.set_nodelay(True)    # Response frames are written as requests complete
+        yield stream.write(
+            'HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: {}\r\n\r\n'.format(
+                BinarySession.PROTOCOL
+            ).encode()
+        )
+        yield BinarySession(self.application, stream).run()
+
+# Binary Session
+
+class BinarySession(object):
+    ''' Serve frames from one upgraded connection (see include/mq/frame.h). '''
+    PROTOCOL    = 'mq-binary/1'
+    HEADER      = struct.Struct('!IBBHI')
+    HEADERS     = 0x01  # Flag: body starts with headers (length, then "name=value\\n" lines)
+    DECLARE     = 0x01
+    PUBLISH     = 0x02
+    SUBSCRIBE   = 0x03
+    UNSUBSCRIBE = 0x04
+    FETCH       = 0x05
+    DELIVER     = 0x06
+    ROUTE       = 0x07
+    UNROUTE     = 0x08
+    STATS       = 0x09
+    READ        = 0x0A
+    RESULT      = 0x81
+    MESSAGE     = 0x82
+
+    def __init__(self, application, stream):
+        self.application = application
+        self.stream      = stream
+        self.topics      = {}
+
+    @tornado.gen.coroutine
+    def run(self):
+        ''' Handle frames in order until client disconnects (reading ahead, so
+        a disconnect is noticed while a fetch is still waiting). '''
+        frames  = tornado.queues.Queue()
+        handler = self.serve(frames)
+        try:
+            while True:
+                header = yield self.stream.read_bytes(self.HEADER.size)
+                length, opcode, flags, _, id = self.HEADER.unpack(header)
+                body = (yield self.stream.read_bytes(length)) if length else b''
+                frames.put_nowait((opcode, flags, id, body))
+        except tornado.iostream.StreamClosedError:
+            frames.put_nowait(None)
+            for log in self.application.logs.values():
+                log.wake()
+        yield handler
+
+    @tornado.gen.coroutine
+    def serve(self, frames):
+        ''' Handle queued frames in order (until None). '''
+        while True:
+            frame = yield frames.get()
+            if frame is None:
+                return
+            yield self.handle(*frame)
+
+    @tornado.gen.coroutine
+    def handle(self, opcode, flags, id, body):
+        ''' Dispatch one request frame and write its response frame. '''
+        if opcode == self.DECLARE:
+            self.topics[id] = body.decode()
+            return
+
+        result = b''
+        hint   = 0
+        try:
+            if opcode == self.PUBLISH:
+                _, load = yield self.application.publish(self.topic(id), *self.split(flags, body))
+                hint    = min(int(load * 1000), 0xffffffff)
+            elif opcode == self.SUBSCRIBE:
+                queue, _, selector = body.decode().partition('\0')
+                message = yield self.application.subscribe(queue, self.topic(id), selector or None)
+                self.application.logger.info(message.rstrip())
+            elif opcode == self.UNSUBSCRIBE:
+                message = yield self.application.unsubscribe(body.decode(), self.topic(id))
+                self.application.logger.info(message.rstrip())
+            elif opcode == self.FETCH:
+                queue, _, limits = body.decode().partition('\0')
+                yield self.fetch(queue, id, *self.application.limits(*limits.split()))
+                return
+            elif opcode == self.READ:
+                offset, count, wait = self.application.cursor(*body.decode().split())
+                records, offset = yield self.application.read(self.topic(id), offset, count, self.stream.closed, wait)
+                if records is None:
+                    self.respond(self.RESULT, 204, str(offset))
+                else:
+                    self.respond(self.MESSAGE, 200, records)
+                return
+            elif opcode == self.DELIVER:
+                result = '{} {:.3f}'.format(*self.application.deliver(self.topic(id), *self.split(flags, body)))
+            elif opcode == self.ROUTE:
+                self.application.routes[body.decode()].add(id)
+            elif opcode == self.UNROUTE:
+                self.application.routes[body.decode()].discard(id)
+            elif opcode == self.STATS:
+                result = json.dumps(self.application.local_stats())
+            else:
+                raise tornado.web.HTTPError(400, 'Unknown opcode: {}'.format(opcode))
+        except tornado.web.HTTPError as e:
+            self.respond(self.RESULT, e.status_code, e.log_message + '\n', getattr(e, 'retry', 0))
+            return
+
+        self.respond(self.RESULT, 200, result, hint)
+
+    @tornado.gen.coroutine
+    def fetch(self, queue, wait, count=None, size=None):
+        ''' Respond with one message (or batch of messages) from queue (or 204 once wait milliseconds pass, if nonzero). '''
         try:
-            self.application.subscriptions[queue].remove(topic)
+            message = yield self.application.retrieve(queue, self.stream.closed, wait / 1000.0 if wait else None, count, size)
+        except tornado.web.HTTPError as e:
+            if wait and queue in self.application.queues:
+                self.respond(self.RESULT, 204, b'')
+            else:
+                self.respond(self.RESULT, e.status_code, e.log_message + '\n')
+            return
+
+        self.respond(self.MESSAGE, 200, message)
+
+    @classmethod
+    def split(cls, flags, body):
+        ''' Split body into message and headers. '''
+        if not flags & cls.HEADERS:
+            return body, {}
+        length, = struct.unpack_from('!H', body)
+        return body[2 + length:], decode_headers(body[2:2 + length])
+
+    @classmethod
+    def join(cls, message, headers):
+        ''' Join message and headers into body (returns flags and body). '''
+        if not headers:
+            return 0, message
+        block = encode_headers(headers)
+        return cls.HEADERS, struct.pack('!H', len(block)) + block + message
+
+    def topic(self, id):
+        try:
+            return self.topics[id]
         except KeyError:
-            raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
+            raise tornado.web.HTTPError(400, 'Undeclared topic id: {}'.format(id))
+
+    def respond(self, opcode, status, message, id=0):
+        ''' Write response frame (unless client has disconnected).  Publish
+        results carry the load hint (in permille) or Retry-After (in
+        milliseconds) in their id. '''
+        if isinstance(message, str):
+            message = message.encode()
+
+        if not self.stream.closed():
+            self.stream.write(self.HEADER.pack(len(message), opcode, 0, status, id) + message)
+
+# Shard Client
+
+class ShardClient(object):
+    ''' Forward requests to another worker over internal binary connections. '''
+    UPGRADE = 'GET /binary HTTP/1.1\r\nHost: mq\r\nConnection: Upgrade\r\nUpgrade: {}\r\n\r\n'.format(
+        BinarySession.PROTOCOL
+    ).encode()
+
+    def __init__(self, address, max_buffer_size=None):
+        self.address    = address
+        self.max_buffer = max_buffer_size         # Largest frame forwarded (None for Tornado's default)
+        self.connection = None                  # Future of pipelined connection
+        self.topics     = {}                    # Topic ids declared on pipelined connection
+        self.waiters    = collections.deque()   # Futures of pipelined responses (in order)
+        self.idle       = []                    # Idle connections for fetches
+
+    @tornado.gen.coroutine
+    def connect(self):
+        ''' Open connection to worker and upgrade it to binary protocol. '''
+        stream = yield tornado.tcpclient.TCPClient().connect(*self.address, max_buffer_size=self.max_buffer)
+        stream.set_nodelay(True)
+        yield stream.write(self.UPGRADE)
+        response = yield stream.read_until(b'\r\n\r\n')
+        if response.split()[1] != b'101':
+            stream.close()
+            raise tornado.iostream.StreamClosedError()
+        return stream
+
+    @staticmethod
+    @tornado.gen.coroutine
+    def read(stream):
+        ''' Read one response frame. '''
+        header = yield stream.read_bytes(BinarySession.HEADER.size)
+        length, opcode, _, status, _ = BinarySession.HEADER.unpack(header)
+        body = (yield stream.read_bytes(length)) if length else b''
+        return status, body
+
+    @tornado.gen.coroutine
+    def request(self, opcode, body, topic=None, id=0, flags=0):
+        ''' Send request frame on pipelined connection and return (status, body) of its response. '''
+        try:
+            if self.connection is None:
+                self.connection = self.connect()
+                self.topics     = {}
+            stream = yield self.connection
+
+            frames = []
+            if topic is not None:
+                if topic not in self.topics:
+                    self.topics[topic] = len(self.topics) + 1
+                    name = topic.encode()
+                    frames.append(BinarySession.HEADER.pack(len(name), BinarySession.DECLARE, 0, 0, self.topics[topic]) + name)
+                id = self.topics[topic]
+            frames.append(BinarySession.HEADER.pack(len(body), opcode, flags, 0, id) + body)
+
+            waiter = tornado.concurrent.Future()
+            self.waiters.append(waiter)
+            stream.write(b''.join(frames))
+            if len(self.waiters) == 1:
+                self.receive(stream)
+            return (yield waiter)
+        except (tornado.iostream.StreamClosedError, OSError):
+            self.connection = None
+            raise tornado.web.HTTPError(502, 'Unable to reach shard {}:{}'.format(*self.address))
+
+    def receive(self, stream):
+        ''' Resolve pipelined responses in order until none are outstanding. '''
+        @tornado.gen.coroutine
+        def reader():
+            try:
+                while self.waiters:
+                    response = yield self.read(stream)
+                    self.waiters.popleft().set_result(response)
+            except tornado.iostream.StreamClosedError as e:
+                self.connection = None
+                while self.waiters:
+                    self.waiters.popleft().set_exception(e)
+        tornado.ioloop.IOLoop.current().add_future(reader(), lambda f: f.result())
+
+    @tornado.gen.coroutine
+    def fetch(self, queue, wait, count=None, size=None):
+        ''' Fetch one message (or batch of messages) on a dedicated connection (returns (status, body)). '''
+        while self.idle and self.idle[-1].closed():
+            self.idle.pop()
+
+        try:
+            stream = self.idle.pop() if self.idle else (yield self.connect())
+            name   = queue.encode() + ('\0{} {}'.format(count, size or 0).encode() if count else b'')
+            yield stream.write(BinarySession.HEADER.pack(len(name), BinarySession.FETCH, 0, 0, wait) + name)
+            response = yield self.read(stream)
+        except (tornado.iostream.StreamClosedError, OSError):
+            raise tornado.web.HTTPError(502, 'Unable to reach shard {}:{}'.format(*self.address))
+
+        self.idle.append(stream)
+        return response
+
+    @tornado.gen.coroutine
+    def read_topic(self, topic, offset, count, wait):
+        ''' Read retained messages of topic on a dedicated connection (returns (status, body)). '''
+        while self.idle and self.idle[-1].closed():
+            self.idle.pop()
+
+        try:
+            stream = self.idle.pop() if self.idle else (yield self.connect())
+            name   = topic.encode()
+            cursor = '{} {} {}'.format(offset, count, wait).encode()
+            yield stream.write(
+                BinarySession.HEADER.pack(len(name), BinarySession.DECLARE, 0, 0, 1) + name +
+                BinarySession.HEADER.pack(len(cursor), BinarySession.READ, 0, 0, 1) + cursor
+            )
+            response = yield self.read(stream)
+        except (tornado.iostream.StreamClosedError, OSError):
+            raise tornado.web.HTTPError(502, 'Unable to reach shard {}:{}'.format(*self.address))
+
+        self.idle.append(stream)
+        return response
+
+# Shared Memory Ring
+
+class SharedMemoryRing(object):
+    ''' Single-producer, single-consumer byte ring (see include/mq/shm.h). '''
+    HEAD    = 0
+    WAITING = 8
+    TAIL    = 64
+    SIZE   = 128
+    DATA   = 192
+    RECORD = struct.Struct('=IB3x')
+    FENCE  = threading.Lock()   # Acquired and released as a full memory barrier
+
+    def __init__(self, buffer, offset, size):
+        self.buffer = buffer
+        self.offset = offset
+        self.size   = size
+
+    def _get(self, field):
+        return struct.unpack_from('=Q', self.buffer, self.offset + field)[0]
+
+    def _set(self, field, value):
+        struct.pack_into('=Q', self.buffer, self.offset + field, value)
+
+    def _copy_out(self, position, length):
+        start = self.offset + self.DATA + position % self.size
+        first = min(length, self.size - position % self.size)
+        data  = self.buffer[start:start + first]
+        if first < length:
+            start = self.offset + self.DATA
+            data += self.buffer[start:start + length - first]
+        return data
+
+    def _copy_in(self, position, data):
+        start = self.offset + self.DATA + position % self.size
+        first = min(len(data), self.size - position % self.size)
+        self.buffer[start:start + first] = data[:first]
+        if first < len(data):
+            start = self.offset + self.DATA
+            self.buffer[start:start + len(data) - first] = data[first:]
+
+    @staticmethod
+    def _align(length):
+        return (SharedMemoryRing.RECORD.size + length + 7) & ~7
+
+    def read(self):
+        ''' Remove next record from ring (or return None if empty). '''
+        head = self._get(self.HEAD)
+        if head == self._get(self.TAIL):
+            return None
+
+        length, tag = self.RECORD.unpack(self._copy_out(head, self.RECORD.size))
+        data = self._copy_out(head + self.RECORD.size, length)
+        self._set(self.HEAD, head + self._align(length))
+        return tag, data
+
+    def write(self, tag, data):
+        ''' Append record to ring (returns whether or not it fit). '''
+        head  = self._get(self.HEAD)
+        tail  = self._get(self.TAIL)
+        total = self._align(len(data))
+        if total > self.size - (tail - head):
+            return False
+
+        self._copy_in(tail, self.RECORD.pack(len(data), tag))
+        self._copy_in(tail + self.RECORD.size, data)
+        self._set(self.TAIL, tail + total)
+        return True
+
+    def fits(self, length):
+        ''' Return whether or not a record of length bytes fits in the empty ring. '''
+        return self._align(length) <= self.size
+
+    def wait(self):
+        ''' Ask consumer to signal once it frees space (after a write did not fit). '''
+        self._set(self.WAITING, 1)
+        with self.FENCE:
+            pass
+
+    def drained(self):
+        ''' Return whether or not producer waits for the space just freed by reads (clearing its request). '''
+        with self.FENCE:
+            pass
+        if not self._get(self.WAITING):
+            return False
+        self._set(self.WAITING, 0)
+        return True
+
+# Shared Memory Session
+
+class SharedMemorySession(object):
+    ''' Serve one co-located client's requests from its shared memory rings. '''
+    MAGIC  = b'MQSHM1'
+    ROUTES = (
+        (re.compile(r'.*/topic/(.*)')            , 'topic'),
+        (re.compile(r'.*/queue/(.*)')            , 'queue'),
+        (re.compile(r'.*/subscription/(.*)/(.*)'), 'subscription'),
+    )
+
+    def __init__(self, application, connection, memfd, tx_event, rx_event):
+        self.application = application
+        self.connection  = connection
+        self.tx_event    = tx_event
+        self.rx_event    = rx_event
+        self.closed      = False
+        self.pending     = collections.deque()  # Responses waiting for space in tx ring
+
+        length       = os.fstat(memfd).st_size
+        self.memory  = mmap.mmap(memfd, length)
+        os.close(memfd)
+
+        ring_size    = struct.unpack_from('=Q', self.memory, SharedMemoryRing.SIZE)[0]
+        ring_bytes   = SharedMemoryRing.DATA + ring_size
+        self.rx      = SharedMemoryRing(self.memory, 0, ring_size)            # Client to broker
+        self.tx      = SharedMemoryRing(self.memory, ring_bytes, ring_size)   # Broker to client
+
+        self.application.ioloop.add_handler(self.tx_event, self.on_event, tornado.ioloop.IOLoop.READ)
+        self.application.ioloop.add_handler(self.connection, self.on_control, tornado.ioloop.IOLoop.READ)
+        self.connection.send(b'OK\n')
+
+    def on_control(self, fd, events):
+        ''' Close session when client disconnects. '''
+        try:
+            if self.connection.recv(4096):
+                return
+        except BlockingIOError:
+            return
+        except OSError:
+            pass
+        self.close()
+
+    def on_event(self, fd, events):
+        ''' Drain request records (and write held responses) after client signals its eventfd. '''
+        try:
+            os.read(self.tx_event, 8)
+        except BlockingIOError:
+            pass
+
+        self.flush()
+
+        record = self.rx.read()
+        while record:
+            self.application.ioloop.add_future(self.handle(*record), lambda f: f.result())
+            record = self.rx.read()
+
+        if self.rx.drained():
+            os.write(self.rx_event, struct.pack('=Q', 1))
+
+    @tornado.gen.coroutine
+    def handle(self, tag, request):
+        ''' Dispatch one HTTP request record and write its response record. '''
+        header, _, body = request.partition(b'\r\n\r\n')
+        lines           = header.decode().split('\r\n')
+        method, uri     = lines[0].split()[:2]
+        status, message = 404, 'Not Found\n'
+        headers         = {}
+        extra           = {}
+        for line in lines[1:]:
+            name, _, value = line.partition(':')
+            if name.lower().startswith('mq-'):
+                headers[name[3:].lower()] = value.strip()
+
+        try:
+            for pattern, route in self.ROUTES:
+                match = pattern.match(uri)
+                if not match:
+                    continue
+
+                if route == 'topic' and method == 'PUT':
+                    message, load = yield self.application.publish(match.group(1), bytes(body), headers)
+                    status  = 200
+                    extra['Mq-Load'] = '{:.3f}'.format(load)
+                elif route == 'topic' and method == 'GET':
+                    topic, _, query = match.group(1).partition('?')
+                    arguments       = urllib.parse.parse_qs(query)
+                    offset, count, wait = self.application.cursor(
+                        *(arguments[name][-1] if name in arguments else None for name in ('offset', 'max', 'wait'))
+                    )
+                    message, offset = yield self.application.read(topic, offset, count, lambda: self.closed, wait)
+                    status  = 200 if message is not None else 204
+                    message = message or b''
+                    extra['Mq-Offset'] = offset
+                elif route == 'queue' and method == 'GET':
+                    queue, _, query = match.group(1).partition('?')
+                    arguments       = urllib.parse.parse_qs(query)
+                    count, size     = self.application.limits(
+                        *(arguments[name][-1] if name in arguments else None for name in ('max', 'bytes'))
+                    )
+                    message = yield self.application.retrieve(
+                        queue, lambda: self.closed, None, count, size, self.tx.size // 2 if count else None
+                    )
+                    status  = 200
+                elif route == 'subscription' and method == 'PUT':
+                    message = yield self.application.subscribe(*match.groups(), bytes(body).decode().strip() or None)
+                    status  = 200
+                elif route == 'subscription' and method == 'DELETE':
+                    message = yield self.application.unsubscribe(*match.groups())
+                    status  = 200
+                break
+        except tornado.web.HTTPError as e:
+            status, message = e.status_code, e.log_message + '\n'
+            if isinstance(e, Overloaded):
+                extra['Retry-After']    = math.ceil(e.retry / 1000.0)
+                extra['Mq-Retry-After'] = e.retry
+
+        if not self.closed:
+            self.respond(tag, status, message, extra)
+
+    def respond(self, tag, status, message, headers=None):
+        ''' Write HTTP response record (with extra headers) and signal client.
+
+        While the ring is full, responses are held until the client drains it.
+        A response larger than the whole ring is refused with 413 instead.
+        '''
+        if isinstance(message, str):
+            message = message.encode()
+
+        response = 'HTTP/1.0 {} {}\r\n{}Content-Length: {}\r\n\r\n'.format(
+            status, http.client.responses.get(status, ''),
+            ''.join('{}: {}\r\n'.format(name, value) for name, value in (headers or {}).items()),
+            len(message),
+        ).encode() + message
+
+        if not self.tx.fits(len(response)):
+            self.application.logger.error('Response of {} bytes does not fit in shared memory ring'.format(len(response)))
+            self.respond(tag, 413, 'Response of {} bytes exceeds shared memory ring of {} bytes\n'.format(
+                len(response), self.tx.size
+            ))
+            return
+
+        self.pending.append((tag, response))
+        self.flush()
+
+    def flush(self):
+        ''' Write held responses while they fit in the ring and signal client. '''
+        written = False
+        while self.pending and not self.closed:
+            if not self.tx.write(*self.pending[0]):
+                # Ask client to signal once it reads, then check again in case it already has
+                self.tx.wait()
+                if not self.tx.write(*self.pending[0]):
+                    break
+            self.pending.popleft()
+            written = True
+
+        if written:
+            os.write(self.rx_event, struct.pack('=Q', 1))
+
+    def close(self):
+        if self.closed:
+            return
+
+        self.closed = True
+        self.application.ioloop.remove_handler(self.tx_event)
+        self.application.ioloop.remove_handler(self.connection)
+        self.connection.close()
+        os.close(self.tx_event)
+        os.close(self.rx_event)
+        self.memory.close()
+        self.pending.clear()
+
+# Rate
+
+class Rate(object):
+    ''' Exponentially decaying event counter: approximates events per second
+    over the last TAU seconds in O(1) time and space per event.
+    '''
+    TAU = 10.0
+
+    __slots__ = ('value', 'updated', 'clock')
 
-        self.write_response('Unsubscribed queue ({}) from topic ({})\n'.format(queue, topic))
+    def __init__(self, clock=time.monotonic):
+        self.value   = 0.0
+        self.updated = clock()
+        self.clock   = clock
+
+    def mark(self, count=1):
+        now          = self.clock()
+        self.value   = self.value * math.exp((self.updated - now) / self.TAU) + count / self.TAU
+        self.updated = now
+
+    def __float__(self):
+        return self.value * math.exp((self.updated - self.clock()) / self.TAU)
+
+class TopicStats(object):
+    ''' Counters of one topic (on one worker). '''
+    __slots__ = ('published', 'bytes', 'delivered', 'rate')
+
+    def __init__(self):
+        self.published = 0          # Messages accepted by this worker
+        self.bytes     = 0          # Bytes of messages accepted by this worker
+        self.delivered = 0          # Copies appended to this worker's queues
+        self.rate      = Rate()     # Messages per second accepted by this worker
+
+# Message Segment
+
+class MessageSegment(object):
+    ''' Memory-mapped (unlinked) spool file of length-prefixed messages (with deadlines). '''
+    RECORD = struct.Struct('=Id')   # Length and deadline (0 if none)
+
+    def __init__(self, directory, size):
+        self.file   = tempfile.TemporaryFile(dir=directory or None)
+        self.file.truncate(size)
+        self.memory = mmap.mmap(self.file.fileno(), size)
+        self.head   = 0     # Offset of next message to read
+        self.tail   = 0     # Offset of next message to write
+
+    def append(self, message, deadline=0):
+        ''' Write message to end of segment (returns whether or not it fit). '''
+        end = self.tail + self.RECORD.size + len(message)
+        if end > len(self.memory):
+            return False
+
+        self.RECORD.pack_into(self.memory, self.tail, len(message), deadline)
+        self.memory[self.tail + self.RECORD.size:end] = message
+        self.tail = end
+        return True
+
+    def popleft(self):
+        ''' Read message from front of segment (returns message and deadline). '''
+        length, deadline = self.RECORD.unpack_from(self.memory, self.head)
+        start   = self.head + self.RECORD.size
+        self.head = start + length
+        return self.memory[start:self.head], deadline
+
+    def deadline(self):
+        ''' Return deadline of message at front of segment (0 if none). '''
+        return self.RECORD.unpack_from(self.memory, self.head)[1]
+
+    def peek(self):
+        ''' Return length of message at front of segment. '''
+        return self.RECORD.unpack_from(self.memory, self.head)[0]
+
+    def __bool__(self):
+        return self.head < self.tail
+
+    def close(self):
+        ''' Unmap segment and close its spool file (releasing its disk space). '''
+        self.memory.close()
+        self.file.close()
+
+# Timer Wheel
+
+class TimerWheel(object):
+    ''' Hierarchical timing wheel: each level has SLOTS buckets, each covering
+    SLOTS times as many ticks as a bucket of the level below.  Timers are
+    bucketed by expiry tick, moved down a level as their bucket comes up, and
+    fired a whole bucket at a time, so adding and expiring are O(1) per timer.
+    '''
+    TICK   = 0.01   # Seconds per tick
+    BITS   = 6      # Slots per level (log2)
+    SLOTS  = 1 << BITS
+    LEVELS = 4      # Spans SLOTS ** LEVELS ticks (later timers are moved down early and rescheduled)
+
+    def __init__(self, clock=time.monotonic):
+        self.clock  = clock
+        self.tick   = int(clock() / self.TICK)    # Next tick to expire
+        self.levels = [[[] for _ in range(self.SLOTS)] for _ in range(self.LEVELS)]
+        self.sizes  = [0] * self.LEVELS          # Timers in each level
+        self.count  = 0
+
+    def add(self, deadline, callback, *args):
+        ''' Call callback(*args) once deadline (in clock seconds) passes. '''
+        if not self.count:
+            self.tick = max(self.tick, int(self.clock() / self.TICK))
+        self.insert((max(math.ceil(deadline / self.TICK), self.tick), callback, args))
+        self.count += 1
+
+    def insert(self, timer):
+        ''' Put timer in bucket of the lowest level that spans its expiry tick. '''
+        tick  = min(timer[0], self.tick + self.SLOTS ** self.LEVELS - 1)
+        delta = tick - self.tick
+        level = 0
+        while delta >= self.SLOTS ** (level + 1):
+            level += 1
+        self.levels[level][(tick >> (self.BITS * level)) & (self.SLOTS - 1)].append(timer)
+        self.sizes[level] += 1
+
+    def take(self, level, slot):
+        ''' Empty bucket (returns its timers). '''
+        bucket, self.levels[level][slot] = self.levels[level][slot], []
+        self.sizes[level] -= len(bucket)
+        return bucket
+
+    def advance(self):
+        ''' Fire every timer whose deadline has passed (returns number fired). '''
+        now   = int(self.clock() / self.TICK)
+        fired = 0
+
+        while self.tick <= now and self.count:
+            # Move timers of higher level buckets that come up at this tick down
+            for level in range(1, self.LEVELS):
+                if self.tick & ((1 << (self.BITS * level)) - 1):
+                    break
+                for timer in self.take(level, (self.tick >> (self.BITS * level)) & (self.SLOTS - 1)):
+                    self.insert(timer)
+
+            # Skip ahead to the next bucket that comes up while lower levels are empty
+            level = 0
+            while level < self.LEVELS - 1 and not self.sizes[level]:
+                level += 1
+            if level:
+                span = 1 << (self.BITS * level)
+                self.tick = min((self.tick | (span - 1)) + 1, now + 1)
+                continue
+
+            # Callbacks may add timers, which must not land in this bucket
+            tick = self.tick
+            self.tick += 1
+            for timer in self.take(0, tick & (self.SLOTS - 1)):
+                if timer[0] > tick:         # Beyond span of wheel when added
+                    self.insert(timer)
+                    continue
+                self.count -= 1
+                fired += 1
+                timer[1](*timer[2])
+
+        self.tick = max(self.tick, now + 1)
+        return fired
+
+    def __len__(self):
+        return self.count
+
+# Message Store
+
+class Expiring(object):
+    ''' In-memory message with a deadline (message is None once it expires). '''
+    __slots__ = ('message', 'deadline')
+
+    def __init__(self, message, deadline):
+        self.message  = message
+        self.deadline = deadline
+
+class MessageStore(object):
+    ''' FIFO of one queue's messages: newest in memory, oldest spilled to segments once over budget. '''
+    SEGMENT_SIZE = 64 * 1024 * 1024
+
+    def __init__(self, application):
+        self.application = application
+        self.memory      = collections.deque()  # Newest messages
+        self.bytes       = 0                    # Bytes of messages in memory
+        self.segments    = collections.deque()  # Oldest messages
+        self.spilled     = 0                    # Number of messages in segments
+        self.dead        = 0                    # Expired messages still in memory deque
+        self.expired     = 0                    # Messages dropped because they expired
+        self.enqueued    = Rate()               # Messages appended per second
+        self.dequeued    = Rate()               # Messages removed per second
+
+    def append(self, message, deadline=None):
+        ''' Add message to end of queue, until deadline (spilling oldest messages while over budget). '''
+        if deadline is None:
+            self.memory.append(message)
+        else:
+            entry = Expiring(message, deadline)
+            self.memory.append(entry)
+            self.application.schedule(deadline, self.expire, entry)
+        self.account(len(message))
+        self.enqueued.mark()
+
+        while self.memory and (
+            self.bytes > self.application.queue_memory or self.application.memory > self.application.max_memory
+        ):
+            self.spill()
+
+    def popleft(self):
+        ''' Remove message from front of queue (None if only expired messages are left). '''
+        self.purge()
+        if self.spilled:
+            segment = self.segments[0]
+            message, _ = segment.popleft()
+            self.spilled -= 1
+            if not segment:
+                self.segments.popleft().close()
+            self.dequeued.mark()
+            return message
+
+        if not self.memory:
+            return None
+
+        self.dequeued.mark()
+        entry = self.memory.popleft()
+        if isinstance(entry, Expiring):
+            message, entry.message = entry.message, None
+        else:
+            message = entry
+        self.account(-len(message))
+        return message
+
+    def peek(self):
+        ''' Return length of message at front of queue (0 if none). '''
+        self.purge()
+        if self.spilled:
+            return self.segments[0].peek()
+        if not self.memory:
+            return 0
+        entry = self.memory[0]
+        return len(entry.message if isinstance(entry, Expiring) else entry)
+
+    def expire(self, entry):
+        ''' Drop expired message from memory (unless it was already retrieved or spilled). '''
+        if entry.message is None:
+            return
+
+        self.account(-len(entry.message))
+        entry.message = None
+        self.dead    += 1
+        self.expired += 1
+
+        # Compact once most of the deque is expired (amortized O(1) per message)
+        if self.dead > len(self.memory) // 2:
+            self.memory = collections.deque(
+                e for e in self.memory if not isinstance(e, Expiring) or e.message is not None
+            )
+            self.dead = 0
+
+    def purge(self):
+        ''' Drop expired messages from front of queue. '''
+        now = self.application.timers.clock() if self.spilled else 0
+        while self.spilled:
+            deadline = self.segments[0].deadline()
+            if not deadline or deadline > now:
+                return
+            self.segments[0].popleft()
+            self.spilled -= 1
+            self.expired += 1
+            if not self.segments[0]:
+                self.segments.popleft().close()
+
+        while self.memory and isinstance(self.memory[0], Expiring) and self.memory[0].message is None:
+            self.memory.popleft()
+            self.dead -= 1
+
+    def spill(self):
+        ''' Move oldest message in memory to end of last segment. '''
+        entry    = self.memory.popleft()
+        deadline = 0
+        if isinstance(entry, Expiring):
+            if entry.message is None:
+                self.dead -= 1
+                return
+            message, deadline, entry.message = entry.message, entry.deadline, None
+        else:
+            message = entry
+        self.account(-len(message))
+
+        if not self.segments or not self.segments[-1].append(message, deadline):
+            size    = max(self.SEGMENT_SIZE, MessageSegment.RECORD.size + len(message))
+            segment = MessageSegment(self.application.spool, size)
+            segment.append(message, deadline)
+            self.segments.append(segment)
+        self.spilled += 1
+
+    def account(self, length):
+        self.bytes += length
+        self.application.memory += length
+
+    def close(self):
+        ''' Drop all messages and close spilled segments (once the store is discarded). '''
+        while self.segments:
+            self.segments.popleft().close()
+        self.spilled = 0
+        self.account(-self.bytes)
+        self.memory.clear()
+        self.dead = 0
+
+    def __len__(self):
+        return len(self.memory) - self.dead + self.spilled
+
+    def __bool__(self):
+        self.purge()
+        return len(self) > 0
+
+# Topic Log
+
+class TopicLog(object):
+    ''' Last messages of one topic, read by offset: each message is stored
+    once however many consumers read it.  The oldest ones are dropped from the
+    front of a list (compacted once most of it is dropped), so appends and
+    reads are amortized O(1) per message.
+    '''
+    def __init__(self, retain):
+        self.retain   = retain
+        self.messages = []
+        self.head     = 0                       # Index of oldest retained message
+        self.first    = 0                       # Offset of oldest retained message
+        self.bytes    = 0                       # Bytes of retained messages
+        self.waiters  = collections.deque()     # Futures of readers waiting for new messages
+
+    def append(self, message):
+        ''' Add message at next offset (dropping oldest beyond retain) and wake readers. '''
+        self.messages.append(message)
+        self.bytes += len(message)
+
+        while len(self) > self.retain:
+            self.bytes -= len(self.messages[self.head])
+            self.messages[self.head] = None
+            self.head  += 1
+            self.first += 1
+
+        if self.head > len(self.messages) // 2:
+            del self.messages[:self.head]
+            self.head = 0
+        self.wake()
+
+    def read(self, offset, count):
+        ''' Return (offset, message) of up to count messages from offset (or the oldest retained one). '''
+        start = max(offset, self.first)
+        index = self.head + start - self.first
+        return zip(itertools.count(start), self.messages[index:index + count])
+
+    def wake(self):
+        ''' Wake every waiting reader. '''
+        while self.waiters:
+            waiter = self.waiters.popleft()
+            if not waiter.done():
+                waiter.set_result(None)
+
+    @property
+    def end(self):
+        ''' Offset of next message. '''
+        return self.first + len(self)
+
+    def __len__(self):
+        return len(self.messages) - self.head
+
+# Producer Windows
+
+class ProducerWindows(object):
+    ''' Sequence numbers recently published by each producer: the highest one
+    and a bitmap of which of the window below it were seen, so the memory per
+    producer is fixed.  The least recently active producers are forgotten once
+    there are too many.
+    '''
+    DEFAULT_WINDOW    = 1024
+    DEFAULT_PRODUCERS = 10000
+    OVERHEAD          = 256     # Approximate bytes per producer besides its bitmap
+
+    def __init__(self, window=DEFAULT_WINDOW, producers=DEFAULT_PRODUCERS):
+        self.window     = window
+        self.mask       = (1 << window) - 1
+        self.producers  = producers
+        self.windows    = collections.OrderedDict()  # Producer to [highest sequence number, bitmap]
+        self.duplicates = 0                          # Messages ignored as duplicates
+        self.forgotten  = 0                          # Producers evicted to stay within limit
+
+    def duplicate(self, producer, sequence):
+        ''' Record producer's sequence number (returns whether it was seen before, or is too old to tell). '''
+        entry = self.windows.get(producer)
+        if entry is None:
+            if len(self.windows) >= self.producers:
+                self.windows.popitem(last=False)
+                self.forgotten += 1
+            self.windows[producer] = [sequence, 1]
+            return False
+
+        self.windows.move_to_end(producer)
+        highest, seen = entry
+        if sequence > highest:
+            shift    = sequence - highest
+            entry[0] = sequence
+            entry[1] = ((seen << shift) | 1) & self.mask if shift < self.window else 1
+            return False
+
+        offset = highest - sequence
+        if offset >= self.window or (seen >> offset) & 1:
+            self.duplicates += 1
+            return True
+
+        entry[1] = seen | (1 << offset)
+        return False
+
+    def memory(self, producers=None):
+        ''' Return approximate bytes used by windows of producers (default: current number). '''
+        if producers is None:
+            producers = len(self.windows)
+        return producers * (self.window // 8 + self.OVERHEAD)
 
 # Message Queue
 
 class MessageQueue(tornado.web.Application):
     DEFAULT_ADDRESS = '0.0.0.0'
     DEFAULT_PORT    = 9620
+    DEFAULT_WORKERS = 1
+    DEFAULT_QUEUE_MEMORY = 64 * 1024 * 1024
+    DEFAULT_MEMORY       = 1024 * 1024 * 1024
+    DEFAULT_MAX_DEPTH    = 1000000
+    DEFAULT_MAX_MESSAGE  = 1024 * 1024 * 1024
+    HEADROOM             = 64 * 1024  # Bytes of request line and headers buffered beyond max_message
+    RETRY_AFTER     = 100   # Milliseconds overloaded publishers wait (scaled by load)
+    SHARD_WAIT      = 1000  # Milliseconds a forwarded fetch waits before rechecking its client
+    READ_MAX        = 1000  # Messages returned by one read of a topic log
+    FETCH_MAX       = 1000  # Messages returned by one batch retrieval from a queue
+    WAIT_CHECK      = 10    # Seconds an idle consumer waits before rechecking its connection
 
     def __init__(self, **settings):
         tornado.web.Application.__init__(self, **settings)
@@ -112,24 +1340,582 @@ class MessageQueue(tornado.web.Application):
         self.logger        = logging.getLogger()
         self.address       = settings.get('address', self.DEFAULT_ADDRESS)
         self.port          = settings.get('port'   , self.DEFAULT_PORT)
-        self.ioloop        = tornado.ioloop.IOLoop.instance()
-        self.queues        = collections.defaultdict(list)
-        self.subscriptions = collections.defaultdict(set)
+        self.unix          = settings.get('unix'   , '')
+        self.shm           = settings.get('shm'    , '')
+        self.workers       = settings.get('workers', self.DEFAULT_WORKERS)
+        self.queue_memory  = settings.get('queue_memory', self.DEFAULT_QUEUE_MEMORY)
+        self.max_memory    = settings.get('memory', self.DEFAULT_MEMORY)
+        self.spool         = settings.get('spool', '')
+        self.max_depth     = settings.get('max_depth', self.DEFAULT_MAX_DEPTH)
+        self.max_message   = settings.get('max_message', self.DEFAULT_MAX_MESSAGE)
+        self.log_messages  = settings.get('log_messages', False)
+        self.retain        = settings.get('retain', 0)
+        self.started       = time.monotonic()
+        self.dedup         = ProducerWindows(
+            settings.get('dedup_window', ProducerWindows.DEFAULT_WINDOW),
+            settings.get('dedup_producers', ProducerWindows.DEFAULT_PRODUCERS),
+        )
+        self.memory        = 0                              # Bytes of messages in memory (all queues)
+        self.ioloop        = None
+        self.queues        = collections.defaultdict(lambda: MessageStore(self))
+        self.waiters       = collections.defaultdict(collections.deque)  # Queue to futures of waiting consumers
+        self.subscriptions = collections.defaultdict(set)   # Queue to topics
+        self.subscribers   = collections.defaultdict(set)   # Topic to local queues
+        self.selectors     = {}                             # Queue and topic to Selector
+        self.shard         = 0                              # Index of this worker
+        self.peers         = {}                             # Index of other workers to ShardClient
+        self.routes        = collections.defaultdict(set)   # Topic to workers with subscribers
+        self.timers        = TimerWheel()                   # Message expiries and delayed deliveries
+        self.ticker        = None                           # Advances timers while any are pending
+        self.topics        = collections.defaultdict(TopicStats)
+        self.logs          = collections.defaultdict(lambda: TopicLog(self.retain))  # Topic to log (owned by this worker)
 
         self.add_handlers('.*', (
+            ('.*/binary'                , BinaryHandler),
             ('.*/topic/(.*)'            , TopicHandler),
             ('.*/queue/(.*)'            , QueueHandler),
             ('.*/subscription/(.*)/(.*)', SubscriptionHandler),
+            ('.*/stats'                 , StatsHandler),
         ))
 
+    def log_request(self, handler):
+        ''' Log request, except successful publishes and retrievals (unless log_messages). '''
+        if not self.log_messages and isinstance(handler, (TopicHandler, QueueHandler)) and handler.get_status() < 400:
+            return
+        tornado.web.Application.log_request(self, handler)
+
+    def owner(self, queue):
+        ''' Return index of worker that owns queue. '''
+        if not self.peers:
+            return self.shard
+        return zlib.crc32(queue.encode()) % self.workers
+
+    @tornado.gen.coroutine
+    def publish(self, topic, message, headers=None):
+        ''' Publish message to each queue that is subscribed to topic (on every worker with subscribers).
+
+        Returns response and load (depth of deepest subscribed queue relative
+        to max_depth), which publishers use to slow down.  Once a queue is at
+        its maximum depth, the message is refused with 429 (on that worker:
+        other workers may have delivered it, so publishers must retry with
+        the same producer id and sequence number to avoid duplicates).
+        '''
+        self.timing(headers)
+        identity    = self.identity(headers)
+        shards      = self.routes.get(topic, ()) if self.peers else (self.shard,)
+        if self.retain and self.peers:
+            shards = set(shards) | {self.owner(topic)}
+        flags, body = BinarySession.join(message, headers)
+        forwards    = [self.peers[shard].request(BinarySession.DELIVER, body, topic, flags=flags) for shard in shards if shard != self.shard]
+        results     = [self.deliver(topic, message, headers)] if self.shard in shards else []
+
+        for status, body in (yield forwards):
+            if status == 200:
+                count, load = body.split()
+                results.append((int(count), float(load)))
+            else:
+                results.append((0, 0.0))
+
+        if not self.retain and not (self.routes.get(topic) if self.peers else topic in self.subscribers):
+            raise tornado.web.HTTPError(404, 'There are no subscribers for topic: {}'.format(topic))
+
+        load = max((load for _, load in results), default=0.0)
+        if load >= 1.0:
+            raise Overloaded(load, int(self.RETRY_AFTER * load))
+
+        if identity and results and all(count < 0 for count, _ in results):
+            return 'Ignored duplicate message ({} bytes) from producer {} (sequence {})\n'.format(
+                len(message),
+                *identity
+            ), load
+
+        stats            = self.topics[topic]
+        stats.published += 1
+        stats.bytes     += len(message)
+        stats.rate.mark()
+
+        subscribers = sum(max(count, 0) for count, _ in results)
+        return 'Published message ({} bytes) to {} subscribers of {}\n'.format(
+            len(message),
+            subscribers,
+            topic,
+        ), load
+
+    def deliver(self, topic, message, headers=None):
+        ''' Append message to each local queue that is subscribed to topic and
+        whose selector matches.  Returns number of queues (0 if any of them is
+        at its maximum depth, or -1 if message is a duplicate) and load.
+        '''
+        queues = []
+        for queue in self.subscribers.get(topic, ()):
+            selector = self.selectors.get((queue, topic))
+            if selector and not selector(headers or {}):
+                continue
+            queues.append(queue)
+
+        # Refused messages are not recorded as seen, so their retries are delivered
+        load = max((len(self.queues[queue]) for queue in queues), default=0) / self.max_depth
+        if load >= 1.0:
+            return 0, load
+
+        identity = self.identity(headers)
+        if identity and self.dedup.duplicate(*identity):
+            return -1, load
+
+        ttl, delay = self.timing(headers)
+        now        = self.timers.clock()
+        deadline   = now + ttl if ttl else None
+        log        = self.logs[topic] if self.retain and self.owner(topic) == self.shard else None
+        if (not queues and log is None) or (deadline and delay >= ttl):
+            return len(queues), load
+
+        if delay:
+            self.schedule(now + delay, self.enqueue, queues, message, deadline, log)
+        else:
+            self.enqueue(queues, message, deadline, log)
+        self.topics[topic].delivered += len(queues)
+        return len(queues), load
+
+    def enqueue(self, queues, message, deadline=None, log=None):
+        ''' Append message to queues (until deadline) and topic log (retained regardless of deadline), and wake their consumers. '''
+        if log is not None:
+            log.append(message)
+        for queue in queues:
+            if deadline is None:
+                self.queues[queue].append(message)
+            else:
+                self.queues[queue].append(message, deadline)
+            self.wake(queue)
+
+    def timing(self, headers):
+        ''' Return TTL and delay (in seconds, or None and 0) from Mq-TTL and Mq-Delay headers (in milliseconds). '''
+        timing = []
+        for name in ('ttl', 'delay'):
+            value = (headers or {}).get(name)
+            try:
+                value = int(value) if value is not None else None
+            except ValueError:
+                value = -1
+            if value is not None and (value < 0 or (name == 'ttl' and value == 0)):
+                raise tornado.web.HTTPError(400, 'Invalid {} header: {}'.format(name, headers[name]))
+            timing.append(value / 1000.0 if value else None)
+        return timing[0], timing[1] or 0
+
+    def identity(self, headers):
+        ''' Return producer and sequence number from Mq-Producer and Mq-Sequence headers (or None). '''
+        producer = (headers or {}).get('producer')
+        sequence = (headers or {}).get('sequence')
+        if producer is None or sequence is None:
+            return None
+
+        try:
+            sequence = int(sequence)
+        except ValueError:
+            sequence = 0
+        if sequence < 1:
+            raise tornado.web.HTTPError(400, 'Invalid sequence header: {}'.format(headers['sequence']))
+        return producer, sequence
+
+    def schedule(self, deadline, callback, *args):
+        ''' Call callback(*args) once deadline passes (advancing timers every tick while any are pending). '''
+        self.timers.add(deadline, callback, *args)
+        if self.ticker is None:
+            self.ticker = tornado.ioloop.PeriodicCallback(self.on_tick, TimerWheel.TICK * 1000)
+            self.ticker.start()
+
+    def on_tick(self):
+        self.timers.advance()
+        if not self.timers:
+            self.ticker.stop()
+            self.ticker = None
+
+    def cursor(self, offset=None, count=None, wait=None):
+        ''' Return offset, count and wait (in seconds, or None) from read arguments (strings or None). '''
+        try:
+            offset = int(offset) if offset is not None else 0
+            count  = min(int(count), self.READ_MAX) if count is not None else 1
+            wait   = int(wait) / 1000.0 if wait and int(wait) > 0 else None
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid read of offset {}, max {}, wait {}'.format(offset, count, wait))
+        if count < 1:
+            raise tornado.web.HTTPError(400, 'Invalid read of offset {}, max {}, wait {}'.format(offset, count, wait))
+        return offset, count, wait
+
+    def limits(self, count=None, size=None):
+        ''' Return count (None unless a batch) and size (in bytes, or None) from retrieval arguments (strings or None). '''
+        try:
+            count = min(int(count), self.FETCH_MAX) if count is not None else None
+            size  = int(size) if size else None
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid retrieval of max {}, bytes {}'.format(count, size))
+        if (count is not None and count < 1) or (size is not None and size < 0):
+            raise tornado.web.HTTPError(400, 'Invalid retrieval of max {}, bytes {}'.format(count, size))
+        return count, size
+
+    @tornado.gen.coroutine
+    def read(self, topic, offset, count, closed, timeout=None):
+        ''' Read up to count messages of topic log from offset (negative for the next new
+        message), waiting until one is available, closed, or timeout seconds pass.
+
+        Returns records (or None if timeout passed) and the offset to read
+        next, so readers of new messages resume where the last read left off.
+        '''
+        if not self.retain:
+            raise tornado.web.HTTPError(404, 'Topics are not retained: {}'.format(topic))
+
+        owner = self.owner(topic)
+        if owner != self.shard:
+            deadline = None if timeout is None else self.ioloop.time() + timeout
+            while True:
+                wait = self.SHARD_WAIT if deadline is None else max(int((deadline - self.ioloop.time()) * 1000), 1)
+                status, records = yield self.peers[owner].read_topic(topic, offset, count, min(wait, self.SHARD_WAIT))
+                if status == 200:
+                    return records, self.next(records)
+                if status != 204:
+                    raise tornado.web.HTTPError(status, records.decode().rstrip())
+                offset = int(records)
+                if closed():
+                    raise tornado.web.HTTPError(404, 'There are no messages for topic: {}'.format(topic))
+                if deadline is not None and self.ioloop.time() >= deadline:
+                    return None, offset
+
+        log      = self.logs[topic]
+        offset   = log.end if offset < 0 else offset
+        deadline = None if timeout is None else self.ioloop.time() + timeout
+        while offset >= log.end and not closed():
+            now = self.ioloop.time()
+            if deadline is not None and now >= deadline:
+                return None, offset
+
+            waiter = tornado.concurrent.Future()
+            log.waiters.append(waiter)
+            try:
+                yield tornado.gen.with_timeout(min(now + self.WAIT_CHECK, deadline or float('inf')), waiter)
+            except tornado.gen.TimeoutError:
+                if waiter in log.waiters:
+                    log.waiters.remove(waiter)
+
+        if closed():
+            raise tornado.web.HTTPError(404, 'There are no messages for topic: {}'.format(topic))
+
+        records = list(log.read(offset, count))
+        return b''.join(
+            '{} {}\n'.format(position, len(message)).encode() + message for position, message in records
+        ), records[-1][0] + 1
+
+    @staticmethod
+    def next(records):
+        ''' Return offset after last of records (read from another worker). '''
+        offset = 0
+        while records:
+            header, _, records = records.partition(b'\n')
+            offset, length     = map(int, header.split())
+            records            = records[length:]
+        return offset + 1
+
+    @tornado.gen.coroutine
+    def stats(self):
+        ''' Return counters of every worker (merged). '''
+        stats = self.local_stats()
+        for status, body in (yield [peer.request(BinarySession.STATS, b'') for peer in self.peers.values()]):
+            if status != 200:
+                raise tornado.web.HTTPError(status, body.decode().rstrip())
+            peer = json.loads(body.decode())
+            for name in ('memory', 'max_memory', 'waiters', 'timers', 'expired', 'duplicates', 'producers', 'forgotten'):
+                stats[name] += peer[name]
+            stats['queues'].update(peer['queues'])
+            for topic, counters in peer['topics'].items():
+                merged = stats['topics'].setdefault(topic, dict.fromkeys(counters, 0))
+                for name, value in counters.items():
+                    merged[name] += value
+
+        for counters in stats['topics'].values():
+            counters['fanout'] = round(counters['delivered'] / counters['published'], 3) if counters['published'] else 0
+        return stats
+
+    def local_stats(self):
+        ''' Return counters of this worker's queues and topics (computed from
+        running totals, so reporting is O(queues + topics)). '''
+        queues = {}
+        for queue, store in self.queues.items():
+            queues[queue] = {
+                'depth'       : len(store),
+                'bytes'       : store.bytes,
+                'spilled'     : store.spilled,
+                'expired'     : store.expired,
+                'waiters'     : len(self.waiters.get(queue, ())),
+                'topics'      : sorted(self.subscriptions.get(queue, ())),
+                'enqueue_rate': round(float(store.enqueued), 3),
+                'dequeue_rate': round(float(store.dequeued), 3),
+            }
+
+        topics = {}
+        for topic in set(self.topics) | set(self.subscribers) | set(self.logs):
+            counters      = self.topics.get(topic) or TopicStats()
+            log           = self.logs.get(topic) or TopicLog(0)
+            topics[topic] = {
+                'published'  : counters.published,
+                'bytes'      : counters.bytes,
+                'delivered'  : counters.delivered,
+                'subscribers': len(self.subscribers.get(topic, ())),
+                'rate'       : round(float(counters.rate), 3),
+                'retained'   : len(log),
+                'log_bytes'  : log.bytes,
+                'offset'     : log.end,
+            }
+
+        return {
+            'workers'   : self.workers,
+            'uptime'    : round(time.monotonic() - self.started, 3),
+            'memory'    : self.memory,
+            'max_memory': self.max_memory,
+            'waiters'   : sum(len(waiters) for waiters in self.waiters.values()),
+            'timers'    : len(self.timers),
+            'expired'   : sum(store.expired for store in self.queues.values()),
+            'duplicates': self.dedup.duplicates,
+            'producers' : len(self.dedup.windows),
+            'forgotten' : self.dedup.forgotten,
+            'queues'    : queues,
+            'topics'    : topics,
+        }
+
+    def wake(self, queue, everyone=False):
+        ''' Wake the longest waiting consumer of queue (or every consumer). '''
+        waiters = self.waiters.get(queue)
+        while waiters:
+            waiter = waiters.popleft()
+            if not waiter.done():
+                waiter.set_result(None)
+                if not everyone:
+                    break
+        if not waiters:
+            self.waiters.pop(queue, None)
+
+    @tornado.gen.coroutine
+    def retrieve(self, queue, closed, timeout=None, count=None, size=None, limit=None):
+        ''' Retrieve one message from queue (wait until one is available, closed, or timeout seconds pass).
+
+        With count, returns a batch of records instead: the first message
+        (retrieved as above), followed by those already queued behind it, up
+        to count messages or until size bytes (if any) are reached.  With
+        limit, messages that would take the batch past limit bytes are left
+        queued (the first message is always retrieved).
+        '''
+        owner = self.owner(queue)
+        if limit:
+            size = min(size or limit, limit)
+        while owner != self.shard:
+            status, message = yield self.peers[owner].fetch(queue, self.SHARD_WAIT, count, size)
+            if status == 200:
+                return message
+            if status != 204:
+                raise tornado.web.HTTPError(status, message.decode().rstrip())
+            if closed():
+                raise tornado.web.HTTPError(404, 'There are no messages for queue: {}'.format(queue))
+
+        if queue not in self.queues:
+            raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
+
+        deadline = None if timeout is None else self.ioloop.time() + timeout
+        while not self.queues[queue] and not closed():
+            now = self.ioloop.time()
+            if deadline is not None and now >= deadline:
+                break
+
+            waiter = tornado.concurrent.Future()
+            self.waiters[queue].append(waiter)
+            try:
+                yield tornado.gen.with_timeout(min(now + self.WAIT_CHECK, deadline or float('inf')), waiter)
+            except tornado.gen.TimeoutError:
+                if waiter in self.waiters.get(queue, ()):
+                    self.waiters[queue].remove(waiter)
+
+        if self.queues[queue] and not closed():
+            message = self.queues[queue].popleft()
+            if count is None:
+                return message
+
+            records = ['{}\n'.format(len(message)).encode(), message]
+            total   = len(message)
+            while len(records) < 2 * count and (not size or total < size) and self.queues[queue]:
+                if limit and total + self.queues[queue].peek() > limit:
+                    break
+                message = self.queues[queue].popleft()
+                total  += len(message)
+                records.extend(('{}\n'.format(len(message)).encode(), message))
+            return b''.join(records)
+
+        # Leave message for another consumer if this one disconnected
+        if self.queues[queue]:
+            self.wake(queue)
+        raise tornado.web.HTTPError(404, 'There are no messages for queue: {}'.format(queue))
+
+    @tornado.gen.coroutine
+    def subscribe(self, queue, topic, selector=None):
+        ''' Subscribe queue to topic, filtered by selector (on the worker that owns queue). '''
+        compiled = Selector(selector) if selector else None
+        owner    = self.owner(queue)
+        if owner != self.shard:
+            yield self.forward(owner, BinarySession.SUBSCRIBE, queue + ('\0' + selector if selector else ''), topic)
+        else:
+            if compiled:
+                self.selectors[(queue, topic)] = compiled
+            else:
+                self.selectors.pop((queue, topic), None)
+            self.subscriptions[queue].add(topic)
+            self.subscribers[topic].add(queue)
+            if queue not in self.queues:
+                self.queues[queue]
+            yield self.route(topic)
+
+        return 'Subscribed queue ({}) to topic ({})\n'.format(queue, topic)
+
+    @tornado.gen.coroutine
+    def unsubscribe(self, queue, topic):
+        ''' Unsubscribe queue from topic (on the worker that owns queue). '''
+        owner = self.owner(queue)
+        if owner != self.shard:
+            yield self.forward(owner, BinarySession.UNSUBSCRIBE, queue, topic)
+        else:
+            try:
+                self.subscriptions[queue].remove(topic)
+            except KeyError:
+                raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
+
+            self.selectors.pop((queue, topic), None)
+            self.subscribers[topic].discard(queue)
+            if not self.subscribers[topic]:
+                del self.subscribers[topic]
+            yield self.route(topic)
+
+        return 'Unsubscribed queue ({}) from topic ({})\n'.format(queue, topic)
+
+    @tornado.gen.coroutine
+    def forward(self, shard, opcode, queue, topic):
+        ''' Forward subscription request to worker (raising its error, if any). '''
+        status, body = yield self.peers[shard].request(opcode, queue.encode(), topic)
+        if status != 200:
+            raise tornado.web.HTTPError(status, body.decode().rstrip())
+
+    @tornado.gen.coroutine
+    def route(self, topic):
+        ''' Announce to other workers whether or not this worker has subscribers for topic. '''
+        if not self.peers:
+            return
+
+        subscribed = topic in self.subscribers
+        if subscribed == (self.shard in self.routes[topic]):
+            return
+
+        if subscribed:
+            self.routes[topic].add(self.shard)
+        else:
+            self.routes[topic].discard(self.shard)
+
+        opcode = BinarySession.ROUTE if subscribed else BinarySession.UNROUTE
+        yield [peer.request(opcode, topic.encode(), id=self.shard) for peer in self.peers.values()]
+
+    def on_shm_attach(self, fd, events):
+        ''' Accept shared memory attachment: segment and eventfds arrive as SCM_RIGHTS. '''
+        try:
+            connection, _ = self.shm_socket.accept()
+        except BlockingIOError:
+            return
+
+        fds = array.array('i')
+        try:
+            message, ancillary, _, _ = connection.recvmsg(64, socket.CMSG_SPACE(3 * fds.itemsize))
+            for level, kind, data in ancillary:
+                if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+                    fds.frombytes(data[:len(data) - (len(data) % fds.itemsize)])
+        except OSError as e:
+            self.logger.error('Unable to attach shared memory: {}'.format(e))
+            connection.close()
+            return
+
+        if message != SharedMemorySession.MAGIC or len(fds) != 3:
+            self.logger.error('Invalid shared memory attachment')
+            for fd in fds:
+                os.close(fd)
+            connection.close()
+            return
+
+        connection.setblocking(False)
+        SharedMemorySession(self, connection, *fds)
+
+    def fork(self):
+        ''' Fork one process per worker and supervise them (returns index of worker in each child). '''
+        children = {}
+        for shard in range(self.workers):
+            pid = os.fork()
+            if pid == 0:
+                return shard
+            children[pid] = shard
+
+        def terminate(signum=None, frame=None):
+            for pid in children:
+                try:
+                    os.kill(pid, signal.SIGTERM)
+                except ProcessLookupError:
+                    pass
+            sys.exit(0 if signum else 1)
+
+        signal.signal(signal.SIGTERM, terminate)
+        signal.signal(signal.SIGINT, terminate)
+
+        # Queues of a worker die with it, so stop the whole broker
+        pid, status = os.wait()
+        self.logger.fatal('Worker {} exited with status {}'.format(children.pop(pid), status))
+        terminate()
+
     def run(self):
         try:
-            self.listen(self.port, self.address)
+            sockets = []
+            if self.workers > 1:
+                internal = [tornado.netutil.bind_sockets(0, '127.0.0.1')[0] for _ in range(self.workers)]
+            else:
+                sockets.extend(tornado.netutil.bind_sockets(self.port, self.address))
+            if self.unix:
+                sockets.append(tornado.netutil.bind_unix_socket(self.unix))
+            if self.shm:
+                self.shm_socket = tornado.netutil.bind_unix_socket(self.shm)
         except socket.error as e:
             self.logger.fatal('Unable to listen on {}:{} = {}'.format(self.address, self.port, e))
             sys.exit(1)
 
-        self.ioloop.start()
+        if self.workers > 1:
+            self.shard = self.fork()
+            self.peers = {
+                shard: ShardClient(internal[shard].getsockname(), self.max_message + self.HEADROOM)
+                for shard in range(self.workers) if shard != self.shard
+            }
+            sockets.append(internal[self.shard])
+            for shard, sock in enumerate(internal):
+                if shard != self.shard:
+                    sock.close()
+            try:
+                sockets.extend(tornado.netutil.bind_sockets(self.port, self.address, reuse_port=True))
+            except socket.error as e:
+                self.logger.fatal('Unable to listen on {}:{} = {}'.format(self.address, self.port, e))
+                sys.exit(1)
+
+        self.logger.info('Deduplicating publishes of up to {} producers ({} sequence numbers each, ~{} KB)'.format(
+            self.dedup.producers, self.dedup.window, self.dedup.memory(self.dedup.producers) // 1024,
+        ))
+
+        self.ioloop = tornado.ioloop.IOLoop.current()
+        server = tornado.httpserver.HTTPServer(
+            self, max_body_size=self.max_message, max_buffer_size=self.max_message + self.HEADROOM
+        )
+        server.add_sockets(sockets)
+        if self.shm:
+            self.ioloop.add_handler(self.shm_socket, self.on_shm_attach, tornado.ioloop.IOLoop.READ)
+
+        try:
+            self.ioloop.start()
+        finally:
+            for store in self.queues.values():
+                store.close()
 
 # Main execution
 
@@ -137,6 +1923,18 @@ if __name__ == '__main__':
     tornado.options.define('debug'  , default=False, help='Enable debugging mode')
     tornado.options.define('address', default=MessageQueue.DEFAULT_ADDRESS, help='Address to listen on.')
     tornado.options.define('port'   , default=MessageQueue.DEFAULT_PORT   , help='Port to listen on.')
+    tornado.options.define('unix'   , default='', help='Unix domain socket path to listen on.')
+    tornado.options.define('shm'    , default='', help='Unix domain socket path for shared memory attachments.')
+    tornado.options.define('queue_memory', default=MessageQueue.DEFAULT_QUEUE_MEMORY, help='Bytes of messages each queue keeps in memory before spilling.')
+    tornado.options.define('memory' , default=MessageQueue.DEFAULT_MEMORY, help='Bytes of messages all queues keep in memory before spilling.')
+    tornado.options.define('spool'  , default='', help='Directory for spilled message segments.')
+    tornado.options.define('max_depth', default=MessageQueue.DEFAULT_MAX_DEPTH, help='Messages a queue holds before publishes to it are refused with 429.')
+    tornado.options.define('max_message', default=MessageQueue.DEFAULT_MAX_MESSAGE, help='Bytes of the largest message accepted.')
+    tornado.options.define('retain' , default=0, help='Messages each topic log retains for reads by offset (0 disables topic logs).')
+    tornado.options.define('workers', default=MessageQueue.DEFAULT_WORKERS, help='Number of worker processes (queues are sharded across them).')
+    tornado.options.define('dedup_window'   , default=ProducerWindows.DEFAULT_WINDOW, help='Sequence numbers remembered per producer to drop duplicate publishes.')
+    tornado.options.define('log_messages', default=False, help='Log every retrieved message and hot path request.')
+    tornado.options.define('dedup_producers', default=ProducerWindows.DEFAULT_PRODUCERS, help='Producers remembered to drop duplicate publishes.')
     tornado.options.parse_command_line()
 
     signal.signal(signal.SIGTERM, lambda s, e: sys.exit(0))
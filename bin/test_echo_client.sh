@@ -21,7 +21,7 @@ find_port() {
 
 cleanup() {
     STATUS=${1:-$FAILURES}
-    kill $SERVERPID
+    kill $SERVERPID $SHARDEDPID
     rm -fr $WORKSPACE
     exit $STATUS
 }
@@ -32,7 +32,7 @@ trap "cleanup" EXIT
 trap "cleanup 1" INT TERM
 
 echo
-printf "%-40s  ... " "Testing $FUNCTIONAL"
+echo "Testing $FUNCTIONAL..."
 
 if [ ! -x bin/$FUNCTIONAL ]; then
     echo "Failure: bin/$FUNCTIONAL is not executable!"
@@ -41,12 +41,23 @@ fi
 
 PORT=$(find_port)
 
-./bin/mq_server.py --port=$PORT > /dev/null 2>&1 &
+./bin/mq_server.py --port=$PORT --unix=$WORKSPACE/unix.sock --shm=$WORKSPACE/shm.sock > /dev/null 2>&1 &
 SERVERPID=$!
-
-valgrind --leak-check=full bin/$FUNCTIONAL localhost $PORT &> $WORKSPACE/test
-if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
-    error "Failure"
-else
-    echo "Success"
-fi
+sleep 1
+
+SHARDEDPORT=$(find_port)
+
+./bin/mq_server.py --port=$SHARDEDPORT --workers=4 > /dev/null 2>&1 &
+SHARDEDPID=$!
+sleep 1
+
+for endpoint in "binary localhost $PORT" "http localhost $PORT" "binary unix:$WORKSPACE/unix.sock -" "http shm:$WORKSPACE/shm.sock -" "http inproc://echo -" "binary localhost $SHARDEDPORT workers=4"; do
+    set -- $endpoint
+    printf " %-40s ... " "$2 ($1${4:+, $4})"
+    MQ_PROTOCOL=$1 valgrind --leak-check=full bin/$FUNCTIONAL $2 $3 &> $WORKSPACE/test
+    if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+	error "Failure"
+    else
+	echo "Success"
+    fi
+done
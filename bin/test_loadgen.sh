@@ -0,0 +1,54 @@
+#!/bin/bash
+
+FUNCTIONAL=test_loadgen
+WORKSPACE=/tmp/$FUNCTIONAL.$(id -u)
+FAILURES=0
+
+error() {
+    echo "$@"
+    [ -r $WORKSPACE/test ] && (echo; cat $WORKSPACE/test; echo)
+    FAILURES=$((FAILURES + 1))
+}
+
+find_port() {
+    for port in $(seq 9000 9999); do
+    	if ! ss -H4tlpn | awk '{print $4}' | cut -d : -f 2 | grep -q $port; then
+    	    echo $port
+    	    break
+	fi
+    done
+}
+
+cleanup() {
+    STATUS=${1:-$FAILURES}
+    kill $SERVERPID
+    rm -fr $WORKSPACE
+    exit $STATUS
+}
+
+mkdir $WORKSPACE
+
+trap "cleanup" EXIT
+trap "cleanup 1" INT TERM
+
+echo
+printf "%-40s  ... " "Testing $FUNCTIONAL"
+
+if [ ! -x bin/mq_loadgen ]; then
+    echo "Failure: bin/mq_loadgen is not executable!"
+    exit 1
+fi
+
+PORT=$(find_port)
+
+./bin/mq_server.py --port=$PORT > /dev/null 2>&1 &
+SERVERPID=$!
+sleep 1
+
+# Sustained load from several clients must be delivered in full, promptly
+bin/mq_loadgen --port=$PORT --publishers=2 --subscribers=2 --topics=2 --rate=250 --duration=2 --max-drops=0 --max-p50=10 --max-p99=50 &> $WORKSPACE/test
+if [ $? -ne 0 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
@@ -1,8 +1,20 @@
 #!/usr/bin/env python3
 
+import math
+import os
+import sys
+import time
+import types
 import unittest
 import requests
 
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+import tornado.ioloop
+import tornado.web
+
+import mq_server
+
 # Server Test Case
 
 class ServerTestCase(unittest.TestCase):
@@ -31,6 +43,7 @@ class ServerTestCase(unittest.TestCase):
             r.text.rstrip(), 
             'Published message ({} bytes) to 1 subscribers of _topic'.format(len(self.BODY)),
         )
+        self.assertLess(float(r.headers['Mq-Load']), 1.0)
 
     def test_04_retrieve(self):
         r = requests.get(self.URL + '/queue/_queue', data=self.BODY)
@@ -51,6 +64,423 @@ class ServerTestCase(unittest.TestCase):
 
         self.test_00_publish_without_subscribers()
 
+    def test_07_selector(self):
+        r = requests.put(self.URL + '/subscription/_selected/_topic', data="region = 'us' and priority >= 5")
+        self.assertEqual(r.status_code, 200)
+
+        r = requests.put(self.URL + '/topic/_topic', data='low', headers={'Mq-Region': 'us', 'Mq-Priority': '1'})
+        self.assertEqual(r.status_code  , 200)
+        self.assertEqual(r.text.rstrip(), 'Published message (3 bytes) to 0 subscribers of _topic')
+
+        r = requests.put(self.URL + '/topic/_topic', data='high', headers={'Mq-Region': 'us', 'Mq-Priority': '9'})
+        self.assertEqual(r.status_code  , 200)
+        self.assertEqual(r.text.rstrip(), 'Published message (4 bytes) to 1 subscribers of _topic')
+
+        r = requests.get(self.URL + '/queue/_selected')
+        self.assertEqual(r.status_code  , 200)
+        self.assertEqual(r.text.rstrip(), 'high')
+
+        r = requests.delete(self.URL + '/subscription/_selected/_topic')
+        self.assertEqual(r.status_code, 200)
+
+    def test_08_invalid_selector(self):
+        r = requests.put(self.URL + '/subscription/_selected/_topic', data="region = ")
+        self.assertEqual(r.status_code, 400)
+
+    def test_09_ttl(self):
+        r = requests.put(self.URL + '/subscription/_timed/_timing')
+        self.assertEqual(r.status_code, 200)
+
+        r = requests.put(self.URL + '/topic/_timing', data='stale', headers={'Mq-TTL': '100'})
+        self.assertEqual(r.status_code, 200)
+        time.sleep(0.3)
+
+        r = requests.put(self.URL + '/topic/_timing', data='fresh', headers={'Mq-TTL': '10000'})
+        self.assertEqual(r.status_code, 200)
+
+        r = requests.get(self.URL + '/queue/_timed')
+        self.assertEqual(r.status_code  , 200)
+        self.assertEqual(r.text.rstrip(), 'fresh')
+
+    def test_10_delay(self):
+        start = time.time()
+        r = requests.put(self.URL + '/topic/_timing', data='later', headers={'Mq-Delay': '500'})
+        self.assertEqual(r.status_code, 200)
+        r = requests.put(self.URL + '/topic/_timing', data='now')
+        self.assertEqual(r.status_code, 200)
+
+        r = requests.get(self.URL + '/queue/_timed')
+        self.assertEqual(r.text.rstrip(), 'now')
+        r = requests.get(self.URL + '/queue/_timed')
+        self.assertEqual(r.text.rstrip(), 'later')
+        self.assertGreaterEqual(time.time() - start, 0.5)
+
+    def test_11_invalid_timing(self):
+        for headers in ({'Mq-TTL': 'soon'}, {'Mq-TTL': '0'}, {'Mq-Delay': '-1'}):
+            r = requests.put(self.URL + '/topic/_timing', data='invalid', headers=headers)
+            self.assertEqual(r.status_code, 400)
+
+        r = requests.delete(self.URL + '/subscription/_timed/_timing')
+        self.assertEqual(r.status_code, 200)
+
+    def test_12_duplicate(self):
+        r = requests.put(self.URL + '/subscription/_deduplicated/_dedup')
+        self.assertEqual(r.status_code, 200)
+
+        for sequence, delivered in ((1, True), (1, False), (3, True), (2, True), (3, False)):
+            headers = {'Mq-Producer': '_producer', 'Mq-Sequence': str(sequence)}
+            r = requests.put(self.URL + '/topic/_dedup', data=str(sequence), headers=headers)
+            self.assertEqual(r.status_code, 200)
+            self.assertEqual(r.text.startswith('Ignored duplicate message'), not delivered)
+
+        for sequence in (1, 3, 2):
+            r = requests.get(self.URL + '/queue/_deduplicated')
+            self.assertEqual(r.text, str(sequence))
+
+        r = requests.put(self.URL + '/topic/_dedup', data='bad', headers={'Mq-Producer': '_producer', 'Mq-Sequence': 'x'})
+        self.assertEqual(r.status_code, 400)
+
+        r = requests.delete(self.URL + '/subscription/_deduplicated/_dedup')
+        self.assertEqual(r.status_code, 200)
+
+    def test_13_stats(self):
+        r = requests.put(self.URL + '/subscription/_counted/_stats')
+        self.assertEqual(r.status_code, 200)
+
+        for body in ('one', 'two'):
+            r = requests.put(self.URL + '/topic/_stats', data=body)
+            self.assertEqual(r.status_code, 200)
+
+        r = requests.get(self.URL + '/stats')
+        self.assertEqual(r.status_code, 200)
+        stats = r.json()
+        self.assertEqual(stats['topics']['_stats']['published'], 2)
+        self.assertEqual(stats['topics']['_stats']['bytes'], 6)
+        self.assertEqual(stats['topics']['_stats']['fanout'], 1.0)
+        self.assertGreater(stats['topics']['_stats']['rate'], 0)
+        self.assertEqual(stats['queues']['_counted']['depth'], 2)
+        self.assertEqual(stats['queues']['_counted']['bytes'], 6)
+        self.assertEqual(stats['queues']['_counted']['topics'], ['_stats'])
+        self.assertGreaterEqual(stats['duplicates'], 2)     # From test_12_duplicate
+
+        r = requests.delete(self.URL + '/subscription/_counted/_stats')
+        self.assertEqual(r.status_code, 200)
+
+    def test_14_read_unretained(self):
+        r = requests.get(self.URL + '/topic/_topic?offset=0')
+        self.assertEqual(r.status_code, 404)
+
+    def test_15_retrieve_batch(self):
+        r = requests.put(self.URL + '/subscription/_batched/_batch')
+        self.assertEqual(r.status_code, 200)
+
+        for body in ('one', 'two', 'three', 'four'):
+            r = requests.put(self.URL + '/topic/_batch', data=body)
+            self.assertEqual(r.status_code, 200)
+
+        r = requests.get(self.URL + '/queue/_batched?max=2')
+        self.assertEqual(r.status_code, 200)
+        self.assertEqual(r.content, b'3\none3\ntwo')
+
+        r = requests.get(self.URL + '/queue/_batched?max=10&bytes=1')
+        self.assertEqual(r.content, b'5\nthree')
+
+        r = requests.get(self.URL + '/queue/_batched?max=10')
+        self.assertEqual(r.content, b'4\nfour')
+
+        for query in ('max=0', 'max=x', 'max=1&bytes=-1'):
+            r = requests.get(self.URL + '/queue/_batched?' + query)
+            self.assertEqual(r.status_code, 400)
+
+        r = requests.delete(self.URL + '/subscription/_batched/_batch')
+        self.assertEqual(r.status_code, 200)
+
+# Selector Test Case
+
+class SelectorTestCase(unittest.TestCase):
+    def test_00_compare(self):
+        selector = mq_server.Selector("region = 'us' and priority > 2.5")
+        self.assertTrue(selector({'region': 'us', 'priority': '3'}))
+        self.assertFalse(selector({'region': 'eu', 'priority': '3'}))
+        self.assertFalse(selector({'region': 'us', 'priority': 'high'}))
+        self.assertFalse(selector({'region': 'us'}))
+
+    def test_01_logic(self):
+        selector = mq_server.Selector("not (kind in ('debug', 'trace')) or exists urgent")
+        self.assertTrue(selector({'kind': 'info'}))
+        self.assertFalse(selector({'kind': 'debug'}))
+        self.assertTrue(selector({'kind': 'debug', 'urgent': ''}))
+        self.assertTrue(selector({}))
+
+    def test_02_case(self):
+        selector = mq_server.Selector("Region != 'us' AND Priority <= 1")
+        self.assertTrue(selector({'region': 'eu', 'priority': '1'}))
+        self.assertFalse(selector({'region': 'us', 'priority': '1'}))
+
+    def test_03_invalid(self):
+        for expression in ("region =", "(region = 'us'", "region ~ 'us'", "region = 'us' extra", "priority in ()"):
+            with self.assertRaises(mq_server.tornado.web.HTTPError):
+                mq_server.Selector(expression)
+
+# Timer Wheel Test Case
+
+class TimerWheelTestCase(unittest.TestCase):
+    def setUp(self):
+        self.now    = 1000.0
+        self.wheel  = mq_server.TimerWheel(lambda: self.now)
+        self.fired  = []
+
+    def advance(self, seconds):
+        self.now += seconds
+        self.wheel.advance()
+
+    def test_00_order(self):
+        for delay in (0.5, 0.05, 30.0, 2.0):
+            self.wheel.add(self.now + delay, self.fired.append, delay)
+        self.assertEqual(len(self.wheel), 4)
+
+        self.advance(0.04)
+        self.assertEqual(self.fired, [])
+        self.advance(0.02)
+        self.assertEqual(self.fired, [0.05])
+        self.advance(1.0)
+        self.assertEqual(self.fired, [0.05, 0.5])
+        for _ in range(100):
+            self.advance(0.3)
+        self.assertEqual(self.fired, [0.05, 0.5, 2.0, 30.0])
+        self.assertEqual(len(self.wheel), 0)
+
+    def test_01_beyond_span(self):
+        span = mq_server.TimerWheel.TICK * mq_server.TimerWheel.SLOTS ** mq_server.TimerWheel.LEVELS
+        self.wheel.add(self.now + span * 1.5, self.fired.append, 'late')
+        self.advance(span)
+        self.assertEqual(self.fired, [])
+        self.advance(span)
+        self.assertEqual(self.fired, ['late'])
+
+    def test_02_bulk(self):
+        for i in range(1000):
+            self.wheel.add(self.now + 1.0, self.fired.append, i)
+        self.advance(1.5)
+        self.assertEqual(self.fired, list(range(1000)))
+
+# Rate Test Case
+
+class RateTestCase(unittest.TestCase):
+    def test_00_steady(self):
+        self.now = 0.0
+        rate     = mq_server.Rate(lambda: self.now)
+        for _ in range(int(10 * mq_server.Rate.TAU / 0.01)):
+            self.now += 0.01
+            rate.mark()
+        self.assertAlmostEqual(float(rate), 100, delta=1)
+
+        self.now += mq_server.Rate.TAU
+        self.assertAlmostEqual(float(rate), 100 / math.e, delta=1)
+
+# Producer Windows Test Case
+
+class ProducerWindowsTestCase(unittest.TestCase):
+    def test_00_window(self):
+        windows = mq_server.ProducerWindows(window=8, producers=2)
+        self.assertFalse(windows.duplicate('a', 5))
+        self.assertTrue(windows.duplicate('a', 5))
+        self.assertFalse(windows.duplicate('a', 3))   # Reordered within window
+        self.assertTrue(windows.duplicate('a', 3))
+        self.assertFalse(windows.duplicate('a', 20))
+        self.assertTrue(windows.duplicate('a', 12))   # Too old to tell
+        self.assertFalse(windows.duplicate('a', 13))
+        self.assertEqual(windows.duplicates, 3)
+        self.assertLess(windows.windows['a'][1], 1 << 8)
+
+    def test_01_producers(self):
+        windows = mq_server.ProducerWindows(window=8, producers=2)
+        for producer in ('a', 'b', 'a', 'c'):
+            windows.duplicate(producer, 1)
+        self.assertEqual(list(windows.windows), ['a', 'c'])
+        self.assertEqual(windows.forgotten, 1)
+        self.assertEqual(windows.memory(), 2 * (1 + mq_server.ProducerWindows.OVERHEAD))
+
+# Flow Control Test Case
+
+class FlowControlTestCase(unittest.TestCase):
+    def setUp(self):
+        self.ioloop      = tornado.ioloop.IOLoop()
+        self.application = mq_server.MessageQueue(max_depth=4)
+        self.ioloop.run_sync(lambda: self.application.subscribe('_queue', '_topic'))
+
+    def tearDown(self):
+        self.ioloop.close()
+
+    def publish(self, sequence):
+        headers = {'producer': '_producer', 'sequence': str(sequence)}
+        return self.ioloop.run_sync(lambda: self.application.publish('_topic', str(sequence).encode(), headers))
+
+    def test_00_load(self):
+        loads = [self.publish(sequence)[1] for sequence in range(1, 5)]
+        self.assertEqual(loads, [0.0, 0.25, 0.5, 0.75])
+
+        with self.assertRaises(mq_server.Overloaded) as context:
+            self.publish(5)
+        self.assertEqual(context.exception.status_code, 429)
+        self.assertEqual(context.exception.retry, mq_server.MessageQueue.RETRY_AFTER)
+
+    def test_01_retry(self):
+        for sequence in range(1, 6):
+            try:
+                self.publish(sequence)
+            except mq_server.Overloaded:
+                pass
+
+        # Refused message is delivered once it is retried after consumers catch up
+        self.assertEqual(self.application.queues['_queue'].popleft(), b'1')
+        message, load = self.publish(5)
+        self.assertTrue(message.startswith('Published message'))
+        self.assertEqual(load, 0.75)
+
+        self.assertEqual(self.application.queues['_queue'].popleft(), b'2')
+        message, _ = self.publish(5)
+        self.assertTrue(message.startswith('Ignored duplicate message'))
+        self.assertEqual([self.application.queues['_queue'].popleft() for _ in range(3)], [b'3', b'4', b'5'])
+
+# Topic Log Test Case
+
+class TopicLogTestCase(unittest.TestCase):
+    def test_00_retain(self):
+        log = mq_server.TopicLog(retain=3)
+        for message in (b'a', b'b', b'c', b'd', b'e'):
+            log.append(message)
+        self.assertEqual((log.first, log.end, len(log), log.bytes), (2, 5, 3, 3))
+        self.assertEqual(list(log.read(0, 10)), [(2, b'c'), (3, b'd'), (4, b'e')])
+        self.assertEqual(list(log.read(3, 1)), [(3, b'd')])
+        self.assertEqual(list(log.read(5, 1)), [])
+        self.assertLessEqual(len(log.messages), 2 * log.retain)
+
+class RetainTestCase(unittest.TestCase):
+    def setUp(self):
+        self.ioloop             = tornado.ioloop.IOLoop()
+        self.application        = mq_server.MessageQueue(retain=4)
+        self.application.ioloop = self.ioloop
+
+    def tearDown(self):
+        self.ioloop.close()
+
+    def publish(self, message):
+        return self.ioloop.run_sync(lambda: self.application.publish('_topic', message))
+
+    def read(self, offset, count, wait=None):
+        return self.ioloop.run_sync(lambda: self.application.read('_topic', offset, count, lambda: False, wait))
+
+    def test_00_offsets(self):
+        for message in (b'a', b'b', b'c', b'd', b'e'):
+            self.publish(message)
+        self.assertEqual(self.read(0, 2), (b'1 1\nb2 1\nc', 3))
+        self.assertEqual(self.read(3, 10), (b'3 1\nd4 1\ne', 5))
+        self.assertEqual(self.read(-1, 10, 0.05), (None, 5))
+
+    def test_01_wait(self):
+        self.ioloop.call_later(0.05, lambda: self.application.publish('_topic', b'late'))
+        self.assertEqual(self.read(-1, 10, 5), (b'0 4\nlate', 1))
+
+    def test_02_cursor(self):
+        self.assertEqual(self.application.cursor('7', '1000000', '250'), (7, mq_server.MessageQueue.READ_MAX, 0.25))
+        self.assertEqual(self.application.cursor(None, None, '0'), (0, 1, None))
+        for arguments in (('x', None, None), (None, '0', None)):
+            with self.assertRaises(tornado.web.HTTPError) as context:
+                self.application.cursor(*arguments)
+            self.assertEqual(context.exception.status_code, 400)
+
+# Store Test Case
+
+class StoreTestCase(unittest.TestCase):
+    def setUp(self):
+        self.now         = 1000.0
+        self.timers      = mq_server.TimerWheel(lambda: self.now)
+        self.application = types.SimpleNamespace(
+            queue_memory=100, max_memory=250, spool='', memory=0, timers=self.timers, schedule=self.timers.add,
+        )
+
+    def store(self):
+        store = mq_server.MessageStore(self.application)
+        self.addCleanup(store.close)
+        return store
+
+    def test_00_spill(self):
+        store = self.store()
+        for i in range(50):
+            store.append('{:010d}'.format(i).encode())
+
+        self.assertEqual(len(store), 50)
+        self.assertLessEqual(store.bytes, 100)
+        self.assertEqual(store.spilled, 40)
+        self.assertEqual(self.application.memory, store.bytes)
+
+        for i in range(50):
+            self.assertEqual(store.popleft(), '{:010d}'.format(i).encode())
+
+        self.assertEqual(len(store), 0)
+        self.assertEqual(len(store.segments), 0)
+        self.assertEqual(self.application.memory, 0)
+
+    def test_01_global_budget(self):
+        stores = [self.store() for _ in range(3)]
+        for i in range(10):
+            for store in stores:
+                store.append(b'x' * 10)
+
+        self.assertLessEqual(self.application.memory, 250)
+        self.assertEqual(sum(len(store) for store in stores), 30)
+
+    def test_02_large_message(self):
+        store = self.store()
+        store.SEGMENT_SIZE = 64
+        messages = [b'a' * 200, b'b' * 10, b'c' * 300]
+        for message in messages:
+            store.append(message)
+
+        self.assertEqual([store.popleft() for _ in messages], messages)
+
+    def test_03_expire(self):
+        store = self.store()
+        for i in range(20):
+            store.append('{:010d}'.format(i).encode(), self.now + (1 if i % 2 else 10))
+        store.append(b'forever')
+
+        self.assertEqual(len(store), 21)
+        self.assertEqual(store.spilled, 11)
+
+        self.now += 2
+        self.timers.advance()
+        self.assertEqual(len(store), 21 - 5)    # Spilled messages expire as they reach the front
+        self.assertEqual(self.application.memory, store.bytes)
+
+        messages = []
+        while store:
+            messages.append(store.popleft())
+        self.assertEqual(messages, ['{:010d}'.format(i).encode() for i in range(0, 20, 2)] + [b'forever'])
+        self.assertEqual(store.expired, 10)
+        self.assertEqual(self.application.memory, 0)
+
+    def test_04_close(self):
+        store = self.store()
+        for i in range(50):
+            store.append('{:010d}'.format(i).encode())
+        segments = list(store.segments)
+        self.assertTrue(segments)
+
+        store.close()
+        self.assertEqual(len(store), 0)
+        self.assertEqual(self.application.memory, 0)
+        self.assertTrue(all(segment.file.closed and segment.memory.closed for segment in segments))
+
+        # Segments are also closed once drained
+        for i in range(50):
+            store.append('{:010d}'.format(i).encode())
+        segments = list(store.segments)
+        while store:
+            store.popleft()
+        self.assertTrue(all(segment.file.closed for segment in segments))
+
 # Main execution
 
 if __name__ == '__main__':
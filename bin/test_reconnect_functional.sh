@@ -0,0 +1,63 @@
+#!/bin/bash
+
+FUNCTIONAL=test_reconnect_functional
+WORKSPACE=/tmp/$FUNCTIONAL.$(id -u)
+FAILURES=0
+
+error() {
+    echo "$@"
+    [ -r $WORKSPACE/test ] && (echo; cat $WORKSPACE/test; echo)
+    FAILURES=$((FAILURES + 1))
+}
+
+find_port() {
+    for port in $(seq 9000 9999); do
+    	if ! ss -H4tlpn | awk '{print $4}' | cut -d : -f 2 | grep -q $port; then
+    	    echo $port
+    	    break
+	fi
+    done
+}
+
+cleanup() {
+    STATUS=${1:-$FAILURES}
+    kill $SERVERPID 2> /dev/null
+    rm -fr $WORKSPACE
+    exit $STATUS
+}
+
+mkdir $WORKSPACE
+
+trap "cleanup" EXIT
+trap "cleanup 1" INT TERM
+
+echo
+echo "Testing $FUNCTIONAL..."
+
+if [ ! -x bin/$FUNCTIONAL ]; then
+    echo "Failure: bin/$FUNCTIONAL is not executable!"
+    exit 1
+fi
+
+PORT=$(find_port)
+
+# Client starts before the broker (timing sensitive, so not run under valgrind)
+for HOST in localhost shm:$WORKSPACE/shm.sock; do
+    printf " %-40s ... " "$HOST"
+    bin/$FUNCTIONAL $HOST $PORT &> $WORKSPACE/test &
+    CLIENTPID=$!
+    sleep 3
+
+    ./bin/mq_server.py --port=$PORT --shm=$WORKSPACE/shm.sock > /dev/null 2>&1 &
+    SERVERPID=$!
+
+    wait $CLIENTPID
+    if [ $? -ne 0 ]; then
+	error "Failure"
+    else
+	echo "Success"
+    fi
+
+    kill $SERVERPID
+    wait $SERVERPID 2> /dev/null
+done
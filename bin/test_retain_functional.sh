@@ -0,0 +1,63 @@
+#!/bin/bash
+
+FUNCTIONAL=test_retain_functional
+WORKSPACE=/tmp/$FUNCTIONAL.$(id -u)
+FAILURES=0
+
+error() {
+    echo "$@"
+    [ -r $WORKSPACE/test ] && (echo; cat $WORKSPACE/test; echo)
+    FAILURES=$((FAILURES + 1))
+}
+
+find_port() {
+    for port in $(seq 9000 9999); do
+    	if ! ss -H4tlpn | awk '{print $4}' | cut -d : -f 2 | grep -q $port; then
+    	    echo $port
+    	    break
+	fi
+    done
+}
+
+cleanup() {
+    STATUS=${1:-$FAILURES}
+    kill $SERVERPID $SHARDEDPID
+    rm -fr $WORKSPACE
+    exit $STATUS
+}
+
+mkdir $WORKSPACE
+
+trap "cleanup" EXIT
+trap "cleanup 1" INT TERM
+
+echo
+echo "Testing $FUNCTIONAL..."
+
+if [ ! -x bin/$FUNCTIONAL ]; then
+    echo "Failure: bin/$FUNCTIONAL is not executable!"
+    exit 1
+fi
+
+PORT=$(find_port)
+
+./bin/mq_server.py --port=$PORT --shm=$WORKSPACE/shm.sock --retain=100 > /dev/null 2>&1 &
+SERVERPID=$!
+sleep 1
+
+SHARDEDPORT=$(find_port)
+
+./bin/mq_server.py --port=$SHARDEDPORT --workers=4 --retain=100 > /dev/null 2>&1 &
+SHARDEDPID=$!
+sleep 1
+
+for endpoint in "binary localhost $PORT" "http localhost $PORT" "http shm:$WORKSPACE/shm.sock -" "binary localhost $SHARDEDPORT workers=4"; do
+    set -- $endpoint
+    printf " %-40s ... " "$2 ($1${4:+, $4})"
+    MQ_PROTOCOL=$1 valgrind --leak-check=full bin/$FUNCTIONAL $2 $3 &> $WORKSPACE/test
+    if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+	error "Failure"
+    else
+	echo "Success"
+    fi
+done
@@ -0,0 +1,66 @@
+#!/bin/bash
+
+FUNCTIONAL=test_shard_functional
+WORKSPACE=/tmp/$FUNCTIONAL.$(id -u)
+FAILURES=0
+
+error() {
+    echo "$@"
+    [ -r $WORKSPACE/test ] && (echo; cat $WORKSPACE/test; echo)
+    FAILURES=$((FAILURES + 1))
+}
+
+find_port() {
+    for port in $(seq 9000 9999); do
+    	if ! ss -H4tlpn | awk '{print $4}' | cut -d : -f 2 | grep -q $port; then
+    	    echo $port
+    	    break
+	fi
+    done
+}
+
+cleanup() {
+    STATUS=${1:-$FAILURES}
+    kill $SERVERPIDS
+    rm -fr $WORKSPACE
+    exit $STATUS
+}
+
+mkdir $WORKSPACE
+
+trap "cleanup" EXIT
+trap "cleanup 1" INT TERM
+
+echo
+echo "Testing $FUNCTIONAL..."
+
+if [ ! -x bin/$FUNCTIONAL ]; then
+    echo "Failure: bin/$FUNCTIONAL is not executable!"
+    exit 1
+fi
+
+# Independent brokers (the last also listens on a Unix domain socket)
+PORTS=""
+SERVERPIDS=""
+for broker in 1 2 3; do
+    PORT=$(find_port)
+    UNIX=$([ $broker -eq 3 ] && echo --unix=$WORKSPACE/broker.sock)
+    ./bin/mq_server.py --port=$PORT --retain=100 $UNIX > /dev/null 2>&1 &
+    SERVERPIDS="$SERVERPIDS $!"
+    PORTS="$PORTS $PORT"
+    sleep 1
+done
+set -- $PORTS
+HOSTS="localhost:$1,localhost:$2,localhost:$3"
+MIXED="localhost:$1,localhost:$2,unix:$WORKSPACE/broker.sock"
+
+for endpoint in "binary $HOSTS" "http $HOSTS" "binary $MIXED unix"; do
+    set -- $endpoint
+    printf " %-40s ... " "3 brokers ($1${3:+, $3})"
+    MQ_PROTOCOL=$1 valgrind --leak-check=full bin/$FUNCTIONAL $2 &> $WORKSPACE/test
+    if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+	error "Failure"
+    else
+	echo "Success"
+    fi
+done
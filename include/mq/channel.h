@@ -0,0 +1,74 @@
+/* channel.h: Asynchronous HTTP (or binary framed) exchange */
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "mq/frame.h"
+#include "mq/reactor.h"
+#include "mq/request.h"
+#include "mq/transport.h"
+
+#include <stdbool.h>
+
+/* Structures */
+
+typedef struct Channel Channel;
+typedef void (*ChannelFunc)(Channel *c);
+typedef void (*ChannelChunkFunc)(Channel *c, const char *chunk, size_t length, bool last);
+
+struct Channel
+{
+    Reactor *reactor;
+    Op op;
+    int fd;
+    const Transport *transport; // Record transport (instead of sockets, if any)
+    void *endpoint;             // Transport's endpoint
+    uint8_t tag;                // Tag of this channel's records
+
+    bool binary;       // Whether or not to negotiate the binary protocol
+    bool upgraded;     // Whether or not fd is an established binary connection
+    FrameTable topics; // Topic ids declared on binary connection
+
+    Request *request; // Request being sent (list of requests on binary connection)
+    Request *rejected; // Requests of list that could not be framed (not sent; freed on reset)
+    char *wbuf;       // Serialized request (in a registered buffer of the reactor, while it fits)
+    size_t wlen;
+    size_t wcap;
+    size_t woff;
+    size_t fsent;     // Bytes of request's file sent (after wbuf)
+    char *rbuf;       // Raw response
+    size_t rlen;
+    size_t rcap;
+    size_t roff;      // Offset of next response frame
+    size_t pending;   // Response frames still expected
+    int code;         // Status of last response frame
+    size_t boff;      // Offset and length of last response frame body
+    size_t blen;
+    unsigned load;    // Highest load hint of response frames (permille)
+    unsigned retry;   // Longest Retry-After of response frames refused with 429 (ms)
+    size_t streamed;  // Bytes of response body passed to chunk callback
+
+    ChannelChunkFunc chunk; // Receives successful response bodies in chunks instead of buffering them (if set)
+
+    int status;       // Result of exchange (0 or -errno)
+    bool busy;        // Whether or not an exchange is in progress
+    bool cancelled;   // Whether or not exchange in progress was cancelled
+    ChannelFunc func; // Completion callback
+    void *arg;
+};
+
+/* Functions */
+
+void channel_init(Channel *c, Reactor *r, ChannelFunc func, void *arg);
+void channel_send(Channel *c, const struct sockaddr *addr, socklen_t addrlen, Request *request);
+void channel_deliver(Channel *c, char *response, size_t length);
+int channel_response(Channel *c, char **body, size_t *length);
+unsigned channel_pressure(Channel *c, unsigned *load);
+const char *channel_header(Channel *c, const char *name);
+void channel_reset(Channel *c);
+void channel_cancel(Channel *c);
+void channel_close(Channel *c);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,14 +3,64 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include "mq/channel.h"
+#include "mq/hashring.h"
+#include "mq/message.h"
 #include "mq/queue.h"
+#include "mq/reactor.h"
+#include "mq/socket.h"
+#include "mq/trace.h"
 
 #include <netdb.h>
 #include <stdbool.h>
 
+/* Constants */
+
+#define MQ_ADDRESSES 4         // Maximum number of resolved server addresses
+#define MQ_PROTOCOL  "binary"  // Wire protocol (env MQ_PROTOCOL: binary or http)
+#define MQ_BATCH     64        // Maximum requests pipelined per binary exchange
+#define MQ_DRAIN     5000      // Milliseconds mq_stop waits for outgoing requests to be sent
+#define MQ_BACKOFF_MIN  10     // Milliseconds before first retry of a failed exchange
+#define MQ_BACKOFF_MAX  5000   // Maximum milliseconds between retries (and probes)
+#define MQ_BREAKER      5      // Consecutive failures that open the circuit breaker
+#define MQ_RATE_MIN     10     // Messages per second the rate controller never throttles below
+#define MQ_RATE_STEP    100    // Messages per second added to the allowed rate each uncongested window
+#define MQ_RATE_WINDOW  100    // Milliseconds between adjustments of the allowed rate
+#define MQ_LOAD_HIGH    800    // Server load hint (permille) at which the allowed rate is halved
+#define MQ_READ_MAX     64     // Messages requested per read of a topic log
+#define MQ_READ_WAIT    1000   // Milliseconds a read of a topic log waits for new messages (and for mq_seek)
+#define MQ_OFFSET_LATEST -1    // Offset of the next message published to a topic
+#define MQ_PREFETCH     256    // Messages puller keeps retrieved ahead of retrievers (see mq_prefetch)
+#define MQ_PREFETCH_BYTES (256 * 1024) // Bytes of messages puller keeps retrieved ahead of retrievers
+
+#define MQ_HEADER_TTL   "ttl"   // Milliseconds a message may wait in queues before the server drops it
+#define MQ_HEADER_DELAY "delay" // Milliseconds the server waits before delivering a message
+#define MQ_HEADER_PRODUCER "producer" // Random id of publishing client (set on every message)
+#define MQ_HEADER_SEQUENCE "sequence" // Sequence number of message from its producer (set on every message)
+
 /* Structures */
 
+typedef struct MessageHeader MessageHeader;
+struct MessageHeader
+{
+    const char *name;  // Header name (case insensitive; no '=', ':' or newline)
+    const char *value; // Header value (no newline)
+};
+
+/* Connection state (reported to the state callback as it changes) */
+typedef enum
+{
+    MQ_CONNECTING,   // Started, but no exchange with the server has completed yet
+    MQ_CONNECTED,    // Last exchange with the server succeeded
+    MQ_RETRYING,     // Exchange failed: retrying after a jittered exponential backoff
+    MQ_DISCONNECTED, // Circuit breaker open: pusher and puller parked until a probe succeeds
+} MQState;
+
 typedef struct MessageQueue MessageQueue;
+typedef struct MQTopic MQTopic;
+typedef void (*MQStateFunc)(MessageQueue *mq, MQState state, void *arg);
+typedef void (*MQStreamFunc)(MessageQueue *mq, const char *chunk, size_t length, bool last, void *arg);
+
 struct MessageQueue
 {
     char name[NI_MAXHOST]; // Name of message queue
@@ -21,24 +71,132 @@ struct MessageQueue
     Queue *incoming; // Requests received from server
     bool shutdown;   // Whether or not to shutdown
 
-    /* TODO: Add any necessary thread and synchronization primitives */
-    Thread pusher;
-    Thread puller;
+    uint64_t producer;  // Random id sent with every message (server drops retried duplicates)
+    uint64_t published; // Sequence number of last published message
+
+    TraceClock trace;  // Clock of embedded publish timestamps (env MQ_TRACE: monotonic or realtime)
+    uint64_t sequence; // Sequence number of last traced message
+
+    Reactor *reactor; // Shared I/O reactor serving this queue
+    Channel pusher;   // Sends requests from outgoing queue
+    Channel puller;   // Receives messages into incoming queue
+    Task startup;     // Starts channels on reactor thread
+    Task wakeup;      // Notifies pusher of new outgoing requests
+    Task cancel;      // Cancels puller (and pusher, once drain deadline expires)
+    Task refill;      // Resumes puller once retrievers drain prefetch window
+    Channel probe;    // Checks whether server is reachable while circuit breaker is open
+
+    const Transport *transport; // Record transport ("shm:/path" or "inproc://name" hosts)
+    void *endpoint;             // Transport's endpoint (NULL until attached)
+    Op event_op;                // Read of transport's wakeup eventfd
+    uint64_t event_value;
+
+    struct MuxTopic *mux; // Shared subscription served by this client (if any)
+
+    MessageQueue **shards; // Client of each broker, if host lists several (see mq_create)
+    size_t nshards;
+    HashRing *ring;        // Broker of each topic
+    MessageQueue *reader;  // Shard reading topic log (see mq_read_from)
+
+    size_t prefetch;       // Messages puller keeps in incoming queue (retrieved in batches, unless 1)
+    size_t prefetch_bytes; // Bytes of messages puller keeps in incoming queue (0 for no limit)
+    bool throttled;        // Whether puller waits for retrievers to drain prefetch window (updated atomically)
+
+    char topic[NI_MAXHOST]; // Topic whose log puller reads (instead of queue, if set)
+    int64_t offset;         // Offset of next message puller reads (negative for the next new one)
+    int64_t seek;           // Offset requested by mq_seek (applied by puller)
+    bool seeking;           // Whether or not mq_seek is pending
+    uint64_t position;      // Offset after last retrieved message
+
+    MQStreamFunc on_chunk;          // Receives messages in chunks instead of incoming queue (if set)
+    void *chunk_arg;
+    bool chunking;                  // Whether or not a streamed message is in progress
+    struct TraceTopic *chunk_trace; // Latency histograms of streamed message (if traced)
+    uint64_t chunk_published;
+
+    Address addrs[MQ_ADDRESSES]; // Resolved server addresses
+    size_t naddrs;
+    size_t addr;                 // Address currently in use
+    Task resolved;               // Adopts addresses resolved (or endpoint attached) by helper thread (see mq_resolve)
+    Address resolving_addrs[MQ_ADDRESSES];
+    size_t nresolving;
+    void *resolving_endpoint;
+    int resolving_status;        // Result of last lookup (getaddrinfo status)
+
+    MQState state;         // Connection state
+    MQStateFunc on_state;  // Callback run (on reactor thread) when state changes
+    void *state_arg;
+    unsigned int failures; // Consecutive failed exchanges
+    unsigned int seed;     // Backoff jitter
+    Request *parked;       // Requests of pusher waiting to be retried
+    bool stalled;          // Whether or not puller is waiting to be retried
+    int timer_fd;          // Retry timer (timerfd)
+    Op timer_op;
+    uint64_t timer_value;
+
+    double rate;         // Messages per second pusher may send (0 if unthrottled)
+    double tokens;       // Messages pusher may send now (refilled at rate)
+    uint64_t refilled;   // When tokens were last refilled (monotonic ns)
+    uint64_t window;     // Start of current rate adjustment window (monotonic ns)
+    size_t acknowledged; // Requests acknowledged by server during window
+    bool congested;      // Whether or not server was loaded (or refused requests) during window
+
+    bool pushing; // Whether or not pusher is still running
+    bool pulling; // Whether or not puller is still running
+    bool waiting; // Whether or not shared memory receive is still pending
+    bool sleeping; // Whether or not retry timer is armed
+    bool probing;  // Whether or not probe is in progress
+    bool resolving; // Whether or not helper thread is resolving host
+    bool expired; // Whether or not drain deadline of mq_stop has expired
+    bool dropped; // Whether or not outgoing requests were dropped (during shutdown, or unframeable)
 
     Mutex lock;
+    Cond stopped; // Signaled when pusher and puller stop
+};
+
+/* Topic opened for repeated publishing (see mq_topic_open) */
+struct MQTopic
+{
+    MessageQueue *mq;
+    char *name;
+    RequestLine *line; // "PUT /topic/$name" shared by published Requests
+    TraceTopic *trace; // Latency histograms of topic (once traced; accessed atomically)
 };
 
 MessageQueue *mq_create(const char *name, const char *host, const char *port);
 void mq_delete(MessageQueue *mq);
+MessageQueue *mq_shard(MessageQueue *mq, const char *topic);
 
-void mq_publish(MessageQueue *mq, const char *topic, const char *body);
+bool mq_publish(MessageQueue *mq, const char *topic, const char *body);
+bool mq_publish_headers(MessageQueue *mq, const char *topic, const char *body, const MessageHeader *headers, size_t nheaders);
+bool mq_publish_fd(MessageQueue *mq, const char *topic, int fd, size_t length); // Over shm: hosts, up to one ring record (SHM_RECORD_MAX)
+MQTopic *mq_topic_open(MessageQueue *mq, const char *topic);
+bool mq_publish_handle(MQTopic *t, const char *body, size_t length);
+void mq_topic_close(MQTopic *t);
 char *mq_retrieve(MessageQueue *mq);
+Message *mq_retrieve_message(MessageQueue *mq);
+void mq_stream(MessageQueue *mq, MQStreamFunc func, void *arg);
+void mq_stream_fd(MessageQueue *mq, int fd);
+void mq_prefetch(MessageQueue *mq, size_t messages, size_t bytes);
 
 void mq_subscribe(MessageQueue *mq, const char *topic);
 void mq_unsubscribe(MessageQueue *mq, const char *topic);
+void mq_subscribe_selector(MessageQueue *mq, const char *topic, const char *selector);
+void mq_subscribe_shared(MessageQueue *mq, const char *topic);
+void mq_unsubscribe_shared(MessageQueue *mq, const char *topic);
+
+void mq_read_from(MessageQueue *mq, const char *topic, int64_t offset);
+void mq_seek(MessageQueue *mq, int64_t offset);
+uint64_t mq_offset(MessageQueue *mq);
+
+void mq_trace(MessageQueue *mq, TraceClock clock);
+void mq_on_state(MessageQueue *mq, MQStateFunc func, void *arg);
+MQState mq_state(MessageQueue *mq);
+double mq_rate(MessageQueue *mq);
 
 void mq_start(MessageQueue *mq);
 void mq_stop(MessageQueue *mq);
+bool mq_stop_timeout(MessageQueue *mq, unsigned int timeout);
 
 bool mq_shutdown(MessageQueue *mq);
 
@@ -0,0 +1,78 @@
+/* frame.h: Binary framing protocol */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "mq/request.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define FRAME_PROTOCOL  "mq-binary/1"   // Upgrade token negotiated over HTTP
+#define FRAME_HEADER    12              // Length (4), opcode (1), flags (1), status (2), id (4)
+#define FRAME_BUCKETS   64              // Buckets in table of declared topics
+
+/* Frame opcodes (requests from client, responses from broker) */
+typedef enum
+{
+    FRAME_DECLARE     = 0x01, // Bind id to topic name (body); no response
+    FRAME_PUBLISH     = 0x02, // Publish body to topic id
+    FRAME_SUBSCRIBE   = 0x03, // Subscribe queue (body, then NUL and selector if any) to topic id
+    FRAME_UNSUBSCRIBE = 0x04, // Unsubscribe queue (body) from topic id
+    FRAME_FETCH       = 0x05, // Retrieve one message from queue (body, then NUL and "max bytes" for a batch), waiting at most id ms (if nonzero)
+    FRAME_DELIVER     = 0x06, // Publish body to local subscribers of topic id (between broker workers)
+    FRAME_ROUTE       = 0x07, // Worker id has subscribers for topic (body)
+    FRAME_UNROUTE     = 0x08, // Worker id no longer has subscribers for topic (body)
+    FRAME_STATS       = 0x09, // Counters of worker (between broker workers; JSON result body)
+    FRAME_READ        = 0x0A, // Read topic id's log from offset (body: "offset max wait"); 204 result body is next offset
+    FRAME_RESULT      = 0x81, // Status of request (body is error message, if any); id is load or Retry-After of publish
+    FRAME_MESSAGE     = 0x82, // Message retrieved by fetch (or records of batch fetch or read from topic log)
+} FrameOpcode;
+
+/* Frame flags */
+typedef enum
+{
+    FRAME_HEADERS = 0x01, // Body starts with headers: length (2) and "name=value\n" lines
+} FrameFlags;
+
+/* Structures */
+
+typedef struct Frame Frame;
+struct Frame
+{
+    uint32_t length; // Length of body following header
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t status; // HTTP status code (responses only)
+    uint32_t id;     // Topic id (0 if unused; publish results: load in permille, or Retry-After ms if 429)
+};
+
+typedef struct FrameTopic FrameTopic;
+struct FrameTopic
+{
+    char *name;
+    uint32_t id;
+    FrameTopic *next;
+};
+
+/* Topic ids declared on one connection */
+typedef struct FrameTable FrameTable;
+struct FrameTable
+{
+    FrameTopic *buckets[FRAME_BUCKETS];
+    uint32_t count;
+    uint64_t generation; // Unique across connections (0 until a topic is declared)
+};
+
+/* Functions */
+
+void frame_pack(const Frame *f, char *buffer);
+void frame_unpack(const char *buffer, Frame *f);
+int frame_write(FrameTable *t, Request *r, FILE *fs);
+void frame_clear(FrameTable *t);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
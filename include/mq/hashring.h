@@ -0,0 +1,41 @@
+/* hashring.h: Consistent hashing of keys to nodes */
+
+#ifndef HASHRING_H
+#define HASHRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define HASHRING_REPLICAS 160 // Points of each node on the ring (more spread keys more evenly)
+
+/* Structures */
+
+typedef struct HashPoint HashPoint;
+struct HashPoint
+{
+    uint64_t hash;
+    size_t node; // Index of node
+};
+
+/* Points of every node sorted by hash: a key belongs to the node of the first
+ * point at or after its hash, so adding a node only moves the keys that now
+ * fall before its points (about 1/n of them), and all to the new node. */
+typedef struct HashRing HashRing;
+struct HashRing
+{
+    HashPoint *points;
+    size_t npoints;
+};
+
+/* Functions */
+
+HashRing *hashring_create(const char *const *nodes, size_t nnodes);
+void hashring_delete(HashRing *r);
+size_t hashring_lookup(const HashRing *r, const char *key);
+uint64_t hashring_hash(const char *key);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
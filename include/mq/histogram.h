@@ -0,0 +1,39 @@
+/* histogram.h: High dynamic range latency histogram */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Constants */
+
+#define HISTOGRAM_SUB_BITS  4                                               // Sub-buckets per power of two (log2)
+#define HISTOGRAM_SUB       (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS   ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB) // Covers every uint64_t value
+
+/* Structures */
+
+/* Log-linear buckets: values are recorded within 1/HISTOGRAM_SUB of their
+ * magnitude (6.25%), so percentiles of nanosecond latencies stay accurate from
+ * nanoseconds to hours in a fixed 8KB of counters (updated atomically). */
+typedef struct Histogram Histogram;
+struct Histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t counts[HISTOGRAM_BUCKETS];
+};
+
+/* Functions */
+
+void histogram_record(Histogram *h, uint64_t value);
+void histogram_copy(const Histogram *h, Histogram *copy);
+void histogram_merge(Histogram *h, const Histogram *other);
+void histogram_reset(Histogram *h);
+uint64_t histogram_percentile(const Histogram *h, double percentile);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
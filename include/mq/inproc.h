@@ -0,0 +1,140 @@
+/* inproc.h: In-process broker transport */
+
+#ifndef INPROC_H
+#define INPROC_H
+
+#include "mq/message.h"
+#include "mq/thread.h"
+#include "mq/transport.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define INPROC_PREFIX       "inproc://" // Host prefix for in-process brokers
+#define INPROC_BUCKETS      256         // Hash buckets of queues and of topics (per broker)
+#define INPROC_MAX_DEPTH    1000000     // Messages a queue holds before publishes to it are refused with 429
+#define INPROC_RETRY_AFTER  100         // Milliseconds overloaded publishers wait (scaled by load)
+#define INPROC_WINDOW       1024        // Sequence numbers of each producer checked for duplicates
+#define INPROC_FETCH_MAX    1000        // Messages returned by one batch retrieval
+
+/* Structures */
+
+typedef struct Inproc Inproc;
+
+/* Response record waiting to be received by an endpoint */
+typedef struct InprocRecord InprocRecord;
+struct InprocRecord
+{
+    char *data;
+    size_t length;
+    uint8_t tag;
+    InprocRecord *next;
+};
+
+/* Message in a queue (shared by every queue it was published to) */
+typedef struct InprocEntry InprocEntry;
+struct InprocEntry
+{
+    Message *message;
+    InprocEntry *next;
+};
+
+/* Retrieval waiting for a message */
+typedef struct InprocWaiter InprocWaiter;
+struct InprocWaiter
+{
+    Inproc *endpoint;
+    uint8_t tag;
+    bool records;          // Whether retrieval is a batch (answered with records)
+    InprocWaiter *next;
+};
+
+typedef struct InprocQueue InprocQueue;
+struct InprocQueue
+{
+    char *name;
+    InprocEntry *head;
+    InprocEntry *tail;
+    size_t depth;
+    InprocWaiter *waiters; // Oldest first
+    InprocQueue *next;     // Next queue in bucket
+};
+
+typedef struct InprocTopic InprocTopic;
+struct InprocTopic
+{
+    char *name;
+    InprocQueue **subscribers;
+    size_t nsubscribers;
+    size_t capacity;
+    InprocTopic *next;     // Next topic in bucket
+};
+
+/* Result of serving one request (status 0 while a retrieval waits) */
+typedef struct InprocResponse InprocResponse;
+struct InprocResponse
+{
+    int status;
+    char text[BUFSIZ];     // Body (unless entries)
+    size_t length;
+    InprocEntry *entries;  // Retrieved messages (if any)
+    bool records;          // Whether entries are rendered as "$LENGTH\n" records (of a batch retrieval)
+    bool published;        // Whether load was measured by publishing
+    double load;           // Depth of deepest queue published to (relative to INPROC_MAX_DEPTH)
+    unsigned retry;        // Milliseconds publisher refused with 429 waits
+};
+
+/* Sequence numbers recently published by a producer: the highest one, and
+ * which of the window below it were seen (bit sequence % INPROC_WINDOW) */
+typedef struct InprocProducer InprocProducer;
+struct InprocProducer
+{
+    char *name;
+    uint64_t highest;
+    uint64_t seen[INPROC_WINDOW / 64];
+    InprocProducer *next;  // Next producer in bucket
+};
+
+/* Broker named by "inproc://name" hosts (lives until the process exits) */
+typedef struct InprocBroker InprocBroker;
+struct InprocBroker
+{
+    char *name;
+    Mutex lock;
+    InprocQueue *queues[INPROC_BUCKETS];
+    InprocTopic *topics[INPROC_BUCKETS];
+    InprocProducer *producers[INPROC_BUCKETS];
+    InprocBroker *next;
+};
+
+/* One client's attachment to a broker */
+struct Inproc
+{
+    InprocBroker *broker;
+    int event;             // Signaled when records are appended to an empty list
+    Mutex lock;
+    InprocRecord *head;
+    InprocRecord *tail;
+};
+
+/* Variables */
+
+extern const Transport InprocTransport;
+
+/* Functions */
+
+Inproc *inproc_attach(const char *name);
+void inproc_detach(Inproc *p);
+
+bool inproc_send(Inproc *p, uint8_t tag, Request *r);
+char *inproc_recv(Inproc *p, uint8_t *tag, size_t *length);
+void inproc_wake(Inproc *p);
+void inproc_cancel(Inproc *p, uint8_t tag);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,24 +3,80 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <pthread.h>
 
+/* Constants */
+
+#define LOG_SLOTS   256     // Records per thread ring (full rings drop records)
+#define LOG_SLOT    256     // Bytes per record (captured arguments are truncated)
+#define LOG_BURST   10      // Records per second of one callsite (rest are suppressed)
+#define LOG_PERIOD  10      // Milliseconds between drains of background writer
+
+/* Structures */
+
+/* Severity of records (MQ_LOG_LEVEL=debug|info|error|off sets the initial
+ * threshold) */
+typedef enum
+{
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_ERROR,
+    LOG_OFF,
+} LogLevel;
+
+/* Static state of one logging statement: rate limiting is per callsite, so a
+ * statement in a retry loop cannot flood the log */
+typedef struct LogSite LogSite;
+struct LogSite
+{
+    LogLevel    level;
+    const char *file;
+    int         line;
+    const char *func;
+    const char *format;
+
+    uint64_t    window;     // Second of records counted
+    uint32_t    count;      // Records in window
+    uint32_t    suppressed; // Records suppressed since last record
+};
+
+/* Variables */
+
+extern LogLevel LogThreshold;   // Lowest level recorded
+
+/* Functions */
+
+void log_record(LogSite *site, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_level(LogLevel level);
+void log_flush(void);
+
+/* Macros */
+
+/* Records are captured in binary (format arguments are copied, not formatted)
+ * into a lock-free ring of the calling thread and written by a background
+ * thread, so logging never blocks the caller */
+#define log_at(L, M, ...) \
+    do { \
+        static LogSite _site = {L, __FILE__, __LINE__, __func__, M}; \
+        if ((L) >= __atomic_load_n(&LogThreshold, __ATOMIC_RELAXED)) { \
+            log_record(&_site, M, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
 #ifndef NDEBUG
-#define debug(M, ...) \
-    fprintf(stderr, "[%09lu] DEBUG %s:%d:%s: " M "\n", pthread_self(), __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+#define debug(M, ...)   log_at(LOG_DEBUG, M, ##__VA_ARGS__)
 #else
 #define debug(M, ...)
 #endif
 
-#define info(M, ...) \
-    fprintf(stderr, "[%09lu] INFO  " M "\n", pthread_self(), ##__VA_ARGS__)
+#define info(M, ...)    log_at(LOG_INFO, M, ##__VA_ARGS__)
 
-#define error(M, ...) \
-    fprintf(stderr, "[%09lu] ERROR " M "\n", pthread_self(), ##__VA_ARGS__)
+#define error(M, ...)   log_at(LOG_ERROR, M, ##__VA_ARGS__)
 
 #endif
 
@@ -0,0 +1,26 @@
+/* message.h: Reference counted message buffer */
+
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <stddef.h>
+
+/* Structures */
+
+typedef struct Message Message;
+struct Message
+{
+    size_t refs;   // Number of references (updated atomically)
+    size_t length; // Length of body (excluding terminating NUL)
+    char body[];
+};
+
+/* Functions */
+
+Message *message_create(const char *body, size_t length);
+Message *message_retain(Message *m);
+void message_release(Message *m);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,38 @@
+/* mux.h: Process-wide subscription multiplexer */
+
+#ifndef MUX_H
+#define MUX_H
+
+#include "mq/client.h"
+#include "mq/message.h"
+#include "mq/thread.h"
+
+/* Structures */
+
+/* One network subscription shared by every local subscriber of a topic */
+typedef struct MuxTopic MuxTopic;
+struct MuxTopic
+{
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    char *topic;
+
+    MessageQueue *mq;           // Network client subscribed to topic
+    MessageQueue **subscribers; // Local message queues
+    size_t nsubscribers;
+    size_t capacity;
+
+    Mutex lock;
+    MuxTopic *next;
+};
+
+/* Functions */
+
+void mux_subscribe(MessageQueue *mq, const char *topic);
+void mux_unsubscribe(MessageQueue *mq, const char *topic);
+void mux_leave(MessageQueue *mq);
+void mux_deliver(MuxTopic *t, Message *m, const Request *origin);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
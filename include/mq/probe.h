@@ -0,0 +1,81 @@
+/* probe.h: Minimal USDT (statically defined tracing) probes */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdint.h>
+
+/* Macros */
+
+/* Each probe is a single nop, described by a SystemTap-compatible ELF note
+ * (.note.stapsdt: provider "mq", probe name, and where its arguments are) so
+ * that bpftrace, perf and SystemTap can attach to it (usdt:*:mq:name) without
+ * sys/sdt.h.  Arguments are evaluated (as 64-bit integers, left in registers
+ * or wherever the compiler already keeps them) even when nothing is attached,
+ * so they should be values at hand.  Built with USDT=0 (or on targets other
+ * than x86-64), probes compile to nothing. */
+
+#if defined(MQ_USDT) && defined(__x86_64__)
+
+#define MQ_PROBE_ARG(x)     ((int64_t)(intptr_t)(x))
+
+#define MQ_PROBE_NOTE(name, args)                                               \
+    "990:   nop\n"                                                              \
+    "       .pushsection .note.stapsdt,\"\",\"note\"\n"                         \
+    "       .balign 4\n"                                                        \
+    "       .4byte 992f-991f, 994f-993f, 3\n"                                   \
+    "991:   .asciz \"stapsdt\"\n"                                               \
+    "992:   .balign 4\n"                                                        \
+    "993:   .8byte 990b\n"                                                      \
+    "       .8byte _.stapsdt.base\n"                                            \
+    "       .8byte 0\n"                                                         \
+    "       .asciz \"mq\"\n"                                                    \
+    "       .asciz \"" #name "\"\n"                                             \
+    "       .asciz \"" args "\"\n"                                              \
+    "994:   .balign 4\n"                                                        \
+    "       .popsection\n"                                                      \
+    "       .ifndef _.stapsdt.base\n"                                           \
+    "       .pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    "       .weak _.stapsdt.base\n"                                             \
+    "       .hidden _.stapsdt.base\n"                                           \
+    "_.stapsdt.base: .space 1\n"                                                \
+    "       .size _.stapsdt.base, 1\n"                                          \
+    "       .popsection\n"                                                      \
+    "       .endif\n"
+
+#define MQ_PROBE2(name, a0, a1)                                                 \
+    __asm__ __volatile__(MQ_PROBE_NOTE(name, "-8@%[A0] -8@%[A1]")               \
+        :: [A0] "nor"(MQ_PROBE_ARG(a0)), [A1] "nor"(MQ_PROBE_ARG(a1)))
+
+#define MQ_PROBE3(name, a0, a1, a2)                                             \
+    __asm__ __volatile__(MQ_PROBE_NOTE(name, "-8@%[A0] -8@%[A1] -8@%[A2]")      \
+        :: [A0] "nor"(MQ_PROBE_ARG(a0)), [A1] "nor"(MQ_PROBE_ARG(a1)),          \
+           [A2] "nor"(MQ_PROBE_ARG(a2)))
+
+#define MQ_PROBE4(name, a0, a1, a2, a3)                                         \
+    __asm__ __volatile__(MQ_PROBE_NOTE(name, "-8@%[A0] -8@%[A1] -8@%[A2] -8@%[A3]") \
+        :: [A0] "nor"(MQ_PROBE_ARG(a0)), [A1] "nor"(MQ_PROBE_ARG(a1)),          \
+           [A2] "nor"(MQ_PROBE_ARG(a2)), [A3] "nor"(MQ_PROBE_ARG(a3)))
+
+#else
+
+#define MQ_PROBE2(name, a0, a1)             do { (void)(a0); (void)(a1); } while (0)
+#define MQ_PROBE3(name, a0, a1, a2)         do { (void)(a0); (void)(a1); (void)(a2); } while (0)
+#define MQ_PROBE4(name, a0, a1, a2, a3)     do { (void)(a0); (void)(a1); (void)(a2); (void)(a3); } while (0)
+
+#endif
+
+/* Probes (arguments in order)
+ *
+ *  queue_push      queue, request, stage of queue, depth after push
+ *  queue_pop       queue, request, stage of queue, depth after pop
+ *  connect_start   channel, socket
+ *  connect_end     channel, result (negative errno on failure)
+ *  request_write   channel, first request, bytes written (0 over transports)
+ *  response_parse  channel, status of exchange (negative errno on failure), bytes received
+ *  retrieve        message queue, request, bytes of body
+ */
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
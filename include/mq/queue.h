@@ -8,6 +8,7 @@
 
 #include "mq/request.h"
 #include "mq/thread.h"
+#include "mq/trace.h"
 
 /* Structures */
 
@@ -16,11 +17,14 @@ struct Queue
 {
     Request *head;
     Request *tail;
-    size_t size;
+    size_t size;  // Number of requests (updated atomically, so it may be read without lock)
+    size_t bytes; // Bytes of their messages (likewise)
 
     /* TODO: Add any necessary thread and synchronization primitives */
     sem_t lock;
     sem_t produced;
+
+    TraceStage stage; // Stage that traced requests spend in queue
 };
 
 /* Functions */
@@ -30,6 +34,7 @@ void queue_delete(Queue *q);
 
 void queue_push(Queue *q, Request *r);
 Request *queue_pop(Queue *q);
+Request *queue_trypop(Queue *q);
 
 #endif
 
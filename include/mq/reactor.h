@@ -0,0 +1,111 @@
+/* reactor.h: Shared I/O reactor */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "mq/thread.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/* Constants */
+
+#define REACTOR_THREADS     2       // Default number of I/O threads (MQ_REACTOR_THREADS)
+#define REACTOR_BACKEND     "epoll" // Default I/O backend (MQ_IO_BACKEND: epoll or io_uring)
+#define REACTOR_EVENTS      64      // Maximum events handled per epoll_wait
+#define REACTOR_ENTRIES     256     // io_uring submission queue entries
+#define REACTOR_BUFFERS     64      // io_uring registered buffers
+#define REACTOR_BUFFER_SIZE (16*1024)
+
+/* Structures */
+
+typedef struct Reactor Reactor;
+typedef struct Task    Task;
+typedef struct Op      Op;
+
+typedef void (*TaskFunc)(Task *t);
+typedef void (*OpFunc)(Op *op);
+
+/* Task: callback run on a reactor thread (posted from any thread) */
+struct Task
+{
+    TaskFunc func;
+    void *arg;
+
+    bool pending; // Whether or not task is already queued
+    Task *next;
+};
+
+/* Op: asynchronous socket operation completed on a reactor thread */
+typedef enum
+{
+    OP_CONNECT,
+    OP_READ,
+    OP_WRITE,
+    OP_SENDFILE,
+} OpType;
+
+struct Op
+{
+    OpType type;
+    int fd;
+
+    const struct sockaddr *addr; // OP_CONNECT: address to connect to
+    socklen_t addrlen;
+    void *buf;                   // OP_READ/OP_WRITE: buffer to transfer
+    size_t len;                  // (OP_SENDFILE: bytes to send)
+    int file;                    // OP_SENDFILE: file to send from (kernel to socket, without copies)
+    off_t offset;                // OP_SENDFILE: offset in file (advanced as bytes are sent)
+
+    ssize_t result; // Bytes transferred (or 0 for connect), otherwise -errno
+    OpFunc func;    // Completion callback
+    void *arg;
+
+    bool active;    // Whether or not op is in progress (until its completion is queued)
+
+    Op *next;
+};
+
+struct Reactor
+{
+    Thread thread;
+    int epoll_fd;
+    int wake_fd;
+
+    struct Uring *ring;   // io_uring instance (NULL when using epoll)
+    Op wake_op;           // io_uring read of wake_fd
+    uint64_t wake_value;
+    char *buffers;        // Registered buffers (io_uring only)
+    int slots[REACTOR_BUFFERS];
+    size_t nslots;        // Number of free buffer slots
+
+    Mutex lock;
+    Task *tasks_head; // Tasks posted from other threads
+    Task *tasks_tail;
+    bool shutdown;
+
+    Op *completed_head; // Ops awaiting callbacks (reactor thread only)
+    Op *completed_tail;
+
+    size_t clients; // Number of clients assigned to this reactor
+};
+
+/* Functions */
+
+Reactor *reactor_acquire();
+void reactor_release(Reactor *r);
+
+void reactor_post(Reactor *r, Task *t);
+void reactor_sync(Reactor *r);
+void reactor_submit(Reactor *r, Op *op);
+void reactor_cancel(Reactor *r, Op *op);
+
+char *reactor_buffer(Reactor *r);
+void reactor_unbuffer(Reactor *r, char *buf);
+bool reactor_buffered(Reactor *r, const void *buf);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,16 +3,45 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
+#include "mq/message.h"
+
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 /* Structures */
 
+/* Method and URI shared by Requests to one resource, with their HTTP request
+ * line rendered once (and the binary topic id declared for it cached) */
+typedef struct RequestLine RequestLine;
+struct RequestLine
+{
+    size_t refs;         // Number of references (updated atomically)
+    char *method;
+    char *uri;
+    char *line;          // "$METHOD $URI HTTP/1.0\r\n"
+    size_t length;       // Length of line
+    uint64_t generation; // Generation of FrameTable that declared id (0 if none)
+    uint32_t id;
+};
+
 typedef struct Request Request;
 struct Request
 {
-    char *method;
+    char *method;     // Owned by Request (or pointing into line, if any)
     char *uri;
     char *body;
+    Message *message; // Shared buffer holding body (if any)
+    RequestLine *line; // Method and URI shared with other Requests (if any)
+    char *headers;    // Message headers ("name=value\n" lines, if any)
+    int file;         // File whose contents follow body (owned by Request, if flength > 0)
+    off_t foffset;    // Offset and length of contents sent from file
+    size_t flength;
+
+    struct TraceTopic *trace; // Latency histograms of traced message (if any)
+    uint64_t stamp;           // When last queued or sent (monotonic nanoseconds, if traced)
+    uint64_t published;       // When published (monotonic nanoseconds, if traced)
+    uint64_t offset;          // Offset after message in its topic log (0 if not read from one)
 
     Request *next;
 };
@@ -20,8 +49,14 @@ struct Request
 /* Functions */
 
 Request *request_create(const char *method, const char *uri, const char *body);
+Request *request_from_line(RequestLine *l, const char *body, size_t length);
 void request_delete(Request *r);
 void request_write(Request *r, FILE *fs);
+size_t request_length(Request *r);
+
+RequestLine *request_line_create(const char *method, const char *uri);
+RequestLine *request_line_retain(RequestLine *l);
+void request_line_release(RequestLine *l);
 
 #endif
 
@@ -0,0 +1,80 @@
+/* shm.h: Shared memory ring transport */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include "mq/transport.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define SHM_PREFIX      "shm:"          // Host prefix for shared memory endpoints
+#define SHM_RING_SIZE   (1<<20)         // Capacity of each ring in bytes
+#define SHM_RECORD_MAX  (SHM_RING_SIZE - 8) // Largest record a ring holds (after its 8 byte header)
+#define SHM_MAGIC       "MQSHM1"        // Handshake sent with descriptors
+
+/* Structures */
+
+/* Single-producer, single-consumer byte ring (lives in shared memory).  A
+ * producer that finds the ring full sets waiting, and the consumer clears it
+ * and signals the producer's eventfd once it has freed space. */
+typedef struct ShmRing ShmRing;
+struct ShmRing
+{
+    uint64_t head;    // Consumer position
+    uint64_t waiting; // Whether producer waits for space (set by producer, cleared by consumer)
+    char pad0[48];
+    uint64_t tail; // Producer position
+    char pad1[56];
+    uint64_t size; // Capacity of data (power of two)
+    char pad2[56];
+    char data[];
+};
+
+/* Record held until the transmit ring has room for it */
+typedef struct ShmRecord ShmRecord;
+struct ShmRecord
+{
+    uint8_t tag;
+    size_t length;
+    ShmRecord *next;
+    char data[];
+};
+
+typedef struct Shm Shm;
+struct Shm
+{
+    int socket_fd; // Control connection to broker (closed on detach)
+    int memfd;
+    void *base;
+    size_t length;
+
+    ShmRing *tx;   // Client to broker
+    ShmRing *rx;   // Broker to client
+    int tx_event;  // Signaled after writing to tx
+    int rx_event;  // Signaled by broker after writing to rx (or freeing space in tx)
+
+    ShmRecord *pending;       // Records waiting for space in tx (oldest first)
+    ShmRecord **pending_tail;
+};
+
+/* Variables */
+
+extern const Transport ShmTransport;
+
+/* Functions */
+
+Shm *shm_attach(const char *path);
+void shm_detach(Shm *s);
+
+bool shm_send(Shm *s, uint8_t tag, const char *data, size_t length);
+char *shm_recv(Shm *s, uint8_t *tag, size_t *length);
+void shm_flush(Shm *s);
+void shm_wake(Shm *s);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -4,10 +4,24 @@
 #define SOCKET_H
 
 #include <stdio.h>
+#include <sys/socket.h>
+
+/* Constants */
+
+#define SOCKET_UNIX "unix:"   /* Host prefix for Unix domain socket paths */
+
+/* Structures */
+
+typedef struct Address Address;
+struct Address {
+    struct sockaddr_storage addr;
+    socklen_t               addrlen;
+};
 
 /* Functions */
 
 FILE *  socket_connect(const char *host, const char *port);
+size_t  socket_resolve(const char *host, const char *port, Address *addrs, size_t n, int *status);
 
 #endif
 
@@ -0,0 +1,65 @@
+/* trace.h: End-to-end message latency tracing */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "mq/histogram.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define TRACE_MAGIC "\036mq-trace/1 "  // Start of envelope embedded in traced message bodies
+
+/* Structures */
+
+/* Clock of publish timestamps (monotonic only compares within one host) */
+typedef enum
+{
+    TRACE_OFF,
+    TRACE_MONOTONIC,
+    TRACE_REALTIME,
+} TraceClock;
+
+/* Stages of a traced message's journey */
+typedef enum
+{
+    TRACE_OUTGOING, // Publish until pusher takes it from outgoing queue
+    TRACE_SEND,     // Pusher send until server acknowledges it
+    TRACE_TRANSIT,  // Publish timestamp until puller receives it
+    TRACE_INCOMING, // Puller receipt until retrieved from incoming queue
+    TRACE_TOTAL,    // Publish timestamp until retrieved
+    TRACE_STAGES,
+} TraceStage;
+
+/* Latency histograms (in nanoseconds) of one topic */
+typedef struct TraceTopic TraceTopic;
+struct TraceTopic
+{
+    char *name;
+    Histogram stages[TRACE_STAGES];
+    uint64_t sequence; // Highest sequence number received
+    uint64_t gaps;     // Sequence numbers skipped (lost or reordered, with one publisher)
+
+    TraceTopic *next;
+};
+
+/* Functions */
+
+uint64_t trace_now(TraceClock clock);
+TraceTopic *trace_topic(const char *name);
+void trace_record(TraceTopic *t, TraceStage stage, uint64_t nanoseconds);
+
+char *trace_stamp(TraceClock clock, uint64_t sequence, const char *topic, const char *body);
+size_t trace_open(const char *body, size_t length, TraceTopic **topic, uint64_t *published);
+
+bool trace_histogram(const char *topic, TraceStage stage, Histogram *h);
+void trace_export(FILE *fs);
+void trace_reset(void);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,37 @@
+/* transport.h: Transports exchanging whole request and response records */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "mq/request.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Structures */
+
+/* Transport selected by a host prefix instead of a socket connection: each
+ * request is sent as one record tagged with its channel, and the matching
+ * response records are received once the transport's eventfd is signaled.
+ * Transports that batch serve a list of requests as one exchange, whose
+ * response carries the status of the last request (or of the first refused
+ * with 429) and the highest load of all of them, as binary exchanges do. */
+typedef struct Transport Transport;
+struct Transport
+{
+    const char *prefix;                                            // Host prefix selecting transport
+    bool batches;                                                  // Whether send serves lists of requests (with one response)
+    size_t record_max;                                             // Largest request record it can send (0 for no limit)
+    void *(*attach)(const char *path);                             // Attach to endpoint (NULL on failure)
+    void (*detach)(void *endpoint);
+    bool (*send)(void *endpoint, uint8_t tag, Request *r);         // Send request (false if it never fits)
+    char *(*recv)(void *endpoint, uint8_t *tag, size_t *length);   // Take next response (NULL if none)
+    int (*event)(void *endpoint);                                  // Eventfd signaled when responses arrive
+    void (*wake)(void *endpoint);                                  // Signal eventfd locally
+    void (*cancel)(void *endpoint, uint8_t tag);                   // Abandon exchange (if supported)
+};
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,53 @@
+/* uring.h: Minimal io_uring interface */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Structures */
+
+typedef struct Uring Uring;
+struct Uring
+{
+    int fd;
+
+    unsigned *sq_head; // Submission queue (shared with kernel)
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_prepared; // Tail of prepared entries (published to kernel by uring_enter)
+    unsigned sq_pending;  // Entries prepared but not yet submitted
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head; // Completion queue (shared with kernel)
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring; // Mappings
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/* Functions */
+
+int uring_init(Uring *u, unsigned entries);
+void uring_exit(Uring *u);
+
+struct io_uring_sqe *uring_sqe(Uring *u);
+int uring_enter(Uring *u, unsigned wait);
+
+struct io_uring_cqe *uring_cqe(Uring *u);
+void uring_seen(Uring *u);
+
+int uring_register_buffer(Uring *u, void *buf, size_t len);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
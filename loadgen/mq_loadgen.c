@@ -0,0 +1,389 @@
+/* mq_loadgen.c: Multi-client load generator for the message queue */
+
+#include "mq/client.h"
+#include "mq/string.h"
+#include "mq/thread.h"
+#include "mq/trace.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define OUTSTANDING (4 * MQ_BATCH) // Maximum unsent messages per unthrottled publisher
+
+/* Structures */
+
+typedef struct Options Options;
+struct Options
+{
+    char *host;
+    char *port;
+    size_t publishers;
+    size_t subscribers;
+    size_t topics;
+    size_t size;       // Message size in bytes
+    double rate;       // Messages per second per publisher (0 is unthrottled)
+    double duration;   // Seconds to publish for
+    double drain;      // Seconds to wait for in-flight messages once publishing ends
+
+    double min_throughput; // SLO: delivered messages per second (0 is unchecked)
+    double max_drops;      // SLO: percent of messages not delivered (negative is unchecked)
+    double max_p50;        // SLO: median latency in milliseconds (0 is unchecked)
+    double max_p99;        // SLO: 99th percentile latency in milliseconds (0 is unchecked)
+};
+
+typedef struct Client Client;
+struct Client
+{
+    MessageQueue *mq;
+    Thread thread;
+    size_t index;
+    uint64_t messages; // Published or received
+    uint64_t bytes;
+    uint64_t last;     // When last message was received (monotonic nanoseconds)
+};
+
+/* Globals */
+
+Options Config = {
+    .host = "localhost",
+    .port = "9620",
+    .publishers = 1,
+    .subscribers = 1,
+    .topics = 1,
+    .size = 64,
+    .duration = 5,
+    .drain = 2,
+    .max_drops = -1,
+};
+
+char *Body = NULL;
+uint64_t Start = 0;
+
+/* Functions */
+
+void usage(const char *program, int status)
+{
+    fprintf(stderr, "Usage: %s [options]\n\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -H, --host HOST            Broker host (default: localhost)\n");
+    fprintf(stderr, "    -p, --port PORT            Broker port (default: 9620)\n");
+    fprintf(stderr, "    -P, --publishers N         Publishing clients (default: 1)\n");
+    fprintf(stderr, "    -S, --subscribers N        Subscribing clients, each subscribed to every topic (default: 1)\n");
+    fprintf(stderr, "    -T, --topics N             Topics published to round-robin (default: 1)\n");
+    fprintf(stderr, "    -s, --size BYTES           Message size (default: 64)\n");
+    fprintf(stderr, "    -r, --rate N               Messages per second per publisher (default: 0, unthrottled;\n");
+    fprintf(stderr, "                               latency then includes time spent queued behind other messages)\n");
+    fprintf(stderr, "    -d, --duration SECONDS     Publishing duration (default: 5)\n");
+    fprintf(stderr, "    -w, --drain SECONDS        Wait for in-flight messages (default: 2)\n");
+    fprintf(stderr, "\nService level objectives (exit status is 1 if any is violated):\n");
+    fprintf(stderr, "        --min-throughput N     Delivered messages per second\n");
+    fprintf(stderr, "        --max-drops PERCENT    Messages not delivered to every subscriber\n");
+    fprintf(stderr, "        --max-p50 MS           Median publish-to-retrieve latency\n");
+    fprintf(stderr, "        --max-p99 MS           99th percentile publish-to-retrieve latency\n");
+    exit(status);
+}
+
+void parse_options(int argc, char *argv[])
+{
+    static struct option options[] = {
+        {"host",           required_argument, NULL, 'H'},
+        {"port",           required_argument, NULL, 'p'},
+        {"publishers",     required_argument, NULL, 'P'},
+        {"subscribers",    required_argument, NULL, 'S'},
+        {"topics",         required_argument, NULL, 'T'},
+        {"size",           required_argument, NULL, 's'},
+        {"rate",           required_argument, NULL, 'r'},
+        {"duration",       required_argument, NULL, 'd'},
+        {"drain",          required_argument, NULL, 'w'},
+        {"min-throughput", required_argument, NULL, 1},
+        {"max-drops",      required_argument, NULL, 2},
+        {"max-p50",        required_argument, NULL, 3},
+        {"max-p99",        required_argument, NULL, 4},
+        {"help",           no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "H:p:P:S:T:s:r:d:w:h", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+            case 'H': Config.host = optarg; break;
+            case 'p': Config.port = optarg; break;
+            case 'P': Config.publishers = strtoul(optarg, NULL, 10); break;
+            case 'S': Config.subscribers = strtoul(optarg, NULL, 10); break;
+            case 'T': Config.topics = strtoul(optarg, NULL, 10); break;
+            case 's': Config.size = strtoul(optarg, NULL, 10); break;
+            case 'r': Config.rate = strtod(optarg, NULL); break;
+            case 'd': Config.duration = strtod(optarg, NULL); break;
+            case 'w': Config.drain = strtod(optarg, NULL); break;
+            case 1:   Config.min_throughput = strtod(optarg, NULL); break;
+            case 2:   Config.max_drops = strtod(optarg, NULL); break;
+            case 3:   Config.max_p50 = strtod(optarg, NULL); break;
+            case 4:   Config.max_p99 = strtod(optarg, NULL); break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+
+    if (optind != argc || !Config.publishers || !Config.subscribers || !Config.topics || Config.duration <= 0)
+    {
+        usage(argv[0], EXIT_FAILURE);
+    }
+}
+
+void topic_name(size_t index, char *name, size_t length)
+{
+    snprintf(name, length, "loadgen.%d.%zu", getpid(), index);
+}
+
+void sleep_until(uint64_t deadline)
+{
+    struct timespec ts = {.tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+/* Threads */
+
+void *publisher_thread(void *arg)
+{
+    Client *c = (Client *)arg;
+    uint64_t end = Start + (uint64_t)(Config.duration * 1e9);
+    uint64_t interval = Config.rate > 0 ? (uint64_t)(1e9 / Config.rate) : 0;
+    char topic[BUFSIZ];
+
+    /* Topics are opened once, so publishing does not format them per message */
+    MQTopic **topics = calloc(Config.topics, sizeof(MQTopic *));
+    if (!topics)
+    {
+        fprintf(stderr, "Unable to allocate topics: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < Config.topics; i++)
+    {
+        topic_name(i, topic, sizeof(topic));
+        if (!(topics[i] = mq_topic_open(c->mq, topic)))
+        {
+            fprintf(stderr, "Unable to open topic %s: %s\n", topic, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (uint64_t now = trace_now(TRACE_MONOTONIC); now < end; now = trace_now(TRACE_MONOTONIC))
+    {
+        if (interval)
+        {
+            sleep_until(Start + c->messages * interval);
+        }
+        else if (__atomic_load_n(&c->mq->outgoing->size, __ATOMIC_RELAXED) >= OUTSTANDING)
+        {
+            sleep_until(now + 100000);
+            continue;
+        }
+
+        mq_publish_handle(topics[(c->index + c->messages) % Config.topics], Body, Config.size);
+        c->messages++;
+        c->bytes += Config.size;
+    }
+
+    for (size_t i = 0; i < Config.topics; i++)
+    {
+        mq_topic_close(topics[i]);
+    }
+    free(topics);
+    return NULL;
+}
+
+void *subscriber_thread(void *arg)
+{
+    Client *c = (Client *)arg;
+    Message *m;
+
+    while ((m = mq_retrieve_message(c->mq)))
+    {
+        __atomic_store_n(&c->last, trace_now(TRACE_MONOTONIC), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->bytes, m->length, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->messages, 1, __ATOMIC_RELAXED);
+        message_release(m);
+    }
+
+    return NULL;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[])
+{
+    parse_options(argc, argv);
+
+    Body = malloc(Config.size + 1);
+    Client *publishers = calloc(Config.publishers, sizeof(Client));
+    Client *subscribers = calloc(Config.subscribers, sizeof(Client));
+    Histogram *latency = calloc(1, sizeof(Histogram));
+    Histogram *h = malloc(sizeof(Histogram));
+    if (!Body || !publishers || !subscribers || !latency || !h)
+    {
+        fprintf(stderr, "Unable to allocate clients: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < Config.size; i++)
+    {
+        Body[i] = 'a' + i % 26;
+    }
+    Body[Config.size] = 0;
+
+    /* Subscribe before publishing, so every message has subscribers */
+    char name[BUFSIZ];
+    char topic[BUFSIZ];
+    for (size_t i = 0; i < Config.subscribers; i++)
+    {
+        snprintf(name, sizeof(name), "loadgen.%d.subscriber.%zu", getpid(), i);
+        subscribers[i].mq = mq_create(name, Config.host, Config.port);
+        subscribers[i].index = i;
+        for (size_t t = 0; t < Config.topics; t++)
+        {
+            topic_name(t, topic, sizeof(topic));
+            mq_subscribe(subscribers[i].mq, topic);
+        }
+        mq_start(subscribers[i].mq);
+        thread_create(&subscribers[i].thread, NULL, subscriber_thread, &subscribers[i]);
+    }
+
+    for (size_t i = 0; i < Config.publishers; i++)
+    {
+        snprintf(name, sizeof(name), "loadgen.%d.publisher.%zu", getpid(), i);
+        publishers[i].mq = mq_create(name, Config.host, Config.port);
+        publishers[i].index = i;
+        mq_trace(publishers[i].mq, TRACE_MONOTONIC);
+        mq_start(publishers[i].mq);
+    }
+    sleep(1);
+
+    /* Publish for duration, then wait for in-flight messages */
+    Start = trace_now(TRACE_MONOTONIC);
+    for (size_t i = 0; i < Config.publishers; i++)
+    {
+        thread_create(&publishers[i].thread, NULL, publisher_thread, &publishers[i]);
+    }
+
+    uint64_t published = 0;
+    for (size_t i = 0; i < Config.publishers; i++)
+    {
+        thread_join(publishers[i].thread, NULL);
+        published += publishers[i].messages;
+    }
+    uint64_t stop = trace_now(TRACE_MONOTONIC);
+
+    uint64_t expected = published * Config.subscribers;
+    uint64_t received = 0;
+    uint64_t bytes = 0;
+    uint64_t last = stop;
+    uint64_t deadline = stop + (uint64_t)(Config.drain * 1e9);
+    while (true)
+    {
+        uint64_t previous = received;
+        received = 0;
+        for (size_t i = 0; i < Config.subscribers; i++)
+        {
+            received += __atomic_load_n(&subscribers[i].messages, __ATOMIC_RELAXED);
+        }
+
+        uint64_t now = trace_now(TRACE_MONOTONIC);
+        if (received >= expected || now >= deadline)
+        {
+            break;
+        }
+        if (received != previous)
+        {
+            deadline = now + (uint64_t)(Config.drain * 1e9); // Still draining
+        }
+        sleep_until(now + 10000000);
+    }
+
+    for (size_t i = 0; i < Config.publishers; i++)
+    {
+        mq_stop(publishers[i].mq);
+        mq_delete(publishers[i].mq);
+    }
+
+    received = 0;
+    for (size_t i = 0; i < Config.subscribers; i++)
+    {
+        for (size_t t = 0; t < Config.topics; t++)
+        {
+            topic_name(t, topic, sizeof(topic));
+            mq_unsubscribe(subscribers[i].mq, topic);
+        }
+        mq_stop(subscribers[i].mq);
+        thread_join(subscribers[i].thread, NULL);
+        received += subscribers[i].messages;
+        bytes += subscribers[i].bytes;
+        last = subscribers[i].last > last ? subscribers[i].last : last;
+        mq_delete(subscribers[i].mq);
+    }
+
+    for (size_t t = 0; t < Config.topics; t++)
+    {
+        topic_name(t, topic, sizeof(topic));
+        if (trace_histogram(topic, TRACE_TOTAL, h))
+        {
+            histogram_merge(latency, h);
+        }
+    }
+
+    /* Report */
+    double publishing = (stop - Start) / 1e9;
+    double delivering = (last - Start) / 1e9;
+    double throughput = received / delivering;
+    uint64_t dropped = expected > received ? expected - received : 0;
+    double drops = expected ? 100.0 * dropped / expected : 0;
+    double p50 = histogram_percentile(latency, 50) / 1e6;
+    double p99 = histogram_percentile(latency, 99) / 1e6;
+
+    printf("publishers=%zu subscribers=%zu topics=%zu size=%zu rate=%.0f duration=%.1f\n",
+           Config.publishers, Config.subscribers, Config.topics, Config.size, Config.rate, Config.duration);
+    printf("published  %10" PRIu64 " messages %12.0f msgs/s %10.2f MB/s\n",
+           published, published / publishing, published * Config.size / publishing / 1e6);
+    printf("delivered  %10" PRIu64 " messages %12.0f msgs/s %10.2f MB/s\n",
+           received, throughput, bytes / delivering / 1e6);
+    printf("dropped    %10" PRIu64 " messages %11.3f%%\n", dropped, drops);
+    printf("latency    p50=%.3f p90=%.3f p99=%.3f p999=%.3f max=%.3f ms\n", p50,
+           histogram_percentile(latency, 90) / 1e6, p99, histogram_percentile(latency, 99.9) / 1e6, latency->max / 1e6);
+
+    int status = EXIT_SUCCESS;
+    if (Config.min_throughput > 0 && throughput < Config.min_throughput)
+    {
+        printf("SLO violated: throughput %.0f msgs/s < %.0f msgs/s\n", throughput, Config.min_throughput);
+        status = EXIT_FAILURE;
+    }
+    if (Config.max_drops >= 0 && drops > Config.max_drops)
+    {
+        printf("SLO violated: drops %.3f%% > %.3f%%\n", drops, Config.max_drops);
+        status = EXIT_FAILURE;
+    }
+    if (Config.max_p50 > 0 && p50 > Config.max_p50)
+    {
+        printf("SLO violated: p50 latency %.3f ms > %.3f ms\n", p50, Config.max_p50);
+        status = EXIT_FAILURE;
+    }
+    if (Config.max_p99 > 0 && p99 > Config.max_p99)
+    {
+        printf("SLO violated: p99 latency %.3f ms > %.3f ms\n", p99, Config.max_p99);
+        status = EXIT_FAILURE;
+    }
+
+    free(Body);
+    free(publishers);
+    free(subscribers);
+    free(latency);
+    free(h);
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
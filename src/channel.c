@@ -0,0 +1,855 @@
+/* channel.c: Asynchronous HTTP (or binary framed) exchange */
+
+#define _GNU_SOURCE /* fopencookie */
+
+#include "mq/channel.h"
+#include "mq/logging.h"
+#include "mq/probe.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define CHANNEL_READ_SIZE BUFSIZ
+#define CHANNEL_UPGRADE \
+    "GET /binary HTTP/1.1\r\n" \
+    "Host: mq\r\n" \
+    "Connection: Upgrade\r\n" \
+    "Upgrade: " FRAME_PROTOCOL "\r\n" \
+    "\r\n"
+
+/* Internal Prototypes */
+
+static void channel_connected(Op *op);
+static void channel_written(Op *op);
+static void channel_upload(Channel *c);
+static void channel_uploaded(Op *op);
+static void channel_read(Op *op);
+static void channel_receive(Channel *c);
+static void channel_stream(Channel *c);
+static void channel_handshake(Channel *c);
+static void channel_transmit(Channel *c);
+static FILE *channel_render(Channel *c);
+static ssize_t channel_append(void *cookie, const char *data, size_t size);
+static void channel_discard(Channel *c);
+static bool channel_parse(Channel *c);
+static void channel_submit(Channel *c);
+static void channel_finish(Channel *c, int status);
+
+/* External Functions */
+
+/**
+ * Initialize channel (must be used only from the reactor's thread).
+ * @param   c       Channel structure.
+ * @param   r       Reactor structure.
+ * @param   func    Callback run when an exchange completes.
+ * @param   arg     Argument for callback.
+ */
+void channel_init(Channel *c, Reactor *r, ChannelFunc func, void *arg)
+{
+    memset(c, 0, sizeof(Channel));
+    c->reactor = r;
+    c->fd = -1;
+    c->func = func;
+    c->arg = arg;
+    c->op.arg = c;
+}
+
+/**
+ * Start exchange: connect to server, send request, and read response until
+ * the server closes the connection (or, for channels over a record transport
+ * such as shared memory, send the request as one record).
+ *
+ * Binary channels instead upgrade the connection to the framed protocol once
+ * and keep it open: each exchange then writes all of the requests in the list
+ * as frames and completes when a response frame has arrived for each of them.
+ * If the server refuses the upgrade, the channel falls back to HTTP (which
+ * sends only the first request of a list).
+ *
+ * The contents of a request's file (only the last request of a list may have
+ * one) are sent from the file with sendfile after the request, without
+ * copying them through user space, except over record transports.  If the
+ * channel has a chunk callback, successful response bodies are passed to it
+ * as they arrive instead of being buffered whole.
+ * @param   c       Channel structure.
+ * @param   addr    Address of server (NULL if it could not be resolved, which
+ *                  fails the exchange with -EHOSTUNREACH, as a transport
+ *                  channel without an endpoint does with -ENOTCONN).
+ * @param   addrlen Length of address.
+ * @param   request Request to send (owned by channel until reset).
+ */
+void channel_send(Channel *c, const struct sockaddr *addr, socklen_t addrlen, Request *request)
+{
+    channel_reset(c);
+    c->request = request;
+    c->busy = true;
+
+    if (c->transport)
+    {
+        /* Response arrives through channel_deliver */
+        MQ_PROBE3(request_write, c, request, 0);
+        if (!c->endpoint)
+        {
+            channel_finish(c, -ENOTCONN);
+        }
+        else if (!c->transport->send(c->endpoint, c->tag, request))
+        {
+            channel_finish(c, -ENOBUFS);
+        }
+        return;
+    }
+
+    if (c->upgraded)
+    {
+        channel_transmit(c);
+        return;
+    }
+
+    if (!addr)
+    {
+        channel_finish(c, -EHOSTUNREACH);
+        return;
+    }
+
+    FILE *ms = channel_render(c);
+    if (!ms)
+    {
+        channel_finish(c, -errno);
+        return;
+    }
+    if (c->binary)
+    {
+        fputs(CHANNEL_UPGRADE, ms);
+    }
+    else
+    {
+        request_write(request, ms);
+    }
+    bool failed = ferror(ms);
+    fclose(ms);
+    if (failed)
+    {
+        channel_finish(c, -ENOMEM);
+        return;
+    }
+
+    if ((c->fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    {
+        channel_finish(c, -errno);
+        return;
+    }
+
+    /* Exchanges are request/response, so a write must not wait (Nagle) for
+     * the ACK of the previous one, which the broker may delay */
+    int nodelay = 1;
+    if (addr->sa_family != AF_UNIX)
+    {
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+
+    MQ_PROBE2(connect_start, c, c->fd);
+    c->op.type = OP_CONNECT;
+    c->op.fd = c->fd;
+    c->op.addr = addr;
+    c->op.addrlen = addrlen;
+    c->op.func = channel_connected;
+    channel_submit(c);
+}
+
+/**
+ * Finish exchange over record transport with response record from the broker.
+ * @param   c           Channel structure.
+ * @param   response    Response (owned by channel until reset).
+ * @param   length      Length of response.
+ */
+void channel_deliver(Channel *c, char *response, size_t length)
+{
+    c->rbuf = response;
+    c->rlen = c->rcap = length;
+    channel_finish(c, 0);
+}
+
+/**
+ * Parse HTTP response (or last response frame) read by the last exchange.
+ * @param   c       Channel structure.
+ * @param   body    Pointer to response body within channel (may be NULL).
+ * @param   length  Length of response body.
+ * @return  HTTP status code (or -1 if response is malformed).
+ */
+int channel_response(Channel *c, char **body, size_t *length)
+{
+    if (c->upgraded && c->status == 0 && c->rbuf)
+    {
+        if (body)
+        {
+            *body = c->rbuf + c->boff;
+        }
+        if (length)
+        {
+            *length = c->blen;
+        }
+        return c->code;
+    }
+
+    int code;
+    if (c->status < 0 || !c->rbuf || sscanf(c->rbuf, "HTTP/%*s %d", &code) != 1)
+    {
+        return -1;
+    }
+
+    char *end = strstr(c->rbuf, "\r\n\r\n");
+    if (!end)
+    {
+        return -1;
+    }
+
+    size_t offset = (end + 4) - c->rbuf;
+    size_t content = c->rlen - offset;
+    char *header = strstr(c->rbuf, "\r\nContent-Length:");
+    if (header && header < end)
+    {
+        content = strtoul(header + strlen("\r\nContent-Length:"), NULL, 10);
+        if (content > c->rlen - offset)
+        {
+            content = c->rlen - offset;
+        }
+    }
+
+    if (body)
+    {
+        *body = c->rbuf + offset;
+    }
+    if (length)
+    {
+        *length = content;
+    }
+    return code;
+}
+
+/**
+ * Return flow control hints of last exchange: the broker reports how loaded
+ * the queues it published to are with each response, and refuses publishes
+ * with 429 (and a Retry-After) once they are full.
+ * @param   c       Channel structure.
+ * @param   load    Highest load hint of responses (permille, 1000 is full).
+ * @return  Milliseconds to wait before resending (or 0 if no request was refused).
+ */
+unsigned channel_pressure(Channel *c, unsigned *load)
+{
+    if (c->upgraded || c->status < 0 || !c->rbuf)
+    {
+        *load = c->load;
+        return c->retry;
+    }
+
+    const char *header = channel_header(c, "Mq-Load");
+    *load = header ? (unsigned)(strtod(header, NULL) * 1000) : 0;
+
+    if (channel_response(c, NULL, NULL) != 429)
+    {
+        return 0;
+    }
+    if ((header = channel_header(c, "Mq-Retry-After")))
+    {
+        return strtoul(header, NULL, 10);
+    }
+    if ((header = channel_header(c, "Retry-After")))
+    {
+        return strtoul(header, NULL, 10) * 1000;
+    }
+    return 1000;
+}
+
+/**
+ * Return value of header of HTTP response read by the last exchange.
+ * @param   c       Channel structure.
+ * @param   name    Header name (case sensitive).
+ * @return  Value of header within channel (up to the end of its line), or NULL
+ *          if the response has no such header (or is a binary frame).
+ */
+const char *channel_header(Channel *c, const char *name)
+{
+    if (c->upgraded || c->status < 0 || !c->rbuf)
+    {
+        return NULL;
+    }
+
+    char *end = strstr(c->rbuf, "\r\n\r\n");
+    size_t length = strlen(name);
+    for (char *header = strstr(c->rbuf, "\r\n"); header && header < end; header = strstr(header + 2, "\r\n"))
+    {
+        if (strncmp(header + 2, name, length) == 0 && header[2 + length] == ':')
+        {
+            return header + 2 + length + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Release resources from last exchange (including its requests).  An
+ * upgraded binary connection stays open for the next exchange.
+ * @param   c       Channel structure.
+ */
+void channel_reset(Channel *c)
+{
+    if (c->fd >= 0 && !c->upgraded)
+    {
+        close(c->fd);
+        c->fd = -1;
+    }
+
+    while (c->request)
+    {
+        Request *next = c->request->next;
+        request_delete(c->request);
+        c->request = next;
+    }
+    while (c->rejected)
+    {
+        Request *next = c->rejected->next;
+        request_delete(c->rejected);
+        c->rejected = next;
+    }
+    channel_discard(c);
+    if (reactor_buffered(c->reactor, c->rbuf))
+    {
+        reactor_unbuffer(c->reactor, c->rbuf);
+    }
+    else
+    {
+        free(c->rbuf);
+    }
+
+    c->rbuf = NULL;
+    c->woff = c->fsent = 0;
+    c->rlen = c->rcap = c->roff = 0;
+    c->pending = c->boff = c->blen = 0;
+    c->code = 0;
+    c->load = c->retry = 0;
+    c->streamed = 0;
+    c->status = 0;
+    c->cancelled = false;
+}
+
+/**
+ * Cancel exchange in progress: its callback runs with a status of -ECANCELED
+ * (unless the exchange completes first).  An exchange cancelled between
+ * operations (or whose operation completed before the cancel reached it)
+ * stops before its next operation.  Responses to cancelled record transport
+ * exchanges are discarded when they arrive.
+ * @param   c       Channel structure.
+ */
+void channel_cancel(Channel *c)
+{
+    if (!c->busy)
+    {
+        return;
+    }
+
+    c->cancelled = true;
+
+    if (c->transport)
+    {
+        if (c->transport->cancel)
+        {
+            c->transport->cancel(c->endpoint, c->tag);
+        }
+        channel_finish(c, -ECANCELED);
+        return;
+    }
+    reactor_cancel(c->reactor, &c->op);
+}
+
+/**
+ * Close connection (including an upgraded binary connection) and forget the
+ * topics declared on it.
+ * @param   c       Channel structure.
+ */
+void channel_close(Channel *c)
+{
+    if (c->fd >= 0)
+    {
+        close(c->fd);
+        c->fd = -1;
+    }
+
+    c->upgraded = false;
+    frame_clear(&c->topics);
+}
+
+/* Internal Functions */
+
+/**
+ * Handle connection: begin writing request.
+ * @param   op      Op structure.
+ */
+static void channel_connected(Op *op)
+{
+    Channel *c = (Channel *)op->arg;
+    MQ_PROBE2(connect_end, c, op->result);
+    if (op->result < 0)
+    {
+        channel_finish(c, op->result);
+        return;
+    }
+
+    MQ_PROBE3(request_write, c, c->request, c->wlen);
+    c->op.type = OP_WRITE;
+    c->op.buf = c->wbuf;
+    c->op.len = c->wlen;
+    c->op.func = channel_written;
+    channel_submit(c);
+}
+
+/**
+ * Handle write: continue writing request or begin reading response.
+ * @param   op      Op structure.
+ */
+static void channel_written(Op *op)
+{
+    Channel *c = (Channel *)op->arg;
+    if (op->result < 0)
+    {
+        channel_finish(c, op->result);
+        return;
+    }
+
+    c->woff += op->result;
+    if (c->woff < c->wlen)
+    {
+        c->op.buf = c->wbuf + c->woff;
+        c->op.len = c->wlen - c->woff;
+        channel_submit(c);
+        return;
+    }
+
+    channel_upload(c);
+}
+
+/**
+ * Send contents of request's file (unless only the upgrade was written), then
+ * begin reading response.
+ * @param   c       Channel structure.
+ */
+static void channel_upload(Channel *c)
+{
+    Request *r = c->binary && !c->upgraded ? NULL : c->request;
+    while (c->upgraded && r && r->next)
+    {
+        r = r->next;
+    }
+
+    if (r && c->fsent < r->flength)
+    {
+        c->op.type = OP_SENDFILE;
+        c->op.file = r->file;
+        c->op.offset = r->foffset + c->fsent;
+        c->op.len = r->flength - c->fsent;
+        c->op.func = channel_uploaded;
+        channel_submit(c);
+        return;
+    }
+
+    c->op.type = OP_READ;
+    c->op.func = channel_read;
+    channel_receive(c);
+}
+
+/**
+ * Handle sendfile: continue sending file or begin reading response.
+ * @param   op      Op structure.
+ */
+static void channel_uploaded(Op *op)
+{
+    Channel *c = (Channel *)op->arg;
+    if (op->result <= 0)
+    {
+        /* File is shorter than the length promised to the server */
+        channel_finish(c, op->result == 0 ? -EIO : op->result);
+        return;
+    }
+
+    c->fsent += op->result;
+    channel_upload(c);
+}
+
+/**
+ * Handle read: append to response and continue until end of stream (or, on
+ * binary channels, until the upgrade or all response frames have arrived).
+ * @param   op      Op structure.
+ */
+static void channel_read(Op *op)
+{
+    Channel *c = (Channel *)op->arg;
+    if (op->result <= 0)
+    {
+        /* Only HTTP responses end with the connection */
+        channel_finish(c, op->result == 0 && c->binary ? -ECONNRESET : op->result);
+        return;
+    }
+
+    c->rlen += op->result;
+    c->rbuf[c->rlen] = 0;
+
+    if (c->binary && !c->upgraded)
+    {
+        channel_handshake(c);
+        return;
+    }
+    if (c->chunk)
+    {
+        channel_stream(c);
+    }
+    if (c->binary && channel_parse(c))
+    {
+        return;
+    }
+    channel_receive(c);
+}
+
+/**
+ * Read more of the response (growing the response buffer if necessary).
+ * @param   c       Channel structure.
+ */
+static void channel_receive(Channel *c)
+{
+    if (!c->rbuf && (c->rbuf = reactor_buffer(c->reactor)))
+    {
+        /* Most responses fit in one registered buffer */
+        c->rcap = REACTOR_BUFFER_SIZE - 1;
+        c->rbuf[0] = 0;
+    }
+
+    if (c->rcap - c->rlen < CHANNEL_READ_SIZE)
+    {
+        size_t capacity = c->rcap ? 2 * c->rcap : 2 * CHANNEL_READ_SIZE;
+        bool buffered = reactor_buffered(c->reactor, c->rbuf);
+        char *rbuf = realloc(buffered ? NULL : c->rbuf, capacity + 1);
+        if (!rbuf)
+        {
+            channel_finish(c, -ENOMEM);
+            return;
+        }
+        if (buffered)
+        {
+            memcpy(rbuf, c->rbuf, c->rlen + 1);
+            reactor_unbuffer(c->reactor, c->rbuf);
+        }
+        c->rbuf = rbuf;
+        c->rcap = capacity;
+        c->rbuf[c->rlen] = 0;
+    }
+
+    c->op.buf = c->rbuf + c->rlen;
+    c->op.len = c->rcap - c->rlen;
+    channel_submit(c);
+}
+
+/**
+ * Pass body of successful response (or message frame) received so far to
+ * chunk callback, and drop it from the response buffer, so the buffer stays
+ * small however large the body is.  A streamed frame is then parsed as if it
+ * were empty, and a streamed HTTP response as if its body were.
+ * @param   c       Channel structure.
+ */
+static void channel_stream(Channel *c)
+{
+    size_t start, length;
+    char *header = c->binary ? NULL : strstr(c->rbuf, "\r\n\r\n");
+    Frame f;
+
+    if (c->binary)
+    {
+        if (c->rlen - c->roff < FRAME_HEADER)
+        {
+            return;
+        }
+        frame_unpack(c->rbuf + c->roff, &f);
+        if (f.opcode != FRAME_MESSAGE || f.status != 200)
+        {
+            return;
+        }
+        start = c->roff + FRAME_HEADER;
+        length = f.length;
+    }
+    else
+    {
+        char *content = strstr(c->rbuf, "\r\nContent-Length:");
+        if (!header || channel_response(c, NULL, NULL) != 200 || !content || content > header)
+        {
+            return;
+        }
+        start = header + 4 - c->rbuf;
+        length = strtoul(content + strlen("\r\nContent-Length:"), NULL, 10);
+    }
+
+    size_t n = c->rlen - start < length - c->streamed ? c->rlen - start : length - c->streamed;
+    if (n == 0)
+    {
+        return;
+    }
+
+    c->streamed += n;
+    c->chunk(c, c->rbuf + start, n, c->streamed == length);
+    memmove(c->rbuf + start, c->rbuf + start + n, c->rlen - start - n);
+    c->rlen -= n;
+    c->rbuf[c->rlen] = 0;
+
+    if (c->binary && c->streamed == length)
+    {
+        f.length = 0;
+        frame_pack(&f, c->rbuf + c->roff);
+        c->streamed = 0;
+    }
+}
+
+/**
+ * Handle upgrade response: switch to binary frames or fall back to HTTP.
+ * @param   c       Channel structure.
+ */
+static void channel_handshake(Channel *c)
+{
+    if (!strstr(c->rbuf, "\r\n\r\n"))
+    {
+        channel_receive(c);
+        return;
+    }
+
+    int code = 0;
+    if (sscanf(c->rbuf, "HTTP/%*s %d", &code) != 1 || code != 101)
+    {
+        /* Server does not speak binary protocol: resend request over HTTP */
+        const struct sockaddr *addr = c->op.addr;
+        socklen_t addrlen = c->op.addrlen;
+        Request *request = c->request;
+
+        c->request = NULL;
+        c->binary = false;
+        channel_close(c);
+        channel_send(c, addr, addrlen, request);
+        return;
+    }
+
+    c->upgraded = true;
+    channel_transmit(c);
+}
+
+/**
+ * Write requests as frames on upgraded binary connection.  Requests that
+ * cannot be framed are moved from the list to the rejected list (and their
+ * partial frames truncated), so each frame sent still answers to one request
+ * of the list; if none are left to send, the exchange fails with -EINVAL.
+ * @param   c       Channel structure.
+ */
+static void channel_transmit(Channel *c)
+{
+    channel_discard(c);
+    c->woff = c->fsent = 0;
+    c->rlen = c->roff = 0;
+    c->pending = 0;
+
+    FILE *ms = channel_render(c);
+    if (!ms)
+    {
+        channel_finish(c, -errno);
+        return;
+    }
+    Request **link = &c->request;
+    while (*link)
+    {
+        Request *r = *link;
+        size_t wlen = c->wlen;
+        int frames = frame_write(&c->topics, r, ms);
+        if (frames < 0)
+        {
+            error("Unable to frame request: %s %s", r->method, r->uri);
+            c->wlen = wlen;
+            *link = r->next;
+            r->next = c->rejected;
+            c->rejected = r;
+            continue;
+        }
+        c->pending += frames;
+        link = &r->next;
+    }
+    bool failed = ferror(ms);
+    fclose(ms);
+
+    if (failed)
+    {
+        channel_finish(c, -ENOMEM);
+        return;
+    }
+    if (!c->pending)
+    {
+        channel_finish(c, c->rejected ? -EINVAL : 0);
+        return;
+    }
+
+    MQ_PROBE3(request_write, c, c->request, c->wlen);
+    c->op.type = OP_WRITE;
+    c->op.fd = c->fd;
+    c->op.buf = c->wbuf;
+    c->op.len = c->wlen;
+    c->op.func = channel_written;
+    channel_submit(c);
+}
+
+/**
+ * Open stream serializing requests into write buffer, which starts as a
+ * registered buffer of the reactor (so io_uring writes it as a fixed buffer)
+ * and moves to the heap only if the requests outgrow it.
+ * @param   c       Channel structure.
+ * @return  Unbuffered write stream (must be closed), or NULL on failure.
+ */
+static FILE *channel_render(Channel *c)
+{
+    cookie_io_functions_t io = {.write = channel_append};
+    FILE *fs = fopencookie(c, "w", io);
+    if (fs)
+    {
+        setvbuf(fs, NULL, _IONBF, 0); // Appended straight to write buffer
+    }
+    return fs;
+}
+
+/**
+ * Append serialized data to write buffer (growing it if necessary).
+ * @param   cookie  Channel structure.
+ * @param   data    Data to append.
+ * @param   size    Length of data.
+ * @return  Number of bytes appended (0 on failure).
+ */
+static ssize_t channel_append(void *cookie, const char *data, size_t size)
+{
+    Channel *c = (Channel *)cookie;
+
+    if (!c->wbuf && (c->wbuf = reactor_buffer(c->reactor)))
+    {
+        c->wcap = REACTOR_BUFFER_SIZE;
+    }
+
+    if (c->wcap - c->wlen < size)
+    {
+        size_t capacity = c->wcap ? 2 * c->wcap : 2 * CHANNEL_READ_SIZE;
+        while (capacity - c->wlen < size)
+        {
+            capacity *= 2;
+        }
+        bool buffered = reactor_buffered(c->reactor, c->wbuf);
+        char *wbuf = realloc(buffered ? NULL : c->wbuf, capacity);
+        if (!wbuf)
+        {
+            return 0;
+        }
+        if (buffered)
+        {
+            memcpy(wbuf, c->wbuf, c->wlen);
+            reactor_unbuffer(c->reactor, c->wbuf);
+        }
+        c->wbuf = wbuf;
+        c->wcap = capacity;
+    }
+
+    memcpy(c->wbuf + c->wlen, data, size);
+    c->wlen += size;
+    return size;
+}
+
+/**
+ * Release write buffer (returning it to the reactor, if registered).
+ * @param   c       Channel structure.
+ */
+static void channel_discard(Channel *c)
+{
+    if (reactor_buffered(c->reactor, c->wbuf))
+    {
+        reactor_unbuffer(c->reactor, c->wbuf);
+    }
+    else
+    {
+        free(c->wbuf);
+    }
+    c->wbuf = NULL;
+    c->wlen = c->wcap = 0;
+}
+
+/**
+ * Consume complete response frames (remembering the last one, and the
+ * highest load hint and longest Retry-After of all of them).
+ * @param   c       Channel structure.
+ * @return  Whether or not the exchange has finished.
+ */
+static bool channel_parse(Channel *c)
+{
+    while (c->rlen - c->roff >= FRAME_HEADER)
+    {
+        Frame f;
+        frame_unpack(c->rbuf + c->roff, &f);
+        if (c->rlen - c->roff - FRAME_HEADER < f.length)
+        {
+            break;
+        }
+
+        c->code = f.status;
+        if (f.opcode == FRAME_RESULT && f.status == 429)
+        {
+            unsigned retry = f.id ? f.id : 1;
+            c->retry = retry > c->retry ? retry : c->retry;
+        }
+        else if (f.opcode == FRAME_RESULT && f.status == 200 && f.id > c->load)
+        {
+            c->load = f.id;
+        }
+        c->boff = c->roff + FRAME_HEADER;
+        c->blen = f.length;
+        c->roff += FRAME_HEADER + f.length;
+
+        if (--c->pending == 0)
+        {
+            channel_finish(c, 0);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Submit channel's next operation (unless the exchange was cancelled).
+ * @param   c       Channel structure.
+ */
+static void channel_submit(Channel *c)
+{
+    if (c->cancelled)
+    {
+        channel_finish(c, -ECANCELED);
+        return;
+    }
+    reactor_submit(c->reactor, &c->op);
+}
+
+/**
+ * Finish exchange and notify owner.
+ * @param   c       Channel structure.
+ * @param   status  Result of exchange.
+ */
+static void channel_finish(Channel *c, int status)
+{
+    if (c->fd >= 0 && (!c->upgraded || status < 0))
+    {
+        channel_close(c);
+    }
+
+    c->status = status;
+    c->busy = false;
+    MQ_PROBE3(response_parse, c, status, c->rlen);
+    c->func(c);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
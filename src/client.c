@@ -1,28 +1,107 @@
 /* client.c: Message Queue Client */
 
+#define _GNU_SOURCE /* asprintf */
+
 #include "mq/client.h"
+#include "mq/inproc.h"
 #include "mq/logging.h"
+#include "mq/mux.h"
+#include "mq/probe.h"
+#include "mq/shm.h"
 #include "mq/socket.h"
 #include "mq/string.h"
 #include "mq/thread.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/random.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
 /* Internal Constants */
 
-#define SENTINEL "SHUTDOWN"
+#define SENTINEL "SHUTDOWN" // Topic subscribed to on start (so the server creates the queue)
+#define IDENTITY 64         // Bytes of producer and sequence headers
 
 /* Internal Prototypes */
 
-void *mq_pusher(void *);
-void *mq_puller(void *);
+static bool mq_split(MessageQueue *mq, const char *hosts, const char *port);
+static Request *mq_message(MessageQueue *mq, const char *topic, const char *body, const MessageHeader *headers, size_t nheaders);
+static char *mq_identity(MessageQueue *mq);
+static bool mq_fits(MessageQueue *mq, Request *r);
+static void mq_kick(MessageQueue *mq);
+static void mq_startup(Task *t);
+static void mq_wakeup(Task *t);
+static void mq_cancel(Task *t);
+static void mq_push(MessageQueue *mq);
+static void mq_pull(MessageQueue *mq);
+static void mq_pushed(Channel *c);
+static void mq_pulled(Channel *c);
+static void mq_refill(Task *t);
+static void mq_retrieved(MessageQueue *mq);
+static size_t mq_room(MessageQueue *mq, size_t *bytes);
+static void mq_batch(MessageQueue *mq, Channel *c);
+static void mq_probed(Channel *c);
+static void mq_records(MessageQueue *mq, Channel *c);
+static void mq_chunk(Channel *c, const char *chunk, size_t length, bool last);
+static void mq_write_chunk(MessageQueue *mq, const char *chunk, size_t length, bool last, void *arg);
+static void mq_connected(MessageQueue *mq);
+static void mq_failed(MessageQueue *mq, const char *action, int status);
+static void mq_backoff(MessageQueue *mq);
+static bool mq_sleep(MessageQueue *mq, uint64_t delay);
+static size_t mq_allowance(MessageQueue *mq);
+static void mq_adapt(MessageQueue *mq, unsigned load, size_t acknowledged);
+static bool mq_expired(MessageQueue *mq);
+static void mq_retry(Op *op);
+static void mq_resume(MessageQueue *mq);
+static void mq_transition(MessageQueue *mq, MQState state);
+static void mq_drop(MessageQueue *mq);
+static void mq_finish(MessageQueue *mq, bool *running);
+static void mq_send(MessageQueue *mq, Channel *c, Request *r);
+static void mq_received(Op *op);
+static Address *mq_address(MessageQueue *mq);
+static void mq_resolve(MessageQueue *mq);
+static void *mq_resolver(void *arg);
+static void mq_resolved(Task *t);
+static void mq_attach(MessageQueue *mq, void *endpoint);
+static const Transport *mq_transport(const char *host);
+
+/* Internal Variables */
+
+static const Transport *Transports[] = {&ShmTransport, &InprocTransport};
 
 /* External Functions */
 
 /**
- * Create Message Queue withs specified name, host, and port.
+ * Create Message Queue withs specified name, host, and port.  Co-located
+ * clients may use a "unix:/path" host to connect over a Unix domain socket,
+ * or a "shm:/path" host to exchange messages through shared memory rings
+ * attached via the broker's shared memory socket (port is ignored for both).
+ * An "inproc://name" host exchanges messages with an in-memory broker of
+ * that name in this process instead (see inproc.c), so the client library
+ * can be tested and benchmarked without a broker process.
+ *
+ * A comma separated list of hosts ("host:port" each, or host alone to use
+ * port) spreads topics over several brokers by consistent hashing of topic
+ * names: publishes and subscriptions of a topic go to its broker, and
+ * messages from every broker are retrieved from one incoming queue.  Adding
+ * a broker to the list moves only the topics it takes over (about 1/n).
+ *
+ * Socket connections negotiate the compact binary framing protocol (unless
+ * MQ_PROTOCOL=http) and fall back to HTTP if the broker does not support it.
+ *
+ * Every published message carries this client's random producer id and its
+ * sequence number, so the server drops duplicates of messages that were
+ * retried after a failure.  Published messages are also traced (see mq_trace)
+ * if MQ_TRACE is monotonic or realtime.
  * @param   name        Name of client's queue.
  * @param   host        Address of server.
  * @param   port        Port of server.
- * @return  Newly allocated Message Queue structure.
+ * @return  Newly allocated Message Queue structure (NULL if name, host list
+ *          or port does not fit in NI_MAXHOST/NI_MAXSERV bytes).
  */
 MessageQueue *mq_create(const char *name, const char *host, const char *port)
 {
@@ -30,16 +109,61 @@ MessageQueue *mq_create(const char *name, const char *host, const char *port)
 
     if (mq)
     {
-        strcpy(mq->name, name);
-        strcpy(mq->host, host);
-        strcpy(mq->port, port);
+        if (snprintf(mq->name, sizeof(mq->name), "%s", name) >= (int)sizeof(mq->name) ||
+            snprintf(mq->host, sizeof(mq->host), "%s", host) >= (int)sizeof(mq->host) ||
+            snprintf(mq->port, sizeof(mq->port), "%s", port ? port : "") >= (int)sizeof(mq->port))
+        {
+            error("Unable to create queue %s: name, host (list) or port too long", name);
+            free(mq);
+            return NULL;
+        }
 
         mutex_init(&mq->lock, NULL);
+        cond_init(&mq->stopped, NULL);
 
         mq->shutdown = false;
+        mq->startup.func = mq_startup;
+        mq->startup.arg = mq;
+        mq->wakeup.func = mq_wakeup;
+        mq->wakeup.arg = mq;
+        mq->cancel.func = mq_cancel;
+        mq->cancel.arg = mq;
+        mq->refill.func = mq_refill;
+        mq->refill.arg = mq;
+        mq->resolved.func = mq_resolved;
+        mq->resolved.arg = mq;
+        mq->timer_fd = -1;
+        mq->prefetch = MQ_PREFETCH;
+        mq->prefetch_bytes = MQ_PREFETCH_BYTES;
+
+        if (getrandom(&mq->producer, sizeof(mq->producer), GRND_NONBLOCK) != sizeof(mq->producer))
+        {
+            mq->producer = ((uint64_t)getpid() << 32) ^ time(NULL) ^ (uintptr_t)mq;
+        }
 
         mq->outgoing = queue_create();
         mq->incoming = queue_create();
+        if (mq->outgoing && mq->incoming)
+        {
+            mq->outgoing->stage = TRACE_OUTGOING;
+            mq->incoming->stage = TRACE_INCOMING;
+        }
+
+        const char *trace = getenv("MQ_TRACE");
+        if (trace && streq(trace, "monotonic"))
+        {
+            mq->trace = TRACE_MONOTONIC;
+        }
+        else if (trace && streq(trace, "realtime"))
+        {
+            mq->trace = TRACE_REALTIME;
+        }
+
+        if (strchr(host, ',') && !mq_split(mq, host, port))
+        {
+            mq_delete(mq);
+            return NULL;
+        }
     }
 
     return mq;
@@ -53,24 +177,228 @@ void mq_delete(MessageQueue *mq)
 {
     if (mq)
     {
+        for (size_t i = 0; i < mq->nshards; i++)
+        {
+            mq->shards[i]->incoming = NULL; // Shared
+            mq_delete(mq->shards[i]);
+        }
+        free(mq->shards);
+        hashring_delete(mq->ring);
+
+        mux_leave(mq);
         queue_delete(mq->incoming);
         queue_delete(mq->outgoing);
         free(mq);
     }
 }
 
+/**
+ * Return client of broker that topic belongs to.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic name.
+ * @return  Shard of topic (or mq itself, if it connects to one broker).
+ */
+MessageQueue *mq_shard(MessageQueue *mq, const char *topic)
+{
+    return mq->nshards ? mq->shards[hashring_lookup(mq->ring, topic)] : mq;
+}
+
 /**
  * Publish one message to topic (by placing new Request in outgoing queue).
+ * Over "shm:/path" hosts, a message must fit in one record of the shared
+ * memory ring (SHM_RECORD_MAX bytes, with its request line and headers).
  * @param   mq      Message Queue structure.
  * @param   topic   Topic to publish to.
  * @param   body    Message body to publish.
+ * @return  Whether or not message was queued.
+ */
+bool mq_publish(MessageQueue *mq, const char *topic, const char *body)
+{
+    mq = mq_shard(mq, topic);
+
+    Request *r = mq_message(mq, topic, body, NULL, 0);
+    if (!r || !mq_fits(mq, r))
+    {
+        request_delete(r);
+        return false;
+    }
+    queue_push(mq->outgoing, r);
+    mq_kick(mq);
+    return true;
+}
+
+/**
+ * Publish one message with headers to topic.  Subscriptions with a selector
+ * (see mq_subscribe_selector) only receive messages whose headers match it.
+ * The server also expires messages after MQ_HEADER_TTL milliseconds, and
+ * defers their delivery by MQ_HEADER_DELAY milliseconds.
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic to publish to.
+ * @param   body        Message body to publish.
+ * @param   headers     Message headers.
+ * @param   nheaders    Number of message headers.
+ * @return  Whether or not message was queued.
+ */
+bool mq_publish_headers(MessageQueue *mq, const char *topic, const char *body, const MessageHeader *headers, size_t nheaders)
+{
+    mq = mq_shard(mq, topic);
+
+    Request *r = mq_message(mq, topic, body, headers, nheaders);
+    if (!r || !mq_fits(mq, r))
+    {
+        request_delete(r);
+        return false;
+    }
+    queue_push(mq->outgoing, r);
+    mq_kick(mq);
+    return true;
+}
+
+/**
+ * Publish length bytes of file (from its current offset, which is advanced as
+ * if they were read) to topic, without reading them into memory: the pusher
+ * sends them straight from the file to the socket with sendfile, so memory
+ * use does not grow with the size of the message.  The descriptor is
+ * duplicated, so it may be closed once this returns.  Over "shm:/path" hosts
+ * there is no socket: the file is copied into one record of the shared memory
+ * ring, so messages larger than a record (SHM_RECORD_MAX bytes, with request
+ * line and headers) are refused rather than streamed.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   fd      File to publish from (must support sendfile, e.g. a regular file).
+ * @param   length  Number of bytes to publish.
+ * @return  Whether or not message was queued.
+ */
+bool mq_publish_fd(MessageQueue *mq, const char *topic, int fd, size_t length)
+{
+    mq = mq_shard(mq, topic);
+
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    int file = offset >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+    Request *r = file >= 0 ? mq_message(mq, topic, "", NULL, 0) : NULL;
+    if (!r)
+    {
+        error("Unable to publish from file descriptor %d: %s", fd, strerror(errno));
+        if (file >= 0)
+        {
+            close(file);
+        }
+        return false;
+    }
+
+    if (length)
+    {
+        r->file = file;
+        r->foffset = offset;
+        r->flength = length;
+    }
+    else
+    {
+        close(file);
+    }
+    if (!mq_fits(mq, r))
+    {
+        request_delete(r); // Closes duplicated descriptor
+        return false;
+    }
+    lseek(fd, length, SEEK_CUR);
+    queue_push(mq->outgoing, r);
+    mq_kick(mq);
+    return true;
+}
+
+/**
+ * Open topic for repeated publishing: the handle holds the request line (and
+ * on binary connections, the topic id) rendered once, so publishing through
+ * it neither formats nor copies the topic per message.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @return  Newly allocated MQTopic structure (must be closed), or NULL on failure.
  */
-void mq_publish(MessageQueue *mq, const char *topic, const char *body)
+MQTopic *mq_topic_open(MessageQueue *mq, const char *topic)
 {
+    mq = mq_shard(mq, topic);
+
     char uri[BUFSIZ];
-    sprintf(uri, "/topic/%s", topic);
-    Request *r = request_create("PUT", uri, body);
+    snprintf(uri, sizeof(uri), "/topic/%s", topic);
+
+    MQTopic *t = calloc(1, sizeof(MQTopic));
+    if (t && (!(t->name = strdup(topic)) || !(t->line = request_line_create("PUT", uri))))
+    {
+        free(t->name);
+        free(t);
+        return NULL;
+    }
+
+    if (t)
+    {
+        t->mq = mq;
+    }
+    return t;
+}
+
+/**
+ * Publish one message to opened topic.
+ * @param   t       MQTopic structure.
+ * @param   body    Message body to publish.
+ * @param   length  Length of message body.
+ * @return  Whether or not message was queued.
+ */
+bool mq_publish_handle(MQTopic *t, const char *body, size_t length)
+{
+    MessageQueue *mq = t->mq;
+    Request *r = request_from_line(t->line, body, length);
+    if (!r || !(r->headers = mq_identity(mq)))
+    {
+        request_delete(r);
+        return false;
+    }
+
+    TraceClock clock = __atomic_load_n(&mq->trace, __ATOMIC_RELAXED);
+    if (clock != TRACE_OFF)
+    {
+        uint64_t sequence = __atomic_add_fetch(&mq->sequence, 1, __ATOMIC_RELAXED);
+        char *stamped = trace_stamp(clock, sequence, t->name, r->body);
+        if (stamped)
+        {
+            free(r->body);
+            r->body = stamped;
+            /* Handles may be shared by publishing threads: trace_topic
+             * returns the same histograms for a name, so racing threads
+             * store the same pointer */
+            TraceTopic *trace = __atomic_load_n(&t->trace, __ATOMIC_ACQUIRE);
+            if (!trace)
+            {
+                trace = trace_topic(t->name);
+                __atomic_store_n(&t->trace, trace, __ATOMIC_RELEASE);
+            }
+            r->trace = trace;
+            r->published = trace_now(TRACE_MONOTONIC);
+        }
+    }
+
+    if (!mq_fits(mq, r))
+    {
+        request_delete(r);
+        return false;
+    }
     queue_push(mq->outgoing, r);
+    mq_kick(mq);
+    return true;
+}
+
+/**
+ * Close opened topic (messages already published through it are still sent).
+ * @param   t       MQTopic structure.
+ */
+void mq_topic_close(MQTopic *t)
+{
+    if (t)
+    {
+        request_line_release(t->line);
+        free(t->name);
+        free(t);
+    }
 }
 
 /**
@@ -82,8 +410,19 @@ char *mq_retrieve(MessageQueue *mq)
 {
 
     Request *r = queue_pop(mq->incoming);
+    mq_retrieved(mq);
+    MQ_PROBE3(retrieve, mq, r, r->message ? r->message->length : 0);
+
+    if (r->trace)
+    {
+        trace_record(r->trace, TRACE_TOTAL, trace_now(TRACE_MONOTONIC) - r->published);
+    }
+    if (r->offset)
+    {
+        __atomic_store_n(&mq->position, r->offset, __ATOMIC_RELAXED);
+    }
 
-    if (r->body != NULL && !streq(r->body, SENTINEL))
+    if (r->body)
     {
         char *body = strdup(r->body);
         request_delete(r);
@@ -96,6 +435,96 @@ char *mq_retrieve(MessageQueue *mq)
     }
 }
 
+/**
+ * Retrieve one message as a reference counted buffer (shared with the other
+ * local subscribers it was delivered to, if any).
+ * @param   mq      Message Queue structure.
+ * @return  Message structure (must be released), or NULL on shutdown.
+ */
+Message *mq_retrieve_message(MessageQueue *mq)
+{
+    Request *r = queue_pop(mq->incoming);
+    Message *m = NULL;
+    mq_retrieved(mq);
+    MQ_PROBE3(retrieve, mq, r, r->message ? r->message->length : 0);
+
+    if (r->trace)
+    {
+        trace_record(r->trace, TRACE_TOTAL, trace_now(TRACE_MONOTONIC) - r->published);
+    }
+    if (r->offset)
+    {
+        __atomic_store_n(&mq->position, r->offset, __ATOMIC_RELAXED);
+    }
+
+    if (r->body)
+    {
+        m = r->message ? message_retain(r->message) : message_create(r->body, strlen(r->body));
+    }
+
+    request_delete(r);
+    return m;
+}
+
+/**
+ * Receive messages in chunks (must be called before mq_start): instead of
+ * being buffered whole and placed in the incoming queue, each message the
+ * puller receives is passed to func (on a reactor thread) as it arrives, so
+ * memory use does not grow with the size of the message.  The last chunk of
+ * each message is flagged; if the connection fails partway through a
+ * message, func is called once more with a NULL chunk.  Retrievers are still
+ * woken by mq_stop.  Reads of topic logs (see mq_read_from) are not streamed.
+ * @param   mq      Message Queue structure.
+ * @param   func    Callback receiving chunks (NULL to retrieve messages whole).
+ * @param   arg     Argument for callback.
+ */
+void mq_stream(MessageQueue *mq, MQStreamFunc func, void *arg)
+{
+    for (size_t i = 0; i < mq->nshards; i++)
+    {
+        mq_stream(mq->shards[i], func, arg);
+    }
+    mq->on_chunk = func;
+    mq->chunk_arg = arg;
+}
+
+/**
+ * Receive messages into file (must be called before mq_start): the body of
+ * each message is appended to fd as it arrives (see mq_stream).
+ * @param   mq      Message Queue structure.
+ * @param   fd      File to write messages to.
+ */
+void mq_stream_fd(MessageQueue *mq, int fd)
+{
+    mq_stream(mq, mq_write_chunk, (void *)(intptr_t)fd);
+}
+
+/**
+ * Set prefetch window (must be called before mq_start): the puller retrieves
+ * messages from the server in batches, keeping up to messages of them (and
+ * about bytes of them, if nonzero) in the incoming queue ahead of retrievers,
+ * so a consumer catching up on a backlog needs a round trip per batch rather
+ * than per message.  Once the window is full, the puller waits until
+ * retrievers drain it below half.  Prefetched messages are no longer in the
+ * server's queue (so other consumers of it cannot retrieve them), and are
+ * dropped if the client stops before retrieving them.  A window of 1 message
+ * retrieves messages one at a time.  The window defaults to MQ_PREFETCH
+ * messages and MQ_PREFETCH_BYTES bytes; messages streamed (see mq_stream) or
+ * served to a shared subscription are always retrieved one at a time.
+ * @param   mq          Message Queue structure.
+ * @param   messages    Messages kept in incoming queue.
+ * @param   bytes       Bytes of messages kept in incoming queue (0 for no limit).
+ */
+void mq_prefetch(MessageQueue *mq, size_t messages, size_t bytes)
+{
+    for (size_t i = 0; i < mq->nshards; i++)
+    {
+        mq_prefetch(mq->shards[i], messages, bytes);
+    }
+    mq->prefetch = messages ? messages : 1;
+    mq->prefetch_bytes = bytes;
+}
+
 /**
  * Subscribe to specified topic.
  * @param   mq      Message Queue structure.
@@ -103,10 +532,13 @@ char *mq_retrieve(MessageQueue *mq)
  **/
 void mq_subscribe(MessageQueue *mq, const char *topic)
 {
+    mq = mq_shard(mq, topic);
+
     char uri[BUFSIZ];
     sprintf(uri, "/subscription/%s/%s", mq->name, topic);
 
     queue_push(mq->outgoing, request_create("PUT", uri, NULL));
+    mq_kick(mq);
 }
 
 /**
@@ -116,165 +548,1703 @@ void mq_subscribe(MessageQueue *mq, const char *topic)
  **/
 void mq_unsubscribe(MessageQueue *mq, const char *topic)
 {
+    mq = mq_shard(mq, topic);
+
     char uri[BUFSIZ];
     sprintf(uri, "/subscription/%s/%s", mq->name, topic);
 
     queue_push(mq->outgoing, request_create("DELETE", uri, NULL));
+    mq_kick(mq);
 }
 
 /**
- * Start running the background threads:
- *  1. First thread should continuously send requests from outgoing queue.
- *  2. Second thread should continuously receive reqeusts to incoming queue.
- * @param   mq      Message Queue structure.
- */
-void mq_start(MessageQueue *mq)
+ * Subscribe to specified topic, receiving only messages whose headers match
+ * selector (evaluated by the server when the message is published), e.g.:
+ *
+ *  region = 'us' and (priority >= 5 or exists urgent)
+ *
+ * Selectors compare headers with quoted strings or numbers (=, !=, <, <=, >,
+ * >=, in (...)), test for headers with exists, and combine with and, or, not
+ * and parentheses.  Subscribing again replaces the selector.
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic string to subscribe to.
+ * @param   selector    Selector expression (NULL to receive every message).
+ **/
+void mq_subscribe_selector(MessageQueue *mq, const char *topic, const char *selector)
 {
-    thread_create(&mq->pusher, NULL, mq_pusher, mq);
-    thread_create(&mq->puller, NULL, mq_puller, mq);
+    mq = mq_shard(mq, topic);
 
-    mq_subscribe(mq, SENTINEL);
+    char uri[BUFSIZ];
+    sprintf(uri, "/subscription/%s/%s", mq->name, topic);
+
+    queue_push(mq->outgoing, request_create("PUT", uri, selector));
+    mq_kick(mq);
 }
 
 /**
- * Stop the message queue client by setting shutdown attribute and sending
- * sentinel messages
+ * Subscribe to specified topic through the process-wide multiplexer: all
+ * local message queues that share a topic on the same server are served by
+ * one network subscription, and each message is delivered to them as one
+ * reference counted buffer.
  * @param   mq      Message Queue structure.
- */
-void mq_stop(MessageQueue *mq)
+ * @param   topic   Topic string to subscribe to.
+ **/
+void mq_subscribe_shared(MessageQueue *mq, const char *topic)
 {
-    // Send sentinel, puller needs something to pull
-    mq_publish(mq, SENTINEL, SENTINEL);
-
-    mutex_lock(&mq->lock);
-    mq->shutdown = true;
-    mutex_unlock(&mq->lock);
+    mq = mq_shard(mq, topic);
 
-    thread_join(mq->pusher, NULL);
-    thread_join(mq->puller, NULL);
+    mux_subscribe(mq, topic);
 }
 
 /**
- * Returns whether or not the message queue should be shutdown.
+ * Unsubscribe from topic shared through the process-wide multiplexer.
  * @param   mq      Message Queue structure.
- */
-bool mq_shutdown(MessageQueue *mq)
+ * @param   topic   Topic string to unsubscribe from.
+ **/
+void mq_unsubscribe_shared(MessageQueue *mq, const char *topic)
 {
-    mutex_lock(&mq->lock);
-    bool status = mq->shutdown;
-    mutex_unlock(&mq->lock);
+    mq = mq_shard(mq, topic);
 
-    return status;
+    mux_unsubscribe(mq, topic);
 }
 
-/* Internal Functions */
-
 /**
- * Pusher thread takes messages from outgoing queue and sends them to server.
-*  1. First thread should continuously send requests from outgoing queue.
- * @param   arg     Message Queue structure.
- **/
-void *mq_pusher(void *arg)
+ * Read messages from topic's log (retained by a server started with
+ * --retain) instead of this client's queue (must be called before mq_start).
+ * Every message is stored once in the log however many clients read it, and
+ * each client reads from its own offset: 0 is the first message ever
+ * published (reads before the oldest retained message start at the oldest
+ * one), and MQ_OFFSET_LATEST is the next message published.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic whose log to read.
+ * @param   offset  Offset of first message to read.
+ */
+void mq_read_from(MessageQueue *mq, const char *topic, int64_t offset)
 {
-    MessageQueue *mq = (MessageQueue *)arg;
-    Request *r;
-    FILE *fs;
-    char buf[BUFSIZ];
+    if (mq->nshards)
+    {
+        mq->reader = mq_shard(mq, topic);
+        mq_read_from(mq->reader, topic, offset);
+    }
+    snprintf(mq->topic, sizeof(mq->topic), "%s", topic);
+    mq->offset = offset;
+    mq->position = offset > 0 ? offset : 0;
+}
 
-    while (!mq_shutdown(mq))
+/**
+ * Move offset of topic log read (see mq_read_from), to replay or skip
+ * messages.  Messages received from the old offset but not yet retrieved are
+ * dropped, and the next read (within MQ_READ_WAIT milliseconds) starts at the
+ * new offset.
+ * @param   mq      Message Queue structure.
+ * @param   offset  Offset of next message to read.
+ */
+void mq_seek(MessageQueue *mq, int64_t offset)
+{
+    if (mq->reader)
     {
+        mq_seek(mq->reader, offset);
+    }
 
-        fs = socket_connect(mq->host, mq->port);
+    mutex_lock(&mq->lock);
+    mq->seek = offset;
+    mq->seeking = true;
 
-        if (!fs)
+    Request *r;
+    Request *sentinels = NULL;
+    while ((r = queue_trypop(mq->incoming)))
+    {
+        if (r->body)
         {
-            continue;
+            request_delete(r);
         }
         else
         {
-            r = queue_pop(mq->outgoing);
-            request_write(r, fs);
-            // READ RESPONSE UNTIL EOF
-            while (fgets(buf, BUFSIZ, fs))
-            {
-                buf[strlen(buf) - 1] = '\0';
-            }
-
-            request_delete(r);
-            fclose(fs);
+            r->next = sentinels;
+            sentinels = r;
         }
     }
+    while ((r = sentinels))
+    {
+        sentinels = r->next;
+        r->next = NULL;
+        queue_push(mq->incoming, r);
+    }
+    mutex_unlock(&mq->lock);
+    mq_retrieved(mq);
 
-    return NULL;
+    __atomic_store_n(&mq->position, offset > 0 ? offset : 0, __ATOMIC_RELAXED);
 }
 
 /**
- * Puller thread requests new messages from server and then puts them in
- * incoming queue.
- *  2. Second thread should continuously receive reqeusts to incoming queue.
- * @param   arg     Message Queue structure.
- **/
-void *mq_puller(void *arg)
+ * Return offset after the last message retrieved from a topic log (where a
+ * new reader would resume to read the following messages).
+ * @param   mq      Message Queue structure.
+ * @return  Offset of next message to retrieve.
+ */
+uint64_t mq_offset(MessageQueue *mq)
 {
-    MessageQueue *mq = (MessageQueue *)arg;
-    FILE *fs;
+    return __atomic_load_n(&mq->position, __ATOMIC_RELAXED);
+}
 
-    while (!mq_shutdown(mq))
+/**
+ * Trace messages published from now on: each carries a publish timestamp and
+ * sequence number embedded in its body, which receiving clients strip while
+ * recording how long it spent in each stage (see TraceStage) in per-topic
+ * latency histograms (see trace_export).  Monotonic timestamps are only
+ * comparable between clients on the same host.
+ * @param   mq      Message Queue structure.
+ * @param   clock   Clock of publish timestamps (TRACE_OFF to stop tracing).
+ */
+void mq_trace(MessageQueue *mq, TraceClock clock)
+{
+    for (size_t i = 0; i < mq->nshards; i++)
     {
-        // make new request
-        char uri[BUFSIZ];
-        sprintf(uri, "/queue/%s", mq->name);
-        Request *r = request_create("GET", uri, NULL);
+        mq_trace(mq->shards[i], clock);
+    }
+    __atomic_store_n(&mq->trace, clock, __ATOMIC_RELAXED);
+}
 
-        // connect to server
-        fs = socket_connect(mq->host, mq->port);
+/**
+ * Set callback run (on a reactor thread) whenever the connection state
+ * changes: failed exchanges are retried after a jittered exponential backoff
+ * (MQ_BACKOFF_MIN to MQ_BACKOFF_MAX milliseconds), and after MQ_BREAKER
+ * consecutive failures the circuit breaker opens, parking the pusher and
+ * puller until a probe of the server succeeds.  The connections of a client
+ * of several brokers change state separately (and the callback is passed the
+ * shard whose connection changed).
+ * @param   mq      Message Queue structure.
+ * @param   func    Callback (NULL for none).
+ * @param   arg     Argument for callback.
+ */
+void mq_on_state(MessageQueue *mq, MQStateFunc func, void *arg)
+{
+    for (size_t i = 0; i < mq->nshards; i++)
+    {
+        mq_on_state(mq->shards[i], func, arg);
+    }
+    mq->on_state = func;
+    mq->state_arg = arg;
+}
 
-        if (fs)
+/**
+ * Return current connection state (of a client of several brokers, the
+ * least connected state of any of its connections).
+ * @param   mq      Message Queue structure.
+ * @return  Connection state.
+ */
+MQState mq_state(MessageQueue *mq)
+{
+    if (mq->nshards)
+    {
+        MQState state = MQ_CONNECTED;
+        for (size_t i = 0; i < mq->nshards; i++)
         {
-            // write request
-            request_write(r, fs);
-            char buf[BUFSIZ];
-
-            // // read response
-            if (fgets(buf, BUFSIZ, fs) && strstr(buf, "200 OK"))
-            {
-                size_t length = 0;
-                while (fgets(buf, BUFSIZ, fs) && !streq(buf, "\r\n"))
-                {
-                    sscanf(buf, "Content-Length: %ld", &length);
-                }
-
-                if (length > 0)
-                {
-                    r->body = calloc((length + 1), sizeof(char));
-                    fread(r->body, length, 1, fs);
-                }
-
-                if (r->body)
-                {
-                    queue_push(mq->incoming, r);
-                }
-                else
-                {
-                    request_delete(r);
-                }
-            }
-            else
+            MQState shard = mq_state(mq->shards[i]);
+            if (shard != MQ_CONNECTED && (state == MQ_CONNECTED || shard > state))
             {
-                request_delete(r);
-                while (fgets(buf, BUFSIZ, fs))
-                {
-                    continue;
-                }
+                state = shard;
             }
-            fclose(fs);
         }
-        else
+        return state;
+    }
+    return __atomic_load_n(&mq->state, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return publish rate the pusher currently allows.  The server reports how
+ * loaded the queues it publishes to are: once a load hint reaches
+ * MQ_LOAD_HIGH (or the server refuses requests with 429 because a queue is
+ * full), the allowed rate is halved, and otherwise it grows by MQ_RATE_STEP,
+ * at most once every MQ_RATE_WINDOW milliseconds (AIMD).  The pusher is
+ * unthrottled until the server is first loaded, and again once it sends less
+ * than half of the allowed rate.  Each broker of a client of several brokers
+ * throttles its shard separately.
+ * @param   mq      Message Queue structure.
+ * @return  Allowed messages per second (or 0 if unthrottled; summed over
+ *          throttled shards).
+ */
+double mq_rate(MessageQueue *mq)
+{
+    double rate = 0;
+    for (size_t i = 0; i < mq->nshards; i++)
+    {
+        rate += mq_rate(mq->shards[i]);
+    }
+    if (!mq->nshards)
+    {
+        __atomic_load(&mq->rate, &rate, __ATOMIC_RELAXED);
+    }
+    return rate;
+}
+
+/**
+ * Start serving the message queue from the shared I/O reactor:
+ *  1. Pusher channel continuously sends requests from outgoing queue.
+ *  2. Puller channel continuously receives messages to incoming queue.
+ * @param   mq      Message Queue structure.
+ */
+void mq_start(MessageQueue *mq)
+{
+    if (mq->nshards)
+    {
+        for (size_t i = 0; i < mq->nshards; i++)
         {
-            request_delete(r);
+            mq_start(mq->shards[i]);
         }
+        return;
     }
 
+    Reactor *reactor = reactor_acquire();
+    if (!reactor)
+    {
+        error("Unable to acquire reactor");
+        return;
+    }
+
+    /* If the broker is not attachable yet, exchanges fail (and back off)
+     * until mq_resolve attaches to it */
+    mq->transport = mq_transport(mq->host);
+    if (mq->transport)
+    {
+        mq->endpoint = mq->transport->attach(mq->host + strlen(mq->transport->prefix));
+        mq->waiting = mq->endpoint != NULL;
+    }
+    else
+    {
+        int status = 0;
+        if (!(mq->naddrs = socket_resolve(mq->host, mq->port, mq->addrs, MQ_ADDRESSES, &status)))
+        {
+            error("Unable to resolve %s:%s: %s", mq->host, mq->port, gai_strerror(status));
+        }
+    }
+    mq->addr = 0;
+    mq->pushing = true;
+    mq->pulling = true;
+    mq->state = MQ_CONNECTING;
+    mq->failures = 0;
+    mq->seed = time(NULL) ^ getpid() ^ (uintptr_t)mq;
+
+    mq_subscribe(mq, SENTINEL);
+
+    mutex_lock(&mq->lock);
+    mq->reactor = reactor;
+    mutex_unlock(&mq->lock);
+
+    reactor_post(reactor, &mq->startup);
+}
+
+/**
+ * Stop the message queue client, waiting up to MQ_DRAIN milliseconds for
+ * outgoing requests to be sent (see mq_stop_timeout).
+ * @param   mq      Message Queue structure.
+ */
+void mq_stop(MessageQueue *mq)
+{
+    mq_stop_timeout(mq, MQ_DRAIN);
+}
+
+/**
+ * Stop the message queue client by setting shutdown attribute and cancelling
+ * the puller's pending receive (which wakes retrievers, without a round trip
+ * through the server).  The pusher keeps sending outgoing requests until none
+ * are left or the timeout expires, at which point its exchange (even a
+ * connect that would block) is cancelled and the rest are dropped.
+ * @param   mq      Message Queue structure.
+ * @param   timeout Milliseconds to wait for outgoing requests to be sent.
+ * @return  Whether or not every outgoing request was sent.
+ */
+bool mq_stop_timeout(MessageQueue *mq, unsigned int timeout)
+{
+    if (mq->nshards)
+    {
+        mutex_lock(&mq->lock);
+        mq->shutdown = true;
+        mutex_unlock(&mq->lock);
+
+        /* Shards share the timeout */
+        uint64_t deadline = trace_now(TRACE_MONOTONIC) + timeout * 1000000ULL;
+        bool sent = true;
+        for (size_t i = 0; i < mq->nshards; i++)
+        {
+            uint64_t now = trace_now(TRACE_MONOTONIC);
+            sent &= mq_stop_timeout(mq->shards[i], now < deadline ? (deadline - now) / 1000000 : 0);
+        }
+        return sent;
+    }
+
+    mux_leave(mq);
+
+    if (!mq->reactor)
+    {
+        return true;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000 + (deadline.tv_nsec + (timeout % 1000) * 1000000L) / 1000000000L;
+    deadline.tv_nsec = (deadline.tv_nsec + (timeout % 1000) * 1000000L) % 1000000000L;
+
+    mutex_lock(&mq->lock);
+    mq->shutdown = true;
+    reactor_post(mq->reactor, &mq->cancel);
+    mutex_unlock(&mq->lock);
+    mq_kick(mq);
+
+    mutex_lock(&mq->lock);
+    while (mq->pushing && cond_timedwait(&mq->stopped, &mq->lock, &deadline) != ETIMEDOUT)
+        ;
+    if (mq->pushing)
+    {
+        mq->expired = true;
+        reactor_post(mq->reactor, &mq->cancel);
+    }
+    while (mq->pushing || mq->pulling || mq->waiting || mq->sleeping || mq->probing || mq->resolving)
+    {
+        cond_wait(&mq->stopped, &mq->lock);
+    }
+    Reactor *reactor = mq->reactor;
+    mq->reactor = NULL;
+    bool sent = !mq->expired && !mq->dropped;
+    mutex_unlock(&mq->lock);
+
+    reactor_release(reactor);
+    channel_close(&mq->pusher);
+    channel_close(&mq->puller);
+    channel_close(&mq->probe);
+    if (mq->timer_fd >= 0)
+    {
+        close(mq->timer_fd);
+        mq->timer_fd = -1;
+    }
+    if (mq->endpoint)
+    {
+        mq->transport->detach(mq->endpoint);
+    }
+    mq->transport = NULL;
+    mq->endpoint = NULL;
+    return sent;
+}
+
+/**
+ * Returns whether or not the message queue should be shutdown.
+ * @param   mq      Message Queue structure.
+ */
+bool mq_shutdown(MessageQueue *mq)
+{
+    mutex_lock(&mq->lock);
+    bool status = mq->shutdown;
+    mutex_unlock(&mq->lock);
+
+    return status;
+}
+
+/* Internal Functions */
+
+/**
+ * Create client of each broker in comma separated list of hosts (see
+ * mq_create), sharing incoming queue of mq.
+ * @param   mq      Message Queue structure.
+ * @param   hosts   List of hosts ("host:port", or host to use port).
+ * @param   port    Port of hosts without one.
+ * @return  Whether or not every shard was created.
+ */
+static bool mq_split(MessageQueue *mq, const char *hosts, const char *port)
+{
+    size_t count = 1;
+    for (const char *c = hosts; *c; c++)
+    {
+        count += *c == ',';
+    }
+
+    char *list = strdup(hosts);
+    char **names = calloc(count, sizeof(char *));
+    if (!list || !names || !(mq->shards = calloc(count, sizeof(MessageQueue *))))
+    {
+        free(list);
+        free(names);
+        return false;
+    }
+
+    char *saveptr = NULL;
+    for (char *host = strtok_r(list, ",", &saveptr); host; host = strtok_r(NULL, ",", &saveptr))
+    {
+        /* Ports of Unix domain socket and record transport paths are ignored */
+        const char *shard_port = port;
+        char *colon = strrchr(host, ':');
+        if (colon && strncmp(host, SOCKET_UNIX, strlen(SOCKET_UNIX)) && !mq_transport(host))
+        {
+            *colon = 0;
+            shard_port = colon + 1;
+        }
+
+        MessageQueue *shard = mq_create(mq->name, host, shard_port);
+        if (!shard || asprintf(&names[mq->nshards], "%s:%s", shard->host, shard->port) < 0)
+        {
+            names[mq->nshards] = NULL;
+            mq_delete(shard);
+            break;
+        }
+        queue_delete(shard->incoming);
+        shard->incoming = mq->incoming;
+        mq->shards[mq->nshards++] = shard;
+    }
+
+    if (mq->nshards == count)
+    {
+        mq->ring = hashring_create((const char *const *)names, count);
+    }
+
+    for (size_t i = 0; i < mq->nshards; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    free(list);
+    return mq->ring != NULL;
+}
+
+/**
+ * Create publish Request with headers, followed by producer id and sequence
+ * number (embedding publish timestamp, if tracing).
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic to publish to.
+ * @param   body        Message body to publish.
+ * @param   headers     Message headers.
+ * @param   nheaders    Number of message headers.
+ * @return  Newly allocated Request structure.
+ */
+static Request *mq_message(MessageQueue *mq, const char *topic, const char *body, const MessageHeader *headers, size_t nheaders)
+{
+    char uri[BUFSIZ];
+    sprintf(uri, "/topic/%s", topic);
+
+    TraceClock clock = __atomic_load_n(&mq->trace, __ATOMIC_RELAXED);
+    char *stamped = NULL;
+    if (clock != TRACE_OFF)
+    {
+        uint64_t sequence = __atomic_add_fetch(&mq->sequence, 1, __ATOMIC_RELAXED);
+        stamped = trace_stamp(clock, sequence, topic, body);
+    }
+
+    Request *r = request_create("PUT", uri, stamped ? NULL : body);
+    if (r && stamped)
+    {
+        r->body = stamped;
+        r->trace = trace_topic(topic);
+        r->published = trace_now(TRACE_MONOTONIC);
+    }
+    else
+    {
+        free(stamped);
+    }
+
+    size_t length = 0;
+    FILE *ms = r ? open_memstream(&r->headers, &length) : NULL;
+    if (ms)
+    {
+        for (size_t i = 0; i < nheaders; i++)
+        {
+            for (const char *c = headers[i].name; *c; c++)
+            {
+                fputc(tolower(*c), ms);
+            }
+            fprintf(ms, "=%s\n", headers[i].value);
+        }
+        fprintf(ms, MQ_HEADER_PRODUCER "=%016" PRIx64 "\n" MQ_HEADER_SEQUENCE "=%" PRIu64 "\n",
+                mq->producer, __atomic_add_fetch(&mq->published, 1, __ATOMIC_RELAXED));
+        fclose(ms);
+    }
+    return r;
+}
+
+/**
+ * Render producer id and next sequence number as message headers.
+ * @param   mq      Message Queue structure.
+ * @return  Newly allocated "name=value\n" lines (or NULL on failure).
+ */
+static char *mq_identity(MessageQueue *mq)
+{
+    char *headers = malloc(IDENTITY);
+    if (headers)
+    {
+        snprintf(headers, IDENTITY, MQ_HEADER_PRODUCER "=%016" PRIx64 "\n" MQ_HEADER_SEQUENCE "=%" PRIu64 "\n",
+                 mq->producer, __atomic_add_fetch(&mq->published, 1, __ATOMIC_RELAXED));
+    }
+    return headers;
+}
+
+/**
+ * Check that request fits in one record of host's transport (if it has a
+ * limit): a larger record could never be sent, so it is refused when
+ * published rather than retried forever.
+ * @param   mq      Message Queue structure.
+ * @param   r       Request to publish.
+ * @return  Whether or not request can be sent.
+ */
+static bool mq_fits(MessageQueue *mq, Request *r)
+{
+    const Transport *transport = mq_transport(mq->host);
+    if (!transport || !transport->record_max)
+    {
+        return true;
+    }
+
+    size_t length = request_length(r);
+    if (length > transport->record_max)
+    {
+        error("Unable to publish %s: request of %zu bytes exceeds records of %zu bytes to %s",
+              r->uri, length, transport->record_max, mq->host);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Notify pusher that outgoing queue has requests (if started).
+ * @param   mq      Message Queue structure.
+ */
+static void mq_kick(MessageQueue *mq)
+{
+    mutex_lock(&mq->lock);
+    if (mq->reactor)
+    {
+        reactor_post(mq->reactor, &mq->wakeup);
+    }
+    mutex_unlock(&mq->lock);
+}
+
+/**
+ * Start pusher and puller channels (runs on reactor thread).
+ * @param   t       Startup task.
+ */
+static void mq_startup(Task *t)
+{
+    MessageQueue *mq = (MessageQueue *)t->arg;
+
+    const char *protocol = getenv("MQ_PROTOCOL");
+
+    channel_init(&mq->pusher, mq->reactor, mq_pushed, mq);
+    channel_init(&mq->puller, mq->reactor, mq_pulled, mq);
+    channel_init(&mq->probe, mq->reactor, mq_probed, mq);
+    mq->puller.chunk = mq->on_chunk && !mq->topic[0] ? mq_chunk : NULL;
+
+    mq->pusher.binary = mq->puller.binary = !mq->transport && streq(protocol ? protocol : MQ_PROTOCOL, "binary");
+
+    if (mq->transport)
+    {
+        mq->pusher.transport = mq->puller.transport = mq->probe.transport = mq->transport;
+        mq->pusher.tag = 0;
+        mq->puller.tag = 1;
+        mq->probe.tag = 2;
+        if (mq->endpoint)
+        {
+            mq_attach(mq, mq->endpoint);
+        }
+    }
+
+    if ((mq->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+    {
+        error("Unable to create retry timer: %s", strerror(errno));
+    }
+    mq->timer_op.type = OP_READ;
+    mq->timer_op.fd = mq->timer_fd;
+    mq->timer_op.buf = &mq->timer_value;
+    mq->timer_op.len = sizeof(mq->timer_value);
+    mq->timer_op.func = mq_retry;
+    mq->timer_op.arg = mq;
+    mq->window = mq->refilled = trace_now(TRACE_MONOTONIC);
+
+    mq_push(mq);
+    mq_pull(mq);
+}
+
+/**
+ * Wake pusher (runs on reactor thread).
+ * @param   t       Wakeup task.
+ */
+static void mq_wakeup(Task *t)
+{
+    mq_push((MessageQueue *)t->arg);
+}
+
+/**
+ * Cancel puller's exchange, probe, and retry timer, and pusher's exchange
+ * once the drain deadline has expired (runs on reactor thread).
+ * @param   t       Cancel task.
+ */
+static void mq_cancel(Task *t)
+{
+    MessageQueue *mq = (MessageQueue *)t->arg;
+
+    bool expired = mq_expired(mq);
+
+    if (__atomic_exchange_n(&mq->throttled, false, __ATOMIC_SEQ_CST))
+    {
+        queue_push(mq->incoming, request_create(NULL, NULL, NULL)); // Wake retrievers
+        mq_finish(mq, &mq->pulling);
+    }
+    channel_cancel(&mq->puller);
+    channel_cancel(&mq->probe);
+    reactor_cancel(mq->reactor, &mq->timer_op);
+    if (expired)
+    {
+        channel_cancel(&mq->pusher);
+    }
+}
+
+/**
+ * Pusher sends next request from outgoing queue to server (if idle).  Once
+ * the binary protocol is established, all queued requests (up to MQ_BATCH)
+ * are pipelined in one exchange.  Requests are paced to the allowed rate
+ * (see mq_rate), except while draining during shutdown.
+ * @param   mq      Message Queue structure.
+ */
+static void mq_push(MessageQueue *mq)
+{
+    if (!mq->pushing || mq->pusher.busy || mq->parked)
+    {
+        return;
+    }
+
+    bool stopping = mq_shutdown(mq); // Checked first: requests published before mq_stop are queued by then
+    if (mq->state == MQ_DISCONNECTED)
+    {
+        /* Requests wait in outgoing queue until the circuit breaker closes
+         * (or are dropped, since the server is unreachable during shutdown) */
+        if (stopping)
+        {
+            mq_drop(mq);
+            mq_finish(mq, &mq->pushing);
+        }
+        return;
+    }
+
+    size_t allowed = stopping ? MQ_BATCH : mq_allowance(mq);
+    if (allowed == 0)
+    {
+        return; // Retry timer resumes pusher once a request is allowed
+    }
+
+    Request *r = queue_trypop(mq->outgoing);
+    if (r)
+    {
+        Request *tail = r;
+        size_t n = 1;
+        bool batches = mq->pusher.upgraded || (mq->transport && mq->transport->batches);
+        /* Contents of a request's file follow its frame, so it ends the batch */
+        for (; batches && n < allowed && !tail->flength && (tail->next = queue_trypop(mq->outgoing)); n++)
+        {
+            tail = tail->next;
+        }
+        for (Request *s = r; s; s = s->next)
+        {
+            if (s->trace)
+            {
+                s->stamp = trace_now(TRACE_MONOTONIC);
+            }
+        }
+        mq->tokens -= mq->rate > 0 ? n : 0;
+        mq_send(mq, &mq->pusher, r);
+    }
+    else if (stopping)
+    {
+        mq_finish(mq, &mq->pushing);
+    }
+}
+
+/**
+ * Puller requests next messages from server (a batch, up to the room left in
+ * the prefetch window), or next messages from topic log (unless circuit
+ * breaker is open, or prefetch window is full).
+ * @param   mq      Message Queue structure.
+ */
+static void mq_pull(MessageQueue *mq)
+{
+    if (mq->state == MQ_DISCONNECTED)
+    {
+        mq->stalled = true;
+        return;
+    }
+
+    size_t bytes = 0;
+    size_t room = mq->mux ? 1 : mq_room(mq, &bytes);
+    if (!room)
+    {
+        /* Retrievers resume puller once they drain the window (rechecked
+         * after throttling, in case they drained it before noticing) */
+        __atomic_store_n(&mq->throttled, true, __ATOMIC_SEQ_CST);
+        if (!(room = mq_room(mq, &bytes)) || !__atomic_exchange_n(&mq->throttled, false, __ATOMIC_SEQ_CST))
+        {
+            return;
+        }
+    }
+
+    char uri[BUFSIZ];
+    if (mq->topic[0])
+    {
+        mutex_lock(&mq->lock);
+        if (mq->seeking)
+        {
+            mq->offset = mq->seek;
+            mq->seeking = false;
+        }
+        sprintf(uri, "/topic/%s?offset=%" PRId64 "&max=%zu&wait=%d", mq->topic, mq->offset,
+                room < MQ_READ_MAX ? room : MQ_READ_MAX, MQ_READ_WAIT);
+        mutex_unlock(&mq->lock);
+    }
+    else if (room > 1 && !mq->mux && !mq->on_chunk)
+    {
+        sprintf(uri, "/queue/%s?max=%zu&bytes=%zu", mq->name, room, bytes);
+    }
+    else
+    {
+        sprintf(uri, "/queue/%s", mq->name);
+    }
+
+    mq_send(mq, &mq->puller, request_create("GET", uri, NULL));
+}
+
+/**
+ * Handle completed pusher exchange: park requests to be retried on failure
+ * (or after the Retry-After of a server refusing them), otherwise adapt the
+ * allowed rate to the server's load, record send latency of traced requests,
+ * and send next request.
+ * @param   c       Pusher channel.
+ */
+static void mq_pushed(Channel *c)
+{
+    MessageQueue *mq = (MessageQueue *)c->arg;
+    unsigned load = 0;
+    unsigned retry = c->status >= 0 ? channel_pressure(c, &load) : 0;
+    size_t acknowledged = 0;
+    bool batched = c->upgraded || (mq->transport && mq->transport->batches);
+
+    /* Requests that cannot be framed are dropped rather than retried (the
+     * exchange failed only because no other request was left to send) */
+    if (c->rejected)
+    {
+        mutex_lock(&mq->lock);
+        mq->dropped = true;
+        mutex_unlock(&mq->lock);
+        if (!c->request && c->status == -EINVAL)
+        {
+            c->status = 0;
+        }
+    }
+
+    /* Only the first request of a batch was sent if the upgrade was refused */
+    for (Request *r = c->request; c->status >= 0 && !retry && r && (r == c->request || batched); r = r->next)
+    {
+        acknowledged++;
+        if (r->trace)
+        {
+            trace_record(r->trace, TRACE_SEND, trace_now(TRACE_MONOTONIC) - r->stamp);
+        }
+    }
+
+    if (c->status < 0)
+    {
+        if (!mq_shutdown(mq))
+        {
+            int status = c->status;
+            mq->parked = c->request;
+            c->request = NULL;
+            channel_reset(c);
+            mq_failed(mq, "send to", status);
+            return;
+        }
+
+        /* Server is unreachable (or drain deadline expired) during shutdown:
+         * drop remaining requests */
+        if (c->status != -ECANCELED)
+        {
+            error("Unable to send to %s:%s: %s", mq->host, mq->port, strerror(-c->status));
+        }
+        mq_drop(mq);
+    }
+    else if (retry)
+    {
+        /* Server is overloaded: resend whole batch after its Retry-After
+         * (duplicates of the requests it accepted are ignored) */
+        mq_adapt(mq, 1000, 0);
+        if (!mq_expired(mq))
+        {
+            mq->parked = c->request;
+            c->request = NULL;
+            channel_reset(c);
+            if (!mq_sleep(mq, retry))
+            {
+                mq_resume(mq);
+            }
+            return;
+        }
+        mq_drop(mq);
+    }
+    else
+    {
+        mq_adapt(mq, load, acknowledged);
+        if (!batched && c->request && c->request->next)
+        {
+            /* Server refused binary protocol: send rest of batch over HTTP */
+            Request *rest = c->request->next;
+            c->request->next = NULL;
+            mq_send(mq, c, rest);
+            return;
+        }
+    }
+
+    bool sent = c->status >= 0;
+    channel_reset(c);
+    if (sent)
+    {
+        mq_connected(mq);
+    }
+    mq_push(mq);
+}
+
+/**
+ * Handle completed puller exchange: put message (or batch of messages) in
+ * incoming queue (or hand it to the shared subscription this client serves,
+ * or finish streaming it to the stream callback) and request next message
+ * (until mq_stop cancels the exchange, which wakes retrievers instead).  The
+ * envelope of traced messages is stripped as their transit latency is
+ * recorded.
+ * @param   c       Puller channel.
+ */
+static void mq_pulled(Channel *c)
+{
+    MessageQueue *mq = (MessageQueue *)c->arg;
+    int status = c->status;
+    char *body;
+    size_t length;
+
+    if (status == 0 && mq->topic[0])
+    {
+        mq_records(mq, c);
+    }
+    else if (status == 0 && strchr(c->request->uri, '?'))
+    {
+        mq_batch(mq, c);
+    }
+    else if (status == 0 && mq->on_chunk && channel_response(c, &body, &length) == 200 && length > 0)
+    {
+        mq_chunk(c, body, length, true); // Not streamed by channel (record transport response)
+    }
+    else if (status == 0 && channel_response(c, &body, &length) == 200 && length > 0)
+    {
+        size_t envelope = trace_open(body, length, &c->request->trace, &c->request->published);
+        Message *m = message_create(body + envelope, length - envelope);
+
+        if (m && mq->mux)
+        {
+            mux_deliver(mq->mux, m, c->request);
+            message_release(m);
+        }
+        else if (m)
+        {
+            Request *r = c->request;
+            c->request = NULL;
+            r->message = m;
+            r->body = m->body;
+            queue_push(mq->incoming, r);
+        }
+    }
+
+    if (mq->chunking)
+    {
+        /* Exchange failed partway through a streamed message */
+        mq->chunking = false;
+        mq->chunk_trace = NULL;
+        mq->on_chunk(mq, NULL, 0, true, mq->chunk_arg);
+    }
+
+    channel_reset(c);
+    if (mq_shutdown(mq))
+    {
+        queue_push(mq->incoming, request_create(NULL, NULL, NULL)); // Wake retrievers
+        mq_finish(mq, &mq->pulling);
+        return;
+    }
+
+    if (status < 0)
+    {
+        mq->stalled = true;
+        mq_failed(mq, "receive from", status);
+        return;
+    }
+    mq_connected(mq);
+    mq_pull(mq);
+}
+
+/**
+ * Resume puller throttled by a full prefetch window (runs on reactor thread).
+ * @param   t       Refill task.
+ */
+static void mq_refill(Task *t)
+{
+    MessageQueue *mq = (MessageQueue *)t->arg;
+
+    if (mq_shutdown(mq))
+    {
+        queue_push(mq->incoming, request_create(NULL, NULL, NULL)); // Wake retrievers
+        mq_finish(mq, &mq->pulling);
+        return;
+    }
+    mq_pull(mq);
+}
+
+/**
+ * Resume pullers (of every shard) throttled by a full prefetch window, once
+ * retrievers have drained it below half.
+ * @param   mq      Message Queue structure.
+ */
+static void mq_retrieved(MessageQueue *mq)
+{
+    MessageQueue **clients = mq->nshards ? mq->shards : &mq;
+    size_t nclients = mq->nshards ? mq->nshards : 1;
+
+    for (size_t i = 0; i < nclients; i++)
+    {
+        MessageQueue *c = clients[i];
+        size_t bytes;
+        if (__atomic_load_n(&c->throttled, __ATOMIC_SEQ_CST) &&
+            mq_room(c, &bytes) >= (c->prefetch + 1) / 2 &&
+            (!c->prefetch_bytes || bytes >= c->prefetch_bytes / 2) &&
+            __atomic_exchange_n(&c->throttled, false, __ATOMIC_SEQ_CST))
+        {
+            mutex_lock(&c->lock);
+            reactor_post(c->reactor, &c->refill);
+            mutex_unlock(&c->lock);
+        }
+    }
+}
+
+/**
+ * Return how many more messages fit in prefetch window.
+ * @param   mq      Message Queue structure.
+ * @param   bytes   Bytes of messages that fit (0 if there is no limit).
+ * @return  Number of messages that fit (0 if window is full).
+ */
+static size_t mq_room(MessageQueue *mq, size_t *bytes)
+{
+    size_t size = __atomic_load_n(&mq->incoming->size, __ATOMIC_SEQ_CST);
+    size_t used = __atomic_load_n(&mq->incoming->bytes, __ATOMIC_SEQ_CST);
+
+    *bytes = mq->prefetch_bytes > used ? mq->prefetch_bytes - used : 0;
+    if (size >= mq->prefetch || (mq->prefetch_bytes && !*bytes))
+    {
+        return 0;
+    }
+    return mq->prefetch - size;
+}
+
+/**
+ * Push messages of batch retrieval into incoming queue.
+ * @param   mq      Message Queue structure.
+ * @param   c       Puller channel.
+ */
+static void mq_batch(MessageQueue *mq, Channel *c)
+{
+    char *body;
+    size_t length;
+    if (channel_response(c, &body, &length) != 200)
+    {
+        return;
+    }
+
+    /* Each record is a "$LENGTH\n" line followed by the message */
+    for (char *record = body, *end = body + length; record < end;)
+    {
+        char *newline = memchr(record, '\n', end - record);
+        size_t n = newline ? strtoull(record, NULL, 10) : 0;
+        if (!newline || n > (size_t)(end - newline - 1))
+        {
+            error("Malformed record retrieved from queue %s", mq->name);
+            break;
+        }
+
+        Request *r = request_create(NULL, NULL, NULL);
+        size_t envelope = r ? trace_open(newline + 1, n, &r->trace, &r->published) : 0;
+        Message *m = r ? message_create(newline + 1 + envelope, n - envelope) : NULL;
+        if (!m)
+        {
+            request_delete(r);
+            break;
+        }
+
+        r->message = m;
+        r->body = m->body;
+        queue_push(mq->incoming, r);
+        record = newline + 1 + n;
+    }
+}
+
+/**
+ * Push messages read from topic log into incoming queue, and advance offset
+ * past them (or to the offset the server resolved, if none were published
+ * before the read's wait expired).  Messages read before mq_seek are dropped.
+ * @param   mq      Message Queue structure.
+ * @param   c       Puller channel.
+ */
+static void mq_records(MessageQueue *mq, Channel *c)
+{
+    char *body;
+    size_t length;
+    int code = channel_response(c, &body, &length);
+
+    mutex_lock(&mq->lock);
+    if (mq->seeking)
+    {
+        mutex_unlock(&mq->lock);
+        return;
+    }
+
+    if (code == 204)
+    {
+        /* Next offset is a header of HTTP responses, or the body of binary ones */
+        char next[32] = {0};
+        const char *header = channel_header(c, "Mq-Offset");
+        memcpy(next, body, length < sizeof(next) ? length : sizeof(next) - 1);
+        mq->offset = strtoll(header ? header : next, NULL, 10);
+    }
+
+    /* Each record is an "$OFFSET $LENGTH\n" line followed by the message */
+    for (char *record = body, *end = body + length; code == 200 && record < end;)
+    {
+        char *newline = memchr(record, '\n', end - record);
+        char *size;
+        uint64_t offset = newline ? strtoull(record, &size, 10) : 0;
+        size_t n = newline ? strtoull(size, NULL, 10) : 0;
+        if (!newline || n > (size_t)(end - newline - 1))
+        {
+            error("Malformed record read from topic %s", mq->topic);
+            break;
+        }
+
+        Request *r = request_create(NULL, NULL, NULL);
+        size_t envelope = r ? trace_open(newline + 1, n, &r->trace, &r->published) : 0;
+        Message *m = r ? message_create(newline + 1 + envelope, n - envelope) : NULL;
+        if (!m)
+        {
+            request_delete(r);
+            break;
+        }
+
+        r->message = m;
+        r->body = m->body;
+        r->offset = offset + 1;
+        queue_push(mq->incoming, r);
+        mq->offset = offset + 1;
+        record = newline + 1 + n;
+    }
+    mutex_unlock(&mq->lock);
+}
+
+/**
+ * Pass chunk of message received by puller to stream callback, stripping the
+ * envelope of traced messages from their first chunk (and recording their
+ * transit latency once the last one arrives).
+ * @param   c       Puller channel.
+ * @param   chunk   Part of message body.
+ * @param   length  Length of chunk.
+ * @param   last    Whether or not chunk ends message.
+ */
+static void mq_chunk(Channel *c, const char *chunk, size_t length, bool last)
+{
+    MessageQueue *mq = (MessageQueue *)c->arg;
+    size_t envelope = 0;
+
+    if (!mq->chunking)
+    {
+        envelope = trace_open(chunk, length, &mq->chunk_trace, &mq->chunk_published);
+        mq->chunking = true;
+    }
+
+    mq->on_chunk(mq, chunk + envelope, length - envelope, last, mq->chunk_arg);
+
+    if (last)
+    {
+        if (mq->chunk_trace)
+        {
+            trace_record(mq->chunk_trace, TRACE_TOTAL, trace_now(TRACE_MONOTONIC) - mq->chunk_published);
+        }
+        mq->chunk_trace = NULL;
+        mq->chunking = false;
+    }
+}
+
+/**
+ * Append chunk of message to file (stream callback of mq_stream_fd).
+ * @param   mq      Message Queue structure.
+ * @param   chunk   Part of message body.
+ * @param   length  Length of chunk.
+ * @param   last    Whether or not chunk ends message.
+ * @param   arg     File descriptor.
+ */
+static void mq_write_chunk(MessageQueue *mq, const char *chunk, size_t length, bool last, void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+
+    while (length > 0)
+    {
+        ssize_t n = write(fd, chunk, length);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            error("Unable to write message of %s to file descriptor %d: %s", mq->name, fd, strerror(errno));
+            return;
+        }
+        chunk += n;
+        length -= n;
+    }
+}
+
+/**
+ * Handle completed probe: close the circuit breaker (resuming pusher and
+ * puller) if the server responded, otherwise back off further.
+ * @param   c       Probe channel.
+ */
+static void mq_probed(Channel *c)
+{
+    MessageQueue *mq = (MessageQueue *)c->arg;
+    int status = c->status;
+
+    channel_reset(c);
+    mq_finish(mq, &mq->probing);
+
+    if (mq_shutdown(mq))
+    {
+        mq_resume(mq);
+    }
+    else if (status < 0)
+    {
+        mq_failed(mq, "reach", status);
+    }
+    else
+    {
+        mq_connected(mq);
+    }
+}
+
+/**
+ * Record successful exchange with server: reset backoff and resume parked
+ * pusher or puller.
+ * @param   mq      Message Queue structure.
+ */
+static void mq_connected(MessageQueue *mq)
+{
+    if (mq->state == MQ_CONNECTED)
+    {
+        return;
+    }
+
+    if (mq->state != MQ_CONNECTING)
+    {
+        info("Reconnected to %s:%s after %u failures", mq->host, mq->port, mq->failures);
+    }
+    mq->failures = 0;
+    mq_transition(mq, MQ_CONNECTED);
+    mq_resume(mq);
+}
+
+/**
+ * Record failed exchange with server and retry after a backoff (only the
+ * first failure and the circuit breaker opening are logged as errors).
+ * @param   mq      Message Queue structure.
+ * @param   action  Description of failed exchange.
+ * @param   status  Result of exchange (-errno).
+ */
+static void mq_failed(MessageQueue *mq, const char *action, int status)
+{
+    mq->addr = mq->naddrs ? (mq->addr + 1) % mq->naddrs : 0;
+    mq->failures++;
+
+    if (mq->failures >= MQ_BREAKER && mq->state != MQ_DISCONNECTED)
+    {
+        error("Unable to %s %s:%s: %s (circuit breaker open)", action, mq->host, mq->port, strerror(-status));
+        mq_transition(mq, MQ_DISCONNECTED);
+    }
+    else if (mq->state == MQ_CONNECTING || mq->state == MQ_CONNECTED)
+    {
+        error("Unable to %s %s:%s: %s (retrying)", action, mq->host, mq->port, strerror(-status));
+        mq_transition(mq, MQ_RETRYING);
+    }
+    else
+    {
+        debug("Unable to %s %s:%s: %s (%u failures)", action, mq->host, mq->port, strerror(-status), mq->failures);
+    }
+
+    mq_backoff(mq);
+}
+
+/**
+ * Retry after an exponential backoff of MQ_BACKOFF_MIN * 2^(failures - 1)
+ * milliseconds, capped at MQ_BACKOFF_MAX, of which the second half is random
+ * so that clients that failed together do not retry together.
+ * @param   mq      Message Queue structure.
+ */
+static void mq_backoff(MessageQueue *mq)
+{
+    unsigned int shift = mq->failures > 16 ? 16 : mq->failures - 1;
+    uint64_t delay = (uint64_t)MQ_BACKOFF_MIN << shift;
+    delay = delay > MQ_BACKOFF_MAX ? MQ_BACKOFF_MAX : delay;
+    delay = delay / 2 + rand_r(&mq->seed) % (delay / 2 + 1);
+
+    if (!mq_sleep(mq, delay))
+    {
+        mq_resume(mq);
+    }
+}
+
+/**
+ * Arm retry timer (unless already armed), which resumes the pusher and
+ * puller (or probes the server, if the circuit breaker is open).
+ * @param   mq      Message Queue structure.
+ * @param   delay   Milliseconds until timer expires.
+ * @return  Whether or not retry timer is armed.
+ */
+static bool mq_sleep(MessageQueue *mq, uint64_t delay)
+{
+    if (mq->sleeping)
+    {
+        return true;
+    }
+
+    struct itimerspec spec = {
+        .it_value = {.tv_sec = delay / 1000, .tv_nsec = (delay % 1000) * 1000000},
+    };
+    if (timerfd_settime(mq->timer_fd, 0, &spec, NULL) < 0)
+    {
+        error("Unable to arm retry timer: %s", strerror(errno));
+        return false;
+    }
+
+    mutex_lock(&mq->lock);
+    mq->sleeping = true;
+    mutex_unlock(&mq->lock);
+    reactor_submit(mq->reactor, &mq->timer_op);
+    return true;
+}
+
+/**
+ * Return number of requests the pusher may send now (up to MQ_BATCH): tokens
+ * accumulate at the allowed rate, for at most MQ_RATE_WINDOW milliseconds.
+ * If none are available, the retry timer is armed for when one will be.
+ * @param   mq      Message Queue structure.
+ * @return  Number of requests allowed (or 0 if pusher must wait).
+ */
+static size_t mq_allowance(MessageQueue *mq)
+{
+    if (mq->rate <= 0)
+    {
+        return MQ_BATCH;
+    }
+
+    uint64_t now = trace_now(TRACE_MONOTONIC);
+    double burst = mq->rate * MQ_RATE_WINDOW / 1000.0;
+    mq->tokens += mq->rate * (now - mq->refilled) / 1000000000.0;
+    mq->tokens = mq->tokens > burst ? (burst > 1 ? burst : 1) : mq->tokens;
+    mq->refilled = now;
+
+    if (mq->tokens >= 1)
+    {
+        return mq->tokens < MQ_BATCH ? (size_t)mq->tokens : MQ_BATCH;
+    }
+
+    /* Without a timer the pusher cannot wait, so it is not paced */
+    uint64_t delay = (uint64_t)((1 - mq->tokens) * 1000 / mq->rate) + 1;
+    return mq_sleep(mq, delay) ? 0 : 1;
+}
+
+/**
+ * Adjust allowed rate to server load once per MQ_RATE_WINDOW milliseconds:
+ * halve it (starting from the rate actually sent) if the server was loaded
+ * during the window, otherwise increase it by MQ_RATE_STEP (or stop
+ * throttling once less than half of it is sent).
+ * @param   mq              Message Queue structure.
+ * @param   load            Load hint of server's responses (permille).
+ * @param   acknowledged    Number of requests server acknowledged.
+ */
+static void mq_adapt(MessageQueue *mq, unsigned load, size_t acknowledged)
+{
+    uint64_t now = trace_now(TRACE_MONOTONIC);
+    mq->acknowledged += acknowledged;
+    mq->congested = mq->congested || load >= MQ_LOAD_HIGH;
+    if (now - mq->window < MQ_RATE_WINDOW * 1000000ULL)
+    {
+        return;
+    }
+
+    double throughput = mq->acknowledged * 1000000000.0 / (now - mq->window);
+    double rate = mq->rate;
+    if (mq->congested)
+    {
+        rate = (rate > 0 && rate < throughput ? rate : throughput) / 2;
+        rate = rate < MQ_RATE_MIN ? MQ_RATE_MIN : rate;
+        if (mq->rate <= 0)
+        {
+            mq->tokens = 1;
+            mq->refilled = now;
+        }
+        debug("Throttling publishes to %s:%s at %.0f messages/s", mq->host, mq->port, rate);
+    }
+    else if (rate > 0)
+    {
+        rate = rate >= 2 * throughput ? 0 : rate + MQ_RATE_STEP;
+    }
+
+    __atomic_store(&mq->rate, &rate, __ATOMIC_RELAXED);
+    mq->window = now;
+    mq->acknowledged = 0;
+    mq->congested = false;
+}
+
+/**
+ * Handle expired (or cancelled) retry timer: probe server if circuit breaker
+ * is open, otherwise resume parked pusher and puller.
+ * @param   op      Retry timer Op structure.
+ */
+static void mq_retry(Op *op)
+{
+    MessageQueue *mq = (MessageQueue *)op->arg;
+    char uri[BUFSIZ];
+
+    mq_finish(mq, &mq->sleeping);
+
+    if (mq_shutdown(mq) || mq->state != MQ_DISCONNECTED)
+    {
+        mq_resume(mq);
+        return;
+    }
+
+    /* Probe subscribes to SENTINEL again, which also recreates the queue if
+     * the server restarted */
+    sprintf(uri, "/subscription/%s/%s", mq->name, SENTINEL);
+    mutex_lock(&mq->lock);
+    mq->probing = true;
+    mutex_unlock(&mq->lock);
+    mq_send(mq, &mq->probe, request_create("PUT", uri, NULL));
+}
+
+/**
+ * Resume parked pusher and puller (or stop them, during shutdown).  Parked
+ * requests are dropped if the circuit breaker is open during shutdown.
+ * @param   mq      Message Queue structure.
+ */
+static void mq_resume(MessageQueue *mq)
+{
+    bool stopping = mq_shutdown(mq);
+
+    if (mq->parked)
+    {
+        Request *r = mq->parked;
+        mq->parked = NULL;
+
+        if (stopping && mq->state == MQ_DISCONNECTED)
+        {
+            while (r)
+            {
+                Request *next = r->next;
+                request_delete(r);
+                r = next;
+            }
+            mq_drop(mq);
+        }
+        else
+        {
+            mq_send(mq, &mq->pusher, r);
+        }
+    }
+    mq_push(mq);
+
+    if (mq->stalled)
+    {
+        mq->stalled = false;
+        if (stopping)
+        {
+            queue_push(mq->incoming, request_create(NULL, NULL, NULL)); // Wake retrievers
+            mq_finish(mq, &mq->pulling);
+        }
+        else
+        {
+            mq_pull(mq);
+        }
+    }
+}
+
+/**
+ * Change connection state and notify state callback.
+ * @param   mq      Message Queue structure.
+ * @param   state   New connection state.
+ */
+static void mq_transition(MessageQueue *mq, MQState state)
+{
+    if (mq->state == state)
+    {
+        return;
+    }
+
+    __atomic_store_n(&mq->state, state, __ATOMIC_RELAXED);
+    if (mq->on_state)
+    {
+        mq->on_state(mq, state, mq->state_arg);
+    }
+}
+
+/**
+ * Return whether or not the drain deadline of mq_stop has expired.
+ * @param   mq      Message Queue structure.
+ */
+static bool mq_expired(MessageQueue *mq)
+{
+    mutex_lock(&mq->lock);
+    bool expired = mq->expired;
+    mutex_unlock(&mq->lock);
+    return expired;
+}
+
+/**
+ * Drop requests remaining in outgoing queue (during shutdown).
+ * @param   mq      Message Queue structure.
+ */
+static void mq_drop(MessageQueue *mq)
+{
+    Request *r;
+    while ((r = queue_trypop(mq->outgoing)))
+    {
+        request_delete(r);
+    }
+
+    mutex_lock(&mq->lock);
+    mq->dropped = true;
+    mutex_unlock(&mq->lock);
+}
+
+/**
+ * Mark pusher, puller, probe, or retry timer as stopped and notify mq_stop.
+ * @param   mq      Message Queue structure.
+ * @param   running Running flag of pusher, puller, probe, retry timer, or resolver.
+ */
+static void mq_finish(MessageQueue *mq, bool *running)
+{
+    mutex_lock(&mq->lock);
+    *running = false;
+    cond_signal(&mq->stopped);
+    bool idle = !mq->pushing && !mq->pulling && !mq->probing;
+    mutex_unlock(&mq->lock);
+
+    if (idle && mq->endpoint)
+    {
+        mq->transport->wake(mq->endpoint); // Complete pending receive so it can stop
+    }
+}
+
+/**
+ * Send request on channel over record transport or to current server address
+ * (if the host is not resolved, or the transport not attached, yet, the
+ * exchange fails like any other, so the request is parked and retried after
+ * a backoff, or once the circuit breaker closes).
+ * @param   mq      Message Queue structure.
+ * @param   c       Pusher, puller, or probe channel.
+ * @param   r       Request to send.
+ */
+static void mq_send(MessageQueue *mq, Channel *c, Request *r)
+{
+    if (mq->transport)
+    {
+        if (!mq->endpoint)
+        {
+            mq_resolve(mq);
+        }
+        channel_send(c, NULL, 0, r);
+        return;
+    }
+
+    Address *a = mq_address(mq);
+    channel_send(c, a ? (struct sockaddr *)&a->addr : NULL, a ? a->addrlen : 0, r);
+}
+
+/**
+ * Handle record transport wakeup: deliver each response record to the
+ * channel that sent the request.
+ * @param   op      Transport event Op structure.
+ */
+static void mq_received(Op *op)
+{
+    MessageQueue *mq = (MessageQueue *)op->arg;
+    uint8_t tag;
+    size_t length;
+    char *response;
+
+    while ((response = mq->transport->recv(mq->endpoint, &tag, &length)))
+    {
+        Channel *c = tag == mq->pusher.tag ? &mq->pusher : (tag == mq->probe.tag ? &mq->probe : &mq->puller);
+        if (c->busy)
+        {
+            channel_deliver(c, response, length);
+        }
+        else
+        {
+            free(response);
+        }
+    }
+
+    mutex_lock(&mq->lock);
+    mq->waiting = mq->pushing || mq->pulling || mq->probing;
+    cond_signal(&mq->stopped);
+    bool waiting = mq->waiting;
+    mutex_unlock(&mq->lock);
+
+    if (waiting)
+    {
+        reactor_submit(mq->reactor, op);
+    }
+}
+
+/**
+ * Return server address currently in use.  If the host could not be resolved
+ * (by mq_start), it is resolved again on a helper thread, so the reactor
+ * thread never blocks on DNS; exchanges fail (and back off) until it is.
+ * @param   mq      Message Queue structure.
+ * @return  Server address (or NULL if host is not resolved yet).
+ */
+static Address *mq_address(MessageQueue *mq)
+{
+    if (mq->naddrs == 0)
+    {
+        mq_resolve(mq);
+        return NULL;
+    }
+
+    return &mq->addrs[mq->addr];
+}
+
+/**
+ * Start resolving host (or attaching to its record transport) on a helper
+ * thread (unless it already is, or the client is stopping).
+ * @param   mq      Message Queue structure.
+ */
+static void mq_resolve(MessageQueue *mq)
+{
+    mutex_lock(&mq->lock);
+    bool start = !mq->resolving && !mq->shutdown;
+    mq->resolving = mq->resolving || start;
+    mutex_unlock(&mq->lock);
+
+    if (start)
+    {
+        Thread thread;
+        thread_create(&thread, NULL, mq_resolver, mq);
+        thread_detach(thread);
+    }
+}
+
+/**
+ * Resolve host or attach to its record transport (on helper thread), then
+ * pass the addresses or endpoint to the reactor thread (mq_stop waits for
+ * this to finish).
+ * @param   arg     Message Queue structure.
+ * @return  NULL.
+ */
+static void *mq_resolver(void *arg)
+{
+    MessageQueue *mq = (MessageQueue *)arg;
+
+    if (mq->transport)
+    {
+        mq->resolving_endpoint = mq->transport->attach(mq->host + strlen(mq->transport->prefix));
+    }
+    else
+    {
+        mq->nresolving = socket_resolve(mq->host, mq->port, mq->resolving_addrs, MQ_ADDRESSES, &mq->resolving_status);
+    }
+
+    mutex_lock(&mq->lock);
+    reactor_post(mq->reactor, &mq->resolved);
+    mutex_unlock(&mq->lock);
+    return NULL;
+}
+
+/**
+ * Adopt addresses resolved (or endpoint attached) by helper thread (runs on
+ * reactor thread).  The next retry of the failed exchanges uses them.
+ * @param   t       Resolved task.
+ */
+static void mq_resolved(Task *t)
+{
+    MessageQueue *mq = (MessageQueue *)t->arg;
+
+    if (mq->resolving_endpoint)
+    {
+        if (!mq->endpoint && !mq_shutdown(mq))
+        {
+            mq_attach(mq, mq->resolving_endpoint);
+        }
+        else
+        {
+            mq->transport->detach(mq->resolving_endpoint);
+        }
+        mq->resolving_endpoint = NULL;
+    }
+    else if (mq->naddrs == 0 && mq->nresolving)
+    {
+        memcpy(mq->addrs, mq->resolving_addrs, mq->nresolving * sizeof(Address));
+        mq->naddrs = mq->nresolving;
+        mq->addr = 0;
+    }
+    else if (mq->naddrs == 0 && mq->failures == 0)
+    {
+        error("Unable to resolve %s:%s: %s", mq->host, mq->port, gai_strerror(mq->resolving_status));
+    }
+    else if (mq->naddrs == 0)
+    {
+        /* Already reported by mq_start (or the first failed exchange) */
+        debug("Unable to resolve %s:%s: %s (%u failures)", mq->host, mq->port, gai_strerror(mq->resolving_status), mq->failures);
+    }
+    mq_finish(mq, &mq->resolving);
+}
+
+/**
+ * Exchange requests through attached record transport endpoint, waiting for
+ * its responses (runs on reactor thread).
+ * @param   mq          Message Queue structure.
+ * @param   endpoint    Transport's endpoint.
+ */
+static void mq_attach(MessageQueue *mq, void *endpoint)
+{
+    mq->endpoint = mq->pusher.endpoint = mq->puller.endpoint = mq->probe.endpoint = endpoint;
+
+    mutex_lock(&mq->lock);
+    mq->waiting = true;
+    mutex_unlock(&mq->lock);
+
+    mq->event_op.type = OP_READ;
+    mq->event_op.fd = mq->transport->event(endpoint);
+    mq->event_op.buf = &mq->event_value;
+    mq->event_op.len = sizeof(mq->event_value);
+    mq->event_op.func = mq_received;
+    mq->event_op.arg = mq;
+    reactor_submit(mq->reactor, &mq->event_op);
+}
+
+/**
+ * Return record transport selected by host's prefix.
+ * @param   host    Address of server.
+ * @return  Transport structure (or NULL if host is reached over a socket).
+ */
+static const Transport *mq_transport(const char *host)
+{
+    for (size_t i = 0; i < sizeof(Transports) / sizeof(Transports[0]); i++)
+    {
+        if (strncmp(host, Transports[i]->prefix, strlen(Transports[i]->prefix)) == 0)
+        {
+            return Transports[i];
+        }
+    }
     return NULL;
 }
 
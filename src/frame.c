@@ -0,0 +1,325 @@
+/* frame.c: Binary framing protocol */
+
+#include "mq/frame.h"
+#include "mq/string.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+
+/* Internal Prototypes */
+
+static uint32_t frame_topic(FrameTable *t, const char *name, FILE *fs);
+static uint32_t frame_line(FrameTable *t, RequestLine *l, FILE *fs);
+static long long frame_argument(const char *query, const char *name, long long fallback);
+static void frame_emit(FILE *fs, uint8_t opcode, uint8_t flags, uint32_t id, const char *prefix, size_t plength, const char *body, size_t length, size_t trailing);
+
+/* Internal Variables */
+
+static uint64_t FrameGenerations = 0;
+
+/* External Functions */
+
+/**
+ * Pack frame header into buffer (in network byte order).
+ * @param   f       Frame structure.
+ * @param   buffer  Buffer of at least FRAME_HEADER bytes.
+ */
+void frame_pack(const Frame *f, char *buffer)
+{
+    uint32_t length = htonl(f->length);
+    uint16_t status = htons(f->status);
+    uint32_t id = htonl(f->id);
+
+    memcpy(buffer, &length, sizeof(length));
+    buffer[4] = f->opcode;
+    buffer[5] = f->flags;
+    memcpy(buffer + 6, &status, sizeof(status));
+    memcpy(buffer + 8, &id, sizeof(id));
+}
+
+/**
+ * Unpack frame header from buffer.
+ * @param   buffer  Buffer of at least FRAME_HEADER bytes.
+ * @param   f       Frame structure.
+ */
+void frame_unpack(const char *buffer, Frame *f)
+{
+    uint32_t length;
+    uint16_t status;
+    uint32_t id;
+
+    memcpy(&length, buffer, sizeof(length));
+    memcpy(&status, buffer + 6, sizeof(status));
+    memcpy(&id, buffer + 8, sizeof(id));
+
+    f->length = ntohl(length);
+    f->opcode = (uint8_t)buffer[4];
+    f->flags = (uint8_t)buffer[5];
+    f->status = ntohs(status);
+    f->id = ntohl(id);
+}
+
+/**
+ * Write Request as binary frames to stream (declaring its topic first if it
+ * has not been used on this connection yet):
+ *
+ *  PUT     /topic/$topic               PUBLISH     id($topic)  [$HEADERS] $BODY [$FILE]
+ *  PUT     /subscription/$queue/$topic SUBSCRIBE   id($topic)  $queue [\0 $SELECTOR]
+ *  DELETE  /subscription/$queue/$topic UNSUBSCRIBE id($topic)  $queue
+ *  GET     /queue/$queue               FETCH       0           $queue
+ *  GET     /queue/$queue?max=N&bytes=B FETCH       0           $queue \0 N B
+ *  GET     /topic/$topic?offset=N&max=M&wait=W
+ *                                      READ        id($topic)  N M W
+ *
+ * The contents of a Request's file are counted in the length of its frame,
+ * but left for the caller to send after it.
+ * @param   t           FrameTable of topics declared on connection.
+ * @param   r           Request structure.
+ * @param   fs          Stream to write frames to.
+ * @return  Number of response frames expected (or -1, having written nothing,
+ *          if Request cannot be framed).
+ */
+int frame_write(FrameTable *t, Request *r, FILE *fs)
+{
+    const char *uri = r->uri ? r->uri : "";
+    const char *body = r->body ? r->body : "";
+
+    if (streq(r->method, "PUT") && strncmp(uri, "/topic/", strlen("/topic/")) == 0)
+    {
+        size_t hlength = r->headers ? strlen(r->headers) : 0;
+        if (hlength > UINT16_MAX || 2 + hlength + strlen(body) + r->flength > UINT32_MAX)
+        {
+            return -1;
+        }
+
+        if (!hlength)
+        {
+            uint32_t id = r->line ? frame_line(t, r->line, fs) : frame_topic(t, uri + strlen("/topic/"), fs);
+            frame_emit(fs, FRAME_PUBLISH, 0, id, NULL, 0, body, strlen(body), r->flength);
+            return 1;
+        }
+
+        char *prefix = malloc(2 + hlength);
+        if (!prefix)
+        {
+            return -1;
+        }
+        uint16_t hlength16 = htons(hlength);
+        memcpy(prefix, &hlength16, sizeof(hlength16));
+        memcpy(prefix + 2, r->headers, hlength);
+
+        uint32_t id = r->line ? frame_line(t, r->line, fs) : frame_topic(t, uri + strlen("/topic/"), fs);
+        frame_emit(fs, FRAME_PUBLISH, FRAME_HEADERS, id, prefix, 2 + hlength, body, strlen(body), r->flength);
+        free(prefix);
+        return 1;
+    }
+
+    if (streq(r->method, "GET") && strncmp(uri, "/topic/", strlen("/topic/")) == 0)
+    {
+        const char *query = strchr(uri, '?');
+        char *name = query ? strndup(uri + strlen("/topic/"), query - uri - strlen("/topic/")) : strdup(uri + strlen("/topic/"));
+        if (!name)
+        {
+            return -1;
+        }
+
+        char cursor[64];
+        int length = snprintf(cursor, sizeof(cursor), "%lld %lld %lld",
+                              frame_argument(query, "offset", 0),
+                              frame_argument(query, "max", 1),
+                              frame_argument(query, "wait", 0));
+        frame_emit(fs, FRAME_READ, 0, frame_topic(t, name, fs), NULL, 0, cursor, length, 0);
+        free(name);
+        return 1;
+    }
+
+    if (streq(r->method, "GET") && strncmp(uri, "/queue/", strlen("/queue/")) == 0)
+    {
+        const char *queue = uri + strlen("/queue/");
+        const char *query = strchr(queue, '?');
+        if (!query)
+        {
+            frame_emit(fs, FRAME_FETCH, 0, 0, NULL, 0, queue, strlen(queue), 0);
+            return 1;
+        }
+
+        char limits[64];
+        int length = snprintf(limits, sizeof(limits), "%c%lld %lld", 0,
+                              frame_argument(query, "max", 1),
+                              frame_argument(query, "bytes", 0));
+        frame_emit(fs, FRAME_FETCH, 0, 0, queue, query - queue, limits, length, 0);
+        return 1;
+    }
+
+    if (strncmp(uri, "/subscription/", strlen("/subscription/")) == 0)
+    {
+        const char *queue = uri + strlen("/subscription/");
+        const char *slash = strrchr(queue, '/');
+        uint8_t opcode = streq(r->method, "PUT") ? FRAME_SUBSCRIBE : FRAME_UNSUBSCRIBE;
+
+        if (!slash || (!streq(r->method, "PUT") && !streq(r->method, "DELETE")))
+        {
+            return -1;
+        }
+
+        if (opcode == FRAME_SUBSCRIBE && r->body && *r->body)
+        {
+            /* Queue name, NUL, then selector */
+            char *prefix = strndup(queue, slash - queue);
+            if (!prefix)
+            {
+                return -1;
+            }
+            frame_emit(fs, opcode, 0, frame_topic(t, slash + 1, fs), prefix, slash - queue + 1, r->body, strlen(r->body), 0);
+            free(prefix);
+        }
+        else
+        {
+            frame_emit(fs, opcode, 0, frame_topic(t, slash + 1, fs), NULL, 0, queue, slash - queue, 0);
+        }
+        return 1;
+    }
+
+    return -1;
+}
+
+/**
+ * Forget all declared topics (when connection is closed).
+ * @param   t           FrameTable structure.
+ */
+void frame_clear(FrameTable *t)
+{
+    for (size_t i = 0; i < FRAME_BUCKETS; i++)
+    {
+        FrameTopic *topic = t->buckets[i];
+        while (topic)
+        {
+            FrameTopic *next = topic->next;
+            free(topic->name);
+            free(topic);
+            topic = next;
+        }
+        t->buckets[i] = NULL;
+    }
+    t->count = 0;
+    t->generation = 0;
+}
+
+/* Internal Functions */
+
+/**
+ * Lookup id of topic, declaring a new one on the stream if necessary.
+ * @param   t           FrameTable structure.
+ * @param   name        Name of topic.
+ * @param   fs          Stream to write declaration to.
+ * @return  Id of topic.
+ */
+static uint32_t frame_topic(FrameTable *t, const char *name, FILE *fs)
+{
+    uint32_t hash = 5381;
+    for (const char *c = name; *c; c++)
+    {
+        hash = hash * 33 + (uint8_t)*c;
+    }
+
+    FrameTopic **bucket = &t->buckets[hash % FRAME_BUCKETS];
+    for (FrameTopic *topic = *bucket; topic; topic = topic->next)
+    {
+        if (streq(topic->name, name))
+        {
+            return topic->id;
+        }
+    }
+
+    FrameTopic *topic = calloc(1, sizeof(FrameTopic));
+    if (!topic || !(topic->name = strdup(name)))
+    {
+        free(topic);
+        frame_emit(fs, FRAME_DECLARE, 0, t->count + 1, NULL, 0, name, strlen(name), 0);
+        return t->count + 1; // Redeclared each time it is used
+    }
+
+    topic->id = ++t->count;
+    topic->next = *bucket;
+    *bucket = topic;
+
+    frame_emit(fs, FRAME_DECLARE, 0, topic->id, NULL, 0, name, strlen(name), 0);
+    return topic->id;
+}
+
+/**
+ * Lookup id of topic of RequestLine, which caches it for the connection that
+ * declared it (so only the first Request on a connection hashes the topic).
+ * @param   t           FrameTable structure.
+ * @param   l           RequestLine structure (of "/topic/$name").
+ * @param   fs          Stream to write declaration to.
+ * @return  Id of topic.
+ */
+static uint32_t frame_line(FrameTable *t, RequestLine *l, FILE *fs)
+{
+    if (!t->generation)
+    {
+        t->generation = __atomic_add_fetch(&FrameGenerations, 1, __ATOMIC_RELAXED);
+    }
+    if (l->generation == t->generation)
+    {
+        return l->id;
+    }
+
+    uint32_t id = frame_topic(t, l->uri + strlen("/topic/"), fs);
+    if (id <= t->count) // Not cached if topic could not be added to table
+    {
+        l->id = id;
+        l->generation = t->generation;
+    }
+    return id;
+}
+
+/**
+ * Return value of integer argument in query string.
+ * @param   query       Query string (starting with '?', or NULL).
+ * @param   name        Name of argument.
+ * @param   fallback    Value if argument is missing.
+ * @return  Value of argument (or fallback).
+ */
+static long long frame_argument(const char *query, const char *name, long long fallback)
+{
+    size_t length = strlen(name);
+    for (const char *c = query; c && *c; c = strchr(c, '&'))
+    {
+        c++;
+        if (strncmp(c, name, length) == 0 && c[length] == '=')
+        {
+            return strtoll(c + length + 1, NULL, 10);
+        }
+    }
+    return fallback;
+}
+
+/**
+ * Write one frame (header, then body in two parts) to stream.
+ * @param   fs          Stream to write to.
+ * @param   opcode      Frame opcode.
+ * @param   flags       Frame flags.
+ * @param   id          Topic id.
+ * @param   prefix      First part of frame body (may be NULL).
+ * @param   plength     Length of first part.
+ * @param   body        Rest of frame body.
+ * @param   length      Length of rest of frame body.
+ * @param   trailing    Length of frame body the caller sends after it (from a file).
+ */
+static void frame_emit(FILE *fs, uint8_t opcode, uint8_t flags, uint32_t id, const char *prefix, size_t plength, const char *body, size_t length, size_t trailing)
+{
+    char header[FRAME_HEADER];
+    Frame f = {.length = plength + length + trailing, .opcode = opcode, .flags = flags, .id = id};
+
+    frame_pack(&f, header);
+    fwrite(header, 1, FRAME_HEADER, fs);
+    if (plength)
+    {
+        fwrite(prefix, 1, plength, fs);
+    }
+    fwrite(body, 1, length, fs);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,129 @@
+/* hashring.c: Consistent hashing of keys to nodes */
+
+#include "mq/hashring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Internal Prototypes */
+
+static int hashring_compare(const void *a, const void *b);
+
+/* External Functions */
+
+/**
+ * Create HashRing with HASHRING_REPLICAS points per node, placed by hashing
+ * the node's name (so a node's points do not depend on the other nodes or
+ * their order).
+ * @param   nodes   Names of nodes.
+ * @param   nnodes  Number of nodes (at least one).
+ * @return  Newly allocated HashRing structure (or NULL on failure).
+ */
+HashRing *hashring_create(const char *const *nodes, size_t nnodes)
+{
+    HashRing *r = calloc(1, sizeof(HashRing));
+    if (!r || !nnodes || !(r->points = calloc(nnodes * HASHRING_REPLICAS, sizeof(HashPoint))))
+    {
+        free(r);
+        return NULL;
+    }
+
+    char name[BUFSIZ];
+    for (size_t node = 0; node < nnodes; node++)
+    {
+        for (size_t i = 0; i < HASHRING_REPLICAS; i++)
+        {
+            snprintf(name, sizeof(name), "%s#%zu", nodes[node], i);
+            r->points[r->npoints].hash = hashring_hash(name);
+            r->points[r->npoints].node = node;
+            r->npoints++;
+        }
+    }
+
+    qsort(r->points, r->npoints, sizeof(HashPoint), hashring_compare);
+    return r;
+}
+
+/**
+ * Delete HashRing structure.
+ * @param   r       HashRing structure.
+ */
+void hashring_delete(HashRing *r)
+{
+    if (r)
+    {
+        free(r->points);
+        free(r);
+    }
+}
+
+/**
+ * Return node that key belongs to.
+ * @param   r       HashRing structure.
+ * @param   key     Key to lookup.
+ * @return  Index of node.
+ */
+size_t hashring_lookup(const HashRing *r, const char *key)
+{
+    uint64_t hash = hashring_hash(key);
+
+    /* First point at or after hash (wrapping around to the first point) */
+    size_t low = 0;
+    size_t high = r->npoints;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (r->points[middle].hash < hash)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return r->points[low < r->npoints ? low : 0].node;
+}
+
+/**
+ * Hash string (FNV-1a, with its bits mixed so similar strings spread over
+ * the whole ring).
+ * @param   key     String to hash.
+ * @return  64-bit hash.
+ */
+uint64_t hashring_hash(const char *key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = key; *c; c++)
+    {
+        hash = (hash ^ (uint8_t)*c) * 1099511628211ULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* Internal Functions */
+
+/**
+ * Order points by hash (then node, so equal hashes order the same way).
+ * @param   a       First HashPoint.
+ * @param   b       Second HashPoint.
+ * @return  Negative, zero or positive (as for qsort).
+ */
+static int hashring_compare(const void *a, const void *b)
+{
+    const HashPoint *p = a;
+    const HashPoint *q = b;
+    if (p->hash != q->hash)
+    {
+        return p->hash < q->hash ? -1 : 1;
+    }
+    return p->node < q->node ? -1 : p->node > q->node;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
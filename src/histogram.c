@@ -0,0 +1,158 @@
+/* histogram.c: High dynamic range latency histogram */
+
+#include "mq/histogram.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+/* Internal Prototypes */
+
+static size_t histogram_index(uint64_t value);
+static uint64_t histogram_value(size_t index);
+
+/* External Functions */
+
+/**
+ * Record value in histogram (safe to call from multiple threads).
+ * @param   h       Histogram structure.
+ * @param   value   Value to record.
+ */
+void histogram_record(Histogram *h, uint64_t value)
+{
+    __atomic_fetch_add(&h->counts[histogram_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+
+    /* Minimum of zero means unset (or zero was recorded, which is final) */
+    uint64_t min = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while ((min == 0 || value < min) &&
+           !__atomic_compare_exchange_n(&h->min, &min, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copy histogram (while it may still be recorded into).
+ * @param   h       Histogram structure.
+ * @param   copy    Histogram structure to copy into.
+ */
+void histogram_copy(const Histogram *h, Histogram *copy)
+{
+    copy->count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+    copy->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    copy->min = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    copy->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        copy->counts[i] = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Add values recorded in other histogram (which must not be recorded into).
+ * @param   h       Histogram structure.
+ * @param   other   Histogram structure to add.
+ */
+void histogram_merge(Histogram *h, const Histogram *other)
+{
+    if (other->count == 0)
+    {
+        return;
+    }
+
+    h->min = h->count == 0 || other->min < h->min ? other->min : h->min;
+    h->max = other->max > h->max ? other->max : h->max;
+    h->count += other->count;
+    h->sum += other->sum;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        h->counts[i] += other->counts[i];
+    }
+}
+
+/**
+ * Forget all recorded values.
+ * @param   h       Histogram structure.
+ */
+void histogram_reset(Histogram *h)
+{
+    memset(h, 0, sizeof(Histogram));
+}
+
+/**
+ * Return value at percentile: the highest value equivalent (within the
+ * histogram's precision) to the recorded value at that rank.
+ * @param   h           Histogram structure.
+ * @param   percentile  Percentile (0 to 100).
+ * @return  Value at percentile (or 0 if histogram is empty).
+ */
+uint64_t histogram_percentile(const Histogram *h, double percentile)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        total += h->counts[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+    rank = rank < 1 ? 1 : (rank > total ? total : rank);
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= rank)
+        {
+            uint64_t value = histogram_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Internal Functions */
+
+/**
+ * Return bucket of value: values below HISTOGRAM_SUB have a bucket each, then
+ * every power of two is split into HISTOGRAM_SUB equal buckets.
+ * @param   value   Value to find bucket of.
+ * @return  Index of bucket.
+ */
+static size_t histogram_index(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB)
+    {
+        return value;
+    }
+
+    unsigned shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & (HISTOGRAM_SUB - 1));
+}
+
+/**
+ * Return highest value of bucket.
+ * @param   index   Index of bucket.
+ * @return  Highest value that falls in bucket.
+ */
+static uint64_t histogram_value(size_t index)
+{
+    if (index < HISTOGRAM_SUB)
+    {
+        return index;
+    }
+
+    unsigned shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t lowest = (uint64_t)(HISTOGRAM_SUB + (index & (HISTOGRAM_SUB - 1))) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,956 @@
+/* inproc.c: In-process broker transport */
+
+#include "mq/client.h"
+#include "mq/inproc.h"
+#include "mq/logging.h"
+#include "mq/string.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Internal Prototypes */
+
+static InprocBroker *inproc_broker(const char *name);
+static InprocQueue *inproc_queue(InprocBroker *b, const char *name, bool create);
+static InprocTopic *inproc_topic(InprocBroker *b, const char *name, bool create);
+static void inproc_serve(Inproc *p, uint8_t tag, Request *r, InprocResponse *response);
+static void inproc_publish(Inproc *p, const char *topic, Request *r, InprocResponse *response);
+static void inproc_retrieve(Inproc *p, uint8_t tag, const char *queue, InprocResponse *response);
+static void inproc_subscribe(Inproc *p, const char *path, Request *r, InprocResponse *response);
+static void inproc_unsubscribe(Inproc *p, const char *path, InprocResponse *response);
+static bool inproc_duplicate(InprocBroker *b, Request *r, Message *m, InprocResponse *response);
+static void inproc_deliver(InprocQueue *q, Message *m);
+static void inproc_release(InprocEntry *e);
+static long long inproc_argument(const char *query, const char *name, long long fallback);
+static Message *inproc_message(Request *r);
+static void inproc_format(InprocResponse *response, int status, const char *format, ...) __attribute__((format(printf, 3, 4)));
+static void inproc_respond(Inproc *p, uint8_t tag, const InprocResponse *response);
+static void inproc_forget(Inproc *p, bool any, uint8_t tag);
+static size_t inproc_hash(const char *name);
+static void *inproc_transport_attach(const char *path);
+static void inproc_transport_detach(void *endpoint);
+static bool inproc_transport_send(void *endpoint, uint8_t tag, Request *r);
+static char *inproc_transport_recv(void *endpoint, uint8_t *tag, size_t *length);
+static int inproc_transport_event(void *endpoint);
+static void inproc_transport_wake(void *endpoint);
+static void inproc_transport_cancel(void *endpoint, uint8_t tag);
+
+/* External Variables */
+
+/* Requests are served as they are sent (on the sender's reactor thread), and
+ * messages are shared by reference between queues rather than copied */
+const Transport InprocTransport = {
+    .prefix = INPROC_PREFIX,
+    .batches = true,
+    .attach = inproc_transport_attach,
+    .detach = inproc_transport_detach,
+    .send = inproc_transport_send,
+    .recv = inproc_transport_recv,
+    .event = inproc_transport_event,
+    .wake = inproc_transport_wake,
+    .cancel = inproc_transport_cancel,
+};
+
+/* Internal Variables */
+
+static Mutex         InprocLock = PTHREAD_MUTEX_INITIALIZER;
+static InprocBroker *InprocBrokers = NULL;
+
+/* External Functions */
+
+/**
+ * Attach to in-process broker with name (creating it on first use).  Brokers
+ * serve the same topic, queue, and subscription requests as mq_server.py
+ * (except topic logs, selectors, stats, and message headers such as TTL and
+ * delay, though duplicates are dropped), and keep their queues until the
+ * process exits.
+ * @param   name    Name of broker.
+ * @return  Newly allocated Inproc structure (or NULL on failure).
+ */
+Inproc *inproc_attach(const char *name)
+{
+    Inproc *p = calloc(1, sizeof(Inproc));
+    if (!p)
+    {
+        return NULL;
+    }
+
+    if (!(p->broker = inproc_broker(name)) || (p->event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    {
+        error("Unable to attach to %s%s: %s", INPROC_PREFIX, name, strerror(errno));
+        free(p);
+        return NULL;
+    }
+    mutex_init(&p->lock, NULL);
+    return p;
+}
+
+/**
+ * Detach from broker (abandoning retrievals still waiting for messages) and
+ * discard responses that were not received.
+ * @param   p       Inproc structure.
+ */
+void inproc_detach(Inproc *p)
+{
+    if (p)
+    {
+        inproc_forget(p, true, 0);
+
+        while (p->head)
+        {
+            InprocRecord *next = p->head->next;
+            free(p->head->data);
+            free(p->head);
+            p->head = next;
+        }
+        close(p->event);
+        pthread_mutex_destroy(&p->lock);
+        free(p);
+    }
+}
+
+/**
+ * Serve list of requests in order, and append one response record for all
+ * of them to the endpoint's records: the response to the last request (or to
+ * the first publish refused with 429, which ends the list), with the highest
+ * load of the publishes.  A retrieval from an empty queue is answered once a
+ * message is published to it.
+ * @param   p       Inproc structure.
+ * @param   tag     Tag identifying the exchange.
+ * @param   r       Requests to serve.
+ * @return  Whether or not the requests were served.
+ */
+bool inproc_send(Inproc *p, uint8_t tag, Request *r)
+{
+    InprocResponse response = {0};
+    bool published = false;
+    double load = 0;
+
+    mutex_lock(&p->broker->lock);
+    for (Request *s = r; s; s = s->next)
+    {
+        inproc_release(response.entries);
+        memset(&response, 0, sizeof(response));
+        inproc_serve(p, tag, s, &response);
+
+        published |= response.published;
+        load = response.load > load ? response.load : load;
+        if (response.status == 429)
+        {
+            break;
+        }
+    }
+    mutex_unlock(&p->broker->lock);
+
+    response.published = published;
+    response.load = load;
+    if (response.status)
+    {
+        inproc_respond(p, tag, &response);
+    }
+    inproc_release(response.entries);
+    return true;
+}
+
+/**
+ * Remove next response record.
+ * @param   p       Inproc structure.
+ * @param   tag     Tag identifying the exchange.
+ * @param   length  Length of record data.
+ * @return  Record data (or NULL if there are none), owned by the caller.
+ */
+char *inproc_recv(Inproc *p, uint8_t *tag, size_t *length)
+{
+    mutex_lock(&p->lock);
+    InprocRecord *record = p->head;
+    if (record)
+    {
+        p->head = record->next;
+        p->tail = p->head ? p->tail : NULL;
+    }
+    mutex_unlock(&p->lock);
+
+    if (!record)
+    {
+        return NULL;
+    }
+
+    char *data = record->data;
+    *tag = record->tag;
+    *length = record->length;
+    free(record);
+    return data;
+}
+
+/**
+ * Signal endpoint's eventfd (to interrupt a pending read of it).
+ * @param   p       Inproc structure.
+ */
+void inproc_wake(Inproc *p)
+{
+    uint64_t value = 1;
+    if (write(p->event, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    {
+        error("Unable to signal eventfd: %s", strerror(errno));
+    }
+}
+
+/**
+ * Abandon retrieval waiting for a message, so the next message published to
+ * its queue is left for another consumer.
+ * @param   p       Inproc structure.
+ * @param   tag     Tag identifying the exchange.
+ */
+void inproc_cancel(Inproc *p, uint8_t tag)
+{
+    inproc_forget(p, false, tag);
+}
+
+/* Internal Functions */
+
+/**
+ * Return broker with name (creating it if necessary).
+ * @param   name    Name of broker.
+ * @return  InprocBroker structure (or NULL on failure).
+ */
+static InprocBroker *inproc_broker(const char *name)
+{
+    mutex_lock(&InprocLock);
+
+    InprocBroker *b = InprocBrokers;
+    while (b && !streq(b->name, name))
+    {
+        b = b->next;
+    }
+
+    if (!b && (b = calloc(1, sizeof(InprocBroker))))
+    {
+        if ((b->name = strdup(name)))
+        {
+            mutex_init(&b->lock, NULL);
+            b->next = InprocBrokers;
+            InprocBrokers = b;
+        }
+        else
+        {
+            free(b);
+            b = NULL;
+        }
+    }
+
+    mutex_unlock(&InprocLock);
+    return b;
+}
+
+/**
+ * Return broker's queue with name (must be called with broker locked).
+ * @param   b       InprocBroker structure.
+ * @param   name    Name of queue.
+ * @param   create  Whether or not to create queue if it does not exist.
+ * @return  InprocQueue structure (or NULL if it does not exist).
+ */
+static InprocQueue *inproc_queue(InprocBroker *b, const char *name, bool create)
+{
+    InprocQueue **bucket = &b->queues[inproc_hash(name)];
+    for (InprocQueue *q = *bucket; q; q = q->next)
+    {
+        if (streq(q->name, name))
+        {
+            return q;
+        }
+    }
+
+    InprocQueue *q = create ? calloc(1, sizeof(InprocQueue)) : NULL;
+    if (q && !(q->name = strdup(name)))
+    {
+        free(q);
+        q = NULL;
+    }
+    if (q)
+    {
+        q->next = *bucket;
+        *bucket = q;
+    }
+    return q;
+}
+
+/**
+ * Return broker's topic with name (must be called with broker locked).
+ * @param   b       InprocBroker structure.
+ * @param   name    Name of topic.
+ * @param   create  Whether or not to create topic if it does not exist.
+ * @return  InprocTopic structure (or NULL if it does not exist).
+ */
+static InprocTopic *inproc_topic(InprocBroker *b, const char *name, bool create)
+{
+    InprocTopic **bucket = &b->topics[inproc_hash(name)];
+    for (InprocTopic *t = *bucket; t; t = t->next)
+    {
+        if (streq(t->name, name))
+        {
+            return t;
+        }
+    }
+
+    InprocTopic *t = create ? calloc(1, sizeof(InprocTopic)) : NULL;
+    if (t && !(t->name = strdup(name)))
+    {
+        free(t);
+        t = NULL;
+    }
+    if (t)
+    {
+        t->next = *bucket;
+        *bucket = t;
+    }
+    return t;
+}
+
+/**
+ * Serve one request (must be called with broker locked).
+ * @param   p           Inproc structure.
+ * @param   tag         Tag identifying the exchange.
+ * @param   r           Request to serve.
+ * @param   response    Result of request.
+ */
+static void inproc_serve(Inproc *p, uint8_t tag, Request *r, InprocResponse *response)
+{
+    const char *uri = r->uri;
+
+    if (streq(r->method, "PUT") && strncmp(uri, "/topic/", strlen("/topic/")) == 0)
+    {
+        inproc_publish(p, uri + strlen("/topic/"), r, response);
+    }
+    else if (streq(r->method, "GET") && strncmp(uri, "/queue/", strlen("/queue/")) == 0)
+    {
+        inproc_retrieve(p, tag, uri + strlen("/queue/"), response);
+    }
+    else if (streq(r->method, "PUT") && strncmp(uri, "/subscription/", strlen("/subscription/")) == 0)
+    {
+        inproc_subscribe(p, uri + strlen("/subscription/"), r, response);
+    }
+    else if (streq(r->method, "DELETE") && strncmp(uri, "/subscription/", strlen("/subscription/")) == 0)
+    {
+        inproc_unsubscribe(p, uri + strlen("/subscription/"), response);
+    }
+    else
+    {
+        inproc_format(response, 404, "Not Found\n");
+    }
+}
+
+/**
+ * Publish message to each queue subscribed to topic, unless one of them is
+ * at its maximum depth (then the message is refused with 429) or the message
+ * is a duplicate of one its producer published before.
+ * @param   p           Inproc structure.
+ * @param   topic       Name of topic.
+ * @param   r           Publish request.
+ * @param   response    Result of request (with load of deepest queue).
+ */
+static void inproc_publish(Inproc *p, const char *topic, Request *r, InprocResponse *response)
+{
+    InprocTopic *t = inproc_topic(p->broker, topic, false);
+    if (!t || !t->nsubscribers)
+    {
+        inproc_format(response, 404, "There are no subscribers for topic: %s\n", topic);
+        return;
+    }
+
+    size_t depth = 0;
+    for (size_t i = 0; i < t->nsubscribers; i++)
+    {
+        depth = t->subscribers[i]->depth > depth ? t->subscribers[i]->depth : depth;
+    }
+    response->published = true;
+    response->load = (double)depth / INPROC_MAX_DEPTH;
+
+    if (response->load >= 1.0)
+    {
+        response->retry = INPROC_RETRY_AFTER * response->load;
+        inproc_format(response, 429, "Queues are overloaded (%.0f%% of maximum depth), retry after %u ms\n", response->load * 100, response->retry);
+        return;
+    }
+
+    Message *m = inproc_message(r);
+    if (!m)
+    {
+        inproc_format(response, 500, "Unable to read message\n");
+        return;
+    }
+
+    if (!inproc_duplicate(p->broker, r, m, response))
+    {
+        for (size_t i = 0; i < t->nsubscribers; i++)
+        {
+            inproc_deliver(t->subscribers[i], m);
+        }
+        inproc_format(response, 200, "Published message (%zu bytes) to %zu subscribers of %s\n", m->length, t->nsubscribers, topic);
+    }
+    message_release(m);
+}
+
+/**
+ * Retrieve one message from queue (or wait until one is published).  With a
+ * max argument, retrieve a batch instead: the first message (as above), then
+ * those already queued behind it, up to max messages or until bytes (if
+ * nonzero) are reached.
+ * @param   p           Inproc structure.
+ * @param   tag         Tag identifying the exchange.
+ * @param   queue       Name of queue (followed by "?max=N&bytes=B", if a batch).
+ * @param   response    Result of request (status 0 while waiting).
+ */
+static void inproc_retrieve(Inproc *p, uint8_t tag, const char *queue, InprocResponse *response)
+{
+    const char *query = strchr(queue, '?');
+    long long max = inproc_argument(query, "max", 1);
+    long long bytes = inproc_argument(query, "bytes", 0);
+    if (max < 1 || bytes < 0)
+    {
+        inproc_format(response, 400, "Invalid retrieval of max %lld, bytes %lld\n", max, bytes);
+        return;
+    }
+
+    char name[BUFSIZ];
+    snprintf(name, sizeof(name), "%.*s", (int)(query ? query - queue : (ptrdiff_t)strlen(queue)), queue);
+    InprocQueue *q = inproc_queue(p->broker, name, false);
+    if (!q)
+    {
+        inproc_format(response, 404, "There is no queue named: %s\n", name);
+        return;
+    }
+
+    InprocEntry *e = q->head;
+    if (e)
+    {
+        size_t total = e->message->length;
+        long long n = 1;
+        for (; n < max && n < INPROC_FETCH_MAX && (!bytes || total < (size_t)bytes) && e->next; n++)
+        {
+            e = e->next;
+            total += e->message->length;
+        }
+
+        response->status = 200;
+        response->entries = q->head;
+        response->records = query != NULL;
+        q->head = e->next;
+        q->tail = q->head ? q->tail : NULL;
+        q->depth -= n;
+        e->next = NULL;
+        return;
+    }
+
+    InprocWaiter *w = calloc(1, sizeof(InprocWaiter));
+    if (!w)
+    {
+        inproc_format(response, 500, "Unable to wait for message\n");
+        return;
+    }
+    w->endpoint = p;
+    w->tag = tag;
+    w->records = query != NULL;
+
+    InprocWaiter **last = &q->waiters;
+    while (*last)
+    {
+        last = &(*last)->next;
+    }
+    *last = w;
+}
+
+/**
+ * Subscribe queue to topic (creating the queue if necessary).
+ * @param   p           Inproc structure.
+ * @param   path        Queue and topic ("$queue/$topic").
+ * @param   r           Subscribe request (with selector as body).
+ * @param   response    Result of request.
+ */
+static void inproc_subscribe(Inproc *p, const char *path, Request *r, InprocResponse *response)
+{
+    const char *slash = strrchr(path, '/');
+    if (!slash)
+    {
+        inproc_format(response, 404, "Not Found\n");
+        return;
+    }
+    if (r->body && r->body[0])
+    {
+        inproc_format(response, 400, "Invalid selector (not supported by in-process brokers): %s\n", r->body);
+        return;
+    }
+
+    char queue[BUFSIZ];
+    snprintf(queue, sizeof(queue), "%.*s", (int)(slash - path), path);
+    const char *topic = slash + 1;
+
+    InprocQueue *q = inproc_queue(p->broker, queue, true);
+    InprocTopic *t = inproc_topic(p->broker, topic, true);
+    if (!q || !t)
+    {
+        inproc_format(response, 500, "Unable to subscribe queue (%s) to topic (%s)\n", queue, topic);
+        return;
+    }
+
+    bool subscribed = false;
+    for (size_t i = 0; i < t->nsubscribers; i++)
+    {
+        subscribed |= t->subscribers[i] == q;
+    }
+
+    if (!subscribed && t->nsubscribers == t->capacity)
+    {
+        size_t capacity = t->capacity ? 2 * t->capacity : 4;
+        InprocQueue **subscribers = realloc(t->subscribers, capacity * sizeof(InprocQueue *));
+        if (!subscribers)
+        {
+            inproc_format(response, 500, "Unable to subscribe queue (%s) to topic (%s)\n", queue, topic);
+            return;
+        }
+        t->subscribers = subscribers;
+        t->capacity = capacity;
+    }
+    if (!subscribed)
+    {
+        t->subscribers[t->nsubscribers++] = q;
+    }
+
+    inproc_format(response, 200, "Subscribed queue (%s) to topic (%s)\n", queue, topic);
+}
+
+/**
+ * Unsubscribe queue from topic.
+ * @param   p           Inproc structure.
+ * @param   path        Queue and topic ("$queue/$topic").
+ * @param   response    Result of request.
+ */
+static void inproc_unsubscribe(Inproc *p, const char *path, InprocResponse *response)
+{
+    const char *slash = strrchr(path, '/');
+    if (!slash)
+    {
+        inproc_format(response, 404, "Not Found\n");
+        return;
+    }
+
+    char queue[BUFSIZ];
+    snprintf(queue, sizeof(queue), "%.*s", (int)(slash - path), path);
+    const char *topic = slash + 1;
+
+    InprocQueue *q = inproc_queue(p->broker, queue, false);
+    InprocTopic *t = inproc_topic(p->broker, topic, false);
+    size_t i = 0;
+    while (q && t && i < t->nsubscribers && t->subscribers[i] != q)
+    {
+        i++;
+    }
+    if (!q || !t || i == t->nsubscribers)
+    {
+        inproc_format(response, 404, "There is no queue named: %s\n", queue);
+        return;
+    }
+
+    t->subscribers[i] = t->subscribers[--t->nsubscribers];
+    inproc_format(response, 200, "Unsubscribed queue (%s) from topic (%s)\n", queue, topic);
+}
+
+/**
+ * Record sequence number of request's producer (from its producer and
+ * sequence headers), so publishes resent after a 429 refused part of their
+ * batch are not delivered twice.
+ * @param   b           InprocBroker structure.
+ * @param   r           Publish request.
+ * @param   m           Message published by request.
+ * @param   response    Result of request (set if message is a duplicate).
+ * @return  Whether the sequence number was seen before (or is too old to tell).
+ */
+static bool inproc_duplicate(InprocBroker *b, Request *r, Message *m, InprocResponse *response)
+{
+    const char *producer = r->headers ? strstr(r->headers, MQ_HEADER_PRODUCER "=") : NULL;
+    const char *sequence = r->headers ? strstr(r->headers, MQ_HEADER_SEQUENCE "=") : NULL;
+    if (!producer || !sequence)
+    {
+        return false;
+    }
+
+    char name[BUFSIZ];
+    producer += strlen(MQ_HEADER_PRODUCER "=");
+    snprintf(name, sizeof(name), "%.*s", (int)strcspn(producer, "\n"), producer);
+    uint64_t number = strtoull(sequence + strlen(MQ_HEADER_SEQUENCE "="), NULL, 10);
+
+    InprocProducer **bucket = &b->producers[inproc_hash(name)];
+    InprocProducer *e = *bucket;
+    while (e && !streq(e->name, name))
+    {
+        e = e->next;
+    }
+    if (!e)
+    {
+        if (!(e = calloc(1, sizeof(InprocProducer))) || !(e->name = strdup(name)))
+        {
+            free(e);
+            return false;
+        }
+        e->next = *bucket;
+        *bucket = e;
+    }
+
+    /* Bits of sequence numbers that slid out of the window are cleared */
+    for (uint64_t s = e->highest + 1; s <= number && s <= e->highest + INPROC_WINDOW; s++)
+    {
+        e->seen[(s % INPROC_WINDOW) / 64] &= ~(1ULL << (s % 64));
+    }
+    if (number > e->highest)
+    {
+        e->highest = number;
+    }
+    else if (e->highest - number >= INPROC_WINDOW || e->seen[(number % INPROC_WINDOW) / 64] & (1ULL << (number % 64)))
+    {
+        inproc_format(response, 200, "Ignored duplicate message (%zu bytes) from producer %s (sequence %" PRIu64 ")\n", m->length, name, number);
+        return true;
+    }
+
+    e->seen[(number % INPROC_WINDOW) / 64] |= 1ULL << (number % 64);
+    return false;
+}
+
+/**
+ * Pass message to queue's longest waiting retrieval (or append it to queue).
+ * @param   q       InprocQueue structure.
+ * @param   m       Message to deliver (retained by queue).
+ */
+static void inproc_deliver(InprocQueue *q, Message *m)
+{
+    InprocWaiter *w = q->waiters;
+    if (w)
+    {
+        InprocEntry e = {.message = m};
+        InprocResponse response = {.status = 200, .entries = &e, .records = w->records};
+        q->waiters = w->next;
+        inproc_respond(w->endpoint, w->tag, &response);
+        free(w);
+        return;
+    }
+
+    InprocEntry *e = malloc(sizeof(InprocEntry));
+    if (!e)
+    {
+        error("Unable to queue message for %s", q->name);
+        return;
+    }
+    e->message = message_retain(m);
+    e->next = NULL;
+    if (q->tail)
+    {
+        q->tail->next = e;
+    }
+    else
+    {
+        q->head = e;
+    }
+    q->tail = e;
+    q->depth++;
+}
+
+/**
+ * Free list of entries (releasing their messages).
+ * @param   e       First InprocEntry structure (may be NULL).
+ */
+static void inproc_release(InprocEntry *e)
+{
+    while (e)
+    {
+        InprocEntry *next = e->next;
+        message_release(e->message);
+        free(e);
+        e = next;
+    }
+}
+
+/**
+ * Return value of integer argument in query string.
+ * @param   query       Query string (starting with '?', or NULL).
+ * @param   name        Name of argument.
+ * @param   fallback    Value if argument is missing.
+ * @return  Value of argument (or fallback).
+ */
+static long long inproc_argument(const char *query, const char *name, long long fallback)
+{
+    size_t length = strlen(name);
+    for (const char *c = query; c && *c; c = strchr(c, '&'))
+    {
+        c++;
+        if (strncmp(c, name, length) == 0 && c[length] == '=')
+        {
+            return strtoll(c + length + 1, NULL, 10);
+        }
+    }
+    return fallback;
+}
+
+/**
+ * Return message published by request: its shared body, or a copy of its
+ * body followed by the contents of its file.
+ * @param   r       Publish request.
+ * @return  Message structure with one reference (or NULL on failure).
+ */
+static Message *inproc_message(Request *r)
+{
+    const char *body = r->body ? r->body : "";
+    size_t length = strlen(body);
+
+    if (r->message && !r->flength && length == r->message->length)
+    {
+        return message_retain(r->message);
+    }
+    if (!r->flength)
+    {
+        return message_create(body, length);
+    }
+
+    char *buffer = malloc(length + r->flength);
+    if (!buffer)
+    {
+        return NULL;
+    }
+    memcpy(buffer, body, length);
+    for (size_t copied = 0; copied < r->flength;)
+    {
+        ssize_t n = pread(r->file, buffer + length + copied, r->flength - copied, r->foffset + copied);
+        if (n <= 0)
+        {
+            free(buffer);
+            return NULL;
+        }
+        copied += n;
+    }
+
+    Message *m = message_create(buffer, length + r->flength);
+    free(buffer);
+    return m;
+}
+
+/**
+ * Set status and formatted body of response.
+ * @param   response    Result of request.
+ * @param   status      HTTP status code.
+ * @param   format      Format of response body.
+ */
+static void inproc_format(InprocResponse *response, int status, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(response->text, sizeof(response->text), format, args);
+    va_end(args);
+
+    response->status = status;
+    response->length = length < (int)sizeof(response->text) ? (size_t)length : sizeof(response->text) - 1;
+}
+
+/**
+ * Append HTTP response record to endpoint's records (signaling its eventfd if
+ * there were none).
+ * @param   p           Inproc structure.
+ * @param   tag         Tag identifying the exchange.
+ * @param   response    Result of request.
+ */
+static void inproc_respond(Inproc *p, uint8_t tag, const InprocResponse *response)
+{
+    int status = response->status;
+    const char *reason = status == 200 ? "OK" :
+                         status == 400 ? "Bad Request" :
+                         status == 404 ? "Not Found" :
+                         status == 429 ? "Too Many Requests" : "Internal Server Error";
+    size_t length = response->entries ? 0 : response->length;
+    for (InprocEntry *e = response->entries; e; e = e->next)
+    {
+        length += (response->records ? (size_t)snprintf(NULL, 0, "%zu\n", e->message->length) : 0) + e->message->length;
+    }
+
+    char header[BUFSIZ];
+    int hlength = snprintf(header, sizeof(header), "HTTP/1.0 %d %s\r\n", status, reason);
+    if (response->published)
+    {
+        hlength += snprintf(header + hlength, sizeof(header) - hlength, "Mq-Load: %.3f\r\n", response->load);
+    }
+    if (status == 429)
+    {
+        hlength += snprintf(header + hlength, sizeof(header) - hlength, "Retry-After: %u\r\nMq-Retry-After: %u\r\n", (response->retry + 999) / 1000, response->retry);
+    }
+    hlength += snprintf(header + hlength, sizeof(header) - hlength, "Content-Length: %zu\r\n\r\n", length);
+
+    InprocRecord *record = malloc(sizeof(InprocRecord));
+    char *data = malloc(hlength + length + 1);
+    if (!record || !data)
+    {
+        error("Unable to respond to %s%s", INPROC_PREFIX, p->broker->name);
+        free(record);
+        free(data);
+        return;
+    }
+    memcpy(data, header, hlength);
+    char *body = data + hlength;
+    if (!response->entries)
+    {
+        memcpy(body, response->text, length);
+    }
+    for (InprocEntry *e = response->entries; e; e = e->next)
+    {
+        body += response->records ? sprintf(body, "%zu\n", e->message->length) : 0;
+        memcpy(body, e->message->body, e->message->length);
+        body += e->message->length;
+    }
+    data[hlength + length] = 0;
+
+    record->data = data;
+    record->length = hlength + length;
+    record->tag = tag;
+    record->next = NULL;
+
+    mutex_lock(&p->lock);
+    bool empty = !p->head;
+    if (p->tail)
+    {
+        p->tail->next = record;
+    }
+    else
+    {
+        p->head = record;
+    }
+    p->tail = record;
+    mutex_unlock(&p->lock);
+
+    /* Receiver drains every record after each signal */
+    if (empty)
+    {
+        inproc_wake(p);
+    }
+}
+
+/**
+ * Remove endpoint's retrievals waiting for messages.
+ * @param   p       Inproc structure.
+ * @param   any     Whether to remove retrievals of any exchange (or only tag's).
+ * @param   tag     Tag identifying the exchange.
+ */
+static void inproc_forget(Inproc *p, bool any, uint8_t tag)
+{
+    InprocBroker *b = p->broker;
+
+    mutex_lock(&b->lock);
+    for (size_t i = 0; i < INPROC_BUCKETS; i++)
+    {
+        for (InprocQueue *q = b->queues[i]; q; q = q->next)
+        {
+            InprocWaiter **w = &q->waiters;
+            while (*w)
+            {
+                if ((*w)->endpoint == p && (any || (*w)->tag == tag))
+                {
+                    InprocWaiter *next = (*w)->next;
+                    free(*w);
+                    *w = next;
+                }
+                else
+                {
+                    w = &(*w)->next;
+                }
+            }
+        }
+    }
+    mutex_unlock(&b->lock);
+}
+
+/**
+ * Hash name to bucket (djb2).
+ * @param   name    Name of queue or topic.
+ * @return  Index of bucket.
+ */
+static size_t inproc_hash(const char *name)
+{
+    size_t hash = 5381;
+    for (const char *c = name; *c; c++)
+    {
+        hash = hash * 33 + (uint8_t)*c;
+    }
+    return hash % INPROC_BUCKETS;
+}
+
+/**
+ * Attach to broker (Transport interface).
+ * @param   path    Name of broker.
+ * @return  Inproc structure (or NULL on failure).
+ */
+static void *inproc_transport_attach(const char *path)
+{
+    return inproc_attach(path);
+}
+
+/**
+ * Detach from broker (Transport interface).
+ * @param   endpoint    Inproc structure.
+ */
+static void inproc_transport_detach(void *endpoint)
+{
+    inproc_detach(endpoint);
+}
+
+/**
+ * Serve request (Transport interface).
+ * @param   endpoint    Inproc structure.
+ * @param   tag         Tag identifying the exchange.
+ * @param   r           Request to serve.
+ * @return  Whether or not the request was served.
+ */
+static bool inproc_transport_send(void *endpoint, uint8_t tag, Request *r)
+{
+    return inproc_send(endpoint, tag, r);
+}
+
+/**
+ * Remove next response record (Transport interface).
+ * @param   endpoint    Inproc structure.
+ * @param   tag         Tag identifying the exchange.
+ * @param   length      Length of record data.
+ * @return  Record data (or NULL if there are none).
+ */
+static char *inproc_transport_recv(void *endpoint, uint8_t *tag, size_t *length)
+{
+    return inproc_recv(endpoint, tag, length);
+}
+
+/**
+ * Return eventfd signaled when response records arrive (Transport interface).
+ * @param   endpoint    Inproc structure.
+ * @return  Eventfd.
+ */
+static int inproc_transport_event(void *endpoint)
+{
+    return ((Inproc *)endpoint)->event;
+}
+
+/**
+ * Signal eventfd locally (Transport interface).
+ * @param   endpoint    Inproc structure.
+ */
+static void inproc_transport_wake(void *endpoint)
+{
+    inproc_wake(endpoint);
+}
+
+/**
+ * Abandon retrieval waiting for a message (Transport interface).
+ * @param   endpoint    Inproc structure.
+ * @param   tag         Tag identifying the exchange.
+ */
+static void inproc_transport_cancel(void *endpoint, uint8_t tag)
+{
+    inproc_cancel(endpoint, tag);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
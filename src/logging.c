@@ -0,0 +1,582 @@
+/* logging.c: Asynchronous logging to per-thread rings */
+
+#include "mq/logging.h"
+#include "mq/string.h"
+#include "mq/thread.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Internal Constants */
+
+#define LOG_LINE    1024    // Bytes of one rendered record
+#define LOG_BUFFER  65536   // Bytes of rendered records written at once
+
+static const char *LogLevels[LOG_OFF] = {"debug", "info", "error"};
+
+/* Internal Structures */
+
+/* Class of format argument (which determines how it is captured) */
+typedef enum
+{
+    LOG_ARG_NONE,
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_INTMAX,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_LDOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER,
+} LogArg;
+
+/* Record of one logging statement: arguments are stored back to back in the
+ * order of the format (strings are copied inline, including their NUL) */
+typedef struct LogRecord LogRecord;
+struct LogRecord
+{
+    LogSite      *site;
+    unsigned long thread;
+    uint32_t      suppressed;
+    uint32_t      length;
+    char          args[LOG_SLOT - sizeof(LogSite *) - sizeof(unsigned long) - 2 * sizeof(uint32_t)];
+};
+
+/* Single producer (owning thread), single consumer (writer) ring.  Rings are
+ * never freed: the ring of an exited thread is claimed by the next new thread,
+ * which appends after any records the writer has yet to drain. */
+typedef struct LogRing LogRing;
+struct LogRing
+{
+    LogRecord     records[LOG_SLOTS];
+    uint64_t      head;     // Next record written by owner
+    uint64_t      tail;     // Next record read by writer
+    uint64_t      dropped;  // Records dropped because ring was full
+    bool          owned;
+    unsigned long thread;   // Thread of last owner
+
+    LogRing      *next;
+};
+
+/* Internal Prototypes */
+
+static void      log_init(void);
+static void     *log_writer(void *arg);
+static void      log_release(void *arg);
+static LogRing  *log_ring(void);
+static void      log_drain(void);
+static void      log_emit(const char *line, size_t length);
+static size_t    log_render(const LogRecord *r, char *line, size_t size);
+static size_t    log_spec(const char *s, LogArg *arg, int *stars);
+static size_t    log_capture(const char *format, va_list args, char *buffer, size_t size);
+static size_t    log_format(const char *format, const char *args, size_t length, char *out, size_t size);
+
+/* External Variables */
+
+LogLevel LogThreshold = LOG_DEBUG;
+
+/* Internal Variables */
+
+static pthread_once_t    LogOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t     LogKey;
+static bool              LogThreaded = false;
+static __thread LogRing *LogLocal = NULL;
+static LogRing          *LogRings = NULL;
+
+static Mutex             LogLock = PTHREAD_MUTEX_INITIALIZER;   // Serializes drains
+static char              LogBuffer[LOG_BUFFER];
+static size_t            LogUsed = 0;
+
+/* External Functions */
+
+/**
+ * Record statement in ring of calling thread without formatting it or
+ * waiting: the statement is dropped if its callsite exceeded LOG_BURST records
+ * this second (and counted in its next record) or if the ring is full (and
+ * counted by the writer).
+ * @param   site    LogSite structure of statement.
+ * @param   format  Printf format of statement (site->format).
+ */
+void log_record(LogSite *site, const char *format, ...)
+{
+    pthread_once(&LogOnce, log_init);
+    if (site->level < __atomic_load_n(&LogThreshold, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    /* Rate limit callsite (races between threads only blur the window) */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t second = ts.tv_sec;
+    if (__atomic_load_n(&site->window, __ATOMIC_RELAXED) != second)
+    {
+        __atomic_store_n(&site->window, second, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= LOG_BURST)
+    {
+        __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRing *ring = log_ring();
+    if (!ring)
+    {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_SLOTS)
+    {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord *r = &ring->records[head % LOG_SLOTS];
+    r->site       = site;
+    r->thread     = pthread_self();
+    r->suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+
+    va_list args;
+    va_start(args, format);
+    r->length = log_capture(format, args, r->args, sizeof(r->args));
+    va_end(args);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    /* Without a writer, records are written by their own thread */
+    if (!LogThreaded)
+    {
+        log_flush();
+    }
+}
+
+/**
+ * Set lowest level of recorded statements.
+ * @param   level   Threshold (LOG_OFF disables logging).
+ */
+void log_level(LogLevel level)
+{
+    pthread_once(&LogOnce, log_init);
+    __atomic_store_n(&LogThreshold, level, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write every record recorded so far (called at exit).
+ */
+void log_flush(void)
+{
+    pthread_once(&LogOnce, log_init);
+    log_drain();
+}
+
+/* Internal Functions */
+
+/**
+ * Read threshold from MQ_LOG_LEVEL and start background writer.
+ */
+static void log_init(void)
+{
+    char *level = getenv("MQ_LOG_LEVEL");
+    for (LogLevel l = LOG_DEBUG; level && l <= LOG_OFF; l++)
+    {
+        if (l == LOG_OFF || streq(level, LogLevels[l]))
+        {
+            __atomic_store_n(&LogThreshold, l, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    pthread_key_create(&LogKey, log_release);
+    atexit(log_flush);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_writer, NULL) == 0)
+    {
+        pthread_detach(thread);
+        LogThreaded = true;
+    }
+}
+
+/**
+ * Drain rings every LOG_PERIOD milliseconds.
+ * @param   arg     Unused.
+ * @return  Never returns.
+ */
+static void *log_writer(void *arg)
+{
+    struct timespec period = {.tv_sec = 0, .tv_nsec = LOG_PERIOD * 1000000L};
+    while (true)
+    {
+        nanosleep(&period, NULL);
+        log_drain();
+    }
+    return NULL;
+}
+
+/**
+ * Give ring of exiting thread up for reuse.
+ * @param   arg     LogRing structure.
+ */
+static void log_release(void *arg)
+{
+    LogRing *ring = arg;
+    __atomic_store_n(&ring->owned, false, __ATOMIC_RELEASE);
+    LogLocal = NULL;
+}
+
+/**
+ * Return ring of calling thread (claiming a released ring or allocating a new
+ * one the first time).
+ * @return  LogRing structure (or NULL on failure).
+ */
+static LogRing *log_ring(void)
+{
+    if (LogLocal)
+    {
+        return LogLocal;
+    }
+
+    LogRing *ring = __atomic_load_n(&LogRings, __ATOMIC_ACQUIRE);
+    for (; ring; ring = ring->next)
+    {
+        bool owned = false;
+        if (__atomic_compare_exchange_n(&ring->owned, &owned, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    if (!ring)
+    {
+        if (!(ring = calloc(1, sizeof(LogRing))))
+        {
+            return NULL;
+        }
+        ring->owned = true;
+        ring->next  = __atomic_load_n(&LogRings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&LogRings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    ring->thread = pthread_self();
+    pthread_setspecific(LogKey, ring);
+    return (LogLocal = ring);
+}
+
+/**
+ * Render and write every record in every ring (with one writer at a time).
+ */
+static void log_drain(void)
+{
+    char line[LOG_LINE];
+
+    mutex_lock(&LogLock);
+    for (LogRing *ring = __atomic_load_n(&LogRings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+    {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        for (; tail < head; tail++)
+        {
+            log_emit(line, log_render(&ring->records[tail % LOG_SLOTS], line, sizeof(line)));
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped)
+        {
+            int n = snprintf(line, sizeof(line), "[%09lu] ERROR Dropped %lu log records (ring full)\n",
+                             ring->thread, (unsigned long)dropped);
+            log_emit(line, n);
+        }
+    }
+
+    fwrite(LogBuffer, 1, LogUsed, stderr);
+    fflush(stderr);
+    LogUsed = 0;
+    mutex_unlock(&LogLock);
+}
+
+/**
+ * Append rendered record to LogBuffer (writing it out first if full).
+ * @param   line    Rendered record.
+ * @param   length  Length of rendered record.
+ */
+static void log_emit(const char *line, size_t length)
+{
+    if (LogUsed + length > sizeof(LogBuffer))
+    {
+        fwrite(LogBuffer, 1, LogUsed, stderr);
+        LogUsed = 0;
+    }
+    memcpy(LogBuffer + LogUsed, line, length);
+    LogUsed += length;
+}
+
+/**
+ * Render record as line of text.
+ * @param   r       LogRecord structure.
+ * @param   line    Buffer to render into.
+ * @param   size    Size of buffer.
+ * @return  Length of line (including its newline).
+ */
+static size_t log_render(const LogRecord *r, char *line, size_t size)
+{
+    const LogSite *site = r->site;
+    int n;
+    switch (site->level)
+    {
+        case LOG_DEBUG:
+            n = snprintf(line, size, "[%09lu] DEBUG %s:%d:%s: ", r->thread, site->file, site->line, site->func);
+            break;
+        case LOG_INFO:
+            n = snprintf(line, size, "[%09lu] INFO  ", r->thread);
+            break;
+        default:
+            n = snprintf(line, size, "[%09lu] ERROR ", r->thread);
+            break;
+    }
+
+    /* Keep room for newline */
+    size_t length = n < 0 ? 0 : (size_t)n < size - 1 ? (size_t)n : size - 2;
+    length += log_format(site->format, r->args, r->length, line + length, size - 1 - length);
+    if (r->suppressed)
+    {
+        n = snprintf(line + length, size - 1 - length, " (%u similar suppressed)", r->suppressed);
+        length += n < 0 ? 0 : (size_t)n < size - 1 - length ? (size_t)n : size - 2 - length;
+    }
+    line[length++] = '\n';
+    return length;
+}
+
+/**
+ * Parse printf conversion specification.
+ * @param   s       Start of specification (at '%').
+ * @param   arg     Class of argument converted (LOG_ARG_NONE for "%%" and
+ *                  unsupported conversions).
+ * @param   stars   Number of int arguments taken by '*' width and precision.
+ * @return  Length of specification.
+ */
+static size_t log_spec(const char *s, LogArg *arg, int *stars)
+{
+    const char *p = s + 1;
+    *stars = 0;
+
+    while (*p && strchr("-+ #0'", *p))
+    {
+        p++;
+    }
+    while (*p == '*' || *p == '.' || isdigit(*p))
+    {
+        *stars += *p++ == '*';
+    }
+
+    int  longs = 0;
+    char modifier = 0;
+    for (; *p && strchr("hlLqjzt", *p); p++)
+    {
+        longs += *p == 'l';
+        modifier = *p == 'l' ? modifier : *p;
+    }
+
+    switch (*p)
+    {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+            *arg = modifier == 'z' ? LOG_ARG_SIZE :
+                   modifier == 'j' ? LOG_ARG_INTMAX :
+                   modifier == 't' ? LOG_ARG_PTRDIFF :
+                   longs >= 2 || modifier == 'q' ? LOG_ARG_LLONG :
+                   longs == 1 ? LOG_ARG_LONG : LOG_ARG_INT;
+            break;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            *arg = modifier == 'L' ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+            break;
+        case 's':
+            *arg = LOG_ARG_STRING;
+            break;
+        case 'p':
+            *arg = LOG_ARG_POINTER;
+            break;
+        default:
+            *arg = LOG_ARG_NONE;
+            *stars = 0;
+            break;
+    }
+    return (*p ? p + 1 : p) - s;
+}
+
+/**
+ * Copy arguments of format into buffer (stopping at the first argument that
+ * does not fit, except strings, which are truncated).
+ * @param   format  Printf format.
+ * @param   args    Arguments of format.
+ * @param   buffer  Buffer to copy into.
+ * @param   size    Size of buffer.
+ * @return  Number of bytes copied.
+ */
+static size_t log_capture(const char *format, va_list args, char *buffer, size_t size)
+{
+    size_t used = 0;
+
+#define LOG_COPY(type, value) \
+    do { \
+        type _v = (value); \
+        if (used + sizeof(type) > size) return used; \
+        memcpy(buffer + used, &_v, sizeof(type)); \
+        used += sizeof(type); \
+    } while (0)
+
+    for (const char *p = strchr(format, '%'); p; p = strchr(p, '%'))
+    {
+        LogArg arg;
+        int    stars;
+        p += log_spec(p, &arg, &stars);
+
+        for (int i = 0; i < stars; i++)
+        {
+            LOG_COPY(int, va_arg(args, int));
+        }
+
+        switch (arg)
+        {
+            case LOG_ARG_INT:       LOG_COPY(int, va_arg(args, int)); break;
+            case LOG_ARG_LONG:      LOG_COPY(long, va_arg(args, long)); break;
+            case LOG_ARG_LLONG:     LOG_COPY(long long, va_arg(args, long long)); break;
+            case LOG_ARG_SIZE:      LOG_COPY(size_t, va_arg(args, size_t)); break;
+            case LOG_ARG_INTMAX:    LOG_COPY(intmax_t, va_arg(args, intmax_t)); break;
+            case LOG_ARG_PTRDIFF:   LOG_COPY(ptrdiff_t, va_arg(args, ptrdiff_t)); break;
+            case LOG_ARG_DOUBLE:    LOG_COPY(double, va_arg(args, double)); break;
+            case LOG_ARG_LDOUBLE:   LOG_COPY(long double, va_arg(args, long double)); break;
+            case LOG_ARG_POINTER:   LOG_COPY(void *, va_arg(args, void *)); break;
+            case LOG_ARG_STRING:
+            {
+                const char *s = va_arg(args, const char *);
+                s = s ? s : "(null)";
+                if (used + 1 >= size)
+                {
+                    return used;
+                }
+                size_t n = strnlen(s, size - used - 1);
+                memcpy(buffer + used, s, n);
+                buffer[used + n] = 0;
+                used += n + 1;
+                break;
+            }
+            case LOG_ARG_NONE:
+                break;
+        }
+    }
+
+#undef LOG_COPY
+    return used;
+}
+
+/**
+ * Format captured arguments (ending with "..." if they were cut short).
+ * @param   format  Printf format.
+ * @param   args    Captured arguments.
+ * @param   length  Length of captured arguments.
+ * @param   out     Buffer to format into.
+ * @param   size    Size of buffer.
+ * @return  Number of bytes formatted (excluding NUL).
+ */
+static size_t log_format(const char *format, const char *args, size_t length, char *out, size_t size)
+{
+    size_t used = 0;    // Bytes of args consumed
+    size_t n    = 0;    // Bytes of out written
+
+#define LOG_PUT(...) \
+    do { \
+        int _n = snprintf(out + n, size - n, __VA_ARGS__); \
+        n += _n < 0 ? 0 : (size_t)_n < size - n ? (size_t)_n : size - n - 1; \
+    } while (0)
+
+#define LOG_TAKE(type, name) \
+    type name; \
+    if (used + sizeof(type) > length) goto truncated; \
+    memcpy(&name, args + used, sizeof(type)); \
+    used += sizeof(type)
+
+    if (size == 0)
+    {
+        return 0;
+    }
+    out[0] = 0;
+
+    const char *p = format;
+    while (*p)
+    {
+        const char *q = strchr(p, '%');
+        size_t literal = q ? (size_t)(q - p) : strlen(p);
+        LOG_PUT("%.*s", (int)literal, p);
+        if (!q)
+        {
+            break;
+        }
+
+        LogArg arg;
+        int    stars;
+        size_t span = log_spec(q, &arg, &stars);
+        p = q + span;
+
+        /* Rebuild specification with '*' replaced by captured values */
+        char spec[64];
+        size_t s = 0;
+        for (size_t i = 0; i < span && s < sizeof(spec) - 12; i++)
+        {
+            if (q[i] == '*' && stars)
+            {
+                LOG_TAKE(int, star);
+                s += snprintf(spec + s, sizeof(spec) - s, "%d", star);
+            }
+            else
+            {
+                spec[s++] = q[i];
+            }
+        }
+        spec[s] = 0;
+
+        switch (arg)
+        {
+            case LOG_ARG_INT:       { LOG_TAKE(int, v); LOG_PUT(spec, v); break; }
+            case LOG_ARG_LONG:      { LOG_TAKE(long, v); LOG_PUT(spec, v); break; }
+            case LOG_ARG_LLONG:     { LOG_TAKE(long long, v); LOG_PUT(spec, v); break; }
+            case LOG_ARG_SIZE:      { LOG_TAKE(size_t, v); LOG_PUT(spec, v); break; }
+            case LOG_ARG_INTMAX:    { LOG_TAKE(intmax_t, v); LOG_PUT(spec, v); break; }
+            case LOG_ARG_PTRDIFF:   { LOG_TAKE(ptrdiff_t, v); LOG_PUT(spec, v); break; }
+            case LOG_ARG_DOUBLE:    { LOG_TAKE(double, v); LOG_PUT(spec, v); break; }
+            case LOG_ARG_LDOUBLE:   { LOG_TAKE(long double, v); LOG_PUT(spec, v); break; }
+            case LOG_ARG_POINTER:   { LOG_TAKE(void *, v); LOG_PUT(spec, v); break; }
+            case LOG_ARG_STRING:
+            {
+                if (used >= length)
+                {
+                    goto truncated;
+                }
+                const char *v = args + used;
+                used += strlen(v) + 1;
+                LOG_PUT(spec, v);
+                break;
+            }
+            case LOG_ARG_NONE:
+                LOG_PUT("%s", streq(spec, "%%") ? "%" : spec);
+                break;
+        }
+    }
+    return n;
+
+truncated:
+    LOG_PUT("...");
+    return n;
+
+#undef LOG_TAKE
+#undef LOG_PUT
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
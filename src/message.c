@@ -0,0 +1,54 @@
+/* message.c: Reference counted message buffer */
+
+#include "mq/message.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* External Functions */
+
+/**
+ * Create Message with copy of body (and one reference).
+ * @param   body    Message body.
+ * @param   length  Length of message body.
+ * @return  Newly allocated Message structure (or NULL on failure).
+ */
+Message *message_create(const char *body, size_t length)
+{
+    Message *m = malloc(sizeof(Message) + length + 1);
+
+    if (m)
+    {
+        m->refs = 1;
+        m->length = length;
+        memcpy(m->body, body, length);
+        m->body[length] = 0;
+    }
+
+    return m;
+}
+
+/**
+ * Add reference to Message.
+ * @param   m       Message structure.
+ * @return  Message structure.
+ */
+Message *message_retain(Message *m)
+{
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+    return m;
+}
+
+/**
+ * Drop reference to Message (freeing it with the last reference).
+ * @param   m       Message structure.
+ */
+void message_release(Message *m)
+{
+    if (m && __atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(m);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
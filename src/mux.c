@@ -0,0 +1,245 @@
+/* mux.c: Process-wide subscription multiplexer */
+
+#include "mq/logging.h"
+#include "mq/mux.h"
+#include "mq/string.h"
+
+#include <unistd.h>
+
+/* Internal Prototypes */
+
+static MuxTopic *mux_create(MessageQueue *mq, const char *topic);
+static void mux_delete(MuxTopic *t);
+static bool mux_remove(MuxTopic *t, MessageQueue *mq);
+
+/* Internal Variables */
+
+static Mutex     MuxLock = PTHREAD_MUTEX_INITIALIZER;
+static MuxTopic *MuxTopics = NULL;
+static size_t    MuxCount = 0;
+
+/* External Functions */
+
+/**
+ * Subscribe local message queue to topic through the shared network
+ * subscription for the queue's server (creating it for the first subscriber).
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to subscribe to.
+ */
+void mux_subscribe(MessageQueue *mq, const char *topic)
+{
+    mutex_lock(&MuxLock);
+
+    MuxTopic *t = MuxTopics;
+    while (t && !(streq(t->host, mq->host) && streq(t->port, mq->port) && streq(t->topic, topic)))
+    {
+        t = t->next;
+    }
+
+    if (!t && (t = mux_create(mq, topic)))
+    {
+        t->next = MuxTopics;
+        MuxTopics = t;
+    }
+
+    if (t)
+    {
+        mutex_lock(&t->lock);
+        bool subscribed = false;
+        for (size_t i = 0; i < t->nsubscribers; i++)
+        {
+            subscribed |= t->subscribers[i] == mq;
+        }
+
+        if (!subscribed && t->nsubscribers == t->capacity)
+        {
+            size_t capacity = t->capacity ? 2 * t->capacity : 4;
+            MessageQueue **subscribers = realloc(t->subscribers, capacity * sizeof(MessageQueue *));
+            if (subscribers)
+            {
+                t->subscribers = subscribers;
+                t->capacity = capacity;
+            }
+        }
+
+        if (!subscribed && t->nsubscribers < t->capacity)
+        {
+            t->subscribers[t->nsubscribers++] = mq;
+        }
+        mutex_unlock(&t->lock);
+    }
+    else
+    {
+        error("Unable to create shared subscription to %s", topic);
+    }
+
+    mutex_unlock(&MuxLock);
+}
+
+/**
+ * Unsubscribe local message queue from shared topic (stopping the network
+ * subscription when its last local subscriber leaves).
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to unsubscribe from.
+ */
+void mux_unsubscribe(MessageQueue *mq, const char *topic)
+{
+    MuxTopic *unused = NULL;
+
+    mutex_lock(&MuxLock);
+    for (MuxTopic **t = &MuxTopics; *t; t = &(*t)->next)
+    {
+        if (streq((*t)->host, mq->host) && streq((*t)->port, mq->port) && streq((*t)->topic, topic))
+        {
+            if (mux_remove(*t, mq))
+            {
+                unused = *t;
+                *t = unused->next;
+            }
+            break;
+        }
+    }
+    mutex_unlock(&MuxLock);
+
+    mux_delete(unused);
+}
+
+/**
+ * Unsubscribe local message queue from all of its shared topics.
+ * @param   mq      Message Queue structure.
+ */
+void mux_leave(MessageQueue *mq)
+{
+    MuxTopic *unused = NULL;
+
+    mutex_lock(&MuxLock);
+    MuxTopic **t = &MuxTopics;
+    while (*t)
+    {
+        if (mux_remove(*t, mq))
+        {
+            MuxTopic *next = (*t)->next;
+            (*t)->next = unused;
+            unused = *t;
+            *t = next;
+        }
+        else
+        {
+            t = &(*t)->next;
+        }
+    }
+    mutex_unlock(&MuxLock);
+
+    while (unused)
+    {
+        MuxTopic *next = unused->next;
+        mux_delete(unused);
+        unused = next;
+    }
+}
+
+/**
+ * Deliver message received by network subscription to every local subscriber
+ * (each gets a reference to the same buffer).
+ * @param   t       MuxTopic structure.
+ * @param   m       Message structure.
+ * @param   origin  Request that received message (to carry over its trace).
+ */
+void mux_deliver(MuxTopic *t, Message *m, const Request *origin)
+{
+    mutex_lock(&t->lock);
+    for (size_t i = 0; i < t->nsubscribers; i++)
+    {
+        Request *r = request_create(NULL, NULL, NULL);
+        if (r)
+        {
+            r->message = message_retain(m);
+            r->body = m->body;
+            if (origin)
+            {
+                r->trace = origin->trace;
+                r->published = origin->published;
+            }
+            queue_push(t->subscribers[i]->incoming, r);
+        }
+    }
+    mutex_unlock(&t->lock);
+}
+
+/* Internal Functions */
+
+/**
+ * Create shared subscription: start network client (with a queue name unique
+ * to this process) subscribed to topic.
+ * @param   mq      Message Queue structure of first subscriber.
+ * @param   topic   Topic to subscribe to.
+ * @return  Newly allocated MuxTopic structure (or NULL on failure).
+ */
+static MuxTopic *mux_create(MessageQueue *mq, const char *topic)
+{
+    MuxTopic *t = calloc(1, sizeof(MuxTopic));
+    if (!t)
+    {
+        return NULL;
+    }
+
+    char name[NI_MAXHOST];
+    snprintf(name, sizeof(name), "mux.%d.%lu", getpid(), ++MuxCount);
+
+    strcpy(t->host, mq->host);
+    strcpy(t->port, mq->port);
+    if (!(t->topic = strdup(topic)) || !(t->mq = mq_create(name, mq->host, mq->port)))
+    {
+        free(t->topic);
+        free(t);
+        return NULL;
+    }
+    mutex_init(&t->lock, NULL);
+
+    t->mq->mux = t;
+    mq_subscribe(t->mq, topic);
+    mq_start(t->mq);
+    return t;
+}
+
+/**
+ * Stop network subscription and delete shared subscription.
+ * @param   t       MuxTopic structure (may be NULL).
+ */
+static void mux_delete(MuxTopic *t)
+{
+    if (t)
+    {
+        mq_unsubscribe(t->mq, t->topic);
+        mq_stop(t->mq);
+        mq_delete(t->mq);
+        free(t->subscribers);
+        free(t->topic);
+        free(t);
+    }
+}
+
+/**
+ * Remove local subscriber from shared subscription.
+ * @param   t       MuxTopic structure.
+ * @param   mq      Message Queue structure.
+ * @return  Whether or not the shared subscription has no subscribers left.
+ */
+static bool mux_remove(MuxTopic *t, MessageQueue *mq)
+{
+    mutex_lock(&t->lock);
+    for (size_t i = 0; i < t->nsubscribers; i++)
+    {
+        if (t->subscribers[i] == mq)
+        {
+            t->subscribers[i] = t->subscribers[--t->nsubscribers];
+            break;
+        }
+    }
+    bool unused = t->nsubscribers == 0;
+    mutex_unlock(&t->lock);
+
+    return unused;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,6 +1,7 @@
 /* queue.c: Concurrent Queue of Requests */
 
 #include "mq/queue.h"
+#include "mq/probe.h"
 
 /**
  * Create queue structure.
@@ -49,12 +50,20 @@ void queue_delete(Queue *q)
 }
 
 /**
- * Push request to the back of queue.
+ * Push request to the back of queue (stamping it, if traced).
  * @param   q       Queue structure.
  * @param   r       Request structure.
  */
 void queue_push(Queue *q, Request *r)
 {
+    if (r->trace)
+    {
+        r->stamp = trace_now(TRACE_MONOTONIC);
+    }
+
+    sem_wait(&q->lock);
+
+    r->next = NULL;
     if (q->size == 0)
     {
         q->head = r;
@@ -65,12 +74,18 @@ void queue_push(Queue *q, Request *r)
         q->tail->next = r;
         q->tail = r;
     }
-    q->size++;
+    size_t depth = __atomic_add_fetch(&q->size, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&q->bytes, r->message ? r->message->length : 0, __ATOMIC_SEQ_CST);
+
+    MQ_PROBE4(queue_push, q, r, q->stage, depth);
+
+    sem_post(&q->lock);
     sem_post(&q->produced);
 }
 
 /**
  * Pop request to the front of queue (block until there is something to return).
+ * Time that traced requests spent in queue is recorded as the queue's stage.
  * @param   q       Queue structure.
  * @return  Request structure.
  */
@@ -81,9 +96,47 @@ Request *queue_pop(Queue *q)
 
     Request *r = q->head;
     q->head = q->head->next;
-    q->size--;
+    size_t depth = __atomic_sub_fetch(&q->size, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&q->bytes, r->message ? r->message->length : 0, __ATOMIC_SEQ_CST);
+    r->next = NULL;
 
     sem_post(&q->lock);
+    MQ_PROBE4(queue_pop, q, r, q->stage, depth);
+
+    if (r->trace)
+    {
+        trace_record(r->trace, q->stage, trace_now(TRACE_MONOTONIC) - r->stamp);
+    }
+    return r;
+}
+
+/**
+ * Pop request from the front of queue without blocking (recording time that
+ * traced requests spent in queue).
+ * @param   q       Queue structure.
+ * @return  Request structure (or NULL if queue is empty).
+ */
+Request *queue_trypop(Queue *q)
+{
+    if (sem_trywait(&q->produced) < 0)
+    {
+        return NULL;
+    }
+    sem_wait(&q->lock);
+
+    Request *r = q->head;
+    q->head = q->head->next;
+    size_t depth = __atomic_sub_fetch(&q->size, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&q->bytes, r->message ? r->message->length : 0, __ATOMIC_SEQ_CST);
+    r->next = NULL;
+
+    sem_post(&q->lock);
+    MQ_PROBE4(queue_pop, q, r, q->stage, depth);
+
+    if (r->trace)
+    {
+        trace_record(r->trace, q->stage, trace_now(TRACE_MONOTONIC) - r->stamp);
+    }
     return r;
 }
 
@@ -0,0 +1,789 @@
+/* reactor.c: Shared I/O reactor */
+
+#include "mq/logging.h"
+#include "mq/reactor.h"
+#include "mq/string.h"
+#include "mq/uring.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define REACTOR_CANCEL  2   // io_uring user data of cancellation requests (never an Op address)
+
+/* Internal Structures */
+
+typedef struct Fence Fence;
+struct Fence
+{
+    Task task;
+    Mutex lock;
+    Cond done;
+    bool signaled;
+};
+
+/* Internal Globals */
+
+static Mutex    PoolLock = PTHREAD_MUTEX_INITIALIZER;
+static Reactor *Pool = NULL;  // Process-wide pool of reactors
+static size_t   PoolSize = 0;
+static size_t   PoolRefs = 0; // Number of clients using the pool
+
+/* Internal Prototypes */
+
+static void *reactor_loop(void *arg);
+static bool reactor_start(Reactor *r, bool uring);
+static void reactor_stop(Reactor *r);
+static void reactor_wake(Reactor *r);
+static void reactor_wait(Reactor *r, Op *op);
+static void reactor_complete(Reactor *r, Op *op, ssize_t result);
+static ssize_t reactor_attempt(Op *op, bool ready);
+static void reactor_poll(Reactor *r);
+static void reactor_fence(Task *t);
+#ifdef MQ_IO_URING
+static bool reactor_start_uring(Reactor *r);
+static void reactor_stop_uring(Reactor *r);
+static void reactor_queue(Reactor *r, Op *op, bool poll);
+static void reactor_poll_uring(Reactor *r);
+static void reactor_rewake(Op *op);
+#endif
+
+/* External Functions */
+
+/**
+ * Acquire a reactor from the process-wide pool (starting the pool if this is
+ * the first client).  The pool size is REACTOR_THREADS unless overridden by
+ * the MQ_REACTOR_THREADS environment variable, and the I/O backend is
+ * REACTOR_BACKEND unless overridden by MQ_IO_BACKEND.
+ * @return  Least loaded reactor in the pool (or NULL on failure).
+ */
+Reactor *reactor_acquire()
+{
+    mutex_lock(&PoolLock);
+    if (PoolRefs == 0)
+    {
+        char *threads = getenv("MQ_REACTOR_THREADS");
+        char *backend = getenv("MQ_IO_BACKEND");
+        bool uring = streq(backend ? backend : REACTOR_BACKEND, "io_uring");
+
+        PoolSize = threads && atoi(threads) > 0 ? atoi(threads) : REACTOR_THREADS;
+        Pool = calloc(PoolSize, sizeof(Reactor));
+        if (!Pool)
+        {
+            mutex_unlock(&PoolLock);
+            return NULL;
+        }
+
+        for (size_t i = 0; i < PoolSize; i++)
+        {
+            if (!reactor_start(&Pool[i], uring))
+            {
+                for (size_t j = 0; j < i; j++)
+                {
+                    reactor_stop(&Pool[j]);
+                }
+                free(Pool);
+                Pool = NULL;
+                mutex_unlock(&PoolLock);
+                return NULL;
+            }
+        }
+    }
+
+    Reactor *r = &Pool[0];
+    for (size_t i = 1; i < PoolSize; i++)
+    {
+        if (Pool[i].clients < r->clients)
+        {
+            r = &Pool[i];
+        }
+    }
+
+    r->clients++;
+    PoolRefs++;
+    mutex_unlock(&PoolLock);
+    return r;
+}
+
+/**
+ * Release reactor acquired with reactor_acquire (stopping the pool if this
+ * was the last client).  Any tasks already posted by the client are run
+ * before this returns.
+ * @param   r       Reactor structure.
+ */
+void reactor_release(Reactor *r)
+{
+    reactor_sync(r);
+
+    mutex_lock(&PoolLock);
+    r->clients--;
+    if (--PoolRefs == 0)
+    {
+        for (size_t i = 0; i < PoolSize; i++)
+        {
+            reactor_stop(&Pool[i]);
+        }
+        free(Pool);
+        Pool = NULL;
+        PoolSize = 0;
+    }
+    mutex_unlock(&PoolLock);
+}
+
+/**
+ * Post task to be run on the reactor thread (no-op if already pending).
+ * @param   r       Reactor structure.
+ * @param   t       Task structure.
+ */
+void reactor_post(Reactor *r, Task *t)
+{
+    mutex_lock(&r->lock);
+    if (!t->pending)
+    {
+        t->pending = true;
+        t->next = NULL;
+        if (r->tasks_tail)
+        {
+            r->tasks_tail->next = t;
+        }
+        else
+        {
+            r->tasks_head = t;
+        }
+        r->tasks_tail = t;
+        reactor_wake(r);
+    }
+    mutex_unlock(&r->lock);
+}
+
+/**
+ * Wait until all tasks previously posted to the reactor have run.
+ * @param   r       Reactor structure.
+ */
+void reactor_sync(Reactor *r)
+{
+    Fence f = {
+        .task = {.func = reactor_fence},
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+    };
+    f.task.arg = &f;
+
+    reactor_post(r, &f.task);
+
+    mutex_lock(&f.lock);
+    while (!f.signaled)
+    {
+        cond_wait(&f.done, &f.lock);
+    }
+    mutex_unlock(&f.lock);
+}
+
+/**
+ * Submit asynchronous operation (must be called from the reactor thread).
+ * The operation's completion callback is always run later from the reactor
+ * loop, never from within this function.  With io_uring, operations
+ * submitted during one loop iteration are sent to the kernel in one batch.
+ * @param   r       Reactor structure.
+ * @param   op      Op structure.
+ */
+void reactor_submit(Reactor *r, Op *op)
+{
+    op->active = true;
+
+#ifdef MQ_IO_URING
+    if (r->ring)
+    {
+        reactor_queue(r, op, false);
+        return;
+    }
+#endif
+
+    ssize_t result = reactor_attempt(op, false);
+    if (result == -EAGAIN)
+    {
+        reactor_wait(r, op);
+    }
+    else
+    {
+        reactor_complete(r, op, result);
+    }
+}
+
+/**
+ * Cancel operation that is in progress (must be called from the reactor
+ * thread), so that blocking connects, reads, and writes can be interrupted.
+ * Unless the operation completes first, its callback runs later with a
+ * result of -ECANCELED.  Operations that are not in progress are ignored.
+ * @param   r       Reactor structure.
+ * @param   op      Op structure.
+ */
+void reactor_cancel(Reactor *r, Op *op)
+{
+    if (!op->active)
+    {
+        return;
+    }
+
+#ifdef MQ_IO_URING
+    if (r->ring)
+    {
+        /* Operation is in flight either as itself or as a readiness poll */
+        for (uint64_t poll = 0; poll <= 1; poll++)
+        {
+            struct io_uring_sqe *sqe = uring_sqe(r->ring);
+            if (!sqe && uring_enter(r->ring, 0) >= 0)
+            {
+                sqe = uring_sqe(r->ring);
+            }
+            if (sqe)
+            {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = -1;
+                sqe->addr = (uintptr_t)op | poll;
+                sqe->user_data = REACTOR_CANCEL;
+            }
+        }
+        return;
+    }
+#endif
+
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, op->fd, NULL);
+    reactor_complete(r, op, -ECANCELED);
+}
+
+/**
+ * Take registered buffer of REACTOR_BUFFER_SIZE bytes (must be called from
+ * the reactor thread).  Reads into (and writes from) registered buffers
+ * avoid mapping the buffer on every operation.
+ * @param   r       Reactor structure.
+ * @return  Registered buffer (or NULL if none are available).
+ */
+char *reactor_buffer(Reactor *r)
+{
+    if (!r->buffers || r->nslots == 0)
+    {
+        return NULL;
+    }
+
+    return r->buffers + (size_t)r->slots[--r->nslots] * REACTOR_BUFFER_SIZE;
+}
+
+/**
+ * Return registered buffer taken with reactor_buffer.
+ * @param   r       Reactor structure.
+ * @param   buf     Registered buffer.
+ */
+void reactor_unbuffer(Reactor *r, char *buf)
+{
+    r->slots[r->nslots++] = (buf - r->buffers) / REACTOR_BUFFER_SIZE;
+}
+
+/**
+ * Determine whether or not buffer is registered with the reactor.
+ * @param   r       Reactor structure.
+ * @param   buf     Buffer.
+ * @return  Whether or not buffer lies within the registered buffers.
+ */
+bool reactor_buffered(Reactor *r, const void *buf)
+{
+    return buf && r->buffers && (const char *)buf >= r->buffers &&
+           (const char *)buf < r->buffers + REACTOR_BUFFERS * REACTOR_BUFFER_SIZE;
+}
+
+/* Internal Functions */
+
+/**
+ * Initialize reactor and start its I/O thread.
+ * @param   r       Reactor structure.
+ * @param   uring   Whether or not to use io_uring (falls back to epoll).
+ * @return  Whether or not the reactor was started.
+ */
+static bool reactor_start(Reactor *r, bool uring)
+{
+    if ((r->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        error("Unable to create epoll: %s", strerror(errno));
+        return false;
+    }
+
+    if ((r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        error("Unable to create eventfd: %s", strerror(errno));
+        close(r->epoll_fd);
+        return false;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &event) < 0)
+    {
+        error("Unable to watch eventfd: %s", strerror(errno));
+        close(r->wake_fd);
+        close(r->epoll_fd);
+        return false;
+    }
+
+#ifdef MQ_IO_URING
+    if (uring && !reactor_start_uring(r))
+    {
+        error("Unable to use io_uring, falling back to epoll");
+    }
+#else
+    if (uring)
+    {
+        error("Built without io_uring, falling back to epoll");
+    }
+#endif
+
+    mutex_init(&r->lock, NULL);
+    thread_create(&r->thread, NULL, reactor_loop, r);
+    return true;
+}
+
+/**
+ * Stop reactor thread and release its resources.
+ * @param   r       Reactor structure.
+ */
+static void reactor_stop(Reactor *r)
+{
+    mutex_lock(&r->lock);
+    r->shutdown = true;
+    reactor_wake(r);
+    mutex_unlock(&r->lock);
+
+    thread_join(r->thread, NULL);
+#ifdef MQ_IO_URING
+    reactor_stop_uring(r);
+#endif
+    close(r->wake_fd);
+    close(r->epoll_fd);
+}
+
+/**
+ * Wake reactor thread from epoll_wait.
+ * @param   r       Reactor structure.
+ */
+static void reactor_wake(Reactor *r)
+{
+    uint64_t value = 1;
+    if (write(r->wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    {
+        error("Unable to wake reactor: %s", strerror(errno));
+    }
+}
+
+/**
+ * Wait for operation's file descriptor to become ready.
+ * @param   r       Reactor structure.
+ * @param   op      Op structure.
+ */
+static void reactor_wait(Reactor *r, Op *op)
+{
+    struct epoll_event event = {
+        .events = EPOLLONESHOT | (op->type == OP_READ ? EPOLLIN : EPOLLOUT),
+        .data.ptr = op,
+    };
+
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, op->fd, &event) < 0)
+    {
+        if (errno != ENOENT || epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, op->fd, &event) < 0)
+        {
+            reactor_complete(r, op, -errno);
+        }
+    }
+}
+
+/**
+ * Queue completed operation for its callback.
+ * @param   r       Reactor structure.
+ * @param   op      Op structure.
+ * @param   result  Result of operation.
+ */
+static void reactor_complete(Reactor *r, Op *op, ssize_t result)
+{
+    op->active = false;
+    op->result = result;
+    op->next = NULL;
+    if (r->completed_tail)
+    {
+        r->completed_tail->next = op;
+    }
+    else
+    {
+        r->completed_head = op;
+    }
+    r->completed_tail = op;
+}
+
+/**
+ * Attempt operation without blocking.
+ * @param   op      Op structure.
+ * @param   ready   Whether or not the descriptor was reported ready.
+ * @return  Result of operation (-EAGAIN if it would block).
+ */
+static ssize_t reactor_attempt(Op *op, bool ready)
+{
+    ssize_t result;
+
+    switch (op->type)
+    {
+    case OP_CONNECT:
+        if (ready)
+        {
+            int status = 0;
+            socklen_t length = sizeof(status);
+            if (getsockopt(op->fd, SOL_SOCKET, SO_ERROR, &status, &length) < 0)
+            {
+                return -errno;
+            }
+            return -status;
+        }
+        if (connect(op->fd, op->addr, op->addrlen) < 0)
+        {
+            return errno == EINPROGRESS ? -EAGAIN : -errno;
+        }
+        return 0;
+    case OP_READ:
+        result = read(op->fd, op->buf, op->len);
+        break;
+    case OP_WRITE:
+        result = send(op->fd, op->buf, op->len, MSG_NOSIGNAL);
+        break;
+    case OP_SENDFILE:
+        result = sendfile(op->fd, op->file, &op->offset, op->len);
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (result < 0)
+    {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? -EAGAIN : -errno;
+    }
+    return result;
+}
+
+/**
+ * Signal fence task.
+ * @param   t       Task structure.
+ */
+static void reactor_fence(Task *t)
+{
+    Fence *f = (Fence *)t->arg;
+
+    mutex_lock(&f->lock);
+    f->signaled = true;
+    cond_signal(&f->done);
+    mutex_unlock(&f->lock);
+}
+
+/**
+ * Wait for ready descriptors with epoll and attempt their operations (or
+ * wait for io_uring completions).
+ * @param   r       Reactor structure.
+ */
+static void reactor_poll(Reactor *r)
+{
+#ifdef MQ_IO_URING
+    if (r->ring)
+    {
+        reactor_poll_uring(r);
+        return;
+    }
+#endif
+
+    struct epoll_event events[REACTOR_EVENTS];
+    int timeout = r->completed_head ? 0 : -1;
+    int nevents = epoll_wait(r->epoll_fd, events, REACTOR_EVENTS, timeout);
+    if (nevents < 0)
+    {
+        if (errno != EINTR)
+        {
+            error("Unable to wait for events: %s", strerror(errno));
+        }
+        return;
+    }
+
+    for (int i = 0; i < nevents; i++)
+    {
+        Op *op = (Op *)events[i].data.ptr;
+        if (!op)
+        {
+            uint64_t value;
+            while (read(r->wake_fd, &value, sizeof(value)) > 0);
+            continue;
+        }
+
+        ssize_t result = reactor_attempt(op, true);
+        if (result == -EAGAIN)
+        {
+            reactor_wait(r, op);
+        }
+        else
+        {
+            reactor_complete(r, op, result);
+        }
+    }
+}
+
+/**
+ * Reactor thread waits for ready descriptors and posted tasks, and then runs
+ * the corresponding callbacks.  SIGPIPE is blocked, since writes to closed
+ * connections that cannot pass MSG_NOSIGNAL (io_uring fixed writes) raise it.
+ * @param   arg     Reactor structure.
+ **/
+static void *reactor_loop(void *arg)
+{
+    Reactor *r = (Reactor *)arg;
+    bool shutdown = false;
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    while (!shutdown)
+    {
+        reactor_poll(r);
+
+        /* Run posted tasks */
+        mutex_lock(&r->lock);
+        Task *t = r->tasks_head;
+        r->tasks_head = r->tasks_tail = NULL;
+        shutdown = r->shutdown;
+        mutex_unlock(&r->lock);
+
+        while (t)
+        {
+            mutex_lock(&r->lock);
+            Task *next = t->next;
+            t->pending = false; // Task may be posted again once it starts
+            mutex_unlock(&r->lock);
+
+            t->func(t);
+            t = next;
+        }
+
+        /* Run completed operations (callbacks may submit more) */
+        Op *op = r->completed_head;
+        r->completed_head = r->completed_tail = NULL;
+        while (op)
+        {
+            Op *next = op->next;
+            op->func(op);
+            op = next;
+        }
+    }
+
+    return NULL;
+}
+
+#ifdef MQ_IO_URING
+
+/**
+ * Set up io_uring instance, registered buffers, and wakeup read.
+ * @param   r       Reactor structure.
+ * @return  Whether or not io_uring is available.
+ */
+static bool reactor_start_uring(Reactor *r)
+{
+    int status;
+
+    r->ring = calloc(1, sizeof(Uring));
+    if (!r->ring)
+    {
+        return false;
+    }
+
+    if ((status = uring_init(r->ring, REACTOR_ENTRIES)) < 0)
+    {
+        error("Unable to create io_uring: %s", strerror(-status));
+        free(r->ring);
+        r->ring = NULL;
+        return false;
+    }
+
+    /* Registered buffers are optional: reads fall back to plain buffers */
+    size_t size = REACTOR_BUFFERS * REACTOR_BUFFER_SIZE;
+    r->buffers = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->buffers == MAP_FAILED || uring_register_buffer(r->ring, r->buffers, size) < 0)
+    {
+        debug("Unable to register buffers: %s", strerror(errno));
+        if (r->buffers != MAP_FAILED)
+        {
+            munmap(r->buffers, size);
+        }
+        r->buffers = NULL;
+    }
+    else
+    {
+        for (r->nslots = 0; r->nslots < REACTOR_BUFFERS; r->nslots++)
+        {
+            r->slots[r->nslots] = REACTOR_BUFFERS - 1 - r->nslots;
+        }
+    }
+
+    r->wake_op.type = OP_READ;
+    r->wake_op.fd = r->wake_fd;
+    r->wake_op.buf = &r->wake_value;
+    r->wake_op.len = sizeof(r->wake_value);
+    r->wake_op.func = reactor_rewake;
+    r->wake_op.arg = r;
+    reactor_queue(r, &r->wake_op, false);
+    return true;
+}
+
+/**
+ * Release io_uring instance and registered buffers.
+ * @param   r       Reactor structure.
+ */
+static void reactor_stop_uring(Reactor *r)
+{
+    if (r->ring)
+    {
+        uring_exit(r->ring);
+        free(r->ring);
+        r->ring = NULL;
+    }
+    if (r->buffers)
+    {
+        munmap(r->buffers, REACTOR_BUFFERS * REACTOR_BUFFER_SIZE);
+        r->buffers = NULL;
+    }
+}
+
+/**
+ * Prepare submission queue entry for operation (or for a readiness poll
+ * when the descriptor is non-blocking and the operation would block).
+ * @param   r       Reactor structure.
+ * @param   op      Op structure.
+ * @param   poll    Whether or not to poll for readiness instead.
+ */
+static void reactor_queue(Reactor *r, Op *op, bool poll)
+{
+    if (op->type == OP_SENDFILE && !poll)
+    {
+        /* io_uring has no sendfile: attempt it once the socket is writable */
+        ssize_t result = reactor_attempt(op, true);
+        if (result != -EAGAIN)
+        {
+            reactor_complete(r, op, result);
+            return;
+        }
+        poll = true;
+    }
+
+    struct io_uring_sqe *sqe = uring_sqe(r->ring);
+    if (!sqe && uring_enter(r->ring, 0) >= 0)
+    {
+        sqe = uring_sqe(r->ring);
+    }
+    if (!sqe)
+    {
+        reactor_complete(r, op, -EBUSY);
+        return;
+    }
+
+    sqe->fd = op->fd;
+    sqe->user_data = (uintptr_t)op | poll;
+
+    if (poll)
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = op->type == OP_READ ? POLLIN : POLLOUT;
+        return;
+    }
+
+    switch (op->type)
+    {
+    case OP_CONNECT:
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->addr = (uintptr_t)op->addr;
+        sqe->off = op->addrlen;
+        break;
+    case OP_READ:
+        sqe->opcode = reactor_buffered(r, op->buf) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->addr = (uintptr_t)op->buf;
+        sqe->len = op->len;
+        break;
+    case OP_WRITE:
+        if (reactor_buffered(r, op->buf))
+        {
+            /* Fixed writes cannot pass MSG_NOSIGNAL (SIGPIPE is blocked on
+             * reactor threads instead) */
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->msg_flags = MSG_NOSIGNAL;
+        }
+        sqe->addr = (uintptr_t)op->buf;
+        sqe->len = op->len;
+        break;
+    case OP_SENDFILE:
+        break; // Polled above
+    }
+}
+
+/**
+ * Submit queued operations in one batch and collect completions.
+ * @param   r       Reactor structure.
+ */
+static void reactor_poll_uring(Reactor *r)
+{
+    unsigned wait = r->completed_head ? 0 : 1;
+    if (wait || r->ring->sq_pending)
+    {
+        int status = uring_enter(r->ring, wait);
+        if (status < 0 && status != -EINTR && status != -EAGAIN && status != -EBUSY)
+        {
+            error("Unable to enter io_uring: %s", strerror(-status));
+        }
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_cqe(r->ring)))
+    {
+        uint64_t data = cqe->user_data;
+        Op *op = (Op *)(uintptr_t)(data & ~(uint64_t)1);
+        bool poll = data & 1;
+        int result = cqe->res;
+        uring_seen(r->ring);
+
+        if (data == REACTOR_CANCEL)
+        {
+            continue; // Canceled operation completes on its own
+        }
+        if (result != -ECANCELED && (poll || result == -EAGAIN))
+        {
+            /* Non-blocking descriptor: retry once ready */
+            reactor_queue(r, op, !poll && result == -EAGAIN);
+        }
+        else
+        {
+            reactor_complete(r, op, result);
+        }
+    }
+}
+
+/**
+ * Re-arm wakeup read after reactor_wake (runs on reactor thread).
+ * @param   op      Wakeup Op structure.
+ */
+static void reactor_rewake(Op *op)
+{
+    Reactor *r = (Reactor *)op->arg;
+    reactor_queue(r, op, false);
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
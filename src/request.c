@@ -1,9 +1,12 @@
 /* request.c: Request structure */
 
+#define _GNU_SOURCE /* asprintf */
+
 #include "mq/request.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 /**
  * Create Request structure.
@@ -36,16 +39,65 @@ Request *request_create(const char *method, const char *uri, const char *body)
 }
 
 /**
- * Delete Request structure.
+ * Create Request structure sharing method and URI of RequestLine (rather than
+ * copying them).
+ * @param   l           RequestLine structure (retained by Request).
+ * @param   body        Request body.
+ * @param   length      Length of request body.
+ * @return  Newly allocated Request structure (or NULL on failure).
+ */
+Request *request_from_line(RequestLine *l, const char *body, size_t length)
+{
+    Request *r = calloc(1, sizeof(Request));
+
+    if (r && !(r->body = malloc(length + 1)))
+    {
+        free(r);
+        return NULL;
+    }
+
+    if (r)
+    {
+        memcpy(r->body, body, length);
+        r->body[length] = 0;
+        r->line = request_line_retain(l);
+        r->method = l->method;
+        r->uri = l->uri;
+    }
+
+    return r;
+}
+
+/**
+ * Delete Request structure (releasing its shared message and line, if any).
  * @param   r           Request structure.
  */
 void request_delete(Request *r)
 {
     if (r)
     {
-        free(r->method);
-        free(r->uri);
-        free(r->body);
+        if (r->line)
+        {
+            request_line_release(r->line);
+        }
+        else
+        {
+            free(r->method);
+            free(r->uri);
+        }
+        free(r->headers);
+        if (r->flength)
+        {
+            close(r->file);
+        }
+        if (r->message)
+        {
+            message_release(r->message);
+        }
+        else
+        {
+            free(r->body);
+        }
         free(r);
     }
 }
@@ -54,10 +106,13 @@ void request_delete(Request *r)
  * Write HTTP Request to stream:
  *  
  *  $METHOD $URI HTTP/1.0\r\n
+ *  Mq-$NAME: $VALUE\r\n              (for each message header)
  *  Content-Length: Length($BODY)\r\n
  *  \r\n
  *  $BODY
  *      
+ * The contents of the Request's file (if any) are counted in Content-Length,
+ * but left for the caller to send after the body.
  * @param   r           Request structure.
  * @param   fs          Socket file stream.
  */
@@ -65,8 +120,26 @@ void request_write(Request *r, FILE *fs)
 {
     if (r->body)
     {
-        fprintf(fs, "%s %s HTTP/1.0\r\n", r->method, r->uri);
-        fprintf(fs, "Content-Length: %ld\r\n", strlen(r->body));
+        if (r->line)
+        {
+            fwrite(r->line->line, 1, r->line->length, fs);
+        }
+        else
+        {
+            fprintf(fs, "%s %s HTTP/1.0\r\n", r->method, r->uri);
+        }
+        for (const char *line = r->headers; line && *line;)
+        {
+            const char *equals = strchr(line, '=');
+            const char *end = strchr(line, '\n');
+            if (!equals || !end || equals > end)
+            {
+                break;
+            }
+            fprintf(fs, "Mq-%.*s: %.*s\r\n", (int)(equals - line), line, (int)(end - equals - 1), equals + 1);
+            line = end + 1;
+        }
+        fprintf(fs, "Content-Length: %zu\r\n", strlen(r->body) + r->flength);
         fprintf(fs, "\r\n");
         fprintf(fs, "%s", r->body);
     }
@@ -77,4 +150,90 @@ void request_write(Request *r, FILE *fs)
     }
 }
 
+/**
+ * Return length of HTTP Request as written by request_write, including the
+ * contents of its file (if any).
+ * @param   r           Request structure.
+ * @return  Length of Request in bytes.
+ */
+size_t request_length(Request *r)
+{
+    size_t length = r->line ? r->line->length : strlen(r->method) + 1 + strlen(r->uri) + strlen(" HTTP/1.0\r\n");
+
+    if (!r->body)
+    {
+        return length + strlen("\r\n");
+    }
+
+    for (const char *line = r->headers; line && *line;)
+    {
+        const char *equals = strchr(line, '=');
+        const char *end = strchr(line, '\n');
+        if (!equals || !end || equals > end)
+        {
+            break;
+        }
+        length += strlen("Mq-: \r\n") + (equals - line) + (end - equals - 1);
+        line = end + 1;
+    }
+
+    size_t content = strlen(r->body) + r->flength;
+    return length + snprintf(NULL, 0, "Content-Length: %zu\r\n\r\n", content) + content;
+}
+
+/**
+ * Create RequestLine structure (with one reference).
+ * @param   method      Request method string.
+ * @param   uri         Request uri string.
+ * @return  Newly allocated RequestLine structure (or NULL on failure).
+ */
+RequestLine *request_line_create(const char *method, const char *uri)
+{
+    RequestLine *l = calloc(1, sizeof(RequestLine));
+
+    if (l)
+    {
+        l->refs = 1;
+        l->method = strdup(method);
+        l->uri = strdup(uri);
+        int length = asprintf(&l->line, "%s %s HTTP/1.0\r\n", method, uri);
+        if (!l->method || !l->uri || length < 0)
+        {
+            free(l->method);
+            free(l->uri);
+            free(l);
+            return NULL;
+        }
+        l->length = length;
+    }
+
+    return l;
+}
+
+/**
+ * Add reference to RequestLine.
+ * @param   l           RequestLine structure.
+ * @return  RequestLine structure.
+ */
+RequestLine *request_line_retain(RequestLine *l)
+{
+    __atomic_add_fetch(&l->refs, 1, __ATOMIC_RELAXED);
+    return l;
+}
+
+/**
+ * Drop reference to RequestLine (freeing it with the last reference).
+ * @param   l           RequestLine structure.
+ */
+void request_line_release(RequestLine *l)
+{
+    if (l && __atomic_sub_fetch(&l->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(l->method);
+        free(l->uri);
+        free(l->line);
+        free(l);
+    }
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,494 @@
+/* shm.c: Shared memory ring transport */
+
+#define _GNU_SOURCE /* memfd_create */
+
+#include "mq/logging.h"
+#include "mq/shm.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define SHM_HEADER      8                               // Record length (4), tag (1), padding (3)
+#define SHM_ALIGN(n)    (((n) + 7) & ~(uint64_t)7)
+#define SHM_RING_BYTES  (sizeof(ShmRing) + SHM_RING_SIZE)
+
+/* Internal Prototypes */
+
+static bool shm_write(ShmRing *r, uint8_t tag, const char *data, size_t length);
+static void shm_copy_in(ShmRing *r, uint64_t position, const void *data, size_t length);
+static void shm_copy_out(ShmRing *r, uint64_t position, void *data, size_t length);
+static void shm_signal(int fd);
+static void *shm_transport_attach(const char *path);
+static void shm_transport_detach(void *endpoint);
+static bool shm_transport_send(void *endpoint, uint8_t tag, Request *r);
+static char *shm_transport_recv(void *endpoint, uint8_t *tag, size_t *length);
+static int shm_transport_event(void *endpoint);
+static void shm_transport_wake(void *endpoint);
+static int shm_slurp(Request *r, FILE *fs);
+
+/* External Variables */
+
+/* Requests are sent as HTTP request records, so the broker parses them as it
+ * would from a socket */
+const Transport ShmTransport = {
+    .prefix = SHM_PREFIX,
+    .record_max = SHM_RECORD_MAX,
+    .attach = shm_transport_attach,
+    .detach = shm_transport_detach,
+    .send = shm_transport_send,
+    .recv = shm_transport_recv,
+    .event = shm_transport_event,
+    .wake = shm_transport_wake,
+};
+
+/* External Functions */
+
+/**
+ * Attach to broker's shared memory listener: create segment with one ring in
+ * each direction and pass it (along with wakeup eventfds) to the broker.
+ * @param   path    Path of broker's shared memory Unix domain socket.
+ * @return  Newly allocated Shm structure (or NULL on failure).
+ */
+Shm *shm_attach(const char *path)
+{
+    Shm *s = calloc(1, sizeof(Shm));
+    if (!s)
+    {
+        return NULL;
+    }
+    s->socket_fd = s->memfd = s->tx_event = s->rx_event = -1;
+    s->pending_tail = &s->pending;
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if ((s->socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(s->socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        error("Unable to connect to %s: %s", path, strerror(errno));
+        goto failure;
+    }
+
+    s->length = 2 * SHM_RING_BYTES;
+    if ((s->memfd = memfd_create("mq_shm", MFD_CLOEXEC)) < 0 || ftruncate(s->memfd, s->length) < 0)
+    {
+        error("Unable to create shared memory: %s", strerror(errno));
+        goto failure;
+    }
+
+    if ((s->base = mmap(NULL, s->length, PROT_READ | PROT_WRITE, MAP_SHARED, s->memfd, 0)) == MAP_FAILED)
+    {
+        error("Unable to map shared memory: %s", strerror(errno));
+        s->base = NULL;
+        goto failure;
+    }
+
+    s->tx = (ShmRing *)s->base;
+    s->rx = (ShmRing *)((char *)s->base + SHM_RING_BYTES);
+    s->tx->size = s->rx->size = SHM_RING_SIZE;
+
+    if ((s->tx_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ||
+        (s->rx_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    {
+        error("Unable to create eventfd: %s", strerror(errno));
+        goto failure;
+    }
+
+    /* Pass segment and eventfds to broker and wait for acknowledgement */
+    int fds[3] = {s->memfd, s->tx_event, s->rx_event};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {.iov_base = SHM_MAGIC, .iov_len = strlen(SHM_MAGIC)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    memset(control, 0, sizeof(control));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    char ack[BUFSIZ];
+    if (sendmsg(s->socket_fd, &msg, MSG_NOSIGNAL) < 0 || read(s->socket_fd, ack, sizeof(ack)) <= 0)
+    {
+        error("Unable to attach to %s: %s", path, strerror(errno));
+        goto failure;
+    }
+
+    return s;
+
+failure:
+    shm_detach(s);
+    return NULL;
+}
+
+/**
+ * Detach from broker and release shared memory.
+ * @param   s       Shm structure.
+ */
+void shm_detach(Shm *s)
+{
+    if (s)
+    {
+        if (s->base)
+        {
+            munmap(s->base, s->length);
+        }
+        if (s->memfd >= 0)
+        {
+            close(s->memfd);
+        }
+        if (s->tx_event >= 0)
+        {
+            close(s->tx_event);
+        }
+        if (s->rx_event >= 0)
+        {
+            close(s->rx_event);
+        }
+        if (s->socket_fd >= 0)
+        {
+            close(s->socket_fd);
+        }
+        while (s->pending)
+        {
+            ShmRecord *record = s->pending;
+            s->pending = record->next;
+            free(record);
+        }
+        free(s);
+    }
+}
+
+/**
+ * Append record to transmit ring and signal broker.  If the ring is full (or
+ * earlier records are still waiting for room), a copy of the record is held
+ * until the broker frees space (see shm_flush), so records are sent in order.
+ * @param   s       Shm structure.
+ * @param   tag     Tag identifying the exchange.
+ * @param   data    Record data.
+ * @param   length  Length of record data.
+ * @return  Whether or not the record was sent or held (false if it is larger
+ *          than the ring, SHM_RECORD_MAX, or cannot be copied).
+ */
+bool shm_send(Shm *s, uint8_t tag, const char *data, size_t length)
+{
+    if (length > SHM_RECORD_MAX)
+    {
+        return false;
+    }
+
+    if (!s->pending && shm_write(s->tx, tag, data, length))
+    {
+        shm_signal(s->tx_event);
+        return true;
+    }
+
+    ShmRecord *record = malloc(sizeof(ShmRecord) + length);
+    if (!record)
+    {
+        return false;
+    }
+    record->tag = tag;
+    record->length = length;
+    record->next = NULL;
+    memcpy(record->data, data, length);
+
+    *s->pending_tail = record;
+    s->pending_tail = &record->next;
+    shm_flush(s);
+    return true;
+}
+
+/**
+ * Write held records to transmit ring while they fit (and signal broker).  If
+ * one still does not fit, the broker is asked to signal the receive eventfd
+ * once it frees space, so this is called again from shm_transport_recv.
+ * @param   s       Shm structure.
+ */
+void shm_flush(Shm *s)
+{
+    bool written = false;
+
+    while (s->pending)
+    {
+        ShmRecord *record = s->pending;
+        if (!shm_write(s->tx, record->tag, record->data, record->length))
+        {
+            /* Ask for a signal, then check again in case broker freed space
+             * before it could see the request */
+            __atomic_store_n(&s->tx->waiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (!shm_write(s->tx, record->tag, record->data, record->length))
+            {
+                break;
+            }
+        }
+
+        s->pending = record->next;
+        free(record);
+        written = true;
+    }
+
+    if (!s->pending)
+    {
+        s->pending_tail = &s->pending;
+    }
+    if (written)
+    {
+        shm_signal(s->tx_event);
+    }
+}
+
+/**
+ * Remove next record from receive ring.
+ * @param   s       Shm structure.
+ * @param   tag     Tag identifying the exchange.
+ * @param   length  Length of record data.
+ * @return  Newly allocated copy of record data (or NULL if ring is empty).
+ */
+char *shm_recv(Shm *s, uint8_t *tag, size_t *length)
+{
+    ShmRing *r = s->rx;
+    uint64_t head = r->head;
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+    {
+        return NULL;
+    }
+
+    uint8_t header[SHM_HEADER];
+    uint32_t length32;
+    shm_copy_out(r, head, header, SHM_HEADER);
+    memcpy(&length32, header, sizeof(length32));
+
+    char *data = malloc(length32 + 1);
+    if (data)
+    {
+        shm_copy_out(r, head + SHM_HEADER, data, length32);
+        data[length32] = 0;
+        *tag = header[4];
+        *length = length32;
+    }
+
+    __atomic_store_n(&r->head, head + SHM_ALIGN(SHM_HEADER + length32), __ATOMIC_RELEASE);
+
+    /* Wake broker if it waits for the space just freed */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&r->waiting, 0, __ATOMIC_ACQ_REL))
+    {
+        shm_signal(s->tx_event);
+    }
+    return data;
+}
+
+/**
+ * Signal receive eventfd locally (to interrupt a pending read of it).
+ * @param   s       Shm structure.
+ */
+void shm_wake(Shm *s)
+{
+    shm_signal(s->rx_event);
+}
+
+/* Internal Functions */
+
+/**
+ * Append record to ring (without signaling the consumer).
+ * @param   r       ShmRing structure.
+ * @param   tag     Tag identifying the exchange.
+ * @param   data    Record data.
+ * @param   length  Length of record data.
+ * @return  Whether or not the record fit in the ring.
+ */
+static bool shm_write(ShmRing *r, uint8_t tag, const char *data, size_t length)
+{
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->tail;
+    uint64_t total = SHM_ALIGN(SHM_HEADER + length);
+
+    if (total > r->size - (tail - head))
+    {
+        return false;
+    }
+
+    uint8_t header[SHM_HEADER] = {0};
+    uint32_t length32 = length;
+    memcpy(header, &length32, sizeof(length32));
+    header[4] = tag;
+
+    shm_copy_in(r, tail, header, SHM_HEADER);
+    shm_copy_in(r, tail + SHM_HEADER, data, length);
+    __atomic_store_n(&r->tail, tail + total, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Copy data into ring at position (wrapping around the end).
+ * @param   r           ShmRing structure.
+ * @param   position    Ring position.
+ * @param   data        Data to copy.
+ * @param   length      Length of data.
+ */
+static void shm_copy_in(ShmRing *r, uint64_t position, const void *data, size_t length)
+{
+    size_t offset = position & (r->size - 1);
+    size_t first = length < r->size - offset ? length : r->size - offset;
+
+    memcpy(r->data + offset, data, first);
+    memcpy(r->data, (const char *)data + first, length - first);
+}
+
+/**
+ * Copy data out of ring at position (wrapping around the end).
+ * @param   r           ShmRing structure.
+ * @param   position    Ring position.
+ * @param   data        Buffer to copy into.
+ * @param   length      Length of data.
+ */
+static void shm_copy_out(ShmRing *r, uint64_t position, void *data, size_t length)
+{
+    size_t offset = position & (r->size - 1);
+    size_t first = length < r->size - offset ? length : r->size - offset;
+
+    memcpy(data, r->data + offset, first);
+    memcpy((char *)data + first, r->data, length - first);
+}
+
+/**
+ * Signal eventfd.
+ * @param   fd      Eventfd to signal.
+ */
+static void shm_signal(int fd)
+{
+    uint64_t value = 1;
+    if (write(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    {
+        error("Unable to signal eventfd: %s", strerror(errno));
+    }
+}
+
+/**
+ * Attach to broker's shared memory listener (Transport interface).
+ * @param   path    Path of broker's shared memory Unix domain socket.
+ * @return  Shm structure (or NULL on failure).
+ */
+static void *shm_transport_attach(const char *path)
+{
+    return shm_attach(path);
+}
+
+/**
+ * Detach from broker (Transport interface).
+ * @param   endpoint    Shm structure.
+ */
+static void shm_transport_detach(void *endpoint)
+{
+    shm_detach(endpoint);
+}
+
+/**
+ * Send request as HTTP request record, followed by the contents of its file
+ * (Transport interface).
+ * @param   endpoint    Shm structure.
+ * @param   tag         Tag identifying the exchange.
+ * @param   r           Request to send.
+ * @return  Whether or not the record was sent (or held until the ring has room).
+ */
+static bool shm_transport_send(void *endpoint, uint8_t tag, Request *r)
+{
+    if (request_length(r) > SHM_RECORD_MAX)
+    {
+        return false; // Refused by mq_publish*, so its file is never read whole
+    }
+
+    char *data = NULL;
+    size_t length = 0;
+    FILE *ms = open_memstream(&data, &length);
+    if (!ms)
+    {
+        return false;
+    }
+    request_write(r, ms);
+    int status = shm_slurp(r, ms);
+    fclose(ms);
+
+    bool sent = status == 0 && shm_send(endpoint, tag, data, length);
+    free(data);
+    return sent;
+}
+
+/**
+ * Remove next response record, after sending records held while the transmit
+ * ring was full (Transport interface).
+ * @param   endpoint    Shm structure.
+ * @param   tag         Tag identifying the exchange.
+ * @param   length      Length of record data.
+ * @return  Newly allocated copy of record data (or NULL if none).
+ */
+static char *shm_transport_recv(void *endpoint, uint8_t *tag, size_t *length)
+{
+    Shm *s = endpoint;
+    if (s->pending)
+    {
+        shm_flush(s);
+    }
+    return shm_recv(s, tag, length);
+}
+
+/**
+ * Return eventfd the broker signals after writing response records (or
+ * freeing space for held request records) (Transport interface).
+ * @param   endpoint    Shm structure.
+ * @return  Receive eventfd.
+ */
+static int shm_transport_event(void *endpoint)
+{
+    return ((Shm *)endpoint)->rx_event;
+}
+
+/**
+ * Signal receive eventfd locally (Transport interface).
+ * @param   endpoint    Shm structure.
+ */
+static void shm_transport_wake(void *endpoint)
+{
+    shm_wake(endpoint);
+}
+
+/**
+ * Write contents of request's file to stream (shared memory records hold the
+ * whole request, so the file is at most SHM_RECORD_MAX bytes).
+ * @param   r       Request structure.
+ * @param   fs      Stream to write to.
+ * @return  0 on success (or -errno).
+ */
+static int shm_slurp(Request *r, FILE *fs)
+{
+    char buffer[BUFSIZ];
+    for (size_t copied = 0; copied < r->flength;)
+    {
+        size_t wanted = r->flength - copied < sizeof(buffer) ? r->flength - copied : sizeof(buffer);
+        ssize_t n = pread(r->file, buffer, wanted, r->foffset + copied);
+        if (n <= 0)
+        {
+            return n < 0 ? -errno : -EIO;
+        }
+        fwrite(buffer, 1, n, fs);
+        copied += n;
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
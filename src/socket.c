@@ -2,20 +2,51 @@
 
 #include "mq/logging.h"
 #include "mq/socket.h"
+#include "mq/string.h"
+
+#include <stdbool.h>
 
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+/* Internal Prototypes */
+
+static bool socket_unix(const char *host, Address *addr);
+
 /**
- * Create socket connection to specified host and port.
+ * Create socket connection to specified host and port (or to the Unix domain
+ * socket named by a "unix:/path" host, in which case port is ignored).
  * @param   host    Host string to connect to.
  * @param   port    Port string to connect to.
  * @return  Socket file stream of connection if successful, otherwise NULL.
  */
 FILE *  socket_connect(const char *host, const char *port) {
+    /* Connect to Unix domain socket */
+    Address local;
+    if (socket_unix(host, &local)) {
+        int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (socket_fd < 0) {
+            error("Unable to make socket: %s", strerror(errno));
+            return NULL;
+        }
+        if (connect(socket_fd, (struct sockaddr *)&local.addr, local.addrlen) < 0) {
+            error("Unable to connect to %s: %s", host, strerror(errno));
+            close(socket_fd);
+            return NULL;
+        }
+
+        FILE *fs = fdopen(socket_fd, "r+");
+        if (!fs) {
+            error("Unable to make file stream: %s", strerror(errno));
+            close(socket_fd);
+        }
+        return fs;
+    }
+
     /* Lookup server address information */
     struct addrinfo *results;
     struct addrinfo  hints = {
@@ -62,4 +93,64 @@ FILE *  socket_connect(const char *host, const char *port) {
     return fs;
 }
 
+/**
+ * Resolve addresses of specified host and port (or "unix:/path" host).
+ * @param   host    Host string to resolve.
+ * @param   port    Port string to resolve.
+ * @param   addrs   Array of addresses to store results in.
+ * @param   n       Maximum number of addresses to store.
+ * @param   status  Result of lookup (getaddrinfo status, left for the caller
+ *                  to report, since it may be retried).
+ * @return  Number of addresses resolved (0 on failure).
+ */
+size_t  socket_resolve(const char *host, const char *port, Address *addrs, size_t n, int *status) {
+    if (n > 0 && socket_unix(host, &addrs[0])) {
+        return 1;
+    }
+
+    /* Lookup server address information */
+    struct addrinfo *results;
+    struct addrinfo  hints = {
+	.ai_family   = AF_UNSPEC,   /* Return IPv4 and IPv6 choices */
+	.ai_socktype = SOCK_STREAM, /* Use TCP */
+    };
+    if ((*status = getaddrinfo(host, port, &hints, &results)) != 0) {
+        return 0;
+    }
+
+    /* Copy each server entry */
+    size_t count = 0;
+    for (struct addrinfo *p = results; p != NULL && count < n; p = p->ai_next) {
+        memcpy(&addrs[count].addr, p->ai_addr, p->ai_addrlen);
+        addrs[count].addrlen = p->ai_addrlen;
+        count++;
+    }
+
+    /* Release allocate address information */
+    freeaddrinfo(results);
+    return count;
+}
+
+/* Internal Functions */
+
+/**
+ * Parse Unix domain socket address from "unix:/path" host.
+ * @param   host    Host string to parse.
+ * @param   addr    Address structure to store result in.
+ * @return  Whether or not host names a Unix domain socket.
+ */
+static bool socket_unix(const char *host, Address *addr) {
+    size_t prefix = strlen(SOCKET_UNIX);
+    if (strncmp(host, SOCKET_UNIX, prefix) != 0) {
+        return false;
+    }
+
+    struct sockaddr_un *sun = (struct sockaddr_un *)&addr->addr;
+    memset(sun, 0, sizeof(struct sockaddr_un));
+    sun->sun_family = AF_UNIX;
+    strncpy(sun->sun_path, host + prefix, sizeof(sun->sun_path) - 1);
+    addr->addrlen = sizeof(struct sockaddr_un);
+    return true;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,265 @@
+/* trace.c: End-to-end message latency tracing */
+
+#define _GNU_SOURCE /* asprintf */
+
+#include "mq/logging.h"
+#include "mq/string.h"
+#include "mq/thread.h"
+#include "mq/trace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+
+/* Internal Constants */
+
+static const char *TraceStages[TRACE_STAGES] = {"outgoing", "send", "transit", "incoming", "total"};
+
+/* Internal Prototypes */
+
+static TraceTopic *trace_find(const char *name);
+
+/* Internal Variables */
+
+static Mutex       TraceLock = PTHREAD_MUTEX_INITIALIZER;
+static TraceTopic *TraceTopics = NULL;
+
+/* External Functions */
+
+/**
+ * Return current time of clock.
+ * @param   clock   Trace clock (TRACE_REALTIME or else monotonic).
+ * @return  Current time in nanoseconds.
+ */
+uint64_t trace_now(TraceClock clock)
+{
+    struct timespec ts;
+    clock_gettime(clock == TRACE_REALTIME ? CLOCK_REALTIME : CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Return latency histograms of topic (creating them the first time).  Topics
+ * are never freed, so callers may keep the returned pointer.
+ * @param   name    Name of topic.
+ * @return  TraceTopic structure (or NULL on failure).
+ */
+TraceTopic *trace_topic(const char *name)
+{
+    mutex_lock(&TraceLock);
+    TraceTopic *t = trace_find(name);
+    mutex_unlock(&TraceLock);
+    return t;
+}
+
+/**
+ * Record latency of stage.
+ * @param   t           TraceTopic structure (ignored if NULL).
+ * @param   stage       Stage that took nanoseconds.
+ * @param   nanoseconds Latency of stage.
+ */
+void trace_record(TraceTopic *t, TraceStage stage, uint64_t nanoseconds)
+{
+    if (t && stage < TRACE_STAGES)
+    {
+        histogram_record(&t->stages[stage], nanoseconds);
+    }
+}
+
+/**
+ * Embed publish timestamp and sequence number in message body:
+ *
+ *  \036mq-trace/1 $CLOCK $TIMESTAMP $SEQUENCE $TOPIC\036$BODY
+ *
+ * where $CLOCK is M (monotonic) or R (realtime).  Clients strip the envelope
+ * (see trace_open) before delivering the message.
+ * @param   clock       Clock of timestamp.
+ * @param   sequence    Sequence number of message.
+ * @param   topic       Topic message is published to.
+ * @param   body        Message body.
+ * @return  Newly allocated traced message body (or NULL on failure).
+ */
+char *trace_stamp(TraceClock clock, uint64_t sequence, const char *topic, const char *body)
+{
+    char *stamped = NULL;
+    if (asprintf(&stamped, TRACE_MAGIC "%c %" PRIu64 " %" PRIu64 " %s\036%s",
+                 clock == TRACE_REALTIME ? 'R' : 'M', trace_now(clock), sequence, topic, body ? body : "") < 0)
+    {
+        return NULL;
+    }
+    return stamped;
+}
+
+/**
+ * Parse envelope of traced message body: record its transit latency and
+ * sequence number in its topic's histograms.
+ * @param   body        Received message body.
+ * @param   length      Length of message body.
+ * @param   topic       TraceTopic of message (set if traced).
+ * @param   published   Publish time on the local monotonic clock (set if traced).
+ * @return  Length of envelope preceding the message (or 0 if not traced).
+ */
+size_t trace_open(const char *body, size_t length, TraceTopic **topic, uint64_t *published)
+{
+    size_t magic = strlen(TRACE_MAGIC);
+    if (length <= magic || memcmp(body, TRACE_MAGIC, magic) != 0)
+    {
+        return 0;
+    }
+
+    const char *end = memchr(body + magic, '\036', length - magic);
+    if (!end || end - body >= BUFSIZ)
+    {
+        return 0;
+    }
+
+    char envelope[BUFSIZ];
+    memcpy(envelope, body + magic, end - body - magic);
+    envelope[end - body - magic] = 0;
+
+    char clock;
+    char name[BUFSIZ];
+    uint64_t timestamp, sequence;
+    if (sscanf(envelope, "%c %" SCNu64 " %" SCNu64 " %s", &clock, &timestamp, &sequence, name) != 4)
+    {
+        return 0;
+    }
+
+    uint64_t now = trace_now(clock == 'R' ? TRACE_REALTIME : TRACE_MONOTONIC);
+    uint64_t transit = now > timestamp ? now - timestamp : 0; // Realtime clocks may be skewed
+
+    mutex_lock(&TraceLock);
+    TraceTopic *t = trace_find(name);
+    if (t)
+    {
+        if (t->sequence && sequence > t->sequence + 1)
+        {
+            t->gaps += sequence - t->sequence - 1;
+        }
+        if (sequence > t->sequence)
+        {
+            t->sequence = sequence;
+        }
+    }
+    mutex_unlock(&TraceLock);
+
+    trace_record(t, TRACE_TRANSIT, transit);
+    *topic = t;
+    *published = trace_now(TRACE_MONOTONIC) - transit;
+    return end - body + 1;
+}
+
+/**
+ * Copy latency histogram of topic's stage.
+ * @param   topic   Name of topic.
+ * @param   stage   Stage of histogram.
+ * @param   h       Histogram structure to copy into.
+ * @return  Whether or not topic has been traced.
+ */
+bool trace_histogram(const char *topic, TraceStage stage, Histogram *h)
+{
+    mutex_lock(&TraceLock);
+    TraceTopic *t = TraceTopics;
+    while (t && !streq(t->name, topic))
+    {
+        t = t->next;
+    }
+    mutex_unlock(&TraceLock);
+
+    if (!t || stage >= TRACE_STAGES)
+    {
+        return false;
+    }
+
+    histogram_copy(&t->stages[stage], h);
+    return true;
+}
+
+/**
+ * Write latency report (in microseconds) of each traced topic and stage:
+ *
+ *  $TOPIC $STAGE count=$N min=$MIN p50=$P50 p90=$P90 p99=$P99 p999=$P999 max=$MAX
+ *
+ * followed by one "$TOPIC sequence=$SEQUENCE gaps=$GAPS" line per topic.
+ * @param   fs      Stream to write report to.
+ */
+void trace_export(FILE *fs)
+{
+    Histogram *h = malloc(sizeof(Histogram));
+    if (!h)
+    {
+        error("Unable to allocate histogram: %s", strerror(errno));
+        return;
+    }
+
+    mutex_lock(&TraceLock);
+    for (TraceTopic *t = TraceTopics; t; t = t->next)
+    {
+        for (TraceStage stage = 0; stage < TRACE_STAGES; stage++)
+        {
+            histogram_copy(&t->stages[stage], h);
+            if (h->count == 0)
+            {
+                continue;
+            }
+
+            fprintf(fs, "%s %s count=%" PRIu64 " min=%.1f p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+                    t->name, TraceStages[stage], h->count, h->min / 1000.0,
+                    histogram_percentile(h, 50) / 1000.0, histogram_percentile(h, 90) / 1000.0,
+                    histogram_percentile(h, 99) / 1000.0, histogram_percentile(h, 99.9) / 1000.0,
+                    h->max / 1000.0);
+        }
+        fprintf(fs, "%s sequence=%" PRIu64 " gaps=%" PRIu64 "\n", t->name, t->sequence, t->gaps);
+    }
+    mutex_unlock(&TraceLock);
+
+    free(h);
+}
+
+/**
+ * Forget all recorded latencies (topics remain valid).
+ */
+void trace_reset(void)
+{
+    mutex_lock(&TraceLock);
+    for (TraceTopic *t = TraceTopics; t; t = t->next)
+    {
+        for (TraceStage stage = 0; stage < TRACE_STAGES; stage++)
+        {
+            histogram_reset(&t->stages[stage]);
+        }
+        t->sequence = 0;
+        t->gaps = 0;
+    }
+    mutex_unlock(&TraceLock);
+}
+
+/* Internal Functions */
+
+/**
+ * Find topic, creating it if necessary (TraceLock must be held).
+ * @param   name    Name of topic.
+ * @return  TraceTopic structure (or NULL on failure).
+ */
+static TraceTopic *trace_find(const char *name)
+{
+    TraceTopic *t = TraceTopics;
+    while (t && !streq(t->name, name))
+    {
+        t = t->next;
+    }
+
+    if (!t && (t = calloc(1, sizeof(TraceTopic))))
+    {
+        if (!(t->name = strdup(name)))
+        {
+            free(t);
+            return NULL;
+        }
+        t->next = TraceTopics;
+        TraceTopics = t;
+    }
+    return t;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,207 @@
+/* uring.c: Minimal io_uring interface */
+
+#include "mq/uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Set up io_uring instance and map its rings.
+ * @param   u       Uring structure.
+ * @param   entries Number of submission queue entries.
+ * @return  0 if successful, otherwise -errno.
+ */
+int uring_init(Uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(Uring));
+    memset(&p, 0, sizeof(p));
+
+    if ((u->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    {
+        return -errno;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cq_ring_size > u->sq_ring_size)
+        {
+            u->sq_ring_size = u->cq_ring_size;
+        }
+        u->cq_ring_size = u->sq_ring_size;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+    {
+        goto failure;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        u->cq_ring = u->sq_ring;
+    }
+    else
+    {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+        {
+            u->cq_ring = NULL;
+            goto failure;
+        }
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        u->sqes = NULL;
+        goto failure;
+    }
+
+    u->sq_head = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->sq_prepared = *u->sq_tail;
+
+    u->cq_head = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+    return 0;
+
+failure:
+    {
+        int status = -errno;
+        if (u->sq_ring == MAP_FAILED)
+        {
+            u->sq_ring = NULL;
+        }
+        uring_exit(u);
+        return status;
+    }
+}
+
+/**
+ * Unmap rings and close io_uring instance.
+ * @param   u       Uring structure.
+ */
+void uring_exit(Uring *u)
+{
+    if (u->sqes)
+    {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+    {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring)
+    {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->fd >= 0)
+    {
+        close(u->fd);
+    }
+    memset(u, 0, sizeof(Uring));
+    u->fd = -1;
+}
+
+/**
+ * Get next free submission queue entry (filled in by the caller, and only
+ * published to the kernel by the next uring_enter).
+ * @param   u       Uring structure.
+ * @return  Cleared submission queue entry (or NULL if queue is full).
+ */
+struct io_uring_sqe *uring_sqe(Uring *u)
+{
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = u->sq_prepared;
+
+    if (tail - head >= u->sq_entries)
+    {
+        return NULL;
+    }
+
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sq_array[index] = index;
+
+    u->sq_prepared = tail + 1;
+    u->sq_pending++;
+    return sqe;
+}
+
+/**
+ * Publish prepared entries (whose contents the release store of the tail
+ * orders before it), submit them, and wait for completions.
+ * @param   u       Uring structure.
+ * @param   wait    Minimum number of completions to wait for.
+ * @return  Number of entries submitted, otherwise -errno.
+ */
+int uring_enter(Uring *u, unsigned wait)
+{
+    __atomic_store_n(u->sq_tail, u->sq_prepared, __ATOMIC_RELEASE);
+
+    int result = syscall(__NR_io_uring_enter, u->fd, u->sq_pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (result < 0)
+    {
+        return -errno;
+    }
+
+    u->sq_pending -= result;
+    return result;
+}
+
+/**
+ * Peek at next completion queue entry.
+ * @param   u       Uring structure.
+ * @return  Completion queue entry (or NULL if there are none).
+ */
+struct io_uring_cqe *uring_cqe(Uring *u)
+{
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    return head == tail ? NULL : &u->cqes[head & *u->cq_mask];
+}
+
+/**
+ * Mark completion queue entry returned by uring_cqe as consumed.
+ * @param   u       Uring structure.
+ */
+void uring_seen(Uring *u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Register buffer for fixed reads and writes (as buffer index 0).
+ * @param   u       Uring structure.
+ * @param   buf     Buffer to register.
+ * @param   len     Length of buffer.
+ * @return  0 if successful, otherwise -errno.
+ */
+int uring_register_buffer(Uring *u, void *buf, size_t len)
+{
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -45,7 +45,7 @@ void *outgoing_thread(void *arg)
     }
 
     sleep(5);
-    mq_stop(mq);
+    assert(mq_stop_timeout(mq, MQ_DRAIN));
     return NULL;
 }
 
@@ -0,0 +1,86 @@
+/* test_flow_functional.c: Test publish flow control (Functional) */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char *QUEUE = "flow_test";
+const char *TOPIC = "flow";
+const size_t NMESSAGES = 200;       // Published while broker refuses more than --max-depth=20
+const double MAX_THROTTLE = 5.0;    // Seconds until publisher is throttled
+
+/* Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+void wait_for_state(MessageQueue *mq, MQState state) {
+    while (mq_state(mq) != state) {
+        usleep(10000);
+    }
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host = argc > 1 ? argv[1] : "localhost";
+    char *port = argc > 2 ? argv[2] : "9456";
+    char body[BUFSIZ];
+
+    alarm(60);
+
+    /* Subscribe queue, then stop consuming it */
+    MessageQueue *consumer = mq_create(QUEUE, host, port);
+    assert(consumer);
+    mq_subscribe(consumer, TOPIC);
+    mq_start(consumer);
+    wait_for_state(consumer, MQ_CONNECTED);
+    assert(mq_stop_timeout(consumer, MQ_DRAIN));
+    mq_delete(consumer);
+
+    /* Queue fills up: broker refuses publishes and publisher slows down */
+    MessageQueue *publisher = mq_create("flow_publisher", host, port);
+    assert(publisher);
+    mq_start(publisher);
+    assert(mq_rate(publisher) == 0);
+
+    for (size_t i = 0; i < NMESSAGES; i++) {
+        sprintf(body, "%lu", i);
+        mq_publish(publisher, TOPIC, body);
+    }
+
+    double deadline = now() + MAX_THROTTLE;
+    while (mq_rate(publisher) == 0 && now() < deadline) {
+        usleep(10000);
+    }
+    assert(mq_rate(publisher) >= MQ_RATE_MIN);
+
+    /* Consuming again lets refused messages through, exactly once and in order */
+    consumer = mq_create(QUEUE, host, port);
+    assert(consumer);
+    mq_start(consumer);
+
+    for (size_t i = 0; i < NMESSAGES; i++) {
+        sprintf(body, "%lu", i);
+        char *message = mq_retrieve(consumer);
+        assert(message && streq(message, body));
+        free(message);
+    }
+
+    assert(mq_stop_timeout(publisher, MQ_DRAIN));
+    assert(mq_stop_timeout(consumer, MQ_DRAIN));
+    mq_delete(publisher);
+    mq_delete(consumer);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
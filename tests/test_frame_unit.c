@@ -0,0 +1,302 @@
+/* test_frame_unit.c: Test binary framing protocol (Unit) */
+
+#include "mq/frame.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+/* Functions */
+
+size_t read_frame(const char *buffer, Frame *f, const char **body) {
+    frame_unpack(buffer, f);
+    *body = buffer + FRAME_HEADER;
+    return FRAME_HEADER + f->length;
+}
+
+int test_00_frame_pack() {
+    Frame in = {.length = 50, .opcode = FRAME_RESULT, .status = 404, .id = 0x01020304};
+    Frame out;
+    char buffer[FRAME_HEADER];
+
+    frame_pack(&in, buffer);
+    assert(buffer[0] == 0 && buffer[3] == 50);
+    assert((uint8_t)buffer[4] == FRAME_RESULT);
+    assert(buffer[8] == 1 && buffer[11] == 4);
+
+    frame_unpack(buffer, &out);
+    assert(out.length == in.length);
+    assert(out.opcode == in.opcode);
+    assert(out.status == in.status);
+    assert(out.id     == in.id);
+
+    return EXIT_SUCCESS;
+}
+
+int test_01_frame_write_publish() {
+    FrameTable table = {{0}};
+    Request *r = request_create("PUT", "/topic/HOT", "SOME LIKE IT");
+    char *buffer = NULL;
+    size_t length = 0;
+    FILE *ms = open_memstream(&buffer, &length);
+
+    assert(frame_write(&table, r, ms) == 1);
+    assert(frame_write(&table, r, ms) == 1);
+    fclose(ms);
+
+    /* Topic is declared once, then referenced by id */
+    Frame f;
+    const char *body;
+    size_t offset = read_frame(buffer, &f, &body);
+    assert(f.opcode == FRAME_DECLARE && f.id == 1 && f.length == 3);
+    assert(strncmp(body, "HOT", 3) == 0);
+
+    offset += read_frame(buffer + offset, &f, &body);
+    assert(f.opcode == FRAME_PUBLISH && f.id == 1 && f.length == 12);
+    assert(strncmp(body, "SOME LIKE IT", 12) == 0);
+
+    offset += read_frame(buffer + offset, &f, &body);
+    assert(f.opcode == FRAME_PUBLISH && f.id == 1);
+    assert(offset == length);
+    assert(table.count == 1);
+
+    frame_clear(&table);
+    request_delete(r);
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+int test_02_frame_write_subscription() {
+    FrameTable table = {{0}};
+    Request *requests[] = {
+        request_create("PUT"   , "/subscription/LIVE/HOT", NULL),
+        request_create("DELETE", "/subscription/LIVE/COLD", NULL),
+        request_create("GET"   , "/queue/LIVE", NULL),
+        request_create("GET"   , "/queue/LIVE?max=64&bytes=4096", NULL),
+        request_create("POST"  , "/unknown", NULL),
+    };
+    char *buffer = NULL;
+    size_t length = 0;
+    FILE *ms = open_memstream(&buffer, &length);
+
+    assert(frame_write(&table, requests[0], ms) == 1);
+    assert(frame_write(&table, requests[1], ms) == 1);
+    assert(frame_write(&table, requests[2], ms) == 1);
+    assert(frame_write(&table, requests[3], ms) == 1);
+    assert(frame_write(&table, requests[4], ms) == -1);
+    fclose(ms);
+
+    Frame f;
+    const char *body;
+    size_t offset = read_frame(buffer, &f, &body);
+    assert(f.opcode == FRAME_DECLARE && f.id == 1);
+
+    offset += read_frame(buffer + offset, &f, &body);
+    assert(f.opcode == FRAME_SUBSCRIBE && f.id == 1 && f.length == 4);
+    assert(strncmp(body, "LIVE", 4) == 0);
+
+    offset += read_frame(buffer + offset, &f, &body);
+    assert(f.opcode == FRAME_DECLARE && f.id == 2 && strncmp(body, "COLD", 4) == 0);
+
+    offset += read_frame(buffer + offset, &f, &body);
+    assert(f.opcode == FRAME_UNSUBSCRIBE && f.id == 2);
+
+    offset += read_frame(buffer + offset, &f, &body);
+    assert(f.opcode == FRAME_FETCH && f.id == 0 && f.length == 4);
+
+    /* Limits of batch fetch follow queue name and NUL */
+    offset += read_frame(buffer + offset, &f, &body);
+    assert(f.opcode == FRAME_FETCH && f.length == 4 + 1 + 7);
+    assert(memcmp(body, "LIVE\0" "64 4096", 12) == 0);
+    assert(offset == length);
+
+    frame_clear(&table);
+    assert(table.count == 0);
+
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        request_delete(requests[i]);
+    }
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+int test_03_frame_write_headers() {
+    FrameTable table = {{0}};
+    Request *publish = request_create("PUT", "/topic/HOT", "BODY");
+    Request *subscribe = request_create("PUT", "/subscription/LIVE/HOT", "region = 'us'");
+    char *buffer = NULL;
+    size_t length = 0;
+    FILE *ms = open_memstream(&buffer, &length);
+
+    publish->headers = strdup("region=us\n");
+    assert(frame_write(&table, publish, ms) == 1);
+    assert(frame_write(&table, subscribe, ms) == 1);
+    fclose(ms);
+
+    /* Header block is prefixed by its length and flagged */
+    Frame f;
+    const char *body;
+    size_t offset = read_frame(buffer, &f, &body);
+    offset += read_frame(buffer + offset, &f, &body);
+    assert(f.opcode == FRAME_PUBLISH && f.flags == FRAME_HEADERS && f.length == 2 + 10 + 4);
+    assert(body[0] == 0 && body[1] == 10);
+    assert(strncmp(body + 2, "region=us\nBODY", 14) == 0);
+
+    /* Selector follows queue name and NUL */
+    offset += read_frame(buffer + offset, &f, &body);
+    assert(f.opcode == FRAME_SUBSCRIBE && f.flags == 0 && f.length == 5 + 13);
+    assert(memcmp(body, "LIVE\0region = 'us'", 18) == 0);
+    assert(offset == length);
+
+    frame_clear(&table);
+    request_delete(publish);
+    request_delete(subscribe);
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+int test_04_frame_write_read() {
+    FrameTable table = {{0}};
+    Request *read = request_create("GET", "/topic/HOT?offset=-1&max=64&wait=1000", NULL);
+    Request *oldest = request_create("GET", "/topic/HOT", NULL);
+    char *buffer = NULL;
+    size_t length = 0;
+    FILE *ms = open_memstream(&buffer, &length);
+
+    assert(frame_write(&table, read, ms) == 1);
+    assert(frame_write(&table, oldest, ms) == 1);
+    fclose(ms);
+
+    /* Topic name stops at the query, whose arguments become the body */
+    Frame f;
+    const char *body;
+    size_t offset = read_frame(buffer, &f, &body);
+    assert(f.opcode == FRAME_DECLARE && f.id == 1 && f.length == 3 && strncmp(body, "HOT", 3) == 0);
+
+    offset += read_frame(buffer + offset, &f, &body);
+    assert(f.opcode == FRAME_READ && f.id == 1 && f.length == 10);
+    assert(strncmp(body, "-1 64 1000", 10) == 0);
+
+    /* Missing arguments read one message from the oldest one, without waiting */
+    offset += read_frame(buffer + offset, &f, &body);
+    assert(f.opcode == FRAME_READ && f.id == 1 && f.length == 5);
+    assert(strncmp(body, "0 1 0", 5) == 0);
+    assert(offset == length);
+
+    frame_clear(&table);
+    request_delete(read);
+    request_delete(oldest);
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+int test_05_frame_write_line() {
+    FrameTable table = {{0}};
+    RequestLine *l = request_line_create("PUT", "/topic/HOT");
+    Request *r = request_from_line(l, "SOME LIKE IT", strlen("SOME LIKE IT"));
+    Request *other = request_create("PUT", "/topic/COLD", "");
+    char *buffer = NULL;
+    size_t length = 0;
+    FILE *ms = open_memstream(&buffer, &length);
+
+    /* Line caches id declared on connection */
+    assert(frame_write(&table, other, ms) == 1);
+    assert(frame_write(&table, r, ms) == 1);
+    assert(l->id == 2 && l->generation == table.generation && table.generation);
+    assert(frame_write(&table, r, ms) == 1);
+    assert(table.count == 2);
+
+    /* Until connection is closed */
+    frame_clear(&table);
+    assert(frame_write(&table, r, ms) == 1);
+    assert(l->id == 1 && l->generation == table.generation);
+    fclose(ms);
+
+    Frame f;
+    const char *body;
+    size_t offset = 0;
+    uint8_t opcodes[] = {FRAME_DECLARE, FRAME_PUBLISH, FRAME_DECLARE, FRAME_PUBLISH, FRAME_PUBLISH, FRAME_DECLARE, FRAME_PUBLISH};
+    uint32_t ids[] = {1, 1, 2, 2, 2, 1, 1};
+    for (size_t i = 0; i < sizeof(opcodes); i++) {
+        offset += read_frame(buffer + offset, &f, &body);
+        assert(f.opcode == opcodes[i] && f.id == ids[i]);
+    }
+    assert(offset == length);
+
+    frame_clear(&table);
+    request_delete(r);
+    request_delete(other);
+    request_line_release(l);
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+int test_06_frame_write_rejected() {
+    FrameTable table = {{0}};
+    Request *oversized = request_create("PUT", "/topic/HOT", "BODY");
+    Request *publish = request_create("PUT", "/topic/HOT", "BODY");
+    char *buffer = NULL;
+    size_t length = 0;
+    FILE *ms = open_memstream(&buffer, &length);
+
+    /* Request that cannot be framed writes nothing (not even its topic) */
+    oversized->headers = malloc(UINT16_MAX + 2);
+    memset(oversized->headers, 'x', UINT16_MAX + 1);
+    oversized->headers[UINT16_MAX + 1] = 0;
+    assert(frame_write(&table, oversized, ms) == -1);
+    fflush(ms);
+    assert(length == 0 && table.count == 0);
+
+    /* So the next request on the connection still declares the topic */
+    assert(frame_write(&table, publish, ms) == 1);
+    fclose(ms);
+
+    Frame f;
+    const char *body;
+    size_t offset = read_frame(buffer, &f, &body);
+    assert(f.opcode == FRAME_DECLARE && f.id == 1);
+    offset += read_frame(buffer + offset, &f, &body);
+    assert(f.opcode == FRAME_PUBLISH && f.id == 1);
+    assert(offset == length);
+
+    frame_clear(&table);
+    request_delete(oversized);
+    request_delete(publish);
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test frame_pack\n");
+        fprintf(stderr, "    1. Test frame_write_publish\n");
+        fprintf(stderr, "    2. Test frame_write_subscription\n");
+        fprintf(stderr, "    3. Test frame_write_headers\n");
+        fprintf(stderr, "    4. Test frame_write_read\n");
+        fprintf(stderr, "    5. Test frame_write_line\n");
+        fprintf(stderr, "    6. Test frame_write_rejected\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_frame_pack(); break;
+        case 1:  status = test_01_frame_write_publish(); break;
+        case 2:  status = test_02_frame_write_subscription(); break;
+        case 3:  status = test_03_frame_write_headers(); break;
+        case 4:  status = test_04_frame_write_read(); break;
+        case 5:  status = test_05_frame_write_line(); break;
+        case 6:  status = test_06_frame_write_rejected(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,106 @@
+/* test_hashring_unit.c: Test consistent hashing (Unit) */
+
+#include "mq/hashring.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Constants */
+
+#define NKEYS   10000
+
+const char *NODES[] = {"localhost:9001", "localhost:9002", "localhost:9003", "localhost:9004"};
+
+/* Functions */
+
+void key_name(size_t i, char *name, size_t length) {
+    snprintf(name, length, "topic.%zu", i);
+}
+
+int test_00_hashring_lookup() {
+    HashRing *r = hashring_create(NODES, 3);
+    assert(r && r->npoints == 3 * HASHRING_REPLICAS);
+
+    /* Points are sorted */
+    for (size_t i = 1; i < r->npoints; i++) {
+        assert(r->points[i - 1].hash <= r->points[i].hash);
+    }
+
+    /* Keys spread over every node */
+    size_t counts[3] = {0};
+    char key[BUFSIZ];
+    for (size_t i = 0; i < NKEYS; i++) {
+        key_name(i, key, sizeof(key));
+        size_t node = hashring_lookup(r, key);
+        assert(node < 3);
+        assert(hashring_lookup(r, key) == node);
+        counts[node]++;
+    }
+    for (size_t node = 0; node < 3; node++) {
+        assert(counts[node] > NKEYS / 4 && counts[node] < NKEYS / 2);
+    }
+
+    /* Nodes are placed by name, not by position in list */
+    const char *reversed[] = {NODES[2], NODES[1], NODES[0]};
+    HashRing *other = hashring_create(reversed, 3);
+    assert(other);
+    for (size_t i = 0; i < NKEYS; i++) {
+        key_name(i, key, sizeof(key));
+        assert(2 - hashring_lookup(other, key) == hashring_lookup(r, key));
+    }
+
+    assert(!hashring_create(NODES, 0));
+    hashring_delete(other);
+    hashring_delete(r);
+    return EXIT_SUCCESS;
+}
+
+int test_01_hashring_add() {
+    HashRing *before = hashring_create(NODES, 3);
+    HashRing *after = hashring_create(NODES, 4);
+    assert(before && after);
+
+    /* Only keys taken over by the new node move */
+    size_t moved = 0;
+    char key[BUFSIZ];
+    for (size_t i = 0; i < NKEYS; i++) {
+        key_name(i, key, sizeof(key));
+        size_t old = hashring_lookup(before, key);
+        size_t new = hashring_lookup(after, key);
+        if (old != new) {
+            assert(new == 3);
+            moved++;
+        }
+    }
+    assert(moved > NKEYS / 8 && moved < NKEYS * 3 / 8);
+
+    hashring_delete(before);
+    hashring_delete(after);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test hashring_lookup\n");
+        fprintf(stderr, "    1. Test hashring_add\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_hashring_lookup(); break;
+        case 1:  status = test_01_hashring_add(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,312 @@
+/* test_inproc_unit.c: Test in-process broker transport (Unit) */
+
+#include "mq/client.h"
+#include "mq/inproc.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define NMESSAGES 10000
+
+/* Functions */
+
+void send_request(Inproc *p, uint8_t tag, const char *method, const char *uri, const char *body) {
+    Request *r = request_create(method, uri, body);
+    assert(r && inproc_send(p, tag, r));
+    request_delete(r);
+}
+
+/* Receive next response record (with tag), returning its status and body */
+int recv_response(Inproc *p, uint8_t tag, char *body, size_t size) {
+    uint8_t rtag;
+    size_t length;
+    char *data = inproc_recv(p, &rtag, &length);
+    if (!data) {
+        return -1;
+    }
+    assert(rtag == tag && strlen(data) == length);
+
+    int status = 0;
+    char *end = strstr(data, "\r\n\r\n");
+    assert(end && sscanf(data, "HTTP/1.0 %d", &status) == 1);
+    snprintf(body, size, "%s", end + 4);
+    free(data);
+    return status;
+}
+
+bool readable(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    return poll(&pfd, 1, 0) == 1;
+}
+
+int test_00_inproc_publish() {
+    Inproc *p = inproc_attach("unit_publish");
+    char body[BUFSIZ];
+    assert(p);
+
+    /* Topics without subscribers refuse messages */
+    send_request(p, 0, "PUT", "/topic/news", "lost");
+    assert(readable(p->event));
+    assert(recv_response(p, 0, body, sizeof(body)) == 404);
+    assert(recv_response(p, 0, body, sizeof(body)) == -1);
+
+    send_request(p, 1, "PUT", "/subscription/reader/news", NULL);
+    assert(recv_response(p, 1, body, sizeof(body)) == 200);
+    assert(streq(body, "Subscribed queue (reader) to topic (news)\n"));
+
+    send_request(p, 0, "PUT", "/topic/news", "first");
+    send_request(p, 0, "PUT", "/topic/news", "second");
+    assert(recv_response(p, 0, body, sizeof(body)) == 200);
+    assert(streq(body, "Published message (5 bytes) to 1 subscribers of news\n"));
+    assert(recv_response(p, 0, body, sizeof(body)) == 200);
+
+    /* Messages are retrieved in order */
+    send_request(p, 2, "GET", "/queue/reader", NULL);
+    assert(recv_response(p, 2, body, sizeof(body)) == 200 && streq(body, "first"));
+    send_request(p, 2, "GET", "/queue/reader", NULL);
+    assert(recv_response(p, 2, body, sizeof(body)) == 200 && streq(body, "second"));
+
+    /* Retrieval from an empty queue waits for the next message */
+    send_request(p, 2, "GET", "/queue/reader", NULL);
+    assert(recv_response(p, 2, body, sizeof(body)) == -1);
+    send_request(p, 0, "PUT", "/topic/news", "third");
+    assert(recv_response(p, 2, body, sizeof(body)) == 200 && streq(body, "third"));
+    assert(recv_response(p, 0, body, sizeof(body)) == 200);
+
+    send_request(p, 1, "DELETE", "/subscription/reader/news", NULL);
+    assert(recv_response(p, 1, body, sizeof(body)) == 200);
+    send_request(p, 1, "DELETE", "/subscription/reader/news", NULL);
+    assert(recv_response(p, 1, body, sizeof(body)) == 404);
+    send_request(p, 0, "PUT", "/topic/news", "lost");
+    assert(recv_response(p, 0, body, sizeof(body)) == 404);
+
+    send_request(p, 2, "GET", "/queue/missing", NULL);
+    assert(recv_response(p, 2, body, sizeof(body)) == 404);
+    send_request(p, 2, "GET", "/stats", NULL);
+    assert(recv_response(p, 2, body, sizeof(body)) == 404);
+
+    inproc_detach(p);
+    return EXIT_SUCCESS;
+}
+
+int test_01_inproc_cancel() {
+    Inproc *p = inproc_attach("unit_cancel");
+    Inproc *q = inproc_attach("unit_cancel");
+    Inproc *other = inproc_attach("unit_cancel_other");
+    char body[BUFSIZ];
+    assert(p && q && other);
+
+    send_request(p, 1, "PUT", "/subscription/reader/news", NULL);
+    assert(recv_response(p, 1, body, sizeof(body)) == 200);
+
+    /* Brokers with other names have their own queues */
+    send_request(other, 0, "PUT", "/topic/news", "lost");
+    assert(recv_response(other, 0, body, sizeof(body)) == 404);
+
+    /* Messages published after a retrieval is cancelled stay in queue */
+    send_request(p, 2, "GET", "/queue/reader", NULL);
+    inproc_cancel(p, 2);
+    send_request(q, 0, "PUT", "/topic/news", "kept");
+    assert(recv_response(q, 0, body, sizeof(body)) == 200);
+    assert(recv_response(p, 2, body, sizeof(body)) == -1);
+
+    /* And so do messages published after a waiting endpoint detaches */
+    send_request(q, 2, "GET", "/queue/reader", NULL);
+    assert(recv_response(q, 2, body, sizeof(body)) == 200 && streq(body, "kept"));
+    send_request(q, 2, "GET", "/queue/reader", NULL);
+    inproc_detach(q);
+    send_request(p, 0, "PUT", "/topic/news", "also kept");
+    assert(recv_response(p, 0, body, sizeof(body)) == 200);
+    send_request(p, 2, "GET", "/queue/reader", NULL);
+    assert(recv_response(p, 2, body, sizeof(body)) == 200 && streq(body, "also kept"));
+
+    /* Selectors are refused */
+    send_request(p, 1, "PUT", "/subscription/reader/news", "priority > 1");
+    assert(recv_response(p, 1, body, sizeof(body)) == 400);
+
+    inproc_detach(p);
+    inproc_detach(other);
+    return EXIT_SUCCESS;
+}
+
+/* Create publish request with producer id and sequence number */
+Request *identified_request(const char *topic, const char *body, uint64_t sequence) {
+    char uri[BUFSIZ];
+    char headers[BUFSIZ];
+    snprintf(uri, sizeof(uri), "/topic/%s", topic);
+    snprintf(headers, sizeof(headers), MQ_HEADER_PRODUCER "=unit\n" MQ_HEADER_SEQUENCE "=%lu\n", (unsigned long)sequence);
+
+    Request *r = request_create("PUT", uri, body);
+    assert(r && (r->headers = strdup(headers)));
+    return r;
+}
+
+int test_02_inproc_batch() {
+    Inproc *p = inproc_attach("unit_batch");
+    char body[BUFSIZ];
+    assert(p);
+
+    send_request(p, 1, "PUT", "/subscription/reader/news", NULL);
+    assert(recv_response(p, 1, body, sizeof(body)) == 200);
+
+    /* A list of requests gets one response (to its last request) */
+    Request *r = identified_request("news", "first", 1);
+    r->next = identified_request("news", "second", 2);
+    r->next->next = identified_request("news", "third", 3);
+    assert(inproc_send(p, 0, r));
+    assert(recv_response(p, 0, body, sizeof(body)) == 200);
+    assert(streq(body, "Published message (5 bytes) to 1 subscribers of news\n"));
+    assert(recv_response(p, 0, body, sizeof(body)) == -1);
+
+    /* Resending the list (as after a 429) does not deliver it twice */
+    assert(inproc_send(p, 0, r));
+    assert(recv_response(p, 0, body, sizeof(body)) == 200);
+    assert(streq(body, "Ignored duplicate message (5 bytes) from producer unit (sequence 3)\n"));
+    for (Request *s = r; s;) {
+        Request *next = s->next;
+        request_delete(s);
+        s = next;
+    }
+
+    /* Sequence numbers are checked within a window below the highest */
+    r = identified_request("news", "fourth", 2 + INPROC_WINDOW);
+    assert(inproc_send(p, 0, r) && recv_response(p, 0, body, sizeof(body)) == 200);
+    request_delete(r);
+    r = identified_request("news", "late", 2);
+    assert(inproc_send(p, 0, r) && recv_response(p, 0, body, sizeof(body)) == 200);
+    assert(strncmp(body, "Ignored duplicate", strlen("Ignored duplicate")) == 0);
+    request_delete(r);
+
+    /* Batch retrievals return records, up to max messages or bytes */
+    send_request(p, 2, "GET", "/queue/reader?max=2", NULL);
+    assert(recv_response(p, 2, body, sizeof(body)) == 200 && streq(body, "5\nfirst6\nsecond"));
+    send_request(p, 2, "GET", "/queue/reader?max=10&bytes=1", NULL);
+    assert(recv_response(p, 2, body, sizeof(body)) == 200 && streq(body, "5\nthird"));
+    send_request(p, 2, "GET", "/queue/reader", NULL);
+    assert(recv_response(p, 2, body, sizeof(body)) == 200 && streq(body, "fourth"));
+    send_request(p, 2, "GET", "/queue/reader?max=0", NULL);
+    assert(recv_response(p, 2, body, sizeof(body)) == 400);
+
+    /* And wait for the next message like any other retrieval */
+    send_request(p, 2, "GET", "/queue/reader?max=10", NULL);
+    assert(recv_response(p, 2, body, sizeof(body)) == -1);
+    send_request(p, 0, "PUT", "/topic/news", "fifth");
+    assert(recv_response(p, 2, body, sizeof(body)) == 200 && streq(body, "5\nfifth"));
+    assert(recv_response(p, 0, body, sizeof(body)) == 200);
+
+    inproc_detach(p);
+    return EXIT_SUCCESS;
+}
+
+int test_03_inproc_client() {
+    MessageQueue *subscriber = mq_create("inproc_subscriber", "inproc://unit_client", NULL);
+    MessageQueue *publisher = mq_create("inproc_publisher", "inproc://unit_client", NULL);
+    char body[BUFSIZ];
+    assert(subscriber && publisher);
+
+    mq_subscribe(subscriber, "news");
+    mq_start(subscriber);
+    mq_start(publisher);
+    while (mq_state(subscriber) != MQ_CONNECTED) {
+        usleep(1000);
+    }
+
+    MQTopic *t = mq_topic_open(publisher, "news");
+    assert(t);
+    for (size_t i = 0; i < NMESSAGES; i++) {
+        snprintf(body, sizeof(body), "%zu", i);
+        assert(mq_publish_handle(t, body, strlen(body)));
+    }
+    mq_topic_close(t);
+
+    /* Every message arrives once, in order */
+    for (size_t i = 0; i < NMESSAGES; i++) {
+        char *message = mq_retrieve(subscriber);
+        assert(message);
+        snprintf(body, sizeof(body), "%zu", i);
+        assert(streq(message, body));
+        free(message);
+    }
+
+    assert(mq_stop_timeout(publisher, MQ_DRAIN));
+    mq_stop(subscriber);
+    mq_delete(publisher);
+    mq_delete(subscriber);
+    return EXIT_SUCCESS;
+}
+
+int test_04_inproc_prefetch() {
+    MessageQueue *subscriber = mq_create("inproc_prefetcher", "inproc://unit_prefetch", NULL);
+    MessageQueue *publisher = mq_create("inproc_publisher", "inproc://unit_prefetch", NULL);
+    char body[BUFSIZ];
+    assert(subscriber && publisher);
+
+    /* Puller waits for retrievers whenever the window is full */
+    mq_prefetch(subscriber, 8, 32);
+    mq_subscribe(subscriber, "news");
+    mq_start(subscriber);
+    mq_start(publisher);
+    while (mq_state(subscriber) != MQ_CONNECTED) {
+        usleep(1000);
+    }
+
+    for (size_t i = 0; i < NMESSAGES; i++) {
+        snprintf(body, sizeof(body), "%zu", i);
+        mq_publish(publisher, "news", body);
+    }
+    assert(mq_stop_timeout(publisher, MQ_DRAIN));
+
+    /* So the rest of the messages stay in the broker's queue */
+    usleep(10000);
+    assert(subscriber->incoming->size <= 8);
+
+    for (size_t i = 0; i < NMESSAGES; i++) {
+        char *message = mq_retrieve(subscriber);
+        assert(message);
+        snprintf(body, sizeof(body), "%zu", i);
+        assert(streq(message, body));
+        free(message);
+    }
+
+    mq_stop(subscriber);
+    mq_delete(publisher);
+    mq_delete(subscriber);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test inproc_publish\n");
+        fprintf(stderr, "    1. Test inproc_cancel\n");
+        fprintf(stderr, "    2. Test inproc_batch\n");
+        fprintf(stderr, "    3. Test inproc_client\n");
+        fprintf(stderr, "    4. Test inproc_prefetch\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_inproc_publish(); break;
+        case 1:  status = test_01_inproc_cancel(); break;
+        case 2:  status = test_02_inproc_batch(); break;
+        case 3:  status = test_03_inproc_client(); break;
+        case 4:  status = test_04_inproc_prefetch(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,88 @@
+/* test_latency_functional.c: Test publish-to-delivery latency (Functional) */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <time.h>
+
+/* Constants */
+
+const char *TOPIC = "latency";
+const size_t NWARMUP = 20;
+const size_t NMESSAGES = 500;
+const double MAX_MEDIAN = 1.0; // Milliseconds
+const double MAX_P99 = 15.0;   // Milliseconds (tail includes scheduling delays of the broker process)
+
+/* Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host = argc > 1 ? argv[1] : "localhost";
+    char *port = argc > 2 ? argv[2] : "9456";
+
+    MessageQueue *mq = mq_create("latency_test", host, port);
+    assert(mq);
+
+    mq_subscribe(mq, TOPIC);
+    mq_trace(mq, TRACE_MONOTONIC);
+    mq_start(mq);
+
+    /* Publish one message at a time and time its delivery */
+    double *latencies = calloc(NMESSAGES, sizeof(double));
+    assert(latencies);
+
+    for (size_t i = 0; i < NWARMUP + NMESSAGES; i++) {
+        double start = now();
+        mq_publish(mq, TOPIC, "ping");
+
+        char *message = mq_retrieve(mq);
+        assert(message && streq(message, "ping"));
+        free(message);
+
+        if (i >= NWARMUP) {
+            latencies[i - NWARMUP] = now() - start;
+        }
+    }
+
+    qsort(latencies, NMESSAGES, sizeof(double), compare_doubles);
+    double median = latencies[NMESSAGES / 2];
+    double p99 = latencies[NMESSAGES * 99 / 100];
+    printf("latency: median %.3f ms, p99 %.3f ms, max %.3f ms\n", median, p99, latencies[NMESSAGES - 1]);
+
+    /* Every stage of every traced message is recorded */
+    Histogram *h = malloc(sizeof(Histogram));
+    assert(h);
+    for (TraceStage stage = 0; stage < TRACE_STAGES; stage++) {
+        assert(trace_histogram(TOPIC, stage, h));
+        assert(h->count == NWARMUP + NMESSAGES);
+    }
+    assert(histogram_percentile(h, 50) <= 2 * median * 1000000);
+    trace_export(stdout);
+
+    mq_stop(mq);
+    mq_delete(mq);
+    free(latencies);
+    free(h);
+
+    if (median >= MAX_MEDIAN || p99 >= MAX_P99) {
+        fprintf(stderr, "latency exceeds median %.3f ms or p99 %.3f ms\n", MAX_MEDIAN, MAX_P99);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,189 @@
+/* test_logging_unit.c: Test asynchronous logging (Unit) */
+
+#include "mq/logging.h"
+#include "mq/string.h"
+#include "mq/thread.h"
+
+#include <assert.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define SITES   (2 * LOG_SLOTS)
+#define THREADS 4
+
+/* Functions */
+
+/* Redirect stderr to a temporary file (and return its descriptor) */
+int capture() {
+    FILE *fs = tmpfile();
+    assert(fs);
+    assert(dup2(fileno(fs), STDERR_FILENO) == STDERR_FILENO);
+    fclose(fs);
+    return STDERR_FILENO;
+}
+
+/* Return everything logged so far */
+char *captured(int fd) {
+    log_flush();
+
+    struct stat st;
+    assert(fstat(fd, &st) == 0);
+    char *buffer = calloc(1, st.st_size + 1);
+    assert(buffer);
+    assert(pread(fd, buffer, st.st_size, 0) == st.st_size);
+    return buffer;
+}
+
+size_t count(const char *buffer, const char *needle) {
+    size_t n = 0;
+    for (const char *s = strstr(buffer, needle); s; s = strstr(s + 1, needle)) {
+        n++;
+    }
+    return n;
+}
+
+/* Sum of N in "Dropped N log records" */
+size_t dropped(const char *buffer) {
+    size_t n = 0;
+    for (const char *s = strstr(buffer, "Dropped "); s; s = strstr(s + 1, "Dropped ")) {
+        n += strtoul(s + strlen("Dropped "), NULL, 10);
+    }
+    return n;
+}
+
+void *log_sites(void *arg) {
+    LogSite *sites = arg;
+    for (int i = 0; i < SITES; i++) {
+        sites[i] = (LogSite){LOG_INFO, __FILE__, __LINE__, __func__, "site %d"};
+        log_record(&sites[i], "site %d", i);
+    }
+    return NULL;
+}
+
+int test_00_log_capture() {
+    int fd = capture();
+
+    char name[] = "original";
+    info("%s:%d %u %zu %ld %lld %.2f %p %-6.*s| %5s %c 100%%", name, -1, 2u, (size_t)3, -4L, 5LL, 6.125, (void *)0x7, 3, "abcdef", "x", 'y');
+    strcpy(name, "changed!");
+
+    char expected[BUFSIZ];
+    snprintf(expected, sizeof(expected), "INFO  %s:%d %u %zu %ld %lld %.2f %p %-6.*s| %5s %c 100%%\n", "original", -1, 2u, (size_t)3, -4L, 5LL, 6.125, (void *)0x7, 3, "abcdef", "x", 'y');
+
+    /* Arguments that do not fit in a record are cut short */
+    char big[2 * LOG_SLOT];
+    memset(big, 'z', sizeof(big) - 1);
+    big[sizeof(big) - 1] = 0;
+    error("%s %d", big, 42);
+
+    char *buffer = captured(fd);
+    assert(strstr(buffer, expected));
+    assert(!strstr(buffer, "changed"));
+    assert(strstr(buffer, "zzz ..."));
+    assert(!strstr(buffer, "42"));
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+int test_01_log_level() {
+    int fd = capture();
+
+    log_level(LOG_ERROR);
+    debug("hidden debug");
+    info("hidden info");
+    error("shown error");
+    log_level(LOG_DEBUG);
+    info("shown info");
+    debug("shown debug");
+    log_level(LOG_OFF);
+    error("hidden error");
+
+    char *buffer = captured(fd);
+    assert(!strstr(buffer, "hidden"));
+    assert(strstr(buffer, "] ERROR shown error\n"));
+    assert(strstr(buffer, "] INFO  shown info\n"));
+    assert(strstr(buffer, ":test_01_log_level: shown debug\n"));
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+int test_02_log_burst() {
+    int fd = capture();
+
+    for (int i = 0; i <= 100; i++) {
+        if (i == 100) {
+            usleep(1100000);
+        }
+        error("retrying %d", i);
+    }
+
+    /* Suppressed records are counted by the next record of the callsite */
+    char *buffer = captured(fd);
+    size_t lines = count(buffer, "retrying");
+    size_t suppressed = 0;
+    for (const char *s = strstr(buffer, " ("); s; s = strstr(s + 1, " (")) {
+        suppressed += strtoul(s + 2, NULL, 10);
+    }
+    assert(lines <= 2 * LOG_BURST + 1);
+    assert(lines + suppressed == 101);
+    assert(strstr(buffer, "similar suppressed"));
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+int test_03_log_threads() {
+    int fd = capture();
+
+    /* Full rings drop records (and count them) rather than wait */
+    Thread threads[THREADS];
+    LogSite *sites = calloc(THREADS * SITES, sizeof(LogSite));
+    assert(sites);
+    for (int i = 0; i < THREADS; i++) {
+        thread_create(&threads[i], NULL, log_sites, sites + i * SITES);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        thread_join(threads[i], NULL);
+    }
+
+    /* Rings of exited threads are reused */
+    thread_create(&threads[0], NULL, log_sites, sites);
+    thread_join(threads[0], NULL);
+
+    char *buffer = captured(fd);
+    assert(count(buffer, "INFO  site ") + dropped(buffer) == (THREADS + 1) * SITES);
+    assert(strstr(buffer, "INFO  site 0\n"));
+    free(buffer);
+    free(sites);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test log_capture\n");
+        fprintf(stderr, "    1. Test log_level\n");
+        fprintf(stderr, "    2. Test log_burst\n");
+        fprintf(stderr, "    3. Test log_threads\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_log_capture(); break;
+        case 1:  status = test_01_log_level(); break;
+        case 2:  status = test_02_log_burst(); break;
+        case 3:  status = test_03_log_threads(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
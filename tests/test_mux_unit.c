@@ -0,0 +1,93 @@
+/* test_mux_unit.c: Test subscription multiplexer (Unit) */
+
+#include "mq/mux.h"
+#include "mq/string.h"
+
+#include <assert.h>
+
+/* Constants */
+
+#define NSUBSCRIBERS 3
+
+/* Functions */
+
+int test_00_message_refs() {
+    Message *m = message_create("SOME LIKE IT HOT", 8);
+    assert(m);
+    assert(m->length == 8);
+    assert(streq(m->body, "SOME LIK"));
+    assert(m->refs == 1);
+
+    assert(message_retain(m) == m);
+    assert(m->refs == 2);
+    message_release(m);
+    assert(m->refs == 1);
+    message_release(m);
+
+    return EXIT_SUCCESS;
+}
+
+int test_01_mux_deliver() {
+    MessageQueue *subscribers[NSUBSCRIBERS];
+    MuxTopic t = {
+        .subscribers = subscribers,
+        .nsubscribers = NSUBSCRIBERS,
+        .capacity = NSUBSCRIBERS,
+    };
+    mutex_init(&t.lock, NULL);
+
+    for (size_t i = 0; i < NSUBSCRIBERS; i++) {
+        subscribers[i] = mq_create("local", "localhost", "9456");
+        assert(subscribers[i]);
+    }
+
+    Message *m = message_create("FOREVER", strlen("FOREVER"));
+    mux_deliver(&t, m, NULL);
+    message_release(m);
+
+    /* Every subscriber gets a reference to the same buffer */
+    Message *first = mq_retrieve_message(subscribers[0]);
+    assert(first && streq(first->body, "FOREVER"));
+
+    Message *second = mq_retrieve_message(subscribers[1]);
+    assert(second == first);
+    assert(first->refs == 3);
+
+    char *copy = mq_retrieve(subscribers[2]);
+    assert(copy && streq(copy, "FOREVER"));
+    free(copy);
+
+    message_release(first);
+    message_release(second);
+
+    for (size_t i = 0; i < NSUBSCRIBERS; i++) {
+        mq_delete(subscribers[i]);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test message_refs\n");
+        fprintf(stderr, "    1. Test mux_deliver\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_message_refs(); break;
+        case 1:  status = test_01_mux_deliver(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
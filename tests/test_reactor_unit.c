@@ -0,0 +1,253 @@
+/* test_reactor_unit.c: Test Shared I/O reactor (Unit) */
+
+#include "mq/logging.h"
+#include "mq/reactor.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Structures */
+
+typedef struct {
+    Reactor *reactor;
+    Task     task;
+    Op       reader;
+    Op       writer;
+    char     buffer[BUFSIZ];
+} Pair;
+
+/* Globals */
+
+size_t Calls = 0;
+char  *Fixed = NULL; // Registered buffer written from (io_uring only)
+
+/* Callbacks */
+
+void count_task(Task *t) {
+    Calls++;
+}
+
+void read_done(Op *op) {
+    assert(op->result == 5);
+    assert(strncmp(op->buf, "hello", 5) == 0);
+    Calls++;
+}
+
+void write_done(Op *op) {
+    assert(op->result == 5);
+    Calls++;
+}
+
+void broken_done(Op *op) {
+    assert(op->result == -EPIPE);
+    Calls++;
+}
+
+void submit_task(Task *t) {
+    Pair *p = (Pair *)t->arg;
+
+    /* Submit read first so that it must wait for the write */
+    reactor_submit(p->reactor, &p->reader);
+    reactor_submit(p->reactor, &p->writer);
+}
+
+void fixed_task(Task *t) {
+    Pair *p = (Pair *)t->arg;
+
+    if ((Fixed = reactor_buffer(p->reactor))) {
+        memcpy(Fixed, "hello", 5);
+        p->writer.buf = Fixed;
+    }
+    submit_task(t);
+}
+
+void rewrite_task(Task *t) {
+    Pair *p = (Pair *)t->arg;
+    p->writer.func = broken_done;
+    reactor_submit(p->reactor, &p->writer);
+}
+
+void unbuffer_task(Task *t) {
+    Pair *p = (Pair *)t->arg;
+    if (Fixed) {
+        reactor_unbuffer(p->reactor, Fixed);
+    }
+}
+
+/* Functions */
+
+int test_00_reactor_acquire() {
+    Reactor *r0 = reactor_acquire();
+    Reactor *r1 = reactor_acquire();
+    assert(r0);
+    assert(r1);
+    assert(r0 != r1);
+    assert(r0->clients == 1);
+    assert(r1->clients == 1);
+
+    reactor_release(r1);
+    reactor_release(r0);
+    return EXIT_SUCCESS;
+}
+
+int test_01_reactor_post() {
+    Reactor *r = reactor_acquire();
+    assert(r);
+
+    Task t = {count_task, NULL};
+    for (size_t i = 0; i < 10; i++) {
+        reactor_post(r, &t);
+        reactor_sync(r);
+    }
+    assert(Calls == 10);
+
+    reactor_release(r);
+    return EXIT_SUCCESS;
+}
+
+int test_02_reactor_submit() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    Pair p = {
+        .reactor = reactor_acquire(),
+        .reader  = {.type = OP_READ , .fd = fds[0], .len = BUFSIZ, .func = read_done},
+        .writer  = {.type = OP_WRITE, .fd = fds[1], .len = 5     , .func = write_done},
+    };
+    assert(p.reactor);
+    p.task.func = submit_task;
+    p.task.arg  = &p;
+    p.reader.buf = p.buffer;
+    p.writer.buf = "hello";
+
+    reactor_post(p.reactor, &p.task);
+    for (size_t i = 0; i < 100 && Calls < 2; i++) {
+        usleep(1000);
+        reactor_sync(p.reactor);
+    }
+    assert(Calls == 2);
+
+    reactor_release(p.reactor);
+    close(fds[0]);
+    close(fds[1]);
+    return EXIT_SUCCESS;
+}
+
+int test_03_reactor_sendfile() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = tmpfile();
+    assert(file);
+    fputs("--hello", file);
+    fflush(file);
+
+    /* Offset is advanced by the bytes sent (file position is not) */
+    Pair p = {
+        .reactor = reactor_acquire(),
+        .reader  = {.type = OP_READ    , .fd = fds[0], .len = BUFSIZ, .func = read_done},
+        .writer  = {.type = OP_SENDFILE, .fd = fds[1], .len = 5     , .func = write_done, .file = fileno(file), .offset = 2},
+    };
+    assert(p.reactor);
+    p.task.func = submit_task;
+    p.task.arg  = &p;
+    p.reader.buf = p.buffer;
+
+    reactor_post(p.reactor, &p.task);
+    for (size_t i = 0; i < 100 && Calls < 2; i++) {
+        usleep(1000);
+        reactor_sync(p.reactor);
+    }
+    assert(Calls == 2);
+    assert(p.writer.offset == 7);
+
+    reactor_release(p.reactor);
+    fclose(file);
+    close(fds[0]);
+    close(fds[1]);
+    return EXIT_SUCCESS;
+}
+
+int test_04_reactor_fixed() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Write from registered buffer (plain buffer with epoll) */
+    Pair p = {
+        .reactor = reactor_acquire(),
+        .reader  = {.type = OP_READ , .fd = fds[0], .len = BUFSIZ, .func = read_done},
+        .writer  = {.type = OP_WRITE, .fd = fds[1], .len = 5     , .func = write_done},
+    };
+    assert(p.reactor);
+    p.task.func = fixed_task;
+    p.task.arg  = &p;
+    p.reader.buf = p.buffer;
+    p.writer.buf = "hello";
+
+    reactor_post(p.reactor, &p.task);
+    for (size_t i = 0; i < 100 && Calls < 2; i++) {
+        usleep(1000);
+        reactor_sync(p.reactor);
+    }
+    assert(Calls == 2);
+
+    /* Write to closed peer fails without raising SIGPIPE */
+    close(fds[0]);
+    p.task.func = rewrite_task;
+    reactor_post(p.reactor, &p.task);
+    for (size_t i = 0; i < 100 && Calls < 3; i++) {
+        usleep(1000);
+        reactor_sync(p.reactor);
+    }
+    assert(Calls == 3);
+
+    p.task.func = unbuffer_task;
+    reactor_post(p.reactor, &p.task);
+    reactor_sync(p.reactor);
+
+    reactor_release(p.reactor);
+    close(fds[1]);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test reactor_acquire\n");
+        fprintf(stderr, "    1. Test reactor_post\n");
+        fprintf(stderr, "    2. Test reactor_submit\n");
+        fprintf(stderr, "    3. Test reactor_sendfile\n");
+        fprintf(stderr, "    4. Test reactor_fixed\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_reactor_acquire(); break;
+        case 1:  status = test_01_reactor_post(); break;
+        case 2:  status = test_02_reactor_submit(); break;
+        case 3:  status = test_03_reactor_sendfile(); break;
+        case 4:  status = test_04_reactor_fixed(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,100 @@
+/* test_reconnect_functional.c: Test reconnect backoff and circuit breaker (Functional) */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char *TOPIC = "reconnect";
+const double MAX_CPU = 0.2;         // Seconds of CPU used while the broker is down (for one second)
+const double MAX_DISCONNECT = 2.0;  // Seconds until the circuit breaker opens
+const double MAX_RECONNECT = 15.0;  // Seconds until reconnected once the broker is up
+
+/* Globals */
+
+size_t Transitions[MQ_DISCONNECTED + 1];
+
+/* Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+double cpu() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+}
+
+void on_state(MessageQueue *mq, MQState state, void *arg) {
+    __atomic_fetch_add(&Transitions[state], 1, __ATOMIC_RELAXED);
+}
+
+bool wait_for(MessageQueue *mq, MQState state, double timeout) {
+    double deadline = now() + timeout;
+    while (mq_state(mq) != state && now() < deadline) {
+        usleep(10000);
+    }
+    return mq_state(mq) == state;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host = argc > 1 ? argv[1] : "localhost";
+    char *port = argc > 2 ? argv[2] : "9456";
+
+    alarm(60);
+
+    MessageQueue *mq = mq_create("reconnect_test", host, port);
+    assert(mq);
+
+    mq_on_state(mq, on_state, NULL);
+    mq_subscribe(mq, TOPIC);
+    mq_start(mq);
+    mq_publish(mq, TOPIC, "parked");
+
+    /* Broker is not up yet: circuit breaker opens and the client stays idle */
+    assert(wait_for(mq, MQ_DISCONNECTED, MAX_DISCONNECT));
+
+    double start = cpu();
+    sleep(1);
+    assert(cpu() - start < MAX_CPU);
+
+    /* Broker starts: probe closes circuit breaker and parked requests are sent */
+    assert(wait_for(mq, MQ_CONNECTED, MAX_RECONNECT));
+
+    char *message = mq_retrieve(mq);
+    assert(message && streq(message, "parked"));
+    free(message);
+
+    assert(mq_stop_timeout(mq, MQ_DRAIN));
+    mq_delete(mq);
+
+    assert(Transitions[MQ_RETRYING] >= 1);
+    assert(Transitions[MQ_DISCONNECTED] >= 1);
+    assert(Transitions[MQ_CONNECTED] >= 1);
+
+    /* Broker cannot be resolved: message is parked and retried (until the
+     * circuit breaker opens) instead of being dropped, so mq_stop reports it */
+    MessageQueue *unresolved = mq_create("reconnect_test", "mq-nonexistent.invalid", port);
+    assert(unresolved);
+
+    mq_start(unresolved);
+    mq_publish(unresolved, TOPIC, "unresolved");
+    assert(wait_for(unresolved, MQ_DISCONNECTED, MAX_DISCONNECT));
+
+    assert(!mq_stop_timeout(unresolved, 100));
+    mq_delete(unresolved);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -114,6 +114,65 @@ failure:
     return status;
 }
 
+int test_03_request_line() {
+    RequestLine *l = request_line_create("PUT", "/topic/HOT");
+    assert(l);
+    assert(streq(l->line, "PUT /topic/HOT HTTP/1.0\r\n"));
+    assert(l->length == strlen(l->line));
+
+    /* Requests share method and uri of line (and keep it alive) */
+    Request *r = request_from_line(l, "SOME LIKE IT HOT", strlen("SOME LIKE IT"));
+    assert(r);
+    assert(r->line == l && l->refs == 2);
+    assert(r->method == l->method && r->uri == l->uri);
+    assert(streq(r->body, "SOME LIKE IT"));
+    request_line_release(l);
+
+    char *buffer = NULL;
+    size_t length = 0;
+    FILE *ms = open_memstream(&buffer, &length);
+    assert(ms);
+    request_write(r, ms);
+    fclose(ms);
+    assert(streq(buffer, "PUT /topic/HOT HTTP/1.0\r\nContent-Length: 12\r\n\r\nSOME LIKE IT"));
+
+    request_delete(r);
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+int test_04_request_length() {
+    Request *requests[] = {
+        request_create("PUT", "/topic/HOT", "SOME LIKE IT"),
+        request_create("GET", "/queue/LIVE", NULL),
+        request_from_line(request_line_create("PUT", "/topic/HOT"), "SOME LIKE IT", strlen("SOME LIKE IT")),
+    };
+    requests[0]->headers = strdup("producer=abc\nsequence=12\n");
+    requests[2]->flength = 1000;
+
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        Request *r = requests[i];
+        assert(r);
+
+        char *buffer = NULL;
+        size_t length = 0;
+        FILE *ms = open_memstream(&buffer, &length);
+        assert(ms);
+        request_write(r, ms);
+        fclose(ms);
+
+        /* Contents of file are counted, but not written */
+        assert(request_length(r) == length + r->flength);
+        free(buffer);
+        if (r->line) {
+            request_line_release(r->line); // Reference of request_line_create
+        }
+        r->flength = 0;
+        request_delete(r);
+    }
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -123,6 +182,8 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    0. Test request_create\n");
         fprintf(stderr, "    1. Test request_delete\n");
         fprintf(stderr, "    2. Test request_write\n");
+        fprintf(stderr, "    3. Test request_line\n");
+        fprintf(stderr, "    4. Test request_length\n");
         return EXIT_FAILURE;
     }
 
@@ -133,6 +194,8 @@ int main(int argc, char *argv[]) {
         case 0:  status = test_00_request_create(); break;
         case 1:  status = test_01_request_delete(); break;
         case 2:  status = test_02_request_write(); break;
+        case 3:  status = test_03_request_line(); break;
+        case 4:  status = test_04_request_length(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }   
 
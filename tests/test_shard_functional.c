@@ -0,0 +1,167 @@
+/* test_shard_functional.c: Test sharding topics across brokers (Functional) */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define NTOPICS 32
+#define NSHARDS 3
+
+/* Functions */
+
+size_t shard_index(MessageQueue *mq, const char *topic) {
+    MessageQueue *shard = mq_shard(mq, topic);
+    for (size_t i = 0; i < mq->nshards; i++) {
+        if (mq->shards[i] == shard) {
+            return i;
+        }
+    }
+    assert(false);
+    return 0;
+}
+
+/* Subscribe queue to every topic (waiting until all subscriptions are sent) */
+void subscribe_all(const char *name, const char *host, const char *port, char topics[][BUFSIZ]) {
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    for (size_t t = 0; t < NTOPICS; t++) {
+        mq_subscribe(mq, topics[t]);
+    }
+    mq_start(mq);
+    assert(mq_stop_timeout(mq, MQ_DRAIN));
+    mq_delete(mq);
+}
+
+size_t topic_index(char topics[][BUFSIZ], const char *name) {
+    for (size_t i = 0; i < NTOPICS; i++) {
+        if (streq(topics[i], name)) {
+            return i;
+        }
+    }
+    assert(false);
+    return 0;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *hosts = argc > 1 ? argv[1] : "localhost:9456,localhost:9457,localhost:9458";
+    char topics[NTOPICS][BUFSIZ];
+    char name[BUFSIZ];
+
+    alarm(60);
+    for (size_t i = 0; i < NTOPICS; i++) {
+        sprintf(topics[i], "shard_%d_%lu", getpid(), i);
+    }
+
+    MessageQueue *publisher = mq_create("shard_publisher", hosts, NULL);
+    assert(publisher && publisher->nshards == NSHARDS);
+    assert(!mq_create("shard_invalid", "localhost:9456,,localhost:9457", NULL));
+
+    /* Host lists longer than a host name are refused, not truncated */
+    char long_hosts[2 * NI_MAXHOST] = "localhost:9456";
+    while (strlen(long_hosts) < NI_MAXHOST) {
+        strcat(long_hosts, ",localhost:9456");
+    }
+    assert(!mq_create("shard_invalid", long_hosts, NULL));
+
+    /* Clients of single brokers see only the topics of their shard */
+    MessageQueue *direct[NSHARDS];
+    for (size_t i = 0; i < NSHARDS; i++) {
+        sprintf(name, "shard_direct_%lu_%d", i, getpid());
+        subscribe_all(name, publisher->shards[i]->host, publisher->shards[i]->port, topics);
+        direct[i] = mq_create(name, publisher->shards[i]->host, publisher->shards[i]->port);
+        assert(direct[i]);
+        mq_start(direct[i]);
+    }
+
+    sprintf(name, "shard_subscriber_%d", getpid());
+    subscribe_all(name, hosts, NULL, topics);
+    MessageQueue *subscriber = mq_create(name, hosts, NULL);
+    assert(subscriber);
+    mq_start(subscriber);
+    mq_start(publisher);
+
+    bool connected = false;
+    while (!connected) {
+        usleep(10000);
+        connected = mq_state(publisher) == MQ_CONNECTED && mq_state(subscriber) == MQ_CONNECTED;
+        for (size_t i = 0; i < NSHARDS; i++) {
+            connected = connected && mq_state(direct[i]) == MQ_CONNECTED;
+        }
+    }
+
+    /* Every client maps a topic to the same broker */
+    size_t expected[NSHARDS] = {0};
+    for (size_t t = 0; t < NTOPICS; t++) {
+        size_t shard = shard_index(publisher, topics[t]);
+        assert(shard_index(subscriber, topics[t]) == shard);
+        expected[shard]++;
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < NSHARDS; i++) {
+        used += expected[i] > 0;
+    }
+    assert(used > 1);
+
+    for (size_t t = 0; t < NTOPICS; t++) {
+        if (t % 2) {
+            mq_publish(publisher, topics[t], topics[t]);
+        } else {
+            MQTopic *handle = mq_topic_open(publisher, topics[t]);
+            assert(handle && handle->mq == mq_shard(publisher, topics[t]));
+            assert(mq_publish_handle(handle, topics[t], strlen(topics[t])));
+            mq_topic_close(handle);
+        }
+    }
+
+    /* Subscriber of every broker receives every topic once */
+    bool seen[NTOPICS] = {false};
+    for (size_t i = 0; i < NTOPICS; i++) {
+        char *message = mq_retrieve(subscriber);
+        assert(message);
+        size_t t = topic_index(topics, message);
+        assert(!seen[t]);
+        seen[t] = true;
+        free(message);
+    }
+
+    for (size_t i = 0; i < NSHARDS; i++) {
+        for (size_t n = 0; n < expected[i]; n++) {
+            char *message = mq_retrieve(direct[i]);
+            assert(message);
+            assert(shard_index(publisher, message) == i);
+            free(message);
+        }
+    }
+
+    /* Topic logs are read from the broker of their topic */
+    MessageQueue *reader = mq_create("shard_reader", hosts, NULL);
+    assert(reader);
+    mq_read_from(reader, topics[0], 0);
+    mq_start(reader);
+    char *message = mq_retrieve(reader);
+    assert(message && streq(message, topics[0]));
+    assert(mq_offset(reader) == 1);
+    free(message);
+
+    assert(mq_stop_timeout(publisher, MQ_DRAIN));
+    mq_stop(subscriber);
+    mq_stop(reader);
+    for (size_t i = 0; i < NSHARDS; i++) {
+        mq_stop(direct[i]);
+        mq_delete(direct[i]);
+    }
+    assert(mq_shutdown(publisher));
+    mq_delete(publisher);
+    mq_delete(subscriber);
+    mq_delete(reader);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,100 @@
+/* test_shm_functional.c: Test large messages over shared memory rings (Functional) */
+
+#include "mq/client.h"
+#include "mq/shm.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char *TOPIC = "shm_large";
+const size_t NMESSAGES = 8;                         // Large messages published by each client
+const size_t LARGE = SHM_RING_SIZE / 8 * 3;         // Several fill a ring (each fits)
+const size_t OVERSIZED = 2 * SHM_RING_SIZE;         // Never fits in a ring
+
+/* Functions */
+
+char *create_body(size_t length, char fill) {
+    char *body = malloc(length + 1);
+    assert(body);
+    memset(body, fill, length);
+    body[length] = 0;
+    return body;
+}
+
+void wait_for_state(MessageQueue *mq, MQState state) {
+    while (mq_state(mq) != state) {
+        usleep(10000);
+    }
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *shm  = argc > 1 ? argv[1] : "shm:/tmp/mq_shm.sock";
+    char *host = argc > 2 ? argv[2] : "localhost";
+    char *port = argc > 3 ? argv[3] : "9456";
+
+    alarm(60);
+
+    MessageQueue *consumer = mq_create("shm_consumer", shm, NULL);
+    assert(consumer);
+    mq_subscribe(consumer, TOPIC);
+    mq_start(consumer);
+    wait_for_state(consumer, MQ_CONNECTED);
+
+    /* Records larger than the ring are refused when published */
+    char *oversized = create_body(SHM_RECORD_MAX, 'o');
+    assert(!mq_publish(consumer, TOPIC, oversized));
+    MQTopic *t = mq_topic_open(consumer, TOPIC);
+    assert(t);
+    assert(!mq_publish_handle(t, oversized, SHM_RECORD_MAX));
+    mq_topic_close(t);
+
+    FILE *fs = tmpfile();
+    assert(fs);
+    assert(fwrite(oversized, 1, SHM_RECORD_MAX, fs) == SHM_RECORD_MAX);
+    fflush(fs);
+    assert(lseek(fileno(fs), 0, SEEK_SET) == 0);
+    assert(!mq_publish_fd(consumer, TOPIC, fileno(fs), SHM_RECORD_MAX));
+    assert(lseek(fileno(fs), 0, SEEK_CUR) == 0);
+    fclose(fs);
+    free(oversized);
+
+    /* Message published over TCP that no response record could hold is
+     * refused to the shared memory client, which keeps its session */
+    MessageQueue *publisher = mq_create("shm_publisher", host, port);
+    assert(publisher);
+    mq_start(publisher);
+    oversized = create_body(OVERSIZED, 'o');
+    assert(mq_publish(publisher, TOPIC, oversized));
+    free(oversized);
+
+    /* Large messages from both clients outrun the rings */
+    char *large = create_body(LARGE, 'l');
+    for (size_t i = 0; i < NMESSAGES; i++) {
+        assert(mq_publish(publisher, TOPIC, large));
+        assert(mq_publish(consumer, TOPIC, large));
+    }
+    free(large);
+    assert(mq_stop_timeout(publisher, MQ_DRAIN));
+
+    for (size_t i = 0; i < 2 * NMESSAGES; i++) {
+        Message *m = mq_retrieve_message(consumer);
+        assert(m);
+        assert(m->length == LARGE);
+        assert(m->body[0] == 'l' && m->body[LARGE - 1] == 'l');
+        message_release(m);
+    }
+    assert(mq_state(consumer) == MQ_CONNECTED);
+
+    assert(mq_stop_timeout(consumer, MQ_DRAIN));
+    mq_delete(publisher);
+    mq_delete(consumer);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,177 @@
+/* test_stream_functional.c: Test streaming large messages from and to files (Functional) */
+
+#include "mq/client.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char *TOPIC = "stream";
+const size_t MESSAGE_SIZE = 64 * 1024 * 1024;
+const long MAX_GROWTH = 16 * 1024;     // Kilobytes peak memory may grow while streaming
+const double MAX_CONNECT = 10.0;       // Seconds until consumers are connected
+const double MAX_DELIVERY = 60.0;      // Seconds until message is streamed to both consumers
+const unsigned int MAX_DRAIN = 60000;  // Milliseconds publisher may take to send message
+
+/* Structures */
+
+typedef struct {
+    size_t received;    // Bytes of message verified so far
+    size_t messages;    // Messages received whole
+    size_t failures;    // Chunks that did not match
+} Stream;
+
+/* Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+void check(bool passed, const char *stage) {
+    if (!passed) {
+        fprintf(stderr, "Stalled while %s\n", stage);
+        exit(EXIT_FAILURE);
+    }
+}
+
+char pattern(size_t offset) {
+    return (char)((offset * 7 + offset / 4096) & 0xff);
+}
+
+int create_file(size_t size) {
+    char path[] = "/tmp/test_stream_functional.XXXXXX";
+    char buffer[BUFSIZ];
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+
+    for (size_t offset = 0; offset < size; offset += sizeof(buffer)) {
+        for (size_t i = 0; i < sizeof(buffer); i++) {
+            buffer[i] = pattern(offset + i);
+        }
+        assert(write(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+    }
+    assert(lseek(fd, 0, SEEK_SET) == 0);
+    return fd;
+}
+
+void verify_chunk(MessageQueue *mq, const char *chunk, size_t length, bool last, void *arg) {
+    Stream *s = (Stream *)arg;
+    assert(chunk);
+    for (size_t i = 0; i < length; i++) {
+        s->failures += chunk[i] != pattern(s->received + i);
+    }
+    s->received += length;
+    if (last) {
+        s->failures += s->received != MESSAGE_SIZE;
+        s->received = 0;
+        __atomic_add_fetch(&s->messages, 1, __ATOMIC_RELEASE);
+    }
+}
+
+long max_rss() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+MessageQueue *start_consumer(const char *role, const char *host, const char *port) {
+    char name[BUFSIZ];
+    snprintf(name, sizeof(name), "stream_%s_%d", role, getpid()); // Not subscribed by aborted runs
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    mq_subscribe(mq, TOPIC);
+    return mq;
+}
+
+bool wait_connected(MessageQueue *mq, double timeout) {
+    double deadline = now() + timeout;
+    while (mq_state(mq) != MQ_CONNECTED && now() < deadline) {
+        usleep(10000);
+    }
+    return mq_state(mq) == MQ_CONNECTED;
+}
+
+bool wait_verified(Stream *s, double deadline) {
+    while (__atomic_load_n(&s->messages, __ATOMIC_ACQUIRE) < 1 && now() < deadline) {
+        usleep(10000);
+    }
+    return __atomic_load_n(&s->messages, __ATOMIC_ACQUIRE) >= 1;
+}
+
+bool wait_written(int fd, double deadline) {
+    while (lseek(fd, 0, SEEK_CUR) < (off_t)MESSAGE_SIZE && now() < deadline) {
+        usleep(10000);
+    }
+    return lseek(fd, 0, SEEK_CUR) >= (off_t)MESSAGE_SIZE;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host = argc > 1 ? argv[1] : "localhost";
+    char *port = argc > 2 ? argv[2] : "9456";
+    Stream stream = {0};
+
+    alarm(180); // Backstop: each stage below has its own deadline
+
+    int fd = create_file(MESSAGE_SIZE);
+    char path[] = "/tmp/test_stream_functional.XXXXXX";
+    int output = mkstemp(path);
+    assert(output >= 0);
+    unlink(path);
+
+    /* One consumer verifies chunks as they arrive, the other writes them to a file */
+    MessageQueue *verifier = start_consumer("verifier", host, port);
+    mq_stream(verifier, verify_chunk, &stream);
+    mq_start(verifier);
+    MessageQueue *writer = start_consumer("writer", host, port);
+    mq_stream_fd(writer, output);
+    mq_start(writer);
+    check(wait_connected(verifier, MAX_CONNECT), "connecting verifier");
+    check(wait_connected(writer, MAX_CONNECT), "connecting writer");
+
+    long baseline = max_rss();
+
+    /* Message is sent from the file: its offset advances as if it was read */
+    MessageQueue *publisher = mq_create("stream_publisher", host, port);
+    assert(publisher);
+    mq_start(publisher);
+    assert(mq_publish_fd(publisher, TOPIC, fd, MESSAGE_SIZE));
+    assert(lseek(fd, 0, SEEK_CUR) == (off_t)MESSAGE_SIZE);
+    close(fd);
+    check(mq_stop_timeout(publisher, MAX_DRAIN), "publishing message");
+
+    double deadline = now() + MAX_DELIVERY;
+    check(wait_verified(&stream, deadline), "streaming message to verifier");
+    check(wait_written(output, deadline), "streaming message to writer");
+    assert(stream.failures == 0);
+    assert(max_rss() - baseline < MAX_GROWTH);
+
+    char buffer[BUFSIZ];
+    for (size_t offset = 0; offset < MESSAGE_SIZE; offset += sizeof(buffer)) {
+        assert(pread(output, buffer, sizeof(buffer), offset) == sizeof(buffer));
+        for (size_t i = 0; i < sizeof(buffer); i++) {
+            assert(buffer[i] == pattern(offset + i));
+        }
+    }
+
+    mq_unsubscribe(verifier, TOPIC);
+    mq_unsubscribe(writer, TOPIC);
+    check(mq_stop_timeout(verifier, MQ_DRAIN), "unsubscribing verifier");
+    check(mq_stop_timeout(writer, MQ_DRAIN), "unsubscribing writer");
+    mq_delete(publisher);
+    mq_delete(verifier);
+    mq_delete(writer);
+    close(output);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,139 @@
+/* test_trace_unit.c: Test latency tracing (Unit) */
+
+#include "mq/queue.h"
+#include "mq/string.h"
+#include "mq/trace.h"
+
+#include <assert.h>
+
+/* Functions */
+
+int test_00_histogram_percentile() {
+    Histogram *h = calloc(1, sizeof(Histogram));
+    assert(h);
+    assert(histogram_percentile(h, 50) == 0);
+
+    for (uint64_t value = 1; value <= 1000; value++) {
+        histogram_record(h, value);
+    }
+    histogram_record(h, 1000000);
+
+    assert(h->count == 1001);
+    assert(h->min == 1 && h->max == 1000000);
+
+    /* Percentiles are within 1/16th of the recorded value */
+    uint64_t p50 = histogram_percentile(h, 50);
+    uint64_t p99 = histogram_percentile(h, 99);
+    assert(p50 >= 500 && p50 <= 500 + 500 / 16);
+    assert(p99 >= 990 && p99 <= 990 + 990 / 16);
+    assert(histogram_percentile(h, 100) == 1000000);
+    assert(histogram_percentile(h, 0) == 1);
+
+    histogram_record(h, UINT64_MAX);
+    assert(histogram_percentile(h, 100) == UINT64_MAX);
+
+    histogram_reset(h);
+    assert(h->count == 0 && histogram_percentile(h, 99) == 0);
+    free(h);
+    return EXIT_SUCCESS;
+}
+
+int test_01_trace_stamp_open() {
+    TraceTopic *topic = NULL;
+    uint64_t published = 0;
+    uint64_t before = trace_now(TRACE_MONOTONIC);
+
+    char *body = trace_stamp(TRACE_MONOTONIC, 1, "traced", "SOME LIKE IT HOT");
+    assert(body);
+    size_t envelope = trace_open(body, strlen(body), &topic, &published);
+    assert(envelope > 0);
+    assert(streq(body + envelope, "SOME LIKE IT HOT"));
+    assert(topic && topic == trace_topic("traced") && streq(topic->name, "traced"));
+    assert(published >= before && published <= trace_now(TRACE_MONOTONIC));
+    free(body);
+
+    /* Skipped sequence numbers are counted as gaps */
+    body = trace_stamp(TRACE_REALTIME, 4, "traced", "");
+    assert(trace_open(body, strlen(body), &topic, &published) == strlen(body));
+    assert(topic->sequence == 4 && topic->gaps == 2);
+    free(body);
+
+    Histogram *h = malloc(sizeof(Histogram));
+    assert(h);
+    assert(trace_histogram("traced", TRACE_TRANSIT, h));
+    assert(h->count == 2);
+    assert(!trace_histogram("untraced", TRACE_TRANSIT, h));
+    free(h);
+
+    /* Untraced (and truncated) bodies are left alone */
+    assert(trace_open("SOME LIKE IT HOT", 16, &topic, &published) == 0);
+    assert(trace_open(TRACE_MAGIC "M 1 1 traced", strlen(TRACE_MAGIC) + 12, &topic, &published) == 0);
+
+    return EXIT_SUCCESS;
+}
+
+int test_02_trace_queue() {
+    Queue *q = queue_create();
+    Request *r = request_create("PUT", "/topic/queued", "BODY");
+    assert(q && r);
+
+    q->stage = TRACE_INCOMING;
+    r->trace = trace_topic("queued");
+    queue_push(q, r);
+    assert(r->stamp > 0);
+    assert(queue_pop(q) == r);
+
+    queue_push(q, r);
+    assert(queue_trypop(q) == r);
+
+    Histogram *h = malloc(sizeof(Histogram));
+    assert(h);
+    assert(trace_histogram("queued", TRACE_INCOMING, h) && h->count == 2);
+    assert(trace_histogram("queued", TRACE_OUTGOING, h) && h->count == 0);
+
+    /* Export lists each recorded stage of each topic */
+    char *buffer = NULL;
+    size_t length = 0;
+    FILE *ms = open_memstream(&buffer, &length);
+    trace_export(ms);
+    fclose(ms);
+    assert(strstr(buffer, "queued incoming count=2 "));
+    assert(!strstr(buffer, "queued outgoing"));
+    assert(strstr(buffer, "queued sequence=0 gaps=0\n"));
+    free(buffer);
+
+    trace_reset();
+    assert(trace_histogram("queued", TRACE_INCOMING, h) && h->count == 0);
+
+    free(h);
+    request_delete(r);
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test histogram_percentile\n");
+        fprintf(stderr, "    1. Test trace_stamp_open\n");
+        fprintf(stderr, "    2. Test trace_queue\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_histogram_percentile(); break;
+        case 1:  status = test_01_trace_stamp_open(); break;
+        case 2:  status = test_02_trace_queue(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */